@@ -32,23 +32,149 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
 #include <glib.h>
 #include <glib/gstdio.h>
 
 #include <libedataserver/e-msgport.h>
 
 #include "camel-block-file.h"
+#include "camel-debug.h"
 #include "camel-file-utils.h"
 #include "camel-private.h"
 
 #define d(x) /*(printf("%s(%d):%s: ",  __FILE__, __LINE__, __PRETTY_FUNCTION__),(x))*/
 
+#define LOCK(x) pthread_mutex_lock(&x)
+#define UNLOCK(x) pthread_mutex_unlock(&x)
+
+/* Cache of open files, shared by block and key files.
+
+   Open files are spread over FILE_SHARDS lists by address, each with
+   its own lock, so files in different shards never contend.  Using a
+   file which is already open takes no shared lock at all, it just
+   marks the file used.  When a shard has more than FILE_SHARD_LIMIT
+   files open the oldest are taken offline, except those used since
+   they were last looked at, which go to the back of the list, and
+   busy ones, which are skipped. */
+
+struct _file_node {
+	struct _file_node *next;
+	struct _file_node *prev;
+
+	/* take the file offline if it isn't busy, called with the shard locked */
+	int (*offline)(struct _file_node *node);
+
+	unsigned int linked:1;
+	volatile int used;
+};
+
+struct _file_shard {
+	pthread_mutex_t lock;
+	EDList list;		/* open files, oldest first */
+	int count;
+
+	/* statistics, dumped with CAMEL_DEBUG=block:files */
+	guint32 locks;
+	guint32 contended;
+	guint32 opened;
+	guint32 closed;
+	guint32 busy;
+};
+
+#define FILE_SHARDS (4)
+#define FILE_SHARD_LIMIT (5)	/* so at most 20 files are open */
+
+#define FILE_SHARD_INITIALISER(n) { PTHREAD_MUTEX_INITIALIZER, E_DLIST_INITIALISER(file_shards[n].list) }
+
+static struct _file_shard file_shards[FILE_SHARDS] = {
+	FILE_SHARD_INITIALISER(0),
+	FILE_SHARD_INITIALISER(1),
+	FILE_SHARD_INITIALISER(2),
+	FILE_SHARD_INITIALISER(3),
+};
+
+#define FILE_SHARD(node) (&file_shards[(GPOINTER_TO_UINT(node) >> 6) % FILE_SHARDS])
+
+static void
+file_shard_lock(struct _file_shard *shard)
+{
+	if (pthread_mutex_trylock(&shard->lock) != 0) {
+		LOCK(shard->lock);
+		shard->contended++;
+	}
+	shard->locks++;
+}
+
+/* the file of @node has just been opened, call with the file locked */
+static void
+file_node_online(struct _file_node *node)
+{
+	struct _file_shard *shard = FILE_SHARD(node);
+	struct _file_node *nw;
+	int scan;
+
+	file_shard_lock(shard);
+
+	node->used = FALSE;
+	node->linked = TRUE;
+	e_dlist_addtail(&shard->list, (EDListNode *)node);
+	shard->count++;
+	shard->opened++;
+
+	/* every file gets at most one second chance */
+	scan = shard->count * 2;
+	while (shard->count > FILE_SHARD_LIMIT && scan-- > 0) {
+		nw = (struct _file_node *)e_dlist_remhead(&shard->list);
+		if (nw == node || nw->used) {
+			nw->used = FALSE;
+			e_dlist_addtail(&shard->list, (EDListNode *)nw);
+		} else if (nw->offline(nw) == 0) {
+			nw->linked = FALSE;
+			shard->count--;
+			shard->closed++;
+		} else {
+			shard->busy++;
+			e_dlist_addtail(&shard->list, (EDListNode *)nw);
+		}
+	}
+
+	if (camel_debug_start(CAMEL_DEBUG_BLOCK_FILES)) {
+		printf("Block file shard %d: %d open, %u opened, %u closed, %u busy, %u of %u locks contended\n",
+		       (int)(shard - file_shards), shard->count, shard->opened, shard->closed,
+		       shard->busy, shard->contended, shard->locks);
+		camel_debug_end();
+	}
+
+	UNLOCK(shard->lock);
+}
+
+/* the file of @node is being closed or destroyed by its owner */
+static void
+file_node_offline(struct _file_node *node)
+{
+	struct _file_shard *shard = FILE_SHARD(node);
+
+	file_shard_lock(shard);
+
+	if (node->linked) {
+		e_dlist_remove((EDListNode *)node);
+		node->linked = FALSE;
+		shard->count--;
+		shard->closed++;
+	}
+
+	UNLOCK(shard->lock);
+}
+
 /* Locks must be obtained in the order defined */
 
 struct _CamelBlockFilePrivate {
-	/* We use the private structure to form our lru list from */
-	struct _CamelBlockFilePrivate *next;
-	struct _CamelBlockFilePrivate *prev;
+	/* We use the private structure to form our open file list from */
+	struct _file_node node;
 
 	struct _CamelBlockFile *base;
 
@@ -56,30 +182,41 @@ struct _CamelBlockFilePrivate {
 	pthread_mutex_t cache_lock; /* for refcounting, flag manip, cache manip */
 	pthread_mutex_t io_lock; /* for all io ops */
 
+	size_t io_size;		/* multiple of block_size read/written at once */
+	char *io_buffer;	/* io_size bytes, for clustered reads and writes, under io_lock */
+	GHashTable *detached;	/* detached blocks, never read ahead over */
+
+	/* cache adaption, under cache_lock */
+	guint32 lookups;
+	guint32 misses;
+
+	/* read-only files may have their blocks copied from a mapping */
+	unsigned char *map;
+	size_t map_len;
+
 	unsigned int deleted:1;
+	unsigned int mapped:1;
 };
 
+/* The block cache starts at CACHE_MIN blocks, and is doubled up to
+   CACHE_MAX whenever more than 1 in 4 lookups over CACHE_PERIOD
+   lookups miss while it is full.  It drops back to CACHE_MIN when the
+   file is taken offline. */
+#define CACHE_MIN (256)
+#define CACHE_MAX (4096)
+#define CACHE_PERIOD (1024)
+
 
 #define CAMEL_BLOCK_FILE_LOCK(kf, lock) (pthread_mutex_lock(&(kf)->priv->lock))
 #define CAMEL_BLOCK_FILE_TRYLOCK(kf, lock) (pthread_mutex_trylock(&(kf)->priv->lock))
 #define CAMEL_BLOCK_FILE_UNLOCK(kf, lock) (pthread_mutex_unlock(&(kf)->priv->lock))
 
-#define LOCK(x) pthread_mutex_lock(&x)
-#define UNLOCK(x) pthread_mutex_unlock(&x)
-
-static pthread_mutex_t block_file_lock = PTHREAD_MUTEX_INITIALIZER;
-
-/* lru cache of block files */
-static EDList block_file_list = E_DLIST_INITIALISER(block_file_list);
-/* list to store block files that are actually intialised */
-static EDList block_file_active_list = E_DLIST_INITIALISER(block_file_active_list);
-static int block_file_count = 0;
-static int block_file_threshhold = 10;
-
 #define CBF_CLASS(o) ((CamelBlockFileClass *)(((CamelObject *)o)->klass))
 
 static int sync_nolock(CamelBlockFile *bs);
 static int sync_block_nolock(CamelBlockFile *bs, CamelBlock *bl);
+static void trim_nolock(CamelBlockFile *bs, gboolean io);
+static int block_file_offline(struct _file_node *node);
 
 static int
 block_file_validate_root(CamelBlockFile *bs)
@@ -168,33 +305,19 @@ camel_block_file_init(CamelBlockFile *bs)
 	e_dlist_init(&bs->block_cache);
 	bs->blocks = g_hash_table_new((GHashFunc)block_hash_func, NULL);
 	/* this cache size and the text index size have been tuned for about the best
-	   with moderate memory usage.  Doubling the memory usage barely affects performance. */
-	bs->block_cache_limit = 256;
+	   with moderate memory usage.  Doubling the memory usage barely affects performance,
+	   so it is only grown when the cache is thrashing. */
+	bs->block_cache_limit = CACHE_MIN;
 
 	p = bs->priv = g_malloc0(sizeof(*bs->priv));
 	p->base = bs;
+	p->detached = g_hash_table_new((GHashFunc)block_hash_func, NULL);
+	p->io_size = CAMEL_BLOCK_SIZE;
+	p->node.offline = block_file_offline;
 
 	pthread_mutex_init(&p->root_lock, NULL);
 	pthread_mutex_init(&p->cache_lock, NULL);
 	pthread_mutex_init(&p->io_lock, NULL);
-
-	/* link into lru list */
-	LOCK(block_file_lock);
-	e_dlist_addhead(&block_file_list, (EDListNode *)p);
-
-#if 0
-	{
-		printf("dumping block list\n");
-		printf(" head = %p p = %p\n", block_file_list.head, p);
-		p = block_file_list.head;
-		while (p->next) {
-			printf(" '%s'\n", p->base->path);
-			p = p->next;
-		}
-	}
-#endif
-
-	UNLOCK(block_file_lock);
 }
 
 static void
@@ -208,12 +331,8 @@ camel_block_file_finalise(CamelBlockFile *bs)
 	if (bs->root_block)
 		camel_block_file_sync(bs);
 
-	/* remove from lru list */
-	LOCK(block_file_lock);
-	if (bs->fd != -1)
-		block_file_count--;
-	e_dlist_remove((EDListNode *)p);
-	UNLOCK(block_file_lock);
+	/* remove from open file list */
+	file_node_offline(&p->node);
 
 	bl = (CamelBlock *)bs->block_cache.head;
 	bn = bl->next;
@@ -229,6 +348,12 @@ camel_block_file_finalise(CamelBlockFile *bs)
 
 	if (bs->root_block)
 		camel_block_file_unref_block(bs, bs->root_block);
+	g_hash_table_destroy (p->detached);
+#ifdef HAVE_MMAP
+	if (p->map)
+		munmap(p->map, p->map_len);
+#endif
+	g_free(p->io_buffer);
 	g_free(bs->path);
 	if (bs->fd != -1)
 		close(bs->fd);
@@ -258,21 +383,49 @@ camel_block_file_get_type(void)
 	return type;
 }
 
+/* take a block file offline, when there are too many open */
+static int
+block_file_offline(struct _file_node *node)
+{
+	CamelBlockFile *bf = ((struct _CamelBlockFilePrivate *)node)->base;
+	int ret = -1;
+
+	/* Need to trylock, as any of these lock levels might be trying
+	   to lock the shard lock we hold, so we need to check and abort if so */
+	if (CAMEL_BLOCK_FILE_TRYLOCK(bf, root_lock) == 0) {
+		if (CAMEL_BLOCK_FILE_TRYLOCK(bf, cache_lock) == 0) {
+			if (CAMEL_BLOCK_FILE_TRYLOCK(bf, io_lock) == 0) {
+				d(printf("Turning block file offline: %s\n", bf->path));
+				sync_nolock(bf);
+				bf->block_cache_limit = CACHE_MIN;
+				trim_nolock(bf, TRUE);
+				close(bf->fd);
+				bf->fd = -1;
+				ret = 0;
+				CAMEL_BLOCK_FILE_UNLOCK(bf, io_lock);
+			}
+			CAMEL_BLOCK_FILE_UNLOCK(bf, cache_lock);
+		}
+		CAMEL_BLOCK_FILE_UNLOCK(bf, root_lock);
+	}
+
+	return ret;
+}
+
 /* 'use' a block file for io */
 static int
 block_file_use(CamelBlockFile *bs)
 {
-	struct _CamelBlockFilePrivate *nw, *nn, *p = bs->priv;
-	CamelBlockFile *bf;
+	struct _CamelBlockFilePrivate *p = bs->priv;
 	int err;
 
 	/* We want to:
-	    remove file from active list
 	    lock it
+	    open it if it is offline, which may take older files offline
 
 	   Then when done:
+	    mark it used
 	    unlock it
-	    add it back to end of active list
 	*/
 
 	CAMEL_BLOCK_FILE_LOCK(bs, io_lock);
@@ -293,40 +446,7 @@ block_file_use(CamelBlockFile *bs)
 		return -1;
 	}
 
-	LOCK(block_file_lock);
-	e_dlist_remove((EDListNode *)p);
-	e_dlist_addtail(&block_file_active_list, (EDListNode *)p);
-
-	block_file_count++;
-
-	nw = (struct _CamelBlockFilePrivate *)block_file_list.head;
-	nn = nw->next;
-	while (block_file_count > block_file_threshhold && nn) {
-		/* We never hit the current blockfile here, as its removed from the list first */
-		bf = nw->base;
-		if (bf->fd != -1) {
-			/* Need to trylock, as any of these lock levels might be trying
-			   to lock the block_file_lock, so we need to check and abort if so */
-			if (CAMEL_BLOCK_FILE_TRYLOCK(bf, root_lock) == 0) {
-				if (CAMEL_BLOCK_FILE_TRYLOCK(bf, cache_lock) == 0) {
-					if (CAMEL_BLOCK_FILE_TRYLOCK(bf, io_lock) == 0) {
-						d(printf("[%d] Turning block file offline: %s\n", block_file_count-1, bf->path));
-						sync_nolock(bf);
-						close(bf->fd);
-						bf->fd = -1;
-						block_file_count--;
-						CAMEL_BLOCK_FILE_UNLOCK(bf, io_lock);
-					}
-					CAMEL_BLOCK_FILE_UNLOCK(bf, cache_lock);
-				}
-				CAMEL_BLOCK_FILE_UNLOCK(bf, root_lock);
-			}
-		}
-		nw = nn;
-		nn = nw->next;
-	}
-
-	UNLOCK(block_file_lock);
+	file_node_online(&p->node);
 
 	return 0;
 }
@@ -334,10 +454,7 @@ block_file_use(CamelBlockFile *bs)
 static void
 block_file_unuse(CamelBlockFile *bs)
 {
-	LOCK(block_file_lock);
-	e_dlist_remove((EDListNode *)bs->priv);
-	e_dlist_addtail(&block_file_list, (EDListNode *)bs->priv);
-	UNLOCK(block_file_lock);
+	bs->priv->node.used = TRUE;
 
 	CAMEL_BLOCK_FILE_UNLOCK(bs, io_lock);
 }
@@ -352,14 +469,20 @@ camel_cache_remove(c, key);
 /**
  * camel_block_file_new:
  * @path:
- * @:
- * @block_size:
+ * @flags: open flags
+ * @version:
+ * @block_size: The size of the units the file is read and written in.
  *
  * Allocate a new block file, stored at @path.  @version contains an 8 character
  * version string which must match the head of the file, or the file will be
  * intitialised.
  *
- * @block_size is currently ignored and is set to CAMEL_BLOCK_SIZE.
+ * Blocks are always CAMEL_BLOCK_SIZE bytes, as the structures stored
+ * in them are laid out for that size.  @block_size selects the unit
+ * of io instead: a cache miss reads the whole @block_size aligned
+ * extent around the block, and adjacent dirty blocks are written
+ * together.  It must be a power of 2 multiple of CAMEL_BLOCK_SIZE no
+ * larger than CAMEL_BLOCK_FILE_IO_MAX, or 0 for CAMEL_BLOCK_SIZE.
  *
  * Return value: The new block file, or NULL if it could not be created.
  **/
@@ -367,10 +490,22 @@ CamelBlockFile *camel_block_file_new(const char *path, int flags, const char ver
 {
 	CamelBlockFile *bs;
 
+	if (block_size == 0)
+		block_size = CAMEL_BLOCK_SIZE;
+
+	if (block_size < CAMEL_BLOCK_SIZE
+	    || block_size > CAMEL_BLOCK_FILE_IO_MAX
+	    || (block_size & (block_size - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
 	bs = (CamelBlockFile *)camel_object_new(camel_block_file_get_type());
 	memcpy(bs->version, version, 8);
 	bs->path = g_strdup(path);
 	bs->flags = flags;
+	bs->priv->io_size = block_size;
+	bs->priv->io_buffer = g_malloc(block_size);
 
 	bs->root_block = camel_block_file_get_block(bs, 0);
 	if (bs->root_block == NULL) {
@@ -378,7 +513,7 @@ CamelBlockFile *camel_block_file_new(const char *path, int flags, const char ver
 		return NULL;
 	}
 	camel_block_file_detach_block(bs, bs->root_block);
-	bs->root = (CamelBlockRoot *)&bs->root_block->data;
+	bs->root = (CamelBlockRoot *)bs->root_block->data;
 
 	/* we only need these flags on first open */
 	bs->flags &= ~(O_CREAT|O_EXCL|O_TRUNC);
@@ -444,9 +579,7 @@ camel_block_file_delete(CamelBlockFile *bs)
 	CAMEL_BLOCK_FILE_LOCK(bs, io_lock);
 
 	if (bs->fd != -1) {
-		LOCK(block_file_lock);
-		block_file_count--;
-		UNLOCK(block_file_lock);
+		file_node_offline(&p->node);
 		close(bs->fd);
 		bs->fd = -1;
 	}
@@ -460,6 +593,36 @@ camel_block_file_delete(CamelBlockFile *bs)
 
 }
 
+/**
+ * camel_block_file_set_mapped:
+ * @bs:
+ * @mapped:
+ *
+ * Fill cache misses by copying from a shared read-only mapping of the
+ * file rather than with a read() per miss.  The size of the file is
+ * checked on every miss and the mapping dropped or replaced if it has
+ * changed.  Only files opened read-only can be mapped.  The root block
+ * is never mapped.
+ *
+ * Return value: -1 if the file cannot be mapped.
+ **/
+int
+camel_block_file_set_mapped(CamelBlockFile *bs, gboolean mapped)
+{
+#ifdef HAVE_MMAP
+	if (!mapped || (bs->flags & O_ACCMODE) == O_RDONLY) {
+		CAMEL_BLOCK_FILE_LOCK(bs, cache_lock);
+		bs->priv->mapped = mapped != FALSE;
+		CAMEL_BLOCK_FILE_UNLOCK(bs, cache_lock);
+
+		return 0;
+	}
+#endif
+	errno = EINVAL;
+
+	return -1;
+}
+
 /**
  * camel_block_file_new_block:
  * @bs:
@@ -525,6 +688,182 @@ int camel_block_file_free_block(CamelBlockFile *bs, camel_block_t id)
 	return 0;
 }
 
+/* flush old blocks, call with cache_lock held, and io_lock if @io */
+static void
+trim_nolock(CamelBlockFile *bs, gboolean io)
+{
+	CamelBlock *flush, *prev;
+
+	flush = (CamelBlock *)bs->block_cache.tailpred;
+	prev = flush->prev;
+	while (bs->block_cache_count > bs->block_cache_limit && prev) {
+		if (flush->refcount == 0
+		    && (io || (flush->flags & CAMEL_BLOCK_DIRTY) == 0)) {
+			if (sync_block_nolock(bs, flush) != -1) {
+				g_hash_table_remove(bs->blocks, GUINT_TO_POINTER(flush->id));
+				e_dlist_remove((EDListNode *)flush);
+				g_free(flush);
+				bs->block_cache_count--;
+			}
+		}
+		flush = prev;
+		prev = prev->prev;
+	}
+}
+
+static void
+block_file_adapt(CamelBlockFile *bs, gboolean miss)
+{
+	struct _CamelBlockFilePrivate *p = bs->priv;
+
+	p->lookups++;
+	if (miss)
+		p->misses++;
+
+	if (p->lookups < CACHE_PERIOD)
+		return;
+
+	if (p->misses > CACHE_PERIOD / 4
+	    && bs->block_cache_count >= bs->block_cache_limit
+	    && bs->block_cache_limit < CACHE_MAX) {
+		bs->block_cache_limit *= 2;
+		d(printf("Growing block cache of '%s' to %d\n", bs->path, bs->block_cache_limit));
+	}
+
+	p->lookups = 0;
+	p->misses = 0;
+}
+
+#ifdef HAVE_MMAP
+/* copy block @id out of the file mapping, call with cache_lock held.
+   Blocks never point into the mapping, so it can be dropped or
+   replaced whenever the file changes size underneath us */
+static CamelBlock *
+block_file_map_block(CamelBlockFile *bs, camel_block_t id)
+{
+	struct _CamelBlockFilePrivate *p = bs->priv;
+	struct stat st;
+	CamelBlock *bl;
+	void *map;
+
+	/* LOCK io_lock */
+	if (block_file_use(bs) == -1)
+		return NULL;
+
+	/* Touching a page past the end of a file that another process has
+	   truncated raises SIGBUS, so check the size on every miss.  Only a
+	   writer re-initialising the file truncates it, and the root block
+	   is then bogus anyway; the window between the fstat() and the
+	   copy below is as small as we can make it without a signal handler. */
+	if (fstat(bs->fd, &st) == -1
+	    || st.st_size < (off_t)(id + CAMEL_BLOCK_SIZE)
+	    || st.st_size < (off_t)p->map_len) {
+		if (p->map) {
+			munmap(p->map, p->map_len);
+			p->map = NULL;
+			p->map_len = 0;
+		}
+		block_file_unuse(bs);
+		return NULL;
+	}
+
+	if (p->map == NULL || id + CAMEL_BLOCK_SIZE > p->map_len) {
+		if (p->map) {
+			munmap(p->map, p->map_len);
+			p->map = NULL;
+			p->map_len = 0;
+		}
+
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, bs->fd, 0);
+		if (map == MAP_FAILED) {
+			d(printf("Could not map '%s': %s\n", bs->path, strerror(errno)));
+			p->mapped = FALSE;
+			block_file_unuse(bs);
+			return NULL;
+		}
+
+		p->map = map;
+		p->map_len = st.st_size;
+	}
+
+	bl = g_malloc0(sizeof(*bl));
+	bl->id = id;
+	memcpy(bl->data, p->map + id, CAMEL_BLOCK_SIZE);
+
+	/* UNLOCK io_lock */
+	block_file_unuse(bs);
+
+	bs->block_cache_count++;
+	g_hash_table_insert(bs->blocks, GUINT_TO_POINTER(bl->id), bl);
+
+	trim_nolock(bs, FALSE);
+
+	return bl;
+}
+#endif
+
+/* read block @id, and any uncached blocks sharing its io extent while
+   there is room in the cache, call with cache_lock held */
+static CamelBlock *
+block_file_read_block(CamelBlockFile *bs, camel_block_t id)
+{
+	struct _CamelBlockFilePrivate *p = bs->priv;
+	camel_block_t start, end, off;
+	CamelBlock *bl = NULL, *nb;
+	ssize_t len;
+
+	/* LOCK io_lock */
+	if (block_file_use(bs) == -1)
+		return NULL;
+
+	if (bs->root == NULL) {
+		start = id;
+		end = id + CAMEL_BLOCK_SIZE;
+	} else {
+		start = id & ~(p->io_size - 1);
+		end = start + p->io_size;
+		if (end > bs->root->last)
+			end = MAX(bs->root->last, id + CAMEL_BLOCK_SIZE);
+	}
+
+	if (lseek(bs->fd, start, SEEK_SET) == -1
+	    || (len = camel_read(bs->fd, p->io_buffer, end - start)) == -1) {
+		block_file_unuse(bs);
+		return NULL;
+	}
+	memset(p->io_buffer + len, 0, end - start - len);
+
+	for (off = start; off < end; off += CAMEL_BLOCK_SIZE) {
+		if (off != id
+		    && (off == 0
+			|| off >= bs->root->last
+			|| bs->block_cache_count >= bs->block_cache_limit
+			|| g_hash_table_lookup(bs->blocks, GUINT_TO_POINTER(off)) != NULL
+			|| g_hash_table_lookup(p->detached, GUINT_TO_POINTER(off)) != NULL))
+			continue;
+
+		nb = g_malloc0(sizeof(*nb));
+		nb->id = off;
+		memcpy(nb->data, p->io_buffer + (off - start), CAMEL_BLOCK_SIZE);
+
+		bs->block_cache_count++;
+		g_hash_table_insert(bs->blocks, GUINT_TO_POINTER(nb->id), nb);
+
+		/* read-ahead blocks are the first to go if they aren't used */
+		if (off == id)
+			bl = nb;
+		else
+			e_dlist_addtail(&bs->block_cache, (EDListNode *)nb);
+	}
+
+	trim_nolock(bs, TRUE);
+
+	/* UNLOCK io_lock */
+	block_file_unuse(bs);
+
+	return bl;
+}
+
 /**
  * camel_block_file_get_block:
  * @bs:
@@ -537,7 +876,7 @@ int camel_block_file_free_block(CamelBlockFile *bs, camel_block_t id)
  **/
 CamelBlock *camel_block_file_get_block(CamelBlockFile *bs, camel_block_t id)
 {
-	CamelBlock *bl, *flush, *prev;
+	CamelBlock *bl;
 
 	/* Sanity check: Dont allow reading of root block (except before its been read)
 	   or blocks with invalid block id's */
@@ -554,43 +893,19 @@ CamelBlock *camel_block_file_get_block(CamelBlockFile *bs, camel_block_t id)
 
 	d(printf("Get  block %08x: %s\n", id, bl?"cached":"must read"));
 
-	if (bl == NULL) {
-		/* LOCK io_lock */
-		if (block_file_use(bs) == -1) {
-			CAMEL_BLOCK_FILE_UNLOCK(bs, cache_lock);
-			return NULL;
-		}
+	block_file_adapt(bs, bl == NULL);
 
-		bl = g_malloc0(sizeof(*bl));
-		bl->id = id;
-		if (lseek(bs->fd, id, SEEK_SET) == -1 ||
-		    camel_read (bs->fd, (char *) bl->data, CAMEL_BLOCK_SIZE) == -1) {
-			block_file_unuse(bs);
+	if (bl == NULL) {
+#ifdef HAVE_MMAP
+		if (bs->priv->mapped && bs->root != NULL)
+			bl = block_file_map_block(bs, id);
+		if (bl == NULL)
+#endif
+			bl = block_file_read_block(bs, id);
+		if (bl == NULL) {
 			CAMEL_BLOCK_FILE_UNLOCK(bs, cache_lock);
-			g_free(bl);
 			return NULL;
 		}
-
-		bs->block_cache_count++;
-		g_hash_table_insert(bs->blocks, GUINT_TO_POINTER(bl->id), bl);
-
-		/* flush old blocks */
-		flush = (CamelBlock *)bs->block_cache.tailpred;
-		prev = flush->prev;
-		while (bs->block_cache_count > bs->block_cache_limit && prev) {
-			if (flush->refcount == 0) {
-				if (sync_block_nolock(bs, flush) != -1) {
-					g_hash_table_remove(bs->blocks, GUINT_TO_POINTER(flush->id));
-					e_dlist_remove((EDListNode *)flush);
-					g_free(flush);
-					bs->block_cache_count--;
-				}
-			}
-			flush = prev;
-			prev = prev->prev;
-		}
-		/* UNLOCK io_lock */
-		block_file_unuse(bs);
 	} else {
 		e_dlist_remove((EDListNode *)bl);
 	}
@@ -620,7 +935,9 @@ void camel_block_file_detach_block(CamelBlockFile *bs, CamelBlock *bl)
 	CAMEL_BLOCK_FILE_LOCK(bs, cache_lock);
 
 	g_hash_table_remove(bs->blocks, GUINT_TO_POINTER(bl->id));
+	g_hash_table_insert(bs->priv->detached, GUINT_TO_POINTER(bl->id), bl);
 	e_dlist_remove((EDListNode *)bl);
+	bs->block_cache_count--;
 	bl->flags |= CAMEL_BLOCK_DETACHED;
 
 	CAMEL_BLOCK_FILE_UNLOCK(bs, cache_lock);
@@ -637,8 +954,10 @@ void camel_block_file_attach_block(CamelBlockFile *bs, CamelBlock *bl)
 {
 	CAMEL_BLOCK_FILE_LOCK(bs, cache_lock);
 
+	g_hash_table_remove(bs->priv->detached, GUINT_TO_POINTER(bl->id));
 	g_hash_table_insert(bs->blocks, GUINT_TO_POINTER(bl->id), bl);
 	e_dlist_addtail(&bs->block_cache, (EDListNode *)bl);
+	bs->block_cache_count++;
 	bl->flags &= ~CAMEL_BLOCK_DETACHED;
 
 	CAMEL_BLOCK_FILE_UNLOCK(bs, cache_lock);
@@ -685,48 +1004,130 @@ void camel_block_file_unref_block(CamelBlockFile *bs, CamelBlock *bl)
 {
 	CAMEL_BLOCK_FILE_LOCK(bs, cache_lock);
 
-	if (bl->refcount == 1 && (bl->flags & CAMEL_BLOCK_DETACHED))
+	if (bl->refcount == 1 && (bl->flags & CAMEL_BLOCK_DETACHED)) {
+		g_hash_table_remove(bs->priv->detached, GUINT_TO_POINTER(bl->id));
 		g_free(bl);
-	else
+	} else
 		bl->refcount--;
 
 	CAMEL_BLOCK_FILE_UNLOCK(bs, cache_lock);
 }
 
+/* write all @len bytes of @buffer at @off, call with io_lock held.
+   Not camel_write(), a sync must not be cut short by a cancelled
+   operation */
+static int
+block_file_write(CamelBlockFile *bs, camel_block_t off, const char *buffer, size_t len)
+{
+	ssize_t w;
+
+	if (lseek(bs->fd, off, SEEK_SET) == -1)
+		return -1;
+
+	while (len > 0) {
+		do {
+			w = write(bs->fd, buffer, len);
+		} while (w == -1 && errno == EINTR);
+
+		if (w == -1)
+			return -1;
+		if (w == 0) {
+			errno = ENOSPC;
+			return -1;
+		}
+
+		buffer += w;
+		len -= w;
+	}
+
+	return 0;
+}
+
 static int
 sync_block_nolock(CamelBlockFile *bs, CamelBlock *bl)
 {
 	d(printf("Sync block %08x: %s\n", bl->id, (bl->flags & CAMEL_BLOCK_DIRTY)?"dirty":"clean"));
 
 	if (bl->flags & CAMEL_BLOCK_DIRTY) {
-		if (lseek(bs->fd, bl->id, SEEK_SET) == -1
-		    || write(bs->fd, bl->data, CAMEL_BLOCK_SIZE) != CAMEL_BLOCK_SIZE) {
+		if (block_file_write(bs, bl->id, (char *)bl->data, CAMEL_BLOCK_SIZE) == -1)
 			return -1;
-		}
 		bl->flags &= ~CAMEL_BLOCK_DIRTY;
 	}
 
 	return 0;
 }
 
+static int
+block_id_cmp(const void *ap, const void *bp)
+{
+	const CamelBlock *a = *(const CamelBlock **)ap;
+	const CamelBlock *b = *(const CamelBlock **)bp;
+
+	return a->id < b->id ? -1 : a->id > b->id ? 1 : 0;
+}
+
+/* write out @len dirty blocks with consecutive ids in one go */
+static int
+sync_run_nolock(CamelBlockFile *bs, CamelBlock **run, int len)
+{
+	char *buffer = bs->priv->io_buffer;
+	size_t size = len * CAMEL_BLOCK_SIZE;
+	int i;
+
+	if (len == 1)
+		return sync_block_nolock(bs, run[0]);
+
+	d(printf("Sync blocks %08x-%08x\n", run[0]->id, run[len-1]->id));
+
+	for (i=0;i<len;i++)
+		memcpy(buffer + i * CAMEL_BLOCK_SIZE, run[i]->data, CAMEL_BLOCK_SIZE);
+
+	if (block_file_write(bs, run[0]->id, buffer, size) == -1)
+		return -1;
+
+	for (i=0;i<len;i++)
+		run[i]->flags &= ~CAMEL_BLOCK_DIRTY;
+
+	return 0;
+}
+
 static int
 sync_nolock(CamelBlockFile *bs)
 {
 	CamelBlock *bl, *bn;
+	GPtrArray *dirty;
+	int i, start, max, ret = 0;
 	int work = FALSE;
 
+	dirty = g_ptr_array_new();
+
 	bl = (CamelBlock *)bs->block_cache.head;
 	bn = bl->next;
 	while (bn) {
-		if (bl->flags & CAMEL_BLOCK_DIRTY) {
-			work = TRUE;
-			if (sync_block_nolock(bs, bl) == -1)
-				return -1;
-		}
+		if (bl->flags & CAMEL_BLOCK_DIRTY)
+			g_ptr_array_add(dirty, bl);
 		bl = bn;
 		bn = bn->next;
 	}
 
+	/* write in block order, adjacent blocks up to io_size at a time */
+	qsort(dirty->pdata, dirty->len, sizeof(dirty->pdata[0]), block_id_cmp);
+	max = bs->priv->io_size / CAMEL_BLOCK_SIZE;
+	for (start = 0, i = 1; start < dirty->len && ret == 0; i++) {
+		if (i == dirty->len
+		    || i - start == max
+		    || ((CamelBlock *)dirty->pdata[i])->id != ((CamelBlock *)dirty->pdata[i-1])->id + CAMEL_BLOCK_SIZE) {
+			ret = sync_run_nolock(bs, (CamelBlock **)dirty->pdata + start, i - start);
+			start = i;
+		}
+	}
+
+	work = dirty->len > 0;
+	g_ptr_array_free(dirty, TRUE);
+
+	if (ret == -1)
+		return -1;
+
 	if (!work
 	    && (bs->root_block->flags & CAMEL_BLOCK_DIRTY) == 0
 	    && (bs->root->flags & CAMEL_BLOCK_FILE_SYNC) != 0)
@@ -797,25 +1198,32 @@ int camel_block_file_sync(CamelBlockFile *bs)
 /* ********************************************************************** */
 
 struct _CamelKeyFilePrivate {
-	struct _CamelKeyFilePrivate *next;
-	struct _CamelKeyFilePrivate *prev;
+	struct _file_node node;
 
 	struct _CamelKeyFile *base;
 	pthread_mutex_t lock;
 	unsigned int deleted:1;
+	unsigned int packed:1;
 };
 
+/* A record is the next record pointer and a 32 bit size, followed by
+   the keys.  Raw records just have the number of keys as the size,
+   packed records have KEY_PACKED set, the number of keys in the low
+   KEY_COUNT_BITS and the number of bytes of packed keys above that.
+   Each packed key is the zig-zag encoded difference from the previous
+   key, the first from 0, stored 7 bits a byte, low bits first, with
+   the top bit set on all but the last byte. */
+#define KEY_PACKED (0x80000000)
+#define KEY_COUNT_BITS (11)
+#define KEY_COUNT_MASK ((1<<KEY_COUNT_BITS)-1)
+#define KEY_MAX_RECORDS (1024)
+#define KEY_MAX_PACKED (KEY_MAX_RECORDS * 5)
+
 #define CAMEL_KEY_FILE_LOCK(kf, lock) (pthread_mutex_lock(&(kf)->priv->lock))
 #define CAMEL_KEY_FILE_TRYLOCK(kf, lock) (pthread_mutex_trylock(&(kf)->priv->lock))
 #define CAMEL_KEY_FILE_UNLOCK(kf, lock) (pthread_mutex_unlock(&(kf)->priv->lock))
 
-static pthread_mutex_t key_file_lock = PTHREAD_MUTEX_INITIALIZER;
-
-/* lru cache of block files */
-static EDList key_file_list = E_DLIST_INITIALISER(key_file_list);
-static EDList key_file_active_list = E_DLIST_INITIALISER(key_file_active_list);
-static int key_file_count = 0;
-static const int key_file_threshhold = 10;
+static int key_file_offline(struct _file_node *node);
 
 static void
 camel_key_file_class_init(CamelKeyFileClass *klass)
@@ -830,11 +1238,9 @@ camel_key_file_init(CamelKeyFile *bs)
 	p = bs->priv = g_malloc0(sizeof(*bs->priv));
 	p->base = bs;
 
-	pthread_mutex_init(&p->lock, NULL);
+	p->node.offline = key_file_offline;
 
-	LOCK(key_file_lock);
-	e_dlist_addhead(&key_file_list, (EDListNode *)p);
-	UNLOCK(key_file_lock);
+	pthread_mutex_init(&p->lock, NULL);
 }
 
 static void
@@ -842,15 +1248,9 @@ camel_key_file_finalise(CamelKeyFile *bs)
 {
 	struct _CamelKeyFilePrivate *p = bs->priv;
 
-	LOCK(key_file_lock);
-	e_dlist_remove((EDListNode *)p);
-
-	if (bs-> fp) {
-		key_file_count--;
+	file_node_offline(&p->node);
+	if (bs->fp)
 		fclose(bs->fp);
-	}
-
-	UNLOCK(key_file_lock);
 
 	g_free(bs->path);
 
@@ -877,22 +1277,40 @@ camel_key_file_get_type(void)
 	return type;
 }
 
+/* take a key file offline, when there are too many open */
+static int
+key_file_offline(struct _file_node *node)
+{
+	CamelKeyFile *bf = ((struct _CamelKeyFilePrivate *)node)->base;
+
+	/* Need to trylock, as the file lock might be trying to lock
+	   the shard lock we hold, so we need to check and abort if so */
+	if (CAMEL_KEY_FILE_TRYLOCK(bf, lock) != 0)
+		return -1;
+
+	d(printf("Turning key file offline: %s\n", bf->path));
+	fclose(bf->fp);
+	bf->fp = NULL;
+	CAMEL_KEY_FILE_UNLOCK(bf, lock);
+
+	return 0;
+}
+
 /* 'use' a key file for io */
 static int
 key_file_use(CamelKeyFile *bs)
 {
-	struct _CamelKeyFilePrivate *nw, *nn, *p = bs->priv;
-	CamelKeyFile *bf;
+	struct _CamelKeyFilePrivate *p = bs->priv;
 	int err, fd;
 	char *flag;
 
 	/* We want to:
-	    remove file from active list
 	    lock it
+	    open it if it is offline, which may take older files offline
 
 	   Then when done:
+	    mark it used
 	    unlock it
-	    add it back to end of active list
 	*/
 
 	/* TODO: Check header on reset? */
@@ -923,33 +1341,7 @@ key_file_use(CamelKeyFile *bs)
 		return -1;
 	}
 
-	LOCK(key_file_lock);
-	e_dlist_remove((EDListNode *)p);
-	e_dlist_addtail(&key_file_active_list, (EDListNode *)p);
-
-	key_file_count++;
-
-	nw = (struct _CamelKeyFilePrivate *)key_file_list.head;
-	nn = nw->next;
-	while (key_file_count > key_file_threshhold && nn) {
-		/* We never hit the current keyfile here, as its removed from the list first */
-		bf = nw->base;
-		if (bf->fp != NULL) {
-			/* Need to trylock, as any of these lock levels might be trying
-			   to lock the key_file_lock, so we need to check and abort if so */
-			if (CAMEL_BLOCK_FILE_TRYLOCK(bf, lock) == 0) {
-				d(printf("Turning key file offline: %s\n", bf->path));
-				fclose(bf->fp);
-				bf->fp = NULL;
-				key_file_count--;
-				CAMEL_BLOCK_FILE_UNLOCK(bf, lock);
-			}
-		}
-		nw = nn;
-		nn = nw->next;
-	}
-
-	UNLOCK(key_file_lock);
+	file_node_online(&p->node);
 
 	return 0;
 }
@@ -957,10 +1349,7 @@ key_file_use(CamelKeyFile *bs)
 static void
 key_file_unuse(CamelKeyFile *bs)
 {
-	LOCK(key_file_lock);
-	e_dlist_remove((EDListNode *)bs->priv);
-	e_dlist_addtail(&key_file_list, (EDListNode *)bs->priv);
-	UNLOCK(key_file_lock);
+	bs->priv->node.used = TRUE;
 
 	CAMEL_KEY_FILE_UNLOCK(bs, lock);
 }
@@ -969,18 +1358,20 @@ key_file_unuse(CamelKeyFile *bs)
  * camel_key_file_new:
  * @path:
  * @flags: open flags
- * @version: Version string (header) of file.  Currently
- * written but not checked.
+ * @version: Version string (header) of file.  Written to new files,
+ * and an existing file with any other header is not opened.
  *
  * Create a new key file.  A linked list of record blocks.
  *
  * Return value: A new key file, or NULL if the file could not
- * be opened/created/initialised.
+ * be opened/created/initialised.  errno is EINVAL if the file
+ * has a different header.
  **/
 CamelKeyFile *
 camel_key_file_new(const char *path, int flags, const char version[8])
 {
 	CamelKeyFile *kf;
+	char header[8];
 	off_t last;
 	int err;
 
@@ -1001,10 +1392,16 @@ camel_key_file_new(const char *path, int flags, const char version[8])
 		if (last == 0) {
 			fwrite(version, 8, 1, kf->fp);
 			last += 8;
-		}
+			err = ferror(kf->fp) ? EIO : 0;
+		} else if (fseek(kf->fp, 0, SEEK_SET) == -1
+			   || fread(header, 8, 1, kf->fp) != 1
+			   || memcmp(header, version, 8) != 0) {
+			d(printf("Key file '%s' has the wrong header\n", path));
+			err = EINVAL;
+		} else
+			err = 0;
 		kf->last = last;
 
-		err = ferror(kf->fp);
 		key_file_unuse(kf);
 
 		/* we only need these flags on first open */
@@ -1013,6 +1410,7 @@ camel_key_file_new(const char *path, int flags, const char version[8])
 		if (err) {
 			camel_object_unref((CamelObject *)kf);
 			kf = NULL;
+			errno = err;
 		}
 	}
 
@@ -1058,9 +1456,7 @@ camel_key_file_delete(CamelKeyFile *kf)
 	CAMEL_KEY_FILE_LOCK(kf, lock);
 
 	if (kf->fp) {
-		LOCK(key_file_lock);
-		key_file_count--;
-		UNLOCK(key_file_lock);
+		file_node_offline(&p->node);
 		fclose(kf->fp);
 		kf->fp = NULL;
 	}
@@ -1074,6 +1470,69 @@ camel_key_file_delete(CamelKeyFile *kf)
 
 }
 
+/**
+ * camel_key_file_set_packed:
+ * @kf:
+ * @packed:
+ *
+ * Write new records delta and variable length encoded, which usually
+ * takes a quarter or less of the space.  Records written either way
+ * can always be read back, but only by code that knows about packed
+ * records, so callers should give packed files their own header.
+ **/
+void
+camel_key_file_set_packed(CamelKeyFile *kf, gboolean packed)
+{
+	kf->priv->packed = packed != 0;
+}
+
+static size_t
+key_file_pack(unsigned char *out, size_t len, camel_key_t *records)
+{
+	unsigned char *o = out;
+	camel_key_t last = 0;
+	guint32 v;
+	size_t i;
+
+	for (i=0;i<len;i++) {
+		v = records[i] - last;
+		v = (v << 1) ^ -(v >> 31);
+		last = records[i];
+		while (v >= 0x80) {
+			*o++ = (v & 0x7f) | 0x80;
+			v >>= 7;
+		}
+		*o++ = v;
+	}
+
+	return o - out;
+}
+
+static int
+key_file_unpack(const unsigned char *in, size_t inlen, size_t len, camel_key_t *records)
+{
+	const unsigned char *end = in + inlen;
+	camel_key_t last = 0;
+	guint32 v;
+	size_t i;
+	int shift;
+
+	for (i=0;i<len;i++) {
+		v = 0;
+		shift = 0;
+		do {
+			if (in >= end || shift > 28)
+				return -1;
+			v |= (guint32)(*in & 0x7f) << shift;
+			shift += 7;
+		} while (*in++ & 0x80);
+		last += (v >> 1) ^ -(v & 1);
+		records[i] = last;
+	}
+
+	return in == end ? 0 : -1;
+}
+
 /**
  * camel_key_file_write:
  * @kf:
@@ -1088,7 +1547,9 @@ camel_key_file_delete(CamelKeyFile *kf)
 int
 camel_key_file_write(CamelKeyFile *kf, camel_block_t *parent, size_t len, camel_key_t *records)
 {
+	unsigned char packed[KEY_MAX_PACKED];
 	camel_block_t next;
+	size_t packedlen = 0;
 	guint32 size;
 	int ret = -1;
 
@@ -1099,18 +1560,27 @@ camel_key_file_write(CamelKeyFile *kf, camel_block_t *parent, size_t len, camel_
 		return 0;
 	}
 
+	g_return_val_if_fail(len <= KEY_MAX_RECORDS, -1);
+
 	/* LOCK */
 	if (key_file_use(kf) == -1)
 		return -1;
 
-	size = len;
+	if (kf->priv->packed) {
+		packedlen = key_file_pack(packed, len, records);
+		size = KEY_PACKED | (packedlen << KEY_COUNT_BITS) | len;
+	} else
+		size = len;
 
 	/* FIXME: Use io util functions? */
 	next = kf->last;
 	fseek(kf->fp, kf->last, SEEK_SET);
 	fwrite(parent, sizeof(*parent), 1, kf->fp);
 	fwrite(&size, sizeof(size), 1, kf->fp);
-	fwrite(records, sizeof(records[0]), len, kf->fp);
+	if (size & KEY_PACKED)
+		fwrite(packed, 1, packedlen, kf->fp);
+	else
+		fwrite(records, sizeof(records[0]), len, kf->fp);
 
 	if (ferror(kf->fp)) {
 		clearerr(kf->fp);
@@ -1136,14 +1606,15 @@ camel_key_file_write(CamelKeyFile *kf, camel_block_t *parent, size_t len, camel_
  * @records: Records, allocated, must be freed with g_free, if != NULL.
  *
  * Read the next block of data from the key file.  Returns the number of
- * records.
+ * records.  Packed records are decoded as they are read.
  *
  * Return value: -1 on io error.
  **/
 int
 camel_key_file_read(CamelKeyFile *kf, camel_block_t *start, size_t *len, camel_key_t **records)
 {
-	guint32 size;
+	unsigned char packed[KEY_MAX_PACKED];
+	guint32 size, count, packedlen = 0;
 	long pos = *start;
 	camel_block_t next;
 	int ret = -1;
@@ -1157,19 +1628,33 @@ camel_key_file_read(CamelKeyFile *kf, camel_block_t *start, size_t *len, camel_k
 
 	if (fseek(kf->fp, pos, SEEK_SET) == -1
 	    || fread(&next, sizeof(next), 1, kf->fp) != 1
-	    || fread(&size, sizeof(size), 1, kf->fp) != 1
-	    || size > 1024) {
+	    || fread(&size, sizeof(size), 1, kf->fp) != 1) {
 		clearerr(kf->fp);
 		goto fail;
 	}
 
+	if (size & KEY_PACKED) {
+		count = size & KEY_COUNT_MASK;
+		packedlen = (size & ~KEY_PACKED) >> KEY_COUNT_BITS;
+	} else
+		count = size;
+
+	if (count > KEY_MAX_RECORDS || packedlen > KEY_MAX_PACKED)
+		goto fail;
+
 	if (len)
-		*len = size;
+		*len = count;
 
 	if (records) {
-		camel_key_t *keys = g_malloc(size * sizeof(camel_key_t));
+		camel_key_t *keys = g_malloc(count * sizeof(camel_key_t));
 
-		if (fread(keys, sizeof(camel_key_t), size, kf->fp) != size) {
+		if (size & KEY_PACKED) {
+			if (fread(packed, 1, packedlen, kf->fp) != packedlen
+			    || key_file_unpack(packed, packedlen, count, keys) == -1) {
+				g_free(keys);
+				goto fail;
+			}
+		} else if (fread(keys, sizeof(camel_key_t), count, kf->fp) != count) {
 			g_free(keys);
 			goto fail;
 		}
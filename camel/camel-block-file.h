@@ -41,6 +41,9 @@ typedef struct _CamelBlockFileClass CamelBlockFileClass;
 #define CAMEL_BLOCK_SIZE (1024)
 #define CAMEL_BLOCK_SIZE_BITS (10) /* # bits to contain block_size bytes */
 
+/* largest unit a block file may be read and written in */
+#define CAMEL_BLOCK_FILE_IO_MAX (16384)
+
 #define CAMEL_BLOCK_DIRTY (1<<0)
 #define CAMEL_BLOCK_DETACHED (1<<1)
 
@@ -84,7 +87,7 @@ struct _CamelBlockFile {
 	CamelBlock *root_block;
 
 	/* make private? */
-	int block_cache_limit;
+	int block_cache_limit;	/* grows and shrinks with the miss rate */
 	int block_cache_count;
 	EDList block_cache;
 	GHashTable *blocks;
@@ -102,6 +105,7 @@ CamelType camel_block_file_get_type(void);
 CamelBlockFile *camel_block_file_new(const char *path, int flags, const char version[8], size_t block_size);
 int camel_block_file_rename(CamelBlockFile *bs, const char *path);
 int camel_block_file_delete(CamelBlockFile *kf);
+int camel_block_file_set_mapped(CamelBlockFile *bs, gboolean mapped);
 
 CamelBlock *camel_block_file_new_block(CamelBlockFile *bs);
 int camel_block_file_free_block(CamelBlockFile *bs, camel_block_t id);
@@ -138,6 +142,7 @@ CamelType      camel_key_file_get_type(void);
 CamelKeyFile * camel_key_file_new(const char *path, int flags, const char version[8]);
 int	       camel_key_file_rename(CamelKeyFile *kf, const char *path);
 int	       camel_key_file_delete(CamelKeyFile *kf);
+void	       camel_key_file_set_packed(CamelKeyFile *kf, gboolean packed);
 
 int            camel_key_file_write(CamelKeyFile *kf, camel_block_t *parent, size_t len, camel_key_t *records);
 int            camel_key_file_read(CamelKeyFile *kf, camel_block_t *start, size_t *len, camel_key_t **records);
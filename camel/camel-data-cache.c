@@ -25,8 +25,10 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #ifdef HAVE_ALLOCA_H
@@ -43,6 +45,7 @@
 #include "camel-stream-fs.h"
 #include "camel-stream-mem.h"
 #include "camel-file-utils.h"
+#include "camel-list-utils.h"
 
 extern int camel_verbose_debug;
 #define dd(x) (camel_verbose_debug?(x):0)
@@ -56,11 +59,38 @@ extern int camel_verbose_debug;
    once an hour should be enough */
 #define CAMEL_DATA_CACHE_CYCLE_TIME (60*60)
 
+/* With a size limit every item is kept on a list, least recently used
+   first, saved to the manifest so the next cache needn't scan for
+   them.  The manifest is removed as soon as the list changes, so one
+   that exists can be trusted. */
+#define CAMEL_DATA_CACHE_MANIFEST ".cache-manifest"
+#define CAMEL_DATA_CACHE_MANIFEST_VERSION "camel-data-cache 1"
+
+struct _data_cache_item {
+	struct _data_cache_item *next;
+	struct _data_cache_item *prev;
+
+	char *path;		/* full path, key of items */
+	off_t size;		/* -1 until known */
+	time_t atime;
+};
+
 struct _CamelDataCachePrivate {
 	CamelObjectBag *busy_bag;
 
 	int expire_inc;
 	time_t expire_last[1<<CAMEL_DATA_CACHE_BITS];
+
+	GMutex *lock;		/* for the rest */
+
+	GHashTable *items;	/* with expire_size set, path -> item */
+	CamelDList lru;
+	off_t size;		/* of all the items */
+	struct _data_cache_item *pending; /* last added, still being written */
+	guint dirty:1;		/* manifest is out of date or missing */
+	guint touched:1;	/* only the order has changed */
+
+	guint32 hits, misses, expired;
 };
 
 static CamelObject *camel_data_cache_parent;
@@ -84,14 +114,28 @@ static void data_cache_init(CamelDataCache *cdc, CamelDataCacheClass *klass)
 
 	p = cdc->priv = g_malloc0(sizeof(*cdc->priv));
 	p->busy_bag = camel_object_bag_new(g_str_hash, g_str_equal, (CamelCopyFunc)g_strdup, g_free);
+	p->lock = g_mutex_new();
+	camel_dlist_init(&p->lru);
 }
 
+static void data_cache_save(CamelDataCache *cdc);
+
 static void data_cache_finalise(CamelDataCache *cdc)
 {
 	struct _CamelDataCachePrivate *p;
+	struct _data_cache_item *item;
 
 	p = cdc->priv;
+	if (p->items) {
+		data_cache_save(cdc);
+		while ((item = (struct _data_cache_item *)camel_dlist_remhead(&p->lru))) {
+			g_free(item->path);
+			g_free(item);
+		}
+		g_hash_table_destroy(p->items);
+	}
 	camel_object_bag_destroy(p->busy_bag);
+	g_mutex_free(p->lock);
 	g_free(p);
 
 	g_free (cdc->path);
@@ -144,6 +188,7 @@ camel_data_cache_new(const char *path, guint32 flags, CamelException *ex)
 	cdc->flags = flags;
 	cdc->expire_age = -1;
 	cdc->expire_access = -1;
+	cdc->expire_size = -1;
 
 	return cdc;
 }
@@ -190,6 +235,305 @@ camel_data_cache_set_expire_access(CamelDataCache *cdc, time_t when)
 	cdc->expire_access = when;
 }
 
+/* The manifest is about to go out of date */
+static void
+data_cache_changed(CamelDataCache *cdc)
+{
+	char *path;
+
+	if (cdc->priv->dirty)
+		return;
+
+	path = g_strdup_printf("%s/" CAMEL_DATA_CACHE_MANIFEST, cdc->path);
+	g_unlink(path);
+	g_free(path);
+	cdc->priv->dirty = TRUE;
+}
+
+static struct _data_cache_item *
+data_cache_item_add(CamelDataCache *cdc, const char *path, off_t size, time_t atime)
+{
+	struct _CamelDataCachePrivate *p = cdc->priv;
+	struct _data_cache_item *item;
+
+	item = g_malloc(sizeof(*item));
+	item->path = g_strdup(path);
+	item->size = size;
+	item->atime = atime;
+	g_hash_table_insert(p->items, item->path, item);
+	camel_dlist_addtail(&p->lru, (CamelDListNode *)item);
+	if (size > 0)
+		p->size += size;
+
+	return item;
+}
+
+static void
+data_cache_item_remove(CamelDataCache *cdc, const char *path)
+{
+	struct _CamelDataCachePrivate *p = cdc->priv;
+	struct _data_cache_item *item;
+
+	if (p->items == NULL
+	    || (item = g_hash_table_lookup(p->items, path)) == NULL)
+		return;
+
+	data_cache_changed(cdc);
+	if (p->pending == item)
+		p->pending = NULL;
+	g_hash_table_remove(p->items, path);
+	camel_dlist_remove((CamelDListNode *)item);
+	if (item->size > 0)
+		p->size -= item->size;
+	g_free(item->path);
+	g_free(item);
+}
+
+/* Find out how big an item is, once it's been written */
+static void
+data_cache_item_size(CamelDataCache *cdc, struct _data_cache_item *item)
+{
+	struct stat st;
+
+	if (item->size == -1 && g_stat(item->path, &st) == 0) {
+		item->size = st.st_size;
+		cdc->priv->size += item->size;
+	}
+}
+
+/* remove an item, whether or not it's in use.  Only peek at the
+   busy bag, with the lock held we can't wait for a reservation */
+static void
+data_cache_unlink(CamelDataCache *cdc, const char *path)
+{
+	CamelStream *stream;
+
+	g_unlink(path);
+	stream = camel_object_bag_peek(cdc->priv->busy_bag, path);
+	if (stream) {
+		camel_object_bag_remove(cdc->priv->busy_bag, stream);
+		camel_object_unref(stream);
+	}
+	data_cache_item_remove(cdc, path);
+	cdc->priv->expired++;
+}
+
+/* Expire least recently used items until the cache is a little
+   under its size limit, so it isn't done again on every add */
+static void
+data_cache_expire_size(CamelDataCache *cdc)
+{
+	struct _CamelDataCachePrivate *p = cdc->priv;
+	struct _data_cache_item *item;
+	off_t limit;
+
+	if (p->size <= cdc->expire_size)
+		return;
+
+	limit = cdc->expire_size - cdc->expire_size / 10;
+	while (p->size > limit
+	       && (item = (struct _data_cache_item *)p->lru.head)->next != NULL
+	       && item != p->pending) {
+		dd(printf("Expiring '%s' for size\n", item->path));
+		data_cache_unlink(cdc, item->path);
+	}
+}
+
+static int
+data_cache_load(CamelDataCache *cdc)
+{
+	char *path, *contents, *line, *next, *end;
+	off_t size;
+	time_t atime;
+
+	path = g_strdup_printf("%s/" CAMEL_DATA_CACHE_MANIFEST, cdc->path);
+	if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+		g_free(path);
+		return -1;
+	}
+	g_free(path);
+
+	if (strncmp(contents, CAMEL_DATA_CACHE_MANIFEST_VERSION "\n", strlen(CAMEL_DATA_CACHE_MANIFEST_VERSION "\n")) != 0)
+		goto fail;
+
+	/* "<size> <atime> <path>" lines, least recently used first */
+	for (line = contents + strlen(CAMEL_DATA_CACHE_MANIFEST_VERSION "\n"); *line; line = next) {
+		if ((next = strchr(line, '\n')) == NULL)
+			goto fail;
+		*next++ = 0;
+
+		size = strtoul(line, &end, 10);
+		if (*end != ' ')
+			goto fail;
+		atime = strtoul(end + 1, &end, 10);
+		if (*end != ' ' || end[1] == 0)
+			goto fail;
+
+		path = g_strdup_printf("%s/%s", cdc->path, end + 1);
+		if (g_hash_table_lookup(cdc->priv->items, path) == NULL)
+			data_cache_item_add(cdc, path, size, atime);
+		g_free(path);
+	}
+
+	g_free(contents);
+	return 0;
+fail:
+	g_free(contents);
+	return -1;
+}
+
+static int
+data_cache_scan_sort(const void *ap, const void *bp)
+{
+	const struct _data_cache_item *a = *((struct _data_cache_item **)ap);
+	const struct _data_cache_item *b = *((struct _data_cache_item **)bp);
+
+	return a->atime < b->atime ? -1 : a->atime > b->atime ? 1 : 0;
+}
+
+/* Find the items under @path, anything in one of our hash directories */
+static void
+data_cache_scan(CamelDataCache *cdc, const char *path, GPtrArray *found)
+{
+	struct _data_cache_item *item;
+	const char *dname, *base;
+	struct stat st;
+	GDir *dir;
+	char *s;
+
+	dir = g_dir_open(path, 0, NULL);
+	if (dir == NULL)
+		return;
+
+	base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	while ((dname = g_dir_read_name(dir))) {
+		s = g_strdup_printf("%s/%s", path, dname);
+		if (g_stat(s, &st) == 0) {
+			if (S_ISDIR(st.st_mode)) {
+				data_cache_scan(cdc, s, found);
+			} else if (S_ISREG(st.st_mode) && path != cdc->path && strlen(base) == 2
+				   && isxdigit(base[0]) && isxdigit(base[1])) {
+				item = g_malloc(sizeof(*item));
+				item->path = s;
+				item->size = st.st_size;
+				item->atime = st.st_atime;
+				g_ptr_array_add(found, item);
+				continue;
+			}
+		}
+		g_free(s);
+	}
+	g_dir_close(dir);
+}
+
+static void
+data_cache_save_item(struct _data_cache_item *item, FILE *out, CamelDataCache *cdc)
+{
+	data_cache_item_size(cdc, item);
+	fprintf(out, "%lu %lu %s\n", item->size == -1 ? 0 : (unsigned long)item->size,
+		(unsigned long)item->atime, item->path + strlen(cdc->path) + 1);
+}
+
+static void
+data_cache_save(CamelDataCache *cdc)
+{
+	struct _CamelDataCachePrivate *p = cdc->priv;
+	struct _data_cache_item *item;
+	char *path, *tmp;
+	FILE *out;
+
+	if (!p->dirty && !p->touched)
+		return;
+
+	path = g_strdup_printf("%s/" CAMEL_DATA_CACHE_MANIFEST, cdc->path);
+	tmp = g_strdup_printf("%s~", path);
+	out = g_fopen(tmp, "wb");
+	if (out) {
+		fputs(CAMEL_DATA_CACHE_MANIFEST_VERSION "\n", out);
+		for (item = (struct _data_cache_item *)p->lru.head; item->next; item = item->next)
+			data_cache_save_item(item, out, cdc);
+		if (ferror(out) == 0 && fclose(out) == 0 && g_rename(tmp, path) == 0) {
+			p->dirty = FALSE;
+			p->touched = FALSE;
+		} else
+			g_unlink(tmp);
+	}
+	g_free(tmp);
+	g_free(path);
+}
+
+/**
+ * camel_data_cache_set_expire_size:
+ * @cdc: A #CamelDataCache
+ * @size: Most bytes the cache may hold, or -1 for no limit.
+ *
+ * Set the cache expiration policy for the size of the cache.
+ *
+ * Once the items in the cache come to more than @size bytes, the
+ * least recently used are expired until it is back under the limit.
+ * This happens as items are added, without scanning the cache; the
+ * items are listed in a manifest kept with the cache.
+ *
+ * This can be used alongside the age and access limits.
+ **/
+void
+camel_data_cache_set_expire_size(CamelDataCache *cdc, off_t size)
+{
+	struct _CamelDataCachePrivate *p = cdc->priv;
+	GPtrArray *found;
+	int i;
+
+	g_mutex_lock(p->lock);
+
+	cdc->expire_size = size;
+	if (size != -1 && p->items == NULL) {
+		p->items = g_hash_table_new(g_str_hash, g_str_equal);
+		if (data_cache_load(cdc) == -1) {
+			found = g_ptr_array_new();
+			data_cache_scan(cdc, cdc->path, found);
+			qsort(found->pdata, found->len, sizeof(found->pdata[0]), data_cache_scan_sort);
+			for (i = 0; i < found->len; i++) {
+				struct _data_cache_item *item = found->pdata[i];
+
+				if (g_hash_table_lookup(p->items, item->path) == NULL)
+					data_cache_item_add(cdc, item->path, item->size, item->atime);
+				g_free(item->path);
+				g_free(item);
+			}
+			g_ptr_array_free(found, TRUE);
+			data_cache_changed(cdc);
+		}
+	}
+	if (size != -1)
+		data_cache_expire_size(cdc);
+
+	g_mutex_unlock(p->lock);
+}
+
+/**
+ * camel_data_cache_get_stats:
+ * @cdc: A #CamelDataCache
+ * @hits: Set to the number of items found by camel_data_cache_get().
+ * @misses: Set to the number of items camel_data_cache_get() didn't find.
+ * @expired: Set to the number of items expired.
+ *
+ * Get counts of how well the cache is working since it was created.
+ * Any of the pointers may be %NULL.
+ **/
+void
+camel_data_cache_get_stats(CamelDataCache *cdc, guint32 *hits, guint32 *misses, guint32 *expired)
+{
+	g_mutex_lock(cdc->priv->lock);
+	if (hits)
+		*hits = cdc->priv->hits;
+	if (misses)
+		*misses = cdc->priv->misses;
+	if (expired)
+		*expired = cdc->priv->expired;
+	g_mutex_unlock(cdc->priv->lock);
+}
+
 static void
 data_cache_expire(CamelDataCache *cdc, const char *path, const char *keep, time_t now)
 {
@@ -221,6 +565,10 @@ data_cache_expire(CamelDataCache *cdc, const char *path, const char *keep, time_
 				camel_object_bag_remove(cdc->priv->busy_bag, stream);
 				camel_object_unref(stream);
 			}
+			g_mutex_lock(cdc->priv->lock);
+			data_cache_item_remove(cdc, s->str);
+			cdc->priv->expired++;
+			g_mutex_unlock(cdc->priv->lock);
 		}
 	}
 	g_string_free(s, TRUE);
@@ -271,6 +619,45 @@ data_cache_path(CamelDataCache *cdc, int create, const char *path, const char *k
 	return real;
 }
 
+/* Note an item has been added, or found with camel_data_cache_get() */
+static void
+data_cache_touch(CamelDataCache *cdc, const char *path, int add)
+{
+	struct _CamelDataCachePrivate *p = cdc->priv;
+	struct _data_cache_item *item;
+
+	g_mutex_lock(p->lock);
+
+	if (!add)
+		p->hits++;
+
+	if (p->items) {
+		/* by now the last one added will have been written */
+		if (p->pending) {
+			data_cache_item_size(cdc, p->pending);
+			p->pending = NULL;
+		}
+
+		item = g_hash_table_lookup(p->items, path);
+		if (add || item == NULL) {
+			data_cache_changed(cdc);
+			data_cache_item_remove(cdc, path);
+			item = data_cache_item_add(cdc, path, -1, time(NULL));
+			p->pending = item;
+		} else {
+			camel_dlist_remove((CamelDListNode *)item);
+			camel_dlist_addtail(&p->lru, (CamelDListNode *)item);
+			item->atime = time(NULL);
+			p->touched = TRUE;
+		}
+
+		if (cdc->expire_size != -1)
+			data_cache_expire_size(cdc);
+	}
+
+	g_mutex_unlock(p->lock);
+}
+
 /**
  * camel_data_cache_add:
  * @cdc: A #CamelDataCache
@@ -284,7 +671,8 @@ data_cache_path(CamelDataCache *cdc, int create, const char *path, const char *k
  * the item.
  *
  * Potentially, expiry processing will be performed while this call
- * is executing.
+ * is executing.  With a size limit, the item added before this one
+ * is taken to be complete, and counts towards the limit from now.
  *
  * Return value: A CamelStream (file) opened in read-write mode.
  * The caller must unref this when finished.
@@ -314,6 +702,9 @@ camel_data_cache_add(CamelDataCache *cdc, const char *path, const char *key, Cam
 	else
 		camel_object_bag_abort(cdc->priv->busy_bag, real);
 
+	if (stream)
+		data_cache_touch(cdc, real, TRUE);
+
 	g_free(real);
 
 	return stream;
@@ -348,6 +739,15 @@ camel_data_cache_get(CamelDataCache *cdc, const char *path, const char *key, Cam
 		else
 			camel_object_bag_abort(cdc->priv->busy_bag, real);
 	}
+
+	if (stream)
+		data_cache_touch(cdc, real, FALSE);
+	else {
+		g_mutex_lock(cdc->priv->lock);
+		cdc->priv->misses++;
+		g_mutex_unlock(cdc->priv->lock);
+	}
+
 	g_free(real);
 
 	return stream;
@@ -378,6 +778,10 @@ camel_data_cache_remove(CamelDataCache *cdc, const char *path, const char *key,
 		camel_object_unref(stream);
 	}
 
+	g_mutex_lock(cdc->priv->lock);
+	data_cache_item_remove(cdc, real);
+	g_mutex_unlock(cdc->priv->lock);
+
 	/* maybe we were a mem stream */
 	if (g_unlink (real) == -1 && errno != ENOENT) {
 		camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
@@ -49,6 +49,7 @@ struct _CamelDataCache {
 
 	time_t expire_age;
 	time_t expire_access;
+	off_t expire_size;
 };
 
 struct _CamelDataCacheClass {
@@ -71,6 +72,9 @@ CamelDataCache *camel_data_cache_new(const char *path, guint32 flags, CamelExcep
 
 void camel_data_cache_set_expire_age(CamelDataCache *cache, time_t when);
 void camel_data_cache_set_expire_access(CamelDataCache *cdc, time_t when);
+void camel_data_cache_set_expire_size(CamelDataCache *cdc, off_t size);
+
+void camel_data_cache_get_stats(CamelDataCache *cdc, guint32 *hits, guint32 *misses, guint32 *expired);
 
 int             camel_data_cache_rename(CamelDataCache *cache,
 					const char *old, const char *new, CamelException *ex);
@@ -27,6 +27,7 @@
 /* This is how the basic debug checking strings should be done */
 #define CAMEL_DEBUG_IMAP "imap"
 #define CAMEL_DEBUG_IMAP_FOLDER "imap:folder"
+#define CAMEL_DEBUG_BLOCK_FILES "block:files"
 
 G_BEGIN_DECLS
 
@@ -83,6 +83,8 @@ static ESExpResult *search_uid(struct _ESExp *f, int argc, struct _ESExpResult *
 
 static ESExpResult *search_dummy(struct _ESExp *f, int argc, struct _ESExpResult **argv, CamelFolderSearch *search);
 
+static int search_plan(CamelFolderSearch *search, ESExpTerm *t);
+
 static void camel_folder_search_class_init (CamelFolderSearchClass *klass);
 static void camel_folder_search_init       (CamelFolderSearch *obj);
 static void camel_folder_search_finalize   (CamelObject *obj);
@@ -362,6 +364,7 @@ camel_folder_search_execute_expression(CamelFolderSearch *search, const char *ex
 		g_free(search->last_search);
 		search->last_search = g_strdup(expr);
 	}
+	search_plan(search, search->sexp->tree);
 	r = e_sexp_eval(search->sexp);
 	if (r == NULL) {
 		if (!camel_exception_is_set(ex))
@@ -484,6 +487,7 @@ camel_folder_search_search(CamelFolderSearch *search, const char *expr, GPtrArra
 		g_free(search->last_search);
 		search->last_search = g_strdup(expr);
 	}
+	search_plan(search, search->sexp->tree);
 	r = e_sexp_eval(search->sexp);
 	if (r == NULL) {
 		if (!camel_exception_is_set(ex))
@@ -649,6 +653,223 @@ search_not(struct _ESExp *f, int argc, struct _ESExpResult **argv, CamelFolderSe
 	return r;
 }
 
+/* Query planning.
+
+   Before a search runs, the children of every and and or are put in
+   order of the rough cost of the predicates under them, cheapest
+   first, so the short-circuiting of and and or means expensive
+   predicates only run on the messages the cheap ones let through.
+   match-all goes further with an and of body-contains and cheaper
+   predicates, see search_match_all_planned(). */
+
+enum {
+	SEARCH_COST_NONE,	/* literals, operators */
+	SEARCH_COST_SUMMARY,	/* flags, tags, dates, from the summary */
+	SEARCH_COST_HEADER,	/* string matches on summary headers */
+	SEARCH_COST_INDEX,	/* body words looked up in the index */
+	SEARCH_COST_BODY,	/* messages opened, or unknown */
+};
+
+static struct {
+	char *name;
+	int cost;
+} search_costs[] = {
+	{ "and", SEARCH_COST_NONE },
+	{ "or", SEARCH_COST_NONE },
+	{ "not", SEARCH_COST_NONE },
+	{ "<", SEARCH_COST_NONE },
+	{ ">", SEARCH_COST_NONE },
+	{ "=", SEARCH_COST_NONE },
+	{ "+", SEARCH_COST_NONE },
+	{ "-", SEARCH_COST_NONE },
+	{ "cast-int", SEARCH_COST_NONE },
+	{ "cast-string", SEARCH_COST_NONE },
+	{ "if", SEARCH_COST_NONE },
+	{ "begin", SEARCH_COST_NONE },
+	{ "match-all", SEARCH_COST_NONE },
+	{ "match-threads", SEARCH_COST_NONE },
+	{ "get-current-date", SEARCH_COST_NONE },
+	{ "user-tag", SEARCH_COST_SUMMARY },
+	{ "user-flag", SEARCH_COST_SUMMARY },
+	{ "system-flag", SEARCH_COST_SUMMARY },
+	{ "get-sent-date", SEARCH_COST_SUMMARY },
+	{ "get-received-date", SEARCH_COST_SUMMARY },
+	{ "get-size", SEARCH_COST_SUMMARY },
+	{ "uid", SEARCH_COST_SUMMARY },
+	{ "header-contains", SEARCH_COST_HEADER },
+	{ "header-matches", SEARCH_COST_HEADER },
+	{ "header-starts-with", SEARCH_COST_HEADER },
+	{ "header-ends-with", SEARCH_COST_HEADER },
+	{ "header-exists", SEARCH_COST_HEADER },
+};
+
+static int
+search_term_is(ESExpTerm *t, const char *name)
+{
+	return (t->type == ESEXP_TERM_FUNC || t->type == ESEXP_TERM_IFUNC)
+		&& !strcmp(t->value.func.sym->name, name);
+}
+
+/* order the children of and's and or's under @t, returns the cost of @t */
+static int
+search_plan(CamelFolderSearch *search, ESExpTerm *t)
+{
+	int i, j, cost = SEARCH_COST_NONE, *costs;
+	ESExpTerm *tmp;
+
+	if (t->type != ESEXP_TERM_FUNC && t->type != ESEXP_TERM_IFUNC)
+		return SEARCH_COST_NONE;
+
+	costs = g_alloca(t->value.func.termcount * sizeof(costs[0]));
+	for (i=0;i<t->value.func.termcount;i++) {
+		costs[i] = search_plan(search, t->value.func.terms[i]);
+		cost = MAX(cost, costs[i]);
+	}
+
+	/* and and or are the same whatever order they're in, so
+	   just do an insertion sort, keeping equal costs in order */
+	if (search_term_is(t, "and") || search_term_is(t, "or")) {
+		for (i=1;i<t->value.func.termcount;i++) {
+			tmp = t->value.func.terms[i];
+			for (j=i;j>0 && costs[j-1] > costs[i];j--)
+				;
+			if (j < i) {
+				int c = costs[i];
+
+				memmove(&t->value.func.terms[j+1], &t->value.func.terms[j], (i-j) * sizeof(tmp));
+				memmove(&costs[j+1], &costs[j], (i-j) * sizeof(costs[0]));
+				t->value.func.terms[j] = tmp;
+				costs[j] = c;
+			}
+		}
+	}
+
+	if (search_term_is(t, "body-contains"))
+		return MAX(cost, search->body_index ? SEARCH_COST_INDEX : SEARCH_COST_BODY);
+
+	for (i=0;i<sizeof(search_costs)/sizeof(search_costs[0]);i++)
+		if (search_term_is(t, search_costs[i].name))
+			return MAX(cost, search_costs[i].cost);
+
+	return SEARCH_COST_BODY;
+}
+
+/* a body-contains we can run over a set of messages at once */
+static int
+search_term_is_body(ESExpTerm *t)
+{
+	int i;
+
+	if (t->type != ESEXP_TERM_FUNC || strcmp(t->value.func.sym->name, "body-contains") != 0)
+		return FALSE;
+
+	for (i=0;i<t->value.func.termcount;i++)
+		if (t->value.func.terms[i]->type != ESEXP_TERM_STRING)
+			return FALSE;
+
+	return TRUE;
+}
+
+/* Run a match-all of @term, an and of body-contains and anything
+   else, or a single body-contains, into @result.  Looking at the
+   messages one at a time means opening each one, or a scan of the
+   whole index each, for body-contains.  So the rest of the and runs
+   first, message by message, then each body-contains runs just once,
+   over only the messages which are still left. */
+static gboolean
+search_match_all_planned(struct _ESExp *f, ESExpTerm *term, CamelFolderSearch *search, GPtrArray *result)
+{
+	ESExpTerm **terms, **body, **rest;
+	int i, j, count, nbody = 0, nrest = 0, truth;
+	GPtrArray *v, *matches, *summary_set;
+	GHashTable *summary_hash, *have;
+	ESExpResult *r1;
+
+	if (search_term_is(term, "and")) {
+		terms = term->value.func.terms;
+		count = term->value.func.termcount;
+	} else {
+		terms = &term;
+		count = 1;
+	}
+
+	body = g_alloca(count * sizeof(body[0]));
+	rest = g_alloca(count * sizeof(rest[0]));
+	for (i=0;i<count;i++) {
+		if (search_term_is_body(terms[i]))
+			body[nbody++] = terms[i];
+		else
+			rest[nrest++] = terms[i];
+	}
+
+	if (nbody == 0)
+		return FALSE;
+
+	v = search->summary_set?search->summary_set:search->summary;
+	matches = g_ptr_array_new();
+	for (i=0;i<v->len;i++) {
+		search->current = g_ptr_array_index(v, i);
+		truth = TRUE;
+		for (j=0;truth && j<nrest;j++) {
+			r1 = e_sexp_term_eval(f, rest[j]);
+			if (r1->type == ESEXP_RES_BOOL) {
+				truth = r1->value.bool;
+			} else {
+				/* the error doesn't return, so nothing else will free these */
+				e_sexp_result_free(f, r1);
+				g_ptr_array_free(matches, TRUE);
+				search->current = NULL;
+
+				g_warning("invalid syntax, matches require a single bool result");
+				e_sexp_fatal_error(f, _("(%s) requires a single bool result"), "match-all");
+			}
+			e_sexp_result_free(f, r1);
+		}
+		if (truth)
+			g_ptr_array_add(matches, search->current);
+	}
+	search->current = NULL;
+
+	summary_set = search->summary_set;
+	summary_hash = search->summary_hash;
+
+	for (i=0;i<nbody && matches->len > 0;i++) {
+		search->summary_set = matches;
+		search->summary_hash = g_hash_table_new(g_str_hash, g_str_equal);
+		for (j=0;j<matches->len;j++)
+			g_hash_table_insert(search->summary_hash, (char *)camel_message_info_uid(matches->pdata[j]), matches->pdata[j]);
+
+		r1 = e_sexp_term_eval(f, body[i]);
+
+		/* a subclass may not have limited it to the summary set */
+		have = g_hash_table_new(g_str_hash, g_str_equal);
+		if (r1->type == ESEXP_RES_ARRAY_PTR) {
+			for (j=0;j<r1->value.ptrarray->len;j++)
+				g_hash_table_insert(have, r1->value.ptrarray->pdata[j], r1->value.ptrarray->pdata[j]);
+		}
+		e_sexp_result_free(f, r1);
+
+		v = matches;
+		matches = g_ptr_array_new();
+		for (j=0;j<v->len;j++)
+			if (g_hash_table_lookup(have, camel_message_info_uid(v->pdata[j])))
+				g_ptr_array_add(matches, v->pdata[j]);
+
+		g_hash_table_destroy(have);
+		g_hash_table_destroy(search->summary_hash);
+		g_ptr_array_free(v, TRUE);
+	}
+
+	search->summary_set = summary_set;
+	search->summary_hash = summary_hash;
+
+	for (i=0;i<matches->len;i++)
+		g_ptr_array_add(result, (char *)camel_message_info_uid(matches->pdata[i]));
+	g_ptr_array_free(matches, TRUE);
+
+	return TRUE;
+}
+
 static ESExpResult *
 search_match_all(struct _ESExp *f, int argc, struct _ESExpTerm **argv, CamelFolderSearch *search)
 {
@@ -695,6 +916,9 @@ search_match_all(struct _ESExp *f, int argc, struct _ESExpTerm **argv, CamelFold
 		return r;
 	}
 
+	if (argc > 0 && search_match_all_planned(f, argv[0], search, r->value.ptrarray))
+		return r;
+
 	v = search->summary_set?search->summary_set:search->summary;
 	for (i=0;i<v->len;i++) {
 		const char *uid;
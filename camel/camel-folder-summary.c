@@ -26,13 +26,16 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
 #include <glib.h>
 #include <glib/gstdio.h>
 
@@ -55,15 +58,6 @@
 #include "camel-stream-null.h"
 #include "camel-string-utils.h"
 
-static pthread_mutex_t info_lock = PTHREAD_MUTEX_INITIALIZER;
-
-/* this lock is ONLY for the standalone messageinfo stuff */
-#define GLOBAL_INFO_LOCK(i) pthread_mutex_lock(&info_lock)
-#define GLOBAL_INFO_UNLOCK(i) pthread_mutex_unlock(&info_lock)
-
-
-/* this should probably be conditional on it existing */
-#define USE_BSEARCH
 
 #define d(x)
 #define io(x)			/* io debug */
@@ -73,10 +67,128 @@ static pthread_mutex_t info_lock = PTHREAD_MUTEX_INITIALIZER;
 extern int strdup_count, malloc_count, free_count;
 #endif
 
-#define CAMEL_FOLDER_SUMMARY_VERSION (13)
+#define CAMEL_FOLDER_SUMMARY_VERSION (15)
+
+/* first version with fixed size message info records, a string pool
+   and an offset table, which are mapped and decoded lazily */
+#define CAMEL_FOLDER_SUMMARY_VERSION_MAPPED (14)
+
+/* first version with the meta-summary as a section of the summary
+   file, rather than a separate "-meta" file */
+#define CAMEL_FOLDER_SUMMARY_VERSION_META (15)
 
 #define _PRIVATE(o) (((CamelFolderSummary *)(o))->priv)
 
+/* A mapped summary file is laid out as:
+     header (including any subclass header)
+     string pool, starting with a nul byte so offset 0 means NULL
+     records, each a fixed base record followed by subclass data
+     meta-summary header and one meta entry per record (version 15)
+     offset table, one fixed int32 file offset per record
+     trailer, see below
+
+   The words of a base record are all network order int32's.  The
+   string/blob words hold the distance back from the start of the
+   record to the data in the pool, or 0 for NULL, so a record can be
+   decoded from nothing but a pointer to it. */
+enum {
+	REC_UID,
+	REC_FLAGS,
+	REC_SIZE,
+	REC_DATE_SENT_HI,
+	REC_DATE_SENT_LO,
+	REC_DATE_RECEIVED_HI,
+	REC_DATE_RECEIVED_LO,
+	REC_SUBJECT,
+	REC_FROM,
+	REC_TO,
+	REC_CC,
+	REC_MLIST,
+	REC_MESSAGE_ID_HI,
+	REC_MESSAGE_ID_LO,
+	REC_REFERENCES,
+	REC_USER_FLAGS,
+	REC_USER_TAGS,
+	REC_LAST
+};
+
+#define REC_LEN (REC_LAST * 4)
+
+/* the words which point into the pool */
+static const int rec_pooled[] = {
+	REC_UID, REC_SUBJECT, REC_FROM, REC_TO, REC_CC, REC_MLIST,
+	REC_REFERENCES, REC_USER_FLAGS, REC_USER_TAGS
+};
+
+#define rec_pooled_len (sizeof(rec_pooled)/sizeof(rec_pooled[0]))
+
+/* trailer is pool offset, pool length, table offset, magic, with the
+   meta section offset before the magic from version 15 */
+#define TRAILER_LEN (16)
+#define TRAILER_META_LEN (20)
+#define TRAILER_MAGIC (0x43534d50) /* "CSMP" */
+
+/* Saves which don't need to rewrite everything are appended to a
+   journal, summary_path with "-journal" on the end, laid out as:
+     magic, size and inode of the summary file it applies to
+     segments, one per save, of
+       magic, segment length (0 until the rest is synced)
+       length and copy of the summary header
+       length and string pool
+       entry count and entries, each a JOURNAL_* type followed by a
+         uid string for removes, or a record as in the summary file
+   Once the journal gets to 1/JOURNAL_COMPACT_RATIO of the summary
+   file, the next save writes the summary in full again. */
+#define JOURNAL_MAGIC (0x43534d4a) /* "CSMJ" */
+#define JOURNAL_HEADER_LEN (12)
+#define JOURNAL_SEGMENT_MAGIC (0x43534d53) /* "CSMS" */
+#define JOURNAL_SEGMENT_LEN (20) /* smallest possible segment */
+#define JOURNAL_COMPACT_RATIO (4)
+
+enum {
+	JOURNAL_RECORD = 1,
+	JOURNAL_REMOVE = 2
+};
+
+struct _CamelFolderSummaryMap {
+	unsigned char *data;
+	size_t len;
+	gboolean mapped;	/* data is mmap'd, else it is malloc'd */
+
+	guint32 pool_start;
+	guint32 pool_len;
+	guint32 table_start;
+	guint32 meta_start;
+	guint32 count;
+
+	int users;		/* infos still pointing into it, under map_lock */
+};
+
+#define info_record(mi) summary_info_record((const CamelMessageInfo *)(mi))
+
+struct _CamelFolderSummaryPool {
+	GByteArray *data;
+	GByteArray *key;	/* scratch lookup key */
+	GHashTable *offsets;	/* length prefixed data -> offset in data */
+};
+
+static struct _CamelFolderSummaryMap *summary_map_new(int fd, guint32 count, guint32 version);
+static void summary_map_free(struct _CamelFolderSummaryMap *map);
+static void summary_maps_hold(CamelFolderSummary *s);
+static void summary_maps_unhold(CamelFolderSummary *s);
+static struct _CamelFolderSummaryPool *summary_pool_new(void);
+static void summary_pool_free(struct _CamelFolderSummaryPool *pool);
+static void summary_pool_add_info(struct _CamelFolderSummaryPool *pool, CamelMessageInfoBase *mi);
+static void message_info_materialise(CamelMessageInfoBase *mi);
+static char *summary_journal_path(CamelFolderSummary *s);
+static void summary_journal_touch(CamelFolderSummary *s, const char *uid, int change);
+static void summary_journal_replay(CamelFolderSummary *s, FILE *base);
+static int summary_journal_header(CamelFolderSummary *s, FILE *base);
+static int summary_journal_save(CamelFolderSummary *s);
+static gboolean summary_journal_free_key(void *key, void *value, void *data);
+static CamelMessageContentInfo *perform_content_info_load(CamelFolderSummary *s, FILE *in);
+static int perform_content_info_save(CamelFolderSummary *s, FILE *out, CamelMessageContentInfo *ci);
+
 #define META_SUMMARY_SUFFIX_LEN 5 /* strlen("-meta") */
 
 /* trivial lists, just because ... */
@@ -90,6 +202,7 @@ static int my_list_size(struct _node **list);
 static int summary_header_load(CamelFolderSummary *, FILE *);
 static int summary_header_save(CamelFolderSummary *, FILE *);
 static int summary_meta_header_load(CamelFolderSummary *, FILE *);
+static int summary_meta_header_decode(CamelFolderSummary *, FILE *);
 static int summary_meta_header_save(CamelFolderSummary *, FILE *);
 
 static CamelMessageInfo * message_info_new_from_header(CamelFolderSummary *, struct _camel_header_raw *);
@@ -126,6 +239,8 @@ camel_folder_summary_init (CamelFolderSummary *s)
 	p = _PRIVATE(s) = g_malloc0(sizeof(*p));
 
 	p->filter_charset = g_hash_table_new (camel_strcase_hash, camel_strcase_equal);
+	p->journal = g_hash_table_new(g_str_hash, g_str_equal);
+	p->records = g_hash_table_new(NULL, NULL);
 
 	s->message_info_size = sizeof(CamelMessageInfoBase);
 	s->content_info_size = sizeof(CamelMessageContentInfo);
@@ -149,7 +264,7 @@ camel_folder_summary_init (CamelFolderSummary *s)
 	p->io_lock = g_mutex_new();
 	p->filter_lock = g_mutex_new();
 	p->alloc_lock = g_mutex_new();
-	p->ref_lock = g_mutex_new();
+	p->map_lock = g_mutex_new();
 
 	s->meta_summary = g_malloc0(sizeof(CamelFolderMetaSummary));
 
@@ -205,6 +320,13 @@ camel_folder_summary_finalize (CamelObject *obj)
 	if (p->index)
 		camel_object_unref((CamelObject *)p->index);
 
+	g_slist_foreach(p->maps, (GFunc)summary_map_free, NULL);
+	g_slist_free(p->maps);
+	g_hash_table_destroy(p->records);
+
+	g_hash_table_foreach_remove(p->journal, summary_journal_free_key, NULL);
+	g_hash_table_destroy(p->journal);
+
 	/* Freeing memory occupied by meta-summary-header */
 	g_free(s->meta_summary->path);
 	g_free(s->meta_summary);
@@ -213,7 +335,7 @@ camel_folder_summary_finalize (CamelObject *obj)
 	g_mutex_free(p->io_lock);
 	g_mutex_free(p->filter_lock);
 	g_mutex_free(p->alloc_lock);
-	g_mutex_free(p->ref_lock);
+	g_mutex_free(p->map_lock);
 
 	g_free(p);
 }
@@ -351,15 +473,13 @@ camel_folder_summary_index(CamelFolderSummary *s, int i)
 	CamelMessageInfo *info = NULL;
 
 	CAMEL_SUMMARY_LOCK(s, summary_lock);
-	CAMEL_SUMMARY_LOCK(s, ref_lock);
 
 	if (i<s->messages->len)
 		info = g_ptr_array_index(s->messages, i);
 
 	if (info)
-		info->refcount++;
+		g_atomic_int_inc(&info->refcount);
 
-	CAMEL_SUMMARY_UNLOCK(s, ref_lock);
 	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 
 	return info;
@@ -385,15 +505,13 @@ camel_folder_summary_array(CamelFolderSummary *s)
 	int i;
 
 	CAMEL_SUMMARY_LOCK(s, summary_lock);
-	CAMEL_SUMMARY_LOCK(s, ref_lock);
 
 	g_ptr_array_set_size(res, s->messages->len);
 	for (i=0;i<s->messages->len;i++) {
 		info = res->pdata[i] = g_ptr_array_index(s->messages, i);
-		info->refcount++;
+		g_atomic_int_inc(&info->refcount);
 	}
 
-	CAMEL_SUMMARY_UNLOCK(s, ref_lock);
 	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 
 	return res;
@@ -438,14 +556,12 @@ camel_folder_summary_uid(CamelFolderSummary *s, const char *uid)
 	CamelMessageInfo *info;
 
 	CAMEL_SUMMARY_LOCK(s, summary_lock);
-	CAMEL_SUMMARY_LOCK(s, ref_lock);
 
 	info = g_hash_table_lookup(s->messages_uid, uid);
 
 	if (info)
-		info->refcount++;
+		g_atomic_int_inc(&info->refcount);
 
-	CAMEL_SUMMARY_UNLOCK(s, ref_lock);
 	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 
 	return info;
@@ -558,6 +674,7 @@ perform_content_info_load(CamelFolderSummary *s, FILE *in)
 int
 camel_folder_summary_load(CamelFolderSummary *s)
 {
+	struct _CamelFolderSummaryPrivate *p = _PRIVATE(s);
 	FILE *in;
 	int i;
 	CamelMessageInfo *mi;
@@ -571,11 +688,40 @@ camel_folder_summary_load(CamelFolderSummary *s)
 		return -1;
 
 	CAMEL_SUMMARY_LOCK(s, io_lock);
+	summary_maps_hold(s);
 	if ( ((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS(s)))->summary_header_load(s, in) == -1)
 		goto error;
 
+	/* map the records, the infos keep pointing into the map until their
+	   strings are asked for, and it goes once none of them do */
+	if (s->version < 0x100 && s->version >= CAMEL_FOLDER_SUMMARY_VERSION_MAPPED) {
+		if ((p->map = summary_map_new(fileno(in), s->saved_count, s->version)) == NULL)
+			goto error;
+		CAMEL_SUMMARY_LOCK(s, map_lock);
+		p->maps = g_slist_prepend(p->maps, p->map);
+		CAMEL_SUMMARY_UNLOCK(s, map_lock);
+
+		if (s->version >= CAMEL_FOLDER_SUMMARY_VERSION_META
+		    && (fseek(in, p->map->meta_start, SEEK_SET) == -1
+			|| summary_meta_header_decode(s, in) == -1))
+			goto error;
+	}
+
+	/* an older summary has its meta-summary header in a file of its
+	   own, which the next full save takes over */
+	if (!(s->version < 0x100 && s->version >= CAMEL_FOLDER_SUMMARY_VERSION_META))
+		summary_meta_header_load(s, in);
+
 	/* now read in each message ... */
 	for (i=0;i<s->saved_count;i++) {
+		if (p->map) {
+			guint32 offset;
+
+			memcpy(&offset, p->map->data + p->map->table_start + i * 4, 4);
+			if (fseek(in, g_ntohl(offset), SEEK_SET) == -1)
+				goto error;
+		}
+
 		mi = ((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS(s)))->message_info_load(s, in);
 
 		if (mi == NULL)
@@ -593,6 +739,27 @@ camel_folder_summary_load(CamelFolderSummary *s)
 		camel_folder_summary_add(s, mi);
 	}
 
+	/* anything saved since the summary file was last written, which
+	   can only have been appended to one written by this version */
+	g_hash_table_foreach_remove(p->journal, summary_journal_free_key, NULL);
+	p->journal_invalid = FALSE;
+	p->journal_len = 0;
+	p->base_len = 0;
+	if (p->map && s->version != CAMEL_FOLDER_SUMMARY_VERSION)
+		p->map = NULL;
+	if (p->map) {
+		struct stat st;
+
+		p->map = NULL;
+		if (fstat(fileno(in), &st) == 0) {
+			p->base_len = st.st_size;
+			p->base_ino = st.st_ino;
+			summary_journal_replay(s, in);
+			g_hash_table_foreach_remove(p->journal, summary_journal_free_key, NULL);
+		}
+	}
+
+	summary_maps_unhold(s);
 	CAMEL_SUMMARY_UNLOCK(s, io_lock);
 
 	if (fclose (in) != 0)
@@ -606,6 +773,9 @@ error:
 	if (errno != EINVAL)
 		g_warning ("Cannot load summary file: `%s': %s", s->summary_path, g_strerror (errno));
 
+	p->map = NULL;
+	p->base_len = 0;
+	summary_maps_unhold(s);
 	CAMEL_SUMMARY_UNLOCK(s, io_lock);
 	fclose (in);
 	s->flags |= ~CAMEL_SUMMARY_DIRTY;
@@ -641,20 +811,25 @@ perform_content_info_save(CamelFolderSummary *s, FILE *out, CamelMessageContentI
  * @summary: a #CamelFolderSummary object
  *
  * Writes the summary to disk.  The summary is only written if changes
- * have occured.
+ * have occured.  Changes to individual messages are appended to a
+ * journal next to the summary file, which is folded back into it once
+ * it grows too big or a change can't be journalled.  The meta-summary
+ * is only updated when the summary file is written in full.
  *
  * Returns %0 on success or %-1 on fail
  **/
 int
 camel_folder_summary_save(CamelFolderSummary *s)
 {
+	struct _CamelFolderSummaryPrivate *p = _PRIVATE(s);
 	FILE *out;
-	FILE *out_meta;
-	int fd, i, fd_meta;
-	guint32 count;
+	int fd, i;
+	guint32 count, *offsets = NULL;
+	long table_start, meta_start;
 	CamelMessageInfo *mi;
+	struct stat st;
 	char *path;
-	char *path_meta;
+	char *path_journal;
 
 	g_assert(s->message_info_size >= sizeof(CamelMessageInfoBase));
 
@@ -663,6 +838,21 @@ camel_folder_summary_save(CamelFolderSummary *s)
 	    || (s->flags & CAMEL_SUMMARY_DIRTY) == 0)
 		return 0;
 
+	if (p->base_len != 0
+	    && !p->journal_invalid
+	    && p->journal_len <= p->base_len / JOURNAL_COMPACT_RATIO) {
+		CAMEL_SUMMARY_LOCK(s, io_lock);
+		i = summary_journal_save(s);
+		CAMEL_SUMMARY_UNLOCK(s, io_lock);
+		if (i == 0) {
+			s->flags &= ~CAMEL_SUMMARY_DIRTY;
+			return 0;
+		}
+
+		/* the full save below covers anything the journal missed */
+		io(printf("Cannot append to summary journal: %s\n", g_strerror(errno)));
+	}
+
 	path = alloca(strlen(s->summary_path)+4);
 	sprintf(path, "%s~", s->summary_path);
 	fd = g_open(path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0600);
@@ -677,49 +867,37 @@ camel_folder_summary_save(CamelFolderSummary *s)
 		return -1;
 	}
 
-	/* Meta summary code */
-	/* This meta summary will be used by beagle in order to
-	   quickly pass through the actual summary file, which
-	   is quite time consuming otherwise.
-	*/
-	/* FIXME: Merge meta-summary and summary */
-	path_meta = alloca(strlen(s->meta_summary->path)+4);
-	sprintf(path_meta, "%s~", s->meta_summary->path);
-	fd_meta = g_open(path_meta, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0600);
-	if (fd_meta == -1) {
-		fclose(out);
-		return -1;
-	}
-	out_meta = fdopen(fd_meta, "wb");
-	if (out_meta == NULL) {
-		i = errno;
-		g_unlink(path);
-		g_unlink(path_meta);
-		fclose(out);
-		close(fd_meta);
-		errno = i;
-		return -1;
-	}
-
 	io(printf("saving header\n"));
 
 	CAMEL_SUMMARY_LOCK(s, io_lock);
 
+	/* everything is written, so start tracking changes afresh */
+	CAMEL_SUMMARY_LOCK(s, summary_lock);
+	g_hash_table_foreach_remove(p->journal, summary_journal_free_key, NULL);
+	p->journal_invalid = FALSE;
+	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
+
 	if (((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS(s)))->summary_header_save(s, out) == -1)
 		goto exception;
 
-	if (summary_meta_header_save(s, out_meta) == -1)
+	/* the string pool goes first, so records can point back into it */
+	count = s->messages->len;
+	summary_maps_hold(s);
+	p->pool = summary_pool_new();
+	for (i = 0; i < count; i++)
+		summary_pool_add_info(p->pool, s->messages->pdata[i]);
+
+	p->pool_start = ftell(out);
+	if (fwrite(p->pool->data->data, p->pool->data->len, 1, out) != 1)
 		goto exception;
 
 	/* now write out each message ... */
 	/* we check ferorr when done for i/o errors */
 
-	count = s->messages->len;
+	offsets = g_malloc(count * sizeof(offsets[0]) + 1);
 	for (i = 0; i < count; i++) {
 		mi = s->messages->pdata[i];
-		if (((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS (s)))->meta_message_info_save (s, out_meta, out, mi) == -1)
-			goto exception;
-
+		offsets[i] = ftell(out);
 		if (((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS (s)))->message_info_save (s, out, mi) == -1)
 			goto exception;
 
@@ -729,17 +907,42 @@ camel_folder_summary_save(CamelFolderSummary *s)
 		}
 	}
 
+	/* The meta section is used by beagle in order to quickly pass
+	   through the summary without having to parse every record */
+	meta_start = ftell(out);
+	if (summary_meta_header_save(s, out) == -1)
+		goto exception;
+
+	for (i = 0; i < count; i++) {
+		p->meta_offset = offsets[i];
+		if (((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS (s)))->meta_message_info_save (s, out, out, s->messages->pdata[i]) == -1)
+			goto exception;
+	}
+
+	table_start = ftell(out);
+	for (i = 0; i < count; i++)
+		camel_file_util_encode_fixed_int32(out, offsets[i]);
+
+	camel_file_util_encode_fixed_int32(out, p->pool_start);
+	camel_file_util_encode_fixed_int32(out, p->pool->data->len);
+	camel_file_util_encode_fixed_int32(out, table_start);
+	camel_file_util_encode_fixed_int32(out, meta_start);
+	if (camel_file_util_encode_fixed_int32(out, TRAILER_MAGIC) == -1)
+		goto exception;
+
+	g_free(offsets);
+	summary_pool_free(p->pool);
+	p->pool = NULL;
+	summary_maps_unhold(s);
+
 	/* FIXME: Can't we use the above "fd" variables, instead of fileno()? */
 	if (fflush (out) != 0 || fsync (fileno (out)) == -1)
 		goto exception;
 
-	if (fflush (out_meta) != 0 || fsync (fileno (out_meta)) == -1)
+	if (fstat (fileno (out), &st) == -1)
 		goto exception;
 
 	fclose (out);
-	fclose (out_meta);
-
-	CAMEL_SUMMARY_UNLOCK(s, io_lock);
 
 #ifdef G_OS_WIN32
 	g_unlink(s->summary_path);
@@ -748,17 +951,30 @@ camel_folder_summary_save(CamelFolderSummary *s)
 	if (g_rename(path, s->summary_path) == -1) {
 		i = errno;
 		g_unlink(path);
+		p->journal_invalid = TRUE;
+		CAMEL_SUMMARY_UNLOCK(s, io_lock);
 		errno = i;
 		return -1;
 	}
 
-	if (g_rename(path_meta, s->meta_summary->path) == -1) {
-		i = errno;
-		g_unlink(path_meta);
-		errno = i;
-		return -1;
+	/* the old journal no longer matches the summary file, even if
+	   removing it fails */
+	path_journal = summary_journal_path(s);
+	g_unlink(path_journal);
+	g_free(path_journal);
+	p->journal_len = 0;
+	p->base_len = st.st_size;
+	p->base_ino = st.st_ino;
+
+	/* and a separate meta-summary from an older version is stale,
+	   once what was in it has been written out with the rest */
+	if (p->meta_legacy) {
+		g_unlink(s->meta_summary->path);
+		p->meta_legacy = FALSE;
 	}
 
+	CAMEL_SUMMARY_UNLOCK(s, io_lock);
+
 	s->flags &= ~CAMEL_SUMMARY_DIRTY;
 	return 0;
 
@@ -766,12 +982,18 @@ exception:
 
 	i = errno;
 	fclose (out);
-	fclose (out_meta);
 
+	g_free(offsets);
+	if (p->pool) {
+		summary_pool_free(p->pool);
+		p->pool = NULL;
+		summary_maps_unhold(s);
+	}
+
+	p->journal_invalid = TRUE;
 	CAMEL_SUMMARY_UNLOCK(s, io_lock);
 
 	g_unlink (path);
-	g_unlink (path_meta);
 	errno = i;
 
 	return -1;
@@ -792,7 +1014,6 @@ int
 camel_folder_summary_header_load(CamelFolderSummary *s)
 {
 	FILE *in;
-	FILE *in_meta;
 	int ret;
 
 	if (s->summary_path == NULL ||
@@ -803,19 +1024,15 @@ camel_folder_summary_header_load(CamelFolderSummary *s)
 	if (in == NULL)
 		return -1;
 
-	in_meta = g_fopen(s->meta_summary->path, "rb");
-	if (in_meta == NULL) {
-		fclose(in);
-		return -1;
-	}
-
 	CAMEL_SUMMARY_LOCK(s, io_lock);
 	ret = ((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS(s)))->summary_header_load(s, in);
-	ret = summary_meta_header_load(s, in_meta);
+	if (ret == 0)
+		ret = summary_meta_header_load(s, in);
+	if (ret == 0 && s->version == CAMEL_FOLDER_SUMMARY_VERSION)
+		ret = summary_journal_header(s, in);
 	CAMEL_SUMMARY_UNLOCK(s, io_lock);
 
 	fclose(in);
-	fclose(in_meta);
 	s->flags &= ~CAMEL_SUMMARY_DIRTY;
 	return ret;
 }
@@ -890,7 +1107,7 @@ camel_folder_summary_add(CamelFolderSummary *s, CamelMessageInfo *info)
 
 	g_ptr_array_add(s->messages, info);
 	g_hash_table_insert(s->messages_uid, (char *)camel_message_info_uid(info), info);
-	s->flags |= CAMEL_SUMMARY_DIRTY;
+	summary_journal_touch(s, camel_message_info_uid(info), JOURNAL_RECORD);
 
 	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 }
@@ -1139,13 +1356,50 @@ camel_folder_summary_content_info_free(CamelFolderSummary *s, CamelMessageConten
  * @summary: a #CamelFolderSummary object
  *
  * Mark the summary as changed, so that a save will force it to be
- * written back to disk.
+ * written back to disk.  As nothing says what changed, the whole
+ * summary will be written.
  **/
 void
 camel_folder_summary_touch(CamelFolderSummary *s)
 {
 	CAMEL_SUMMARY_LOCK(s, summary_lock);
 	s->flags |= CAMEL_SUMMARY_DIRTY;
+	_PRIVATE(s)->journal_invalid = TRUE;
+	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
+}
+
+
+/**
+ * camel_folder_summary_touch_info:
+ * @summary: a #CamelFolderSummary object
+ * @info: a #CamelMessageInfo in @summary
+ *
+ * Mark @info as changed, so that a save will write it back to disk.
+ * Unlike #camel_folder_summary_touch only @info has to be written.
+ **/
+void
+camel_folder_summary_touch_info(CamelFolderSummary *s, CamelMessageInfo *info)
+{
+	CAMEL_SUMMARY_LOCK(s, summary_lock);
+	summary_journal_touch(s, camel_message_info_uid(info), JOURNAL_RECORD);
+	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
+}
+
+
+/**
+ * camel_folder_summary_touch_header:
+ * @summary: a #CamelFolderSummary object
+ *
+ * Mark the summary header as changed, so that a save will write it
+ * back to disk.  Unlike #camel_folder_summary_touch no messages have
+ * to be written.
+ **/
+void
+camel_folder_summary_touch_header(CamelFolderSummary *s)
+{
+	/* every journal segment carries the header */
+	CAMEL_SUMMARY_LOCK(s, summary_lock);
+	summary_journal_touch(s, NULL, JOURNAL_RECORD);
 	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 }
 
@@ -1174,6 +1428,7 @@ camel_folder_summary_clear(CamelFolderSummary *s)
 	g_hash_table_destroy(s->messages_uid);
 	s->messages_uid = g_hash_table_new(g_str_hash, g_str_equal);
 	s->flags |= CAMEL_SUMMARY_DIRTY;
+	_PRIVATE(s)->journal_invalid = TRUE;
 	s->meta_summary->msg_expunged = TRUE;
 	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 }
@@ -1190,9 +1445,9 @@ void
 camel_folder_summary_remove(CamelFolderSummary *s, CamelMessageInfo *info)
 {
 	CAMEL_SUMMARY_LOCK(s, summary_lock);
+	summary_journal_touch(s, camel_message_info_uid(info), JOURNAL_REMOVE);
 	g_hash_table_remove(s->messages_uid, camel_message_info_uid(info));
 	g_ptr_array_remove(s->messages, info);
-	s->flags |= CAMEL_SUMMARY_DIRTY;
 	s->meta_summary->msg_expunged = TRUE;
 	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 
@@ -1214,16 +1469,13 @@ camel_folder_summary_remove_uid(CamelFolderSummary *s, const char *uid)
         char *olduid;
 
 	CAMEL_SUMMARY_LOCK(s, summary_lock);
-	CAMEL_SUMMARY_LOCK(s, ref_lock);
         if (g_hash_table_lookup_extended(s->messages_uid, uid, (void *)&olduid, (void *)&oldinfo)) {
 		/* make sure it doesn't vanish while we're removing it */
-		oldinfo->refcount++;
-		CAMEL_SUMMARY_UNLOCK(s, ref_lock);
+		g_atomic_int_inc(&oldinfo->refcount);
 		CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 		camel_folder_summary_remove(s, oldinfo);
 		camel_message_info_free(oldinfo);
 	} else {
-		CAMEL_SUMMARY_UNLOCK(s, ref_lock);
 		CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 	}
 }
@@ -1243,9 +1495,9 @@ camel_folder_summary_remove_index(CamelFolderSummary *s, int index)
 	if (index < s->messages->len) {
 		CamelMessageInfo *info = s->messages->pdata[index];
 
+		summary_journal_touch(s, camel_message_info_uid(info), JOURNAL_REMOVE);
 		g_hash_table_remove(s->messages_uid, camel_message_info_uid(info));
 		g_ptr_array_remove_index(s->messages, index);
-		s->flags |= CAMEL_SUMMARY_DIRTY;
 
 		CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 		camel_message_info_free(info);
@@ -1281,12 +1533,12 @@ camel_folder_summary_remove_range(CamelFolderSummary *s, int start, int end)
 			CamelMessageInfo *info = s->messages->pdata[i];
 
 			infos[i-start] = info;
+			summary_journal_touch(s, camel_message_info_uid(info), JOURNAL_REMOVE);
 			g_hash_table_remove(s->messages_uid, camel_message_info_uid(info));
 		}
 
 		memmove(s->messages->pdata+start, s->messages->pdata+end, (s->messages->len-end)*sizeof(s->messages->pdata[0]));
 		g_ptr_array_set_size(s->messages, s->messages->len - (end - start));
-		s->flags |= CAMEL_SUMMARY_DIRTY;
 
 		CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 
@@ -1338,14 +1590,19 @@ static char * tokens[] = {
     >=32 string, length = n-32
 */
 
-#ifdef USE_BSEARCH
-static int
-token_search_cmp(char *key, char **index)
-{
-	d(printf("comparing '%s' to '%s'\n", key, *index));
-	return strcmp(key, *index);
-}
-#endif
+/* A perfect hash of the tokens on their length and (lowercased) first
+   and last characters, giving the token id or 0.  It must be
+   regenerated if the tokens ever change. */
+#define TOKEN_HASH(len, first, last) (((len) * 29 + (first) + (last) * 11) & 63)
+
+static const unsigned char tokens_hash[64] = {
+	 9,  0,  0,  0,  0,  0, 23,  0,  0, 22, 14,  0,  5,  0, 20, 13,
+	 0, 10,  0,  0,  0,  0,  0,  0, 21,  0,  4,  0,  0,  0,  0,  0,
+	25,  0,  0,  0, 24,  8, 11,  1,  2,  0,  7,  0,  0,  0, 15,  0,
+	 0,  0,  0, 12,  0,  0,  0,  3,  0, 16, 17, 19, 18,  6,  0,  0,
+};
+
+static int summary_decode_token(FILE *in, char **str, gboolean pooled);
 
 /**
  * camel_folder_summary_encode_token:
@@ -1363,130 +1620,1025 @@ camel_folder_summary_encode_token(FILE *out, const char *str)
 {
 	io(printf("Encoding token: '%s'\n", str));
 
-	if (str == NULL) {
-		return camel_file_util_encode_uint32(out, 0);
-	} else {
-		int len = strlen(str);
-		int i, token=-1;
-
-		if (len <= 16) {
-			char lower[32];
-			char **match;
-
-			for (i=0;i<len;i++)
-				lower[i] = tolower(str[i]);
-			lower[i] = 0;
-#ifdef USE_BSEARCH
-			match = bsearch(lower, tokens, tokens_len, sizeof(char *), (int (*)(const void *, const void *))token_search_cmp);
-			if (match)
-				token = match-tokens;
-#else
-			for (i=0;i<tokens_len;i++) {
-				if (!strcmp(tokens[i], lower)) {
-					token = i;
+	if (str == NULL) {
+		return camel_file_util_encode_uint32(out, 0);
+	} else {
+		int len = strlen(str);
+		int id, token=-1;
+
+		if (len > 0 && len <= 16) {
+			id = tokens_hash[TOKEN_HASH(len, g_ascii_tolower(str[0]), g_ascii_tolower(str[len-1]))];
+			if (id != 0 && !g_ascii_strcasecmp(tokens[id-1], str))
+				token = id-1;
+		}
+		if (token != -1) {
+			return camel_file_util_encode_uint32(out, token+1);
+		} else {
+			if (camel_file_util_encode_uint32(out, len+32) == -1)
+				return -1;
+			if (fwrite(str, len, 1, out) != 1)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * camel_folder_summary_decode_token:
+ * @in: input FILE pointer
+ * @str: string pointer to hold the decoded result
+ *
+ * Decode a token value.
+ *
+ * Returns %0 on success or %-1 on fail
+ **/
+int
+camel_folder_summary_decode_token(FILE *in, char **str)
+{
+	return summary_decode_token(in, str, FALSE);
+}
+
+/* decode a token, as a pooled string if pooled is set, so the common
+   tokens and values are shared rather than allocated per message */
+static int
+summary_decode_token(FILE *in, char **str, gboolean pooled)
+{
+	char *ret;
+	guint32 len;
+
+	io(printf("Decode token ...\n"));
+
+	if (camel_file_util_decode_uint32(in, &len) == -1) {
+		io(printf ("Could not decode token from file"));
+		*str = NULL;
+		return -1;
+	}
+
+	if (len<32) {
+		if (len <= 0) {
+			ret = NULL;
+		} else if (len<= tokens_len) {
+			ret = pooled ? (char *)camel_pstring_strdup(tokens[len-1]) : g_strdup(tokens[len-1]);
+		} else {
+			io(printf ("Invalid token encountered: %d", len));
+			*str = NULL;
+			return -1;
+		}
+	} else if (len > 10240) {
+		io(printf ("Got broken string header length: %d bytes", len));
+		*str = NULL;
+		return -1;
+	} else {
+		len -= 32;
+		ret = g_malloc(len+1);
+		if (len > 0 && fread(ret, len, 1, in) != 1) {
+			g_free(ret);
+			*str = NULL;
+			return -1;
+		}
+		ret[len]=0;
+		if (pooled)
+			ret = (char *)camel_pstring_add(ret, TRUE);
+	}
+
+	io(printf("Token = '%s'\n", ret));
+
+	*str = ret;
+	return 0;
+}
+
+static struct _node *
+my_list_append(struct _node **list, struct _node *n)
+{
+	struct _node *ln = (struct _node *)list;
+	while (ln->next)
+		ln = ln->next;
+	n->next = NULL;
+	ln->next = n;
+	return n;
+}
+
+static int
+my_list_size(struct _node **list)
+{
+	int len = 0;
+	struct _node *ln = (struct _node *)list;
+	while (ln->next) {
+		ln = ln->next;
+		len++;
+	}
+	return len;
+}
+
+static guint32
+record_word(const unsigned char *record, int word)
+{
+	guint32 v;
+
+	memcpy(&v, record + word * 4, 4);
+
+	return g_ntohl(v);
+}
+
+/* find the pooled data a record word points back to */
+static const unsigned char *
+record_data(const unsigned char *record, int word)
+{
+	guint32 back = record_word(record, word);
+
+	return back ? record - back : NULL;
+}
+
+/* map or read in the whole of fd */
+static struct _CamelFolderSummaryMap *
+summary_map_file(int fd, size_t min)
+{
+	struct _CamelFolderSummaryMap *map;
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return NULL;
+
+	if (st.st_size < min || st.st_size > G_MAXINT32) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = g_malloc0(sizeof(*map));
+	map->len = st.st_size;
+#ifdef HAVE_MMAP
+	map->data = mmap(NULL, map->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map->data == MAP_FAILED) {
+		g_free(map);
+		return NULL;
+	}
+	map->mapped = TRUE;
+#else
+	map->data = g_malloc(map->len);
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		summary_map_free(map);
+		return NULL;
+	} else {
+		size_t done = 0;
+		ssize_t n;
+
+		while (done < map->len) {
+			n = camel_read(fd, (char *) map->data + done, map->len - done);
+			if (n <= 0) {
+				summary_map_free(map);
+				errno = n == 0 ? EINVAL : errno;
+				return NULL;
+			}
+			done += n;
+		}
+	}
+#endif
+	return map;
+}
+
+static struct _CamelFolderSummaryMap *
+summary_map_new(int fd, guint32 count, guint32 version)
+{
+	struct _CamelFolderSummaryMap *map;
+	const unsigned char *trailer;
+	guint32 trailer_len, meta_end;
+
+	trailer_len = version >= CAMEL_FOLDER_SUMMARY_VERSION_META ? TRAILER_META_LEN : TRAILER_LEN;
+	if ((map = summary_map_file(fd, trailer_len)) == NULL)
+		return NULL;
+
+	map->count = count;
+	trailer = map->data + map->len - trailer_len;
+	map->pool_start = record_word(trailer, 0);
+	map->pool_len = record_word(trailer, 1);
+	map->table_start = record_word(trailer, 2);
+	if (trailer_len == TRAILER_META_LEN) {
+		map->meta_start = record_word(trailer, 3);
+		meta_end = map->meta_start;
+	} else
+		meta_end = map->table_start;
+
+	if (record_word(trailer, trailer_len / 4 - 1) != TRAILER_MAGIC
+	    || map->pool_len == 0
+	    || (guint64)map->pool_start + map->pool_len > meta_end
+	    || meta_end > map->table_start
+	    || (guint64)map->table_start + (guint64)count * 4 + trailer_len != map->len
+	    || map->data[map->pool_start + map->pool_len - 1] != 0) {
+		io(printf("Summary map trailer is broken\n"));
+		summary_map_free(map);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return map;
+}
+
+static void
+summary_map_free(struct _CamelFolderSummaryMap *map)
+{
+#ifdef HAVE_MMAP
+	if (map->mapped)
+		munmap(map->data, map->len);
+	else
+#endif
+		g_free(map->data);
+	g_free(map);
+}
+
+/* free any maps no info points into any more, map_lock must be held */
+static void
+summary_maps_prune(CamelFolderSummary *s)
+{
+	struct _CamelFolderSummaryPrivate *p = _PRIVATE(s);
+	struct _CamelFolderSummaryMap *map;
+	GSList *l, *next;
+
+	if (p->map_hold > 0)
+		return;
+
+	for (l = p->maps;l;l = next) {
+		next = l->next;
+		map = l->data;
+		if (map->users == 0) {
+			p->maps = g_slist_delete_link(p->maps, l);
+			summary_map_free(map);
+		}
+	}
+}
+
+/* keep every map while a load or save may be reading records from it */
+static void
+summary_maps_hold(CamelFolderSummary *s)
+{
+	CAMEL_SUMMARY_LOCK(s, map_lock);
+	_PRIVATE(s)->map_hold++;
+	CAMEL_SUMMARY_UNLOCK(s, map_lock);
+}
+
+static void
+summary_maps_unhold(CamelFolderSummary *s)
+{
+	CAMEL_SUMMARY_LOCK(s, map_lock);
+	_PRIVATE(s)->map_hold--;
+	summary_maps_prune(s);
+	CAMEL_SUMMARY_UNLOCK(s, map_lock);
+}
+
+/* an info stopped pointing at record, map_lock must be held */
+static void
+summary_maps_release(CamelFolderSummary *s, const unsigned char *record)
+{
+	struct _CamelFolderSummaryMap *map;
+	GSList *l;
+
+	for (l = _PRIVATE(s)->maps;l;l = l->next) {
+		map = l->data;
+		if (record >= map->data && record < map->data + map->len) {
+			if (--map->users == 0)
+				summary_maps_prune(s);
+			return;
+		}
+	}
+
+	g_assert_not_reached();
+}
+
+/* the mapped record of a lazy info, NULL once materialised */
+static const unsigned char *
+summary_info_record(const CamelMessageInfo *mi)
+{
+	const unsigned char *record;
+
+	if (mi->summary == NULL)
+		return NULL;
+
+	CAMEL_SUMMARY_LOCK(mi->summary, map_lock);
+	record = g_hash_table_lookup(_PRIVATE(mi->summary)->records, mi);
+	CAMEL_SUMMARY_UNLOCK(mi->summary, map_lock);
+
+	return record;
+}
+
+/* check a pooled word of the record at offset points inside the pool */
+static gboolean
+summary_map_check(struct _CamelFolderSummaryMap *map, guint32 offset, int word)
+{
+	guint32 back = record_word(map->data + offset, word);
+
+	return back == 0
+		|| (back < offset
+		    && offset - back > map->pool_start
+		    && offset - back < map->pool_start + map->pool_len);
+}
+
+static guint
+pool_key_hash(gconstpointer key)
+{
+	const unsigned char *p = key;
+	guint32 len, i;
+	guint h = 0;
+
+	memcpy(&len, p, 4);
+	p += 4;
+	for (i=0;i<len;i++)
+		h = (h << 5) - h + p[i];
+
+	return h;
+}
+
+static gboolean
+pool_key_equal(gconstpointer a, gconstpointer b)
+{
+	guint32 len;
+
+	memcpy(&len, a, 4);
+
+	return memcmp(a, b, len + 4) == 0;
+}
+
+static struct _CamelFolderSummaryPool *
+summary_pool_new(void)
+{
+	struct _CamelFolderSummaryPool *pool;
+
+	pool = g_malloc(sizeof(*pool));
+	pool->data = g_byte_array_new();
+	pool->key = g_byte_array_new();
+	pool->offsets = g_hash_table_new_full(pool_key_hash, pool_key_equal, g_free, NULL);
+
+	/* offset 0 is NULL */
+	g_byte_array_append(pool->data, (guint8 *)"", 1);
+
+	return pool;
+}
+
+static void
+summary_pool_free(struct _CamelFolderSummaryPool *pool)
+{
+	g_byte_array_free(pool->data, TRUE);
+	g_byte_array_free(pool->key, TRUE);
+	g_hash_table_destroy(pool->offsets);
+	g_free(pool);
+}
+
+static guint32
+summary_pool_lookup(struct _CamelFolderSummaryPool *pool, const void *data, guint32 len, gboolean add)
+{
+	guint32 offset;
+
+	g_byte_array_set_size(pool->key, 0);
+	g_byte_array_append(pool->key, (guint8 *)&len, 4);
+	g_byte_array_append(pool->key, data, len);
+
+	offset = GPOINTER_TO_UINT(g_hash_table_lookup(pool->offsets, pool->key->data));
+	if (offset == 0 && add) {
+		offset = pool->data->len;
+		g_byte_array_append(pool->data, data, len);
+		/* everything is nul terminated, so strings can be used in place */
+		g_byte_array_append(pool->data, (guint8 *)"", 1);
+		g_hash_table_insert(pool->offsets, g_memdup(pool->key->data, pool->key->len), GUINT_TO_POINTER(offset));
+	}
+
+	return offset;
+}
+
+static void
+pool_put_word(GByteArray *buf, guint32 v)
+{
+	v = g_htonl(v);
+	g_byte_array_append(buf, (guint8 *)&v, 4);
+}
+
+/* get the data for a pooled word of a record, straight from the mapped
+   record if the info hasn't been materialised yet.  Blobs are encoded
+   into buf */
+static const void *
+summary_info_data(CamelMessageInfoBase *mi, const unsigned char *record, int word, GByteArray *buf, guint32 *len)
+{
+	const char *str = NULL;
+	const unsigned char *data;
+	CamelFlag *flag;
+	CamelTag *tag;
+	int i;
+
+	g_byte_array_set_size(buf, 0);
+
+	switch (word) {
+	case REC_UID:
+		str = mi->uid;
+		break;
+	case REC_SUBJECT:
+		str = record ? (const char *)record_data(record, word) : mi->subject;
+		break;
+	case REC_FROM:
+		str = record ? (const char *)record_data(record, word) : mi->from;
+		break;
+	case REC_TO:
+		str = record ? (const char *)record_data(record, word) : mi->to;
+		break;
+	case REC_CC:
+		str = record ? (const char *)record_data(record, word) : mi->cc;
+		break;
+	case REC_MLIST:
+		str = record ? (const char *)record_data(record, word) : mi->mlist;
+		break;
+	case REC_REFERENCES:
+		if (record) {
+			if ((data = record_data(record, word)) == NULL)
+				return NULL;
+			*len = 4 + record_word(data, 0) * 8;
+			return data;
+		}
+		if (mi->references == NULL)
+			return NULL;
+		pool_put_word(buf, mi->references->size);
+		for (i=0;i<mi->references->size;i++) {
+			pool_put_word(buf, mi->references->references[i].id.part.hi);
+			pool_put_word(buf, mi->references->references[i].id.part.lo);
+		}
+		*len = buf->len;
+		return buf->data;
+	case REC_USER_FLAGS:
+		if (mi->user_flags == NULL)
+			return NULL;
+		pool_put_word(buf, camel_flag_list_size(&mi->user_flags));
+		for (flag = mi->user_flags;flag;flag = flag->next)
+			g_byte_array_append(buf, (guint8 *)flag->name, strlen(flag->name) + 1);
+		*len = buf->len;
+		return buf->data;
+	case REC_USER_TAGS:
+		if (mi->user_tags == NULL)
+			return NULL;
+		pool_put_word(buf, camel_tag_list_size(&mi->user_tags));
+		for (tag = mi->user_tags;tag;tag = tag->next) {
+			g_byte_array_append(buf, (guint8 *)tag->name, strlen(tag->name) + 1);
+			g_byte_array_append(buf, (guint8 *)tag->value, strlen(tag->value) + 1);
+		}
+		*len = buf->len;
+		return buf->data;
+	default:
+		g_assert_not_reached();
+	}
+
+	if (str)
+		*len = strlen(str);
+
+	return str;
+}
+
+static void
+summary_pool_add_info(struct _CamelFolderSummaryPool *pool, CamelMessageInfoBase *mi)
+{
+	const unsigned char *record = info_record(mi);
+	GByteArray *buf = g_byte_array_new();
+	const void *data;
+	guint32 len;
+	int i;
+
+	for (i=0;i<rec_pooled_len;i++) {
+		if ((data = summary_info_data(mi, record, rec_pooled[i], buf, &len)))
+			summary_pool_lookup(pool, data, len, TRUE);
+	}
+
+	g_byte_array_free(buf, TRUE);
+}
+
+/* fill in the lazy fields of an info from its mapped record */
+static void
+message_info_materialise(CamelMessageInfoBase *mi)
+{
+	const unsigned char *record, *data;
+	guint32 count, i;
+
+	CAMEL_SUMMARY_LOCK(mi->summary, map_lock);
+
+	if ((record = g_hash_table_lookup(_PRIVATE(mi->summary)->records, mi))) {
+		mi->subject = camel_pstring_strdup((const char *)record_data(record, REC_SUBJECT));
+		mi->from = camel_pstring_strdup((const char *)record_data(record, REC_FROM));
+		mi->to = camel_pstring_strdup((const char *)record_data(record, REC_TO));
+		mi->cc = camel_pstring_strdup((const char *)record_data(record, REC_CC));
+		mi->mlist = camel_pstring_strdup((const char *)record_data(record, REC_MLIST));
+
+		if ((data = record_data(record, REC_REFERENCES))
+		    && (count = record_word(data, 0)) > 0) {
+			mi->references = g_malloc(sizeof(*mi->references) + ((count-1) * sizeof(mi->references->references[0])));
+			mi->references->size = count;
+			for (i=0;i<count;i++) {
+				mi->references->references[i].id.part.hi = record_word(data, 1 + i * 2);
+				mi->references->references[i].id.part.lo = record_word(data, 2 + i * 2);
+			}
+		}
+
+		g_hash_table_remove(_PRIVATE(mi->summary)->records, mi);
+		summary_maps_release(mi->summary, record);
+	}
+
+	CAMEL_SUMMARY_UNLOCK(mi->summary, map_lock);
+}
+
+static char *
+summary_journal_path(CamelFolderSummary *s)
+{
+	return g_strdup_printf("%s-journal", s->summary_path);
+}
+
+static gboolean
+summary_journal_free_key(void *key, void *value, void *data)
+{
+	g_free(key);
+	return TRUE;
+}
+
+/* remember a message has to be written out or removed by the next
+   save, summary_lock must be held */
+static void
+summary_journal_touch(CamelFolderSummary *s, const char *uid, int change)
+{
+	struct _CamelFolderSummaryPrivate *p = _PRIVATE(s);
+	void *key, *value;
+
+	s->flags |= CAMEL_SUMMARY_DIRTY;
+
+	/* infos being loaded are already on disk */
+	if (uid == NULL || p->map != NULL)
+		return;
+
+	if (g_hash_table_lookup_extended(p->journal, uid, &key, &value)) {
+		/* a remove forgets any earlier changes, but an add after
+		   the remove still needs writing */
+		if (change == JOURNAL_REMOVE)
+			value = GINT_TO_POINTER(JOURNAL_REMOVE);
+		else
+			value = GINT_TO_POINTER(GPOINTER_TO_INT(value) | change);
+		g_hash_table_insert(p->journal, key, value);
+	} else
+		g_hash_table_insert(p->journal, g_strdup(uid), GINT_TO_POINTER(change));
+}
+
+/* open the journal, if there is one for the summary file open on base_fd */
+static struct _CamelFolderSummaryMap *
+summary_journal_open(CamelFolderSummary *s, int base_fd, FILE **inp)
+{
+	struct _CamelFolderSummaryMap *map;
+	struct stat st;
+	char *path;
+	FILE *in;
+
+	if (fstat(base_fd, &st) == -1)
+		return NULL;
+
+	path = summary_journal_path(s);
+	in = g_fopen(path, "rb");
+	g_free(path);
+	if (in == NULL)
+		return NULL;
+
+	if ((map = summary_map_file(fileno(in), JOURNAL_HEADER_LEN)) == NULL) {
+		fclose(in);
+		return NULL;
+	}
+
+	/* a journal left over from before the summary was last written
+	   out in full belongs to a different file */
+	if (record_word(map->data, 0) != JOURNAL_MAGIC
+	    || record_word(map->data, 1) != (guint32)st.st_size
+	    || record_word(map->data, 2) != (guint32)st.st_ino) {
+		io(printf("Ignoring stale summary journal\n"));
+		summary_map_free(map);
+		fclose(in);
+		return NULL;
+	}
+
+	*inp = in;
+
+	return map;
+}
+
+/* length of the journal segment at offset, or 0 if it was never completed */
+static guint32
+summary_journal_segment(struct _CamelFolderSummaryMap *map, guint32 offset)
+{
+	guint32 len;
+
+	if ((guint64)offset + JOURNAL_SEGMENT_LEN > map->len
+	    || record_word(map->data + offset, 0) != JOURNAL_SEGMENT_MAGIC)
+		return 0;
+
+	len = record_word(map->data + offset, 1);
+	if (len < JOURNAL_SEGMENT_LEN
+	    || (guint64)offset + len > map->len
+	    || record_word(map->data + offset, 2) > len - JOURNAL_SEGMENT_LEN)
+		return 0;
+
+	return len;
+}
+
+/* the header copy in a segment, has to go through a file since
+   summary_header_load always reads from the start of one */
+static int
+summary_journal_header_load(CamelFolderSummary *s, struct _CamelFolderSummaryMap *map, guint32 offset)
+{
+	guint32 len = record_word(map->data + offset, 2);
+	FILE *tmp;
+	int ret;
+
+	if ((tmp = tmpfile()) == NULL)
+		return -1;
+
+	if (len > 0 && fwrite(map->data + offset + 12, len, 1, tmp) != 1) {
+		fclose(tmp);
+		return -1;
+	}
+
+	rewind(tmp);
+	ret = ((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS(s)))->summary_header_load(s, tmp);
+	fclose(tmp);
+
+	return ret;
+}
+
+struct _journal_change {
+	char *uid;
+	CamelMessageInfo *info;	/* last record written, if any */
+	gboolean removed;	/* the loaded info goes, any record is a new one */
+	guint seq;		/* where in the order list it goes */
+};
+
+static struct _journal_change *
+summary_journal_change(GHashTable *changes, GPtrArray *order, const char *uid)
+{
+	struct _journal_change *c;
+
+	if ((c = g_hash_table_lookup(changes, uid)) == NULL) {
+		c = g_malloc0(sizeof(*c));
+		c->uid = g_strdup(uid);
+		c->seq = order->len;
+		g_ptr_array_add(order, c);
+		g_hash_table_insert(changes, c->uid, c);
+	}
+
+	return c;
+}
+
+static void
+summary_journal_change_free(void *key, void *value, void *data)
+{
+	struct _journal_change *c = value;
+
+	if (c->info)
+		camel_message_info_free(c->info);
+	g_free(c->uid);
+	g_free(c);
+}
+
+/* apply the journal on top of the summary just loaded from base,
+   io_lock must be held */
+static void
+summary_journal_replay(CamelFolderSummary *s, FILE *base)
+{
+	struct _CamelFolderSummaryPrivate *p = _PRIVATE(s);
+	struct _CamelFolderSummaryMap *map;
+	struct _journal_change *c;
+	CamelMessageInfo *mi;
+	GHashTable *changes;
+	GPtrArray *order;
+	guint32 offset, len, hdr, count, type, i, j;
+	char *uid;
+	FILE *in;
+
+	p->journal_len = 0;
+	if ((map = summary_journal_open(s, fileno(base), &in)) == NULL)
+		return;
+
+	/* records may point into it, it goes once none of them do */
+	CAMEL_SUMMARY_LOCK(s, map_lock);
+	p->maps = g_slist_prepend(p->maps, map);
+	CAMEL_SUMMARY_UNLOCK(s, map_lock);
+
+	/* the last record for each uid wins, and nothing is applied until
+	   the whole journal has been read so the summary order can be
+	   kept in one pass */
+	changes = g_hash_table_new(g_str_hash, g_str_equal);
+	order = g_ptr_array_new();
+
+	p->map = map;
+	offset = JOURNAL_HEADER_LEN;
+	while ((len = summary_journal_segment(map, offset)) != 0) {
+		if (summary_journal_header_load(s, map, offset) == -1)
+			break;
+
+		hdr = record_word(map->data + offset, 2);
+		map->pool_start = offset + 16 + hdr;
+		map->pool_len = record_word(map->data + offset + 12 + hdr, 0);
+		map->table_start = offset + len;
+		if (map->pool_len == 0
+		    || (guint64)map->pool_start + map->pool_len + 4 > map->table_start
+		    || map->data[map->pool_start + map->pool_len - 1] != 0)
+			break;
+
+		count = record_word(map->data + map->pool_start + map->pool_len, 0);
+		if (fseek(in, map->pool_start + map->pool_len + 4, SEEK_SET) == -1)
+			break;
+
+		for (i=0;i<count;i++) {
+			if (camel_file_util_decode_fixed_int32(in, &type) == -1)
+				break;
+
+			if (type == JOURNAL_REMOVE) {
+				if (camel_file_util_decode_string(in, &uid) == -1)
 					break;
+				c = summary_journal_change(changes, order, uid);
+				g_free(uid);
+				if (c->info) {
+					camel_message_info_free(c->info);
+					c->info = NULL;
 				}
-			}
-#endif
-		}
-		if (token != -1) {
-			return camel_file_util_encode_uint32(out, token+1);
-		} else {
-			if (camel_file_util_encode_uint32(out, len+32) == -1)
-				return -1;
-			if (fwrite(str, len, 1, out) != 1)
-				return -1;
+				c->removed = TRUE;
+			} else if (type == JOURNAL_RECORD) {
+				mi = ((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS(s)))->message_info_load(s, in);
+				if (mi == NULL)
+					break;
+
+				if (s->build_content) {
+					((CamelMessageInfoBase *)mi)->content = perform_content_info_load(s, in);
+					if (((CamelMessageInfoBase *)mi)->content == NULL) {
+						camel_message_info_free(mi);
+						break;
+					}
+				}
+
+				c = summary_journal_change(changes, order, camel_message_info_uid(mi));
+				if (c->info) {
+					camel_message_info_free(c->info);
+				} else if (c->removed) {
+					/* re-added, goes after anything added before */
+					c->seq = order->len;
+					g_ptr_array_add(order, c);
+				}
+				c->info = mi;
+			} else
+				break;
 		}
+
+		if (i < count)
+			break;
+
+		offset += len;
 	}
-	return 0;
-}
+	p->map = NULL;
 
+	io(printf("Replayed %d journal changes\n", g_hash_table_size(changes)));
 
-/**
- * camel_folder_summary_decode_token:
- * @in: input FILE pointer
- * @str: string pointer to hold the decoded result
- *
- * Decode a token value.
- *
- * Returns %0 on success or %-1 on fail
- **/
-int
-camel_folder_summary_decode_token(FILE *in, char **str)
-{
-	char *ret;
-	guint32 len;
+	/* anything after a broken or unfinished segment is dropped by the
+	   next save, which may as well be a full one */
+	p->journal_len = offset;
+	if (offset != map->len)
+		p->journal_invalid = TRUE;
 
-	io(printf("Decode token ...\n"));
+	CAMEL_SUMMARY_LOCK(s, summary_lock);
+	for (i=0,j=0;i<s->messages->len;i++) {
+		mi = s->messages->pdata[i];
+		if ((c = g_hash_table_lookup(changes, camel_message_info_uid(mi))) == NULL) {
+			s->messages->pdata[j++] = mi;
+			continue;
+		}
 
-	if (camel_file_util_decode_uint32(in, &len) == -1) {
-		io(printf ("Could not decode token from file"));
-		*str = NULL;
-		return -1;
+		g_hash_table_remove(s->messages_uid, camel_message_info_uid(mi));
+		if (!c->removed) {
+			s->messages->pdata[j++] = c->info;
+			g_hash_table_insert(s->messages_uid, (char *)camel_message_info_uid(c->info), c->info);
+			c->info = NULL;
+		}
+		camel_message_info_free(mi);
 	}
+	g_ptr_array_set_size(s->messages, j);
+	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
 
-	if (len<32) {
-		if (len <= 0) {
-			ret = NULL;
-		} else if (len<= tokens_len) {
-			ret = g_strdup(tokens[len-1]);
-		} else {
-			io(printf ("Invalid token encountered: %d", len));
-			*str = NULL;
-			return -1;
-		}
-	} else if (len > 10240) {
-		io(printf ("Got broken string header length: %d bytes", len));
-		*str = NULL;
-		return -1;
-	} else {
-		len -= 32;
-		ret = g_malloc(len+1);
-		if (len > 0 && fread(ret, len, 1, in) != 1) {
-			g_free(ret);
-			*str = NULL;
-			return -1;
+	for (i=0;i<order->len;i++) {
+		c = order->pdata[i];
+		if (c->seq == i && c->info) {
+			camel_folder_summary_add(s, c->info);
+			c->info = NULL;
 		}
-		ret[len]=0;
 	}
 
-	io(printf("Token = '%s'\n", ret));
+	g_hash_table_foreach(changes, summary_journal_change_free, NULL);
+	g_hash_table_destroy(changes);
+	g_ptr_array_free(order, TRUE);
 
-	*str = ret;
-	return 0;
+	fclose(in);
 }
 
-static struct _node *
-my_list_append(struct _node **list, struct _node *n)
+/* load the header from the last segment of the journal, if there is one */
+static int
+summary_journal_header(CamelFolderSummary *s, FILE *base)
 {
-	struct _node *ln = (struct _node *)list;
-	while (ln->next)
-		ln = ln->next;
-	n->next = NULL;
-	ln->next = n;
-	return n;
+	struct _CamelFolderSummaryMap *map;
+	guint32 offset, len, last = 0;
+	int ret = 0;
+	FILE *in;
+
+	if ((map = summary_journal_open(s, fileno(base), &in)) == NULL)
+		return 0;
+
+	offset = JOURNAL_HEADER_LEN;
+	while ((len = summary_journal_segment(map, offset)) != 0) {
+		last = offset;
+		offset += len;
+	}
+
+	if (last != 0)
+		ret = summary_journal_header_load(s, map, last);
+
+	summary_map_free(map);
+	fclose(in);
+
+	return ret;
+}
+
+static void
+summary_journal_removed(void *key, void *value, void *data)
+{
+	GSList **removed = data;
+
+	if (GPOINTER_TO_INT(value) & JOURNAL_REMOVE)
+		*removed = g_slist_prepend(*removed, key);
 }
 
+/* append a segment with everything changed since the last save to the
+   journal, io_lock must be held */
 static int
-my_list_size(struct _node **list)
+summary_journal_save(CamelFolderSummary *s)
 {
-	int len = 0;
-	struct _node *ln = (struct _node *)list;
-	while (ln->next) {
-		ln = ln->next;
-		len++;
+	struct _CamelFolderSummaryPrivate *p = _PRIVATE(s);
+	GSList *removed = NULL, *l;
+	FILE *out = NULL, *tmp;
+	GHashTable *journal;
+	GPtrArray *infos;
+	CamelMessageInfo *mi;
+	guint32 seg_start, hdr_len;
+	int fd, i, change, ret = -1;
+	char buf[4096];
+	long end;
+	size_t n;
+	char *path;
+
+	CAMEL_SUMMARY_LOCK(s, summary_lock);
+	journal = p->journal;
+	p->journal = g_hash_table_new(g_str_hash, g_str_equal);
+	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
+
+	infos = g_ptr_array_new();
+
+	/* the header can only be written at the start of a file */
+	if ((tmp = tmpfile()) == NULL)
+		goto done;
+
+	if (((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS(s)))->summary_header_save(s, tmp) == -1
+	    || fflush(tmp) != 0)
+		goto done;
+	hdr_len = ftell(tmp);
+	rewind(tmp);
+
+	path = summary_journal_path(s);
+	fd = g_open(path, O_RDWR|O_CREAT|O_BINARY, 0600);
+	g_free(path);
+	if (fd == -1)
+		goto done;
+	if ((out = fdopen(fd, "r+b")) == NULL) {
+		close(fd);
+		goto done;
 	}
-	return len;
+
+	/* start a new journal, or drop anything past the last good segment */
+	if (ftruncate(fd, p->journal_len) == -1)
+		goto done;
+
+	if (p->journal_len == 0) {
+		camel_file_util_encode_fixed_int32(out, JOURNAL_MAGIC);
+		camel_file_util_encode_fixed_int32(out, p->base_len);
+		camel_file_util_encode_fixed_int32(out, p->base_ino);
+	} else if (fseek(out, p->journal_len, SEEK_SET) == -1)
+		goto done;
+
+	io(printf("Appending journal segment\n"));
+
+	seg_start = ftell(out);
+	camel_file_util_encode_fixed_int32(out, JOURNAL_SEGMENT_MAGIC);
+	camel_file_util_encode_fixed_int32(out, 0);
+	camel_file_util_encode_fixed_int32(out, hdr_len);
+	while ((n = fread(buf, 1, sizeof(buf), tmp)) > 0)
+		fwrite(buf, n, 1, out);
+	if (ferror(tmp))
+		goto done;
+
+	/* changed infos in summary order, so new ones are replayed in order */
+	for (i=0;i<s->messages->len;i++) {
+		mi = s->messages->pdata[i];
+		change = GPOINTER_TO_INT(g_hash_table_lookup(journal, camel_message_info_uid(mi)));
+		if ((change & JOURNAL_RECORD) || (((CamelMessageInfoBase *)mi)->flags & CAMEL_MESSAGE_FOLDER_FLAGGED))
+			g_ptr_array_add(infos, mi);
+	}
+
+	summary_maps_hold(s);
+	p->pool = summary_pool_new();
+	for (i=0;i<infos->len;i++)
+		summary_pool_add_info(p->pool, infos->pdata[i]);
+
+	camel_file_util_encode_fixed_int32(out, p->pool->data->len);
+	p->pool_start = ftell(out);
+	if (fwrite(p->pool->data->data, p->pool->data->len, 1, out) != 1)
+		goto done;
+
+	/* removes go first, so a uid removed and added again ends up new */
+	g_hash_table_foreach(journal, summary_journal_removed, &removed);
+	camel_file_util_encode_fixed_int32(out, g_slist_length(removed) + infos->len);
+	for (l = removed;l;l=l->next) {
+		camel_file_util_encode_fixed_int32(out, JOURNAL_REMOVE);
+		camel_file_util_encode_string(out, l->data);
+	}
+
+	for (i=0;i<infos->len;i++) {
+		mi = infos->pdata[i];
+		camel_file_util_encode_fixed_int32(out, JOURNAL_RECORD);
+		if (((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS (s)))->message_info_save (s, out, mi) == -1)
+			goto done;
+
+		if (s->build_content) {
+			if (perform_content_info_save (s, out, ((CamelMessageInfoBase *)mi)->content) == -1)
+				goto done;
+		}
+	}
+
+	end = ftell(out);
+	if (ferror(out) || fflush(out) != 0 || fsync(fileno(out)) == -1)
+		goto done;
+
+	/* the segment only counts once all of it is on disk */
+	if (fseek(out, seg_start + 4, SEEK_SET) == -1
+	    || camel_file_util_encode_fixed_int32(out, end - seg_start) == -1
+	    || fflush(out) != 0 || fsync(fileno(out)) == -1)
+		goto done;
+
+	p->journal_len = end;
+	ret = 0;
+done:
+	if (p->pool) {
+		summary_pool_free(p->pool);
+		p->pool = NULL;
+		summary_maps_unhold(s);
+	}
+
+	if (out)
+		fclose(out);
+	if (tmp)
+		fclose(tmp);
+
+	g_slist_free(removed);
+	g_ptr_array_free(infos, TRUE);
+	g_hash_table_foreach_remove(journal, summary_journal_free_key, NULL);
+	g_hash_table_destroy(journal);
+
+	return ret;
 }
 
 static int
 summary_meta_header_load(CamelFolderSummary *s, FILE *in)
 {
+	FILE *in_meta;
+	guint32 meta_start;
+	int ret;
+
+	/* it's in the summary file itself from version 15 */
+	if (s->version < 0x100 && s->version >= CAMEL_FOLDER_SUMMARY_VERSION_META) {
+		if (fseek(in, -(TRAILER_META_LEN - 12), SEEK_END) == -1
+		    || camel_file_util_decode_fixed_int32(in, &meta_start) == -1
+		    || fseek(in, meta_start, SEEK_SET) == -1)
+			return -1;
+
+		return summary_meta_header_decode(s, in);
+	}
+
 	if (!s->meta_summary->path)
 		return -1;
 
-	fseek(in, 0, SEEK_SET);
+	in_meta = g_fopen(s->meta_summary->path, "rb");
+	if (in_meta == NULL)
+		return -1;
+
+	ret = summary_meta_header_decode(s, in_meta);
+	fclose(in_meta);
+
+	if (ret == 0)
+		_PRIVATE(s)->meta_legacy = TRUE;
+
+	return ret;
+}
 
+static int
+summary_meta_header_decode(CamelFolderSummary *s, FILE *in)
+{
 	io(printf("Loading meta-header\n"));
 
 	if (camel_file_util_decode_uint32(in, &s->meta_summary->major) == -1
@@ -1586,8 +2738,6 @@ summary_header_save(CamelFolderSummary *s, FILE *out)
 static int
 summary_meta_header_save(CamelFolderSummary *s, FILE *out_meta)
 {
-	fseek(out_meta, 0, SEEK_SET);
-
 	/* Save meta-summary header */
 	if (s->meta_summary->msg_expunged) {
 		s->meta_summary->msg_expunged = FALSE;
@@ -1837,8 +2987,9 @@ message_info_new_from_header(CamelFolderSummary *s, struct _camel_header_raw *h)
 	return (CamelMessageInfo *)mi;
 }
 
+/* pre-mapped summaries store everything inline */
 static CamelMessageInfo *
-message_info_load(CamelFolderSummary *s, FILE *in)
+message_info_load_inline(CamelFolderSummary *s, FILE *in)
 {
 	CamelMessageInfoBase *mi;
 	guint count;
@@ -1847,7 +2998,7 @@ message_info_load(CamelFolderSummary *s, FILE *in)
 
 	mi = (CamelMessageInfoBase *)camel_message_info_new(s);
 
-	io(printf("Loading message info\n"));
+	io(printf("Loading inline message info\n"));
 
 	camel_file_util_decode_string(in, &uid);
 	camel_file_util_decode_uint32(in, &mi->flags);
@@ -1917,6 +3068,101 @@ error:
 	return NULL;
 }
 
+static CamelMessageInfo *
+message_info_load(CamelFolderSummary *s, FILE *in)
+{
+	struct _CamelFolderSummaryMap *map = _PRIVATE(s)->map;
+	const unsigned char *record, *data, *end;
+	CamelMessageInfoBase *mi;
+	guint32 count, i;
+	long offset;
+
+	if (!(s->version < 0x100 && s->version >= CAMEL_FOLDER_SUMMARY_VERSION_MAPPED))
+		return message_info_load_inline(s, in);
+
+	io(printf("Loading message info\n"));
+
+	/* only uid's, flags and fixed size values are decoded now, the
+	   strings are left in the map until someone asks for them */
+	offset = ftell(in);
+	if (map == NULL
+	    || offset < (long)(map->pool_start + map->pool_len)
+	    || offset + REC_LEN > map->table_start) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (i=0;i<rec_pooled_len;i++) {
+		if (!summary_map_check(map, offset, rec_pooled[i])) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	record = map->data + offset;
+	end = map->data + map->pool_start + map->pool_len;
+
+	mi = (CamelMessageInfoBase *)camel_message_info_new(s);
+
+	mi->uid = g_strdup((const char *)record_data(record, REC_UID));
+	mi->flags = record_word(record, REC_FLAGS);
+	mi->size = record_word(record, REC_SIZE);
+	mi->date_sent = (time_t)(((guint64)record_word(record, REC_DATE_SENT_HI) << 32) | record_word(record, REC_DATE_SENT_LO));
+	mi->date_received = (time_t)(((guint64)record_word(record, REC_DATE_RECEIVED_HI) << 32) | record_word(record, REC_DATE_RECEIVED_LO));
+	mi->message_id.id.part.hi = record_word(record, REC_MESSAGE_ID_HI);
+	mi->message_id.id.part.lo = record_word(record, REC_MESSAGE_ID_LO);
+
+	if ((data = record_data(record, REC_REFERENCES))
+	    && (data + 4 > end || (count = record_word(data, 0)) > 500 || data + 4 + count * 8 > end))
+		goto error;
+
+	/* flags and tags are rare and changed in place, so they are decoded now */
+	if ((data = record_data(record, REC_USER_FLAGS))) {
+		if (data + 4 > end || (count = record_word(data, 0)) > 500)
+			goto error;
+		data += 4;
+		for (i=0;i<count;i++) {
+			if (data >= end || *data == 0)
+				goto error;
+			camel_flag_set(&mi->user_flags, (const char *)data, TRUE);
+			data += strlen((const char *)data) + 1;
+		}
+	}
+
+	if ((data = record_data(record, REC_USER_TAGS))) {
+		const unsigned char *value;
+
+		if (data + 4 > end || (count = record_word(data, 0)) > 500)
+			goto error;
+		data += 4;
+		for (i=0;i<count;i++) {
+			if (data >= end || *data == 0)
+				goto error;
+			value = data + strlen((const char *)data) + 1;
+			if (value >= end)
+				goto error;
+			camel_tag_set(&mi->user_tags, (const char *)data, (const char *)value);
+			data = value + strlen((const char *)value) + 1;
+		}
+	}
+
+	CAMEL_SUMMARY_LOCK(s, map_lock);
+	g_hash_table_insert(_PRIVATE(s)->records, mi, (void *)record);
+	map->users++;
+	CAMEL_SUMMARY_UNLOCK(s, map_lock);
+
+	if (fseek(in, offset + REC_LEN, SEEK_SET) == -1)
+		goto error;
+
+	return (CamelMessageInfo *)mi;
+
+error:
+	errno = EINVAL;
+	camel_message_info_free((CamelMessageInfo *)mi);
+
+	return NULL;
+}
+
 static int
 meta_message_info_save(CamelFolderSummary *s, FILE *out_meta, FILE *out, CamelMessageInfo *info)
 {
@@ -1925,68 +3171,86 @@ meta_message_info_save(CamelFolderSummary *s, FILE *out_meta, FILE *out, CamelMe
 	CamelMessageInfoBase *mi = (CamelMessageInfoBase *)info;
 
 	time (&timestamp);
-	offset = ftell (out);
-	/* FIXME: errno check after ftell */
+	/* the entries follow the records now, so out is past them */
+	offset = _PRIVATE(s)->meta_offset;
 
 	camel_file_util_encode_time_t(out_meta, timestamp);
 	camel_file_util_encode_fixed_string(out_meta, camel_message_info_uid(mi), s->meta_summary->uid_len);
 	camel_file_util_encode_uint32(out_meta, mi->flags);
 	camel_file_util_encode_off_t(out_meta, offset);
 
-	return ferror(out);
+	return ferror(out_meta);
 }
 
 static int
 message_info_save(CamelFolderSummary *s, FILE *out, CamelMessageInfo *info)
 {
-	guint32 count;
-	CamelFlag *flag;
-	CamelTag *tag;
-	int i;
+	struct _CamelFolderSummaryPrivate *p = _PRIVATE(s);
 	CamelMessageInfoBase *mi = (CamelMessageInfoBase *)info;
+	const unsigned char *record = info_record(mi);
+	GByteArray *buf;
+	const void *data;
+	guint32 len, offset;
+	long start;
+	int i, res = 0;
 
 	io(printf("Saving message info\n"));
 
-	camel_file_util_encode_string(out, camel_message_info_uid(mi));
-	camel_file_util_encode_uint32(out, mi->flags);
-	camel_file_util_encode_uint32(out, mi->size);
-	camel_file_util_encode_time_t(out, mi->date_sent);
-	camel_file_util_encode_time_t(out, mi->date_received);
-	camel_file_util_encode_string(out, camel_message_info_subject(mi));
-	camel_file_util_encode_string(out, camel_message_info_from(mi));
-	camel_file_util_encode_string(out, camel_message_info_to(mi));
-	camel_file_util_encode_string(out, camel_message_info_cc(mi));
-	camel_file_util_encode_string(out, camel_message_info_mlist(mi));
-
-	camel_file_util_encode_fixed_int32(out, mi->message_id.id.part.hi);
-	camel_file_util_encode_fixed_int32(out, mi->message_id.id.part.lo);
-
-	if (mi->references) {
-		camel_file_util_encode_uint32(out, mi->references->size);
-		for (i=0;i<mi->references->size;i++) {
-			camel_file_util_encode_fixed_int32(out, mi->references->references[i].id.part.hi);
-			camel_file_util_encode_fixed_int32(out, mi->references->references[i].id.part.lo);
+	/* records can only be written as part of a full save, which has
+	   already put all our data into the pool */
+	g_return_val_if_fail(p->pool != NULL, -1);
+
+	start = ftell(out);
+	buf = g_byte_array_new();
+
+	for (i=0;i<REC_LAST && res == 0;i++) {
+		switch (i) {
+		case REC_FLAGS:
+			res = camel_file_util_encode_fixed_int32(out, mi->flags);
+			break;
+		case REC_SIZE:
+			res = camel_file_util_encode_fixed_int32(out, mi->size);
+			break;
+		case REC_DATE_SENT_HI:
+			res = camel_file_util_encode_fixed_int32(out, (guint32)((guint64)mi->date_sent >> 32));
+			break;
+		case REC_DATE_SENT_LO:
+			res = camel_file_util_encode_fixed_int32(out, (guint32)mi->date_sent);
+			break;
+		case REC_DATE_RECEIVED_HI:
+			res = camel_file_util_encode_fixed_int32(out, (guint32)((guint64)mi->date_received >> 32));
+			break;
+		case REC_DATE_RECEIVED_LO:
+			res = camel_file_util_encode_fixed_int32(out, (guint32)mi->date_received);
+			break;
+		case REC_MESSAGE_ID_HI:
+			res = camel_file_util_encode_fixed_int32(out, mi->message_id.id.part.hi);
+			break;
+		case REC_MESSAGE_ID_LO:
+			res = camel_file_util_encode_fixed_int32(out, mi->message_id.id.part.lo);
+			break;
+		default:
+			offset = 0;
+			if ((data = summary_info_data(mi, record, i, buf, &len))) {
+				offset = summary_pool_lookup(p->pool, data, len, FALSE);
+				if (offset == 0) {
+					g_warning("Message info data missing from summary pool");
+					errno = EINVAL;
+					res = -1;
+					break;
+				}
+				/* distance back from the record start */
+				offset = start - (p->pool_start + offset);
+			}
+			res = camel_file_util_encode_fixed_int32(out, offset);
+			break;
 		}
-	} else {
-		camel_file_util_encode_uint32(out, 0);
 	}
 
-	count = camel_flag_list_size(&mi->user_flags);
-	camel_file_util_encode_uint32(out, count);
-	flag = mi->user_flags;
-	while (flag) {
-		camel_file_util_encode_string(out, flag->name);
-		flag = flag->next;
-	}
+	g_byte_array_free(buf, TRUE);
 
-	count = camel_tag_list_size(&mi->user_tags);
-	camel_file_util_encode_uint32(out, count);
-	tag = mi->user_tags;
-	while (tag) {
-		camel_file_util_encode_string(out, tag->name);
-		camel_file_util_encode_string(out, tag->value);
-		tag = tag->next;
-	}
+	if (res == -1)
+		return -1;
 
 	return ferror(out);
 }
@@ -1995,6 +3259,16 @@ static void
 message_info_free(CamelFolderSummary *s, CamelMessageInfo *info)
 {
 	CamelMessageInfoBase *mi = (CamelMessageInfoBase *)info;
+	const unsigned char *record;
+
+	if (s) {
+		CAMEL_SUMMARY_LOCK(s, map_lock);
+		if ((record = g_hash_table_lookup(_PRIVATE(s)->records, mi))) {
+			g_hash_table_remove(_PRIVATE(s)->records, mi);
+			summary_maps_release(s, record);
+		}
+		CAMEL_SUMMARY_UNLOCK(s, map_lock);
+	}
 
 	g_free(mi->uid);
 	camel_pstring_free(mi->subject);
@@ -2024,9 +3298,9 @@ content_info_new_from_header(CamelFolderSummary *s, struct _camel_header_raw *h)
 	ci = camel_folder_summary_content_info_new (s);
 
 	charset = e_iconv_locale_charset ();
-	ci->id = camel_header_msgid_decode (camel_header_raw_find (&h, "content-id", NULL));
-	ci->description = camel_header_decode_string (camel_header_raw_find (&h, "content-description", NULL), charset);
-	ci->encoding = camel_content_transfer_encoding_decode (camel_header_raw_find (&h, "content-transfer-encoding", NULL));
+	ci->id = (char *)camel_pstring_add (camel_header_msgid_decode (camel_header_raw_find (&h, "content-id", NULL)), TRUE);
+	ci->description = (char *)camel_pstring_add (camel_header_decode_string (camel_header_raw_find (&h, "content-description", NULL), charset), TRUE);
+	ci->encoding = (char *)camel_pstring_add (camel_content_transfer_encoding_decode (camel_header_raw_find (&h, "content-transfer-encoding", NULL)), TRUE);
 	ci->type = camel_content_type_decode(camel_header_raw_find(&h, "content-type", NULL));
 
 	return ci;
@@ -2036,7 +3310,7 @@ static CamelMessageContentInfo *
 content_info_load(CamelFolderSummary *s, FILE *in)
 {
 	CamelMessageContentInfo *ci;
-	char *type, *subtype;
+	struct _camel_header_param *param, *tail;
 	guint32 count, i;
 	CamelContentType *ct;
 
@@ -2044,31 +3318,36 @@ content_info_load(CamelFolderSummary *s, FILE *in)
 
 	ci = camel_folder_summary_content_info_new(s);
 
-	camel_folder_summary_decode_token(in, &type);
-	camel_folder_summary_decode_token(in, &subtype);
-	ct = camel_content_type_new(type, subtype);
-	g_free(type);		/* can this be removed? */
-	g_free(subtype);
+	/* the decoded strings are handed straight to the content type,
+	   rather than being copied by the setters and freed again */
+	ct = ci->type = camel_content_type_new(NULL, NULL);
+	camel_folder_summary_decode_token(in, &ct->type);
+	camel_folder_summary_decode_token(in, &ct->subtype);
 	if (camel_file_util_decode_uint32(in, &count) == -1 || count > 500)
 		goto error;
 
+	tail = (struct _camel_header_param *)&ct->params;
 	for (i = 0; i < count; i++) {
 		char *name, *value;
 		camel_folder_summary_decode_token(in, &name);
 		camel_folder_summary_decode_token(in, &value);
-		if (!(name && value))
+		if (!(name && value)) {
+			g_free(name);
+			g_free(value);
 			goto error;
+		}
 
-		camel_content_type_set_param(ct, name, value);
-		/* TODO: do this so we dont have to double alloc/free */
-		g_free(name);
-		g_free(value);
+		param = g_malloc(sizeof(*param));
+		param->next = NULL;
+		param->name = name;
+		param->value = value;
+		tail->next = param;
+		tail = param;
 	}
-	ci->type = ct;
 
-	camel_folder_summary_decode_token(in, &ci->id);
-	camel_folder_summary_decode_token(in, &ci->description);
-	camel_folder_summary_decode_token(in, &ci->encoding);
+	summary_decode_token(in, &ci->id, TRUE);
+	summary_decode_token(in, &ci->description, TRUE);
+	summary_decode_token(in, &ci->encoding, TRUE);
 
 	camel_file_util_decode_uint32(in, &ci->size);
 
@@ -2117,9 +3396,9 @@ static void
 content_info_free(CamelFolderSummary *s, CamelMessageContentInfo *ci)
 {
 	camel_content_type_unref(ci->type);
-	g_free(ci->id);
-	g_free(ci->description);
-	g_free(ci->encoding);
+	camel_pstring_free(ci->id);
+	camel_pstring_free(ci->description);
+	camel_pstring_free(ci->encoding);
 	e_memchunk_free(s->content_info_chunks, ci);
 }
 
@@ -2780,17 +4059,8 @@ camel_message_info_ref(void *o)
 {
 	CamelMessageInfo *mi = o;
 
-	if (mi->summary) {
-		CAMEL_SUMMARY_LOCK(mi->summary, ref_lock);
-		g_assert(mi->refcount >= 1);
-		mi->refcount++;
-		CAMEL_SUMMARY_UNLOCK(mi->summary, ref_lock);
-	} else {
-		GLOBAL_INFO_LOCK(info);
-		g_assert(mi->refcount >= 1);
-		mi->refcount++;
-		GLOBAL_INFO_UNLOCK(info);
-	}
+	g_assert(g_atomic_int_get(&mi->refcount) >= 1);
+	g_atomic_int_inc(&mi->refcount);
 }
 
 
@@ -2827,18 +4097,12 @@ camel_message_info_free(void *o)
 
 	g_return_if_fail(mi != NULL);
 
-	if (mi->summary) {
-		CAMEL_SUMMARY_LOCK(mi->summary, ref_lock);
-
-		if (mi->refcount >= 1)
-			mi->refcount--;
-		if (mi->refcount > 0) {
-			CAMEL_SUMMARY_UNLOCK(mi->summary, ref_lock);
-			return;
-		}
-
-		CAMEL_SUMMARY_UNLOCK(mi->summary, ref_lock);
+	/* nothing can find an info once the last ref has gone, the
+	   summary only drops its own after taking it out of its tables */
+	if (!g_atomic_int_dec_and_test(&mi->refcount))
+		return;
 
+	if (mi->summary) {
 		/* FIXME: this is kinda busted, should really be handled by message info free */
 		if (mi->summary->build_content
 		    && ((CamelMessageInfoBase *)mi)->content) {
@@ -2847,14 +4111,6 @@ camel_message_info_free(void *o)
 
 		((CamelFolderSummaryClass *)(CAMEL_OBJECT_GET_CLASS(mi->summary)))->message_info_free(mi->summary, mi);
 	} else {
-		GLOBAL_INFO_LOCK(info);
-		mi->refcount--;
-		if (mi->refcount > 0) {
-			GLOBAL_INFO_UNLOCK(info);
-			return;
-		}
-		GLOBAL_INFO_UNLOCK(info);
-
 		message_info_free(NULL, mi);
 	}
 }
@@ -2866,6 +4122,9 @@ message_info_clone(CamelFolderSummary *s, const CamelMessageInfo *mi)
 	CamelFlag *flag;
 	CamelTag *tag;
 
+	if (info_record(from))
+		message_info_materialise(from);
+
 	to = (CamelMessageInfoBase *)camel_message_info_new(s);
 
 	to->flags = from->flags;
@@ -2932,6 +4191,9 @@ camel_message_info_clone(const void *o)
 static const void *
 info_ptr(const CamelMessageInfo *mi, int id)
 {
+	if (info_record(mi))
+		message_info_materialise((CamelMessageInfoBase *)mi);
+
 	switch (id) {
 	case CAMEL_MESSAGE_INFO_SUBJECT:
 		return ((const CamelMessageInfoBase *)mi)->subject;
@@ -3102,7 +4364,7 @@ info_set_flags(CamelMessageInfo *info, guint32 flags, guint32 set)
 	if (old != mi->flags) {
 		mi->flags |= CAMEL_MESSAGE_FOLDER_FLAGGED;
 		if (mi->summary)
-			camel_folder_summary_touch(mi->summary);
+			camel_folder_summary_touch_info(mi->summary, info);
 	}
 
 	if (((old & ~CAMEL_MESSAGE_SYSTEM_MASK) == (mi->flags & ~CAMEL_MESSAGE_SYSTEM_MASK)) && !((set & CAMEL_MESSAGE_JUNK_LEARN) && !(set & CAMEL_MESSAGE_JUNK)))
@@ -3152,7 +4414,7 @@ info_set_user_flag(CamelMessageInfo *info, const char *name, gboolean value)
 		CamelFolderChangeInfo *changes = camel_folder_change_info_new();
 
 		mi->flags |= CAMEL_MESSAGE_FOLDER_FLAGGED;
-		camel_folder_summary_touch(mi->summary);
+		camel_folder_summary_touch_info(mi->summary, info);
 		camel_folder_change_info_change_uid(changes, camel_message_info_uid(info));
 		camel_object_trigger_event(mi->summary->folder, "folder_changed", changes);
 		camel_folder_change_info_free(changes);
@@ -3193,7 +4455,7 @@ info_set_user_tag(CamelMessageInfo *info, const char *name, const char *value)
 		CamelFolderChangeInfo *changes = camel_folder_change_info_new();
 
 		mi->flags |= CAMEL_MESSAGE_FOLDER_FLAGGED;
-		camel_folder_summary_touch(mi->summary);
+		camel_folder_summary_touch_info(mi->summary, info);
 		camel_folder_change_info_change_uid(changes, camel_message_info_uid(info));
 		camel_object_trigger_event(mi->summary->folder, "folder_changed", changes);
 		camel_folder_change_info_free(changes);
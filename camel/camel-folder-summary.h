@@ -54,6 +54,7 @@ struct _CamelMessageContentInfo {
 	struct _CamelMessageContentInfo *parent;
 
 	CamelContentType *type;
+	/* these are camel_pstring's, shared between all the summaries */
 	char *id;
 	char *description;
 	char *encoding;		/* this should be an enum?? */
@@ -147,7 +148,7 @@ enum {
 struct _CamelMessageInfo {
 	CamelFolderSummary *summary;
 
-	guint32 refcount;	/* ??? */
+	volatile gint refcount;	/* atomic, see camel_message_info_ref() */
 	char *uid;
 };
 
@@ -157,7 +158,7 @@ struct _CamelMessageInfo {
 struct _CamelMessageInfoBase {
 	CamelFolderSummary *summary;
 
-	guint32 refcount;	/* ??? */
+	volatile gint refcount;	/* atomic, see camel_message_info_ref() */
 	char *uid;
 
 	const char *subject;
@@ -308,6 +309,8 @@ int camel_folder_summary_header_load(CamelFolderSummary *summary);
 
 /* set the dirty bit on the summary */
 void camel_folder_summary_touch(CamelFolderSummary *summary);
+void camel_folder_summary_touch_info(CamelFolderSummary *summary, CamelMessageInfo *info);
+void camel_folder_summary_touch_header(CamelFolderSummary *summary);
 
 /* add a new raw summary item */
 void camel_folder_summary_add(CamelFolderSummary *summary, CamelMessageInfo *info);
@@ -28,6 +28,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -60,7 +61,9 @@ int inend_id = -1,
   inbuffer_id = -1;
 #endif
 
-#define SCAN_BUF 4096		/* size of read buffer */
+#define SCAN_BUF 32768		/* default size of read buffer */
+#define SCAN_BUF_MIN 4096	/* and the limits on setting it from the environment */
+#define SCAN_BUF_MAX (1024*1024)
 #define SCAN_HEAD 128		/* headroom guaranteed to be before each read buffer */
 
 /* a little hacky, but i couldn't be bothered renaming everything */
@@ -84,10 +87,11 @@ struct _header_scan_state {
 	int ioerrno;		/* io error state */
 
 	/* for scanning input buffers */
-	char *realbuf;		/* the real buffer, SCAN_HEAD*2 + SCAN_BUF bytes */
+	char *realbuf;		/* the real buffer, SCAN_HEAD*2 + bufsize bytes */
 	char *inbuf;		/* points to a subset of the allocated memory, the underflow */
 	char *inptr;		/* (upto SCAN_HEAD) is for use by filters so they dont copy all data */
 	char *inend;
+	int bufsize;		/* how much we read at a time */
 
 	int atleast;
 
@@ -137,8 +141,11 @@ struct _header_scan_stack {
 	int boundarylen;	/* actual length of boundary, including leading -- if there is one */
 	int boundarylenfinal;	/* length of boundary, including trailing -- if there is one */
 	int atleast;		/* the biggest boundary from here to the parent */
+	unsigned char starts[32]; /* bitmap of the first characters of the boundaries from here to the parent */
 };
 
+#define BOUNDARY_START(h, c) ((h)->starts[((unsigned char)(c)) >> 3] & (1 << (((unsigned char)(c)) & 7)))
+
 struct _header_scan_filter {
 	struct _header_scan_filter *next;
 	int id;
@@ -314,6 +321,24 @@ camel_mime_parser_filter_remove(CamelMimeParser *m, int id)
 	}
 }
 
+/**
+ * camel_mime_parser_filtered:
+ * @m:
+ *
+ * Find out if any processing filters are in the pipeline, in
+ * which case the body content returned by step() may differ
+ * from the source data between the offsets it was read from.
+ *
+ * Return value: #TRUE if there are any filters.
+ **/
+gboolean
+camel_mime_parser_filtered(CamelMimeParser *m)
+{
+	struct _header_scan_state *s = _PRIVATE(m);
+
+	return s->filters != NULL;
+}
+
 /**
  * camel_mime_parser_header:
  * @m:
@@ -461,10 +486,12 @@ camel_mime_parser_init_with_fd(CamelMimeParser *m, int fd)
  * @m:
  * @stream:
  *
- * Initialise the scanner with a source stream.  The scanner's
- * offsets will be relative to the current file position of
- * the stream.  As a result, seekable streams should only
- * be seeked using the parser seek function.
+ * Initialise the scanner with a source stream.  If the stream
+ * is seekable the scanner's offsets will be positions in the
+ * stream, otherwise they will be relative to where it was
+ * when the scanner was initialised.  Seekable streams may be
+ * read through substreams while parsing, the scanner will
+ * seek back to where it was before reading more.
  *
  * Return value: -1 on error.
  **/
@@ -890,6 +917,7 @@ folder_read(struct _header_scan_state *s)
 {
 	int len;
 	int inoffset;
+	off_t pos;
 
 	if (s->inptr<s->inend-s->atleast || s->eof)
 		return s->inend-s->inptr;
@@ -903,9 +931,17 @@ folder_read(struct _header_scan_state *s)
 		memmove(s->inbuf, s->inptr, inoffset);
 	}
 	if (s->stream) {
-		len = camel_stream_read(s->stream, s->inbuf+inoffset, SCAN_BUF-inoffset);
+		/* content substreams share a seekable source with us, so
+		   it may have been moved since our last read */
+		pos = s->seek + (s->inend - s->inbuf);
+		if (CAMEL_IS_SEEKABLE_STREAM(s->stream)
+		    && camel_seekable_stream_tell((CamelSeekableStream *)s->stream) != pos
+		    && camel_seekable_stream_seek((CamelSeekableStream *)s->stream, pos, CAMEL_STREAM_SET) != pos)
+			len = -1;
+		else
+			len = camel_stream_read(s->stream, s->inbuf+inoffset, s->bufsize-inoffset);
 	} else {
-		len = read(s->fd, s->inbuf+inoffset, SCAN_BUF-inoffset);
+		len = read(s->fd, s->inbuf+inoffset, s->bufsize-inoffset);
 	}
 	r(printf("read %d bytes, offset = %d\n", len, inoffset));
 	if (len>=0) {
@@ -980,11 +1016,22 @@ folder_seek(struct _header_scan_state *s, off_t offset, int whence)
 static void
 folder_push_part(struct _header_scan_state *s, struct _header_scan_stack *h)
 {
+	unsigned char c;
+
 	if (s->parts && s->parts->atleast > h->boundarylenfinal)
 		h->atleast = s->parts->atleast;
 	else
 		h->atleast = MAX(h->boundarylenfinal, 1);
 
+	if (s->parts)
+		memcpy(h->starts, s->parts->starts, sizeof(h->starts));
+	else
+		memset(h->starts, 0, sizeof(h->starts));
+	if (h->boundary && h->boundarylen > 0) {
+		c = h->boundary[0];
+		h->starts[c >> 3] |= 1 << (c & 7);
+	}
+
 	h->parent = s->parts;
 	s->parts = h;
 }
@@ -1056,15 +1103,19 @@ folder_scan_skip_line(struct _header_scan_state *s, GByteArray *save)
 	return -1;		/* not found */
 }
 
-/* TODO: Is there any way to make this run faster?  It gets called a lot ... */
+/* this gets called for every line, so most lines are thrown out on
+   their first character before we look at any boundary */
 static struct _header_scan_stack *
 folder_boundary_check(struct _header_scan_state *s, const char *boundary, int *lastone)
 {
 	struct _header_scan_stack *part;
 	int len = s->inend - boundary; /* make sure we dont access past the buffer */
 
-	h(printf("checking boundary marker upto %d bytes\n", len));
 	part = s->parts;
+	if (part == NULL || !BOUNDARY_START(part, boundary[0]))
+		return NULL;
+
+	h(printf("checking boundary marker upto %d bytes\n", len));
 	while (part) {
 		h(printf("  boundary: %s\n", part->boundary));
 		h(printf("   against: '%.*s'\n", part->boundarylen, boundary));
@@ -1209,8 +1260,7 @@ folder_scan_header(struct _header_scan_state *s, int *lastone)
 				start = inptr;
 
 				/* goto next line/sentinal */
-				while ((*inptr++)!='\n')
-					;
+				inptr = (char *)memchr(inptr, '\n', s->inend - inptr + 1) + 1;
 
 				g_assert(inptr<=s->inend+1);
 
@@ -1348,9 +1398,8 @@ folder_scan_content(struct _header_scan_state *s, int *lastone, char **data, siz
 					goto normal_exit;
 				}
 
-				/* goto the next line */
-				while ((*inptr++)!='\n')
-					;
+				/* goto the next line, there is always the sentinal */
+				inptr = (char *)memchr(inptr, '\n', s->inend - inptr + 1) + 1;
 
 				/* check the sentinal, if we went past the atleast limit, and reset it to there */
 				if (inptr > inend) {
@@ -1426,6 +1475,7 @@ static struct _header_scan_state *
 folder_scan_init(void)
 {
 	struct _header_scan_state *s;
+	const char *bufsize;
 
 	s = g_malloc(sizeof(*s));
 
@@ -1437,7 +1487,10 @@ folder_scan_init(void)
 	s->outptr = s->outbuf;
 	s->outend = s->outbuf+1024;
 
-	s->realbuf = g_malloc0 (SCAN_BUF + SCAN_HEAD*2);
+	s->bufsize = SCAN_BUF;
+	if ((bufsize = getenv("CAMEL_MIME_PARSER_BUFFER")) != NULL)
+		s->bufsize = CLAMP(strtol(bufsize, NULL, 10), SCAN_BUF_MIN, SCAN_BUF_MAX);
+	s->realbuf = g_malloc0 (s->bufsize + SCAN_HEAD*2);
 	s->inbuf = s->realbuf + SCAN_HEAD;
 	s->inptr = s->inbuf;
 	s->inend = s->inbuf;
@@ -1511,6 +1564,13 @@ folder_scan_init_with_stream(struct _header_scan_state *s, CamelStream *stream)
 	s->stream = stream;
 	camel_object_ref((CamelObject *)stream);
 
+	/* offsets into a seekable stream are its own, so they can be
+	   used to setup substreams of it */
+	if (CAMEL_IS_SEEKABLE_STREAM(stream))
+		s->seek = camel_seekable_stream_tell((CamelSeekableStream *)stream);
+	else
+		s->seek = 0;
+
 	return 0;
 }
 
@@ -127,6 +127,7 @@ const char *camel_mime_parser_from_line (CamelMimeParser *parser);
 /* add a processing filter for body contents */
 int camel_mime_parser_filter_add (CamelMimeParser *parser, CamelMimeFilter *filter);
 void camel_mime_parser_filter_remove (CamelMimeParser *parser, int id);
+gboolean camel_mime_parser_filtered (CamelMimeParser *parser);
 
 /* these should be used with caution, because the state will not
    track the seeked position */
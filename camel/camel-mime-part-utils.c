@@ -29,6 +29,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -53,17 +54,54 @@
 #define d(x) /*(printf("%s(%d): ", __FILE__, __LINE__),(x))
 	       #include <stdio.h>*/
 
+/* is the stream a file we can come back to for content any time later? */
+static gboolean
+stream_is_file (CamelStream *stream)
+{
+	while (CAMEL_IS_SEEKABLE_SUBSTREAM (stream))
+		stream = (CamelStream *) ((CamelSeekableSubstream *) stream)->parent_stream;
+
+	return CAMEL_IS_STREAM_FS (stream)
+		&& ((CamelStreamFs *) stream)->fd != -1
+		&& lseek (((CamelStreamFs *) stream)->fd, 0, SEEK_CUR) != (off_t) -1;
+}
+
 /* simple data wrapper */
 static void
 simple_data_wrapper_construct_from_parser (CamelDataWrapper *dw, CamelMimeParser *mp)
 {
 	char *buf;
 	GByteArray *buffer;
-	CamelStream *mem;
+	CamelStream *mem, *source;
+	off_t start, end;
 	size_t len;
 
 	d(printf ("simple_data_wrapper_construct_from_parser()\n"));
 
+	/* if we're reading a file, just remember where the content is
+	   and leave it there, it gets decoded from there when it's
+	   wanted.  A big attachment then costs nothing until then.  The
+	   substream holds a ref on the file stream, so its fd stays open
+	   for as long as the message, or any part of it, is alive.  The
+	   parts share the one file offset, substream reads seek and read
+	   it as one step so they can be decoded from different threads */
+	source = camel_mime_parser_stream (mp);
+	if (source != NULL
+	    && !camel_mime_parser_filtered (mp)
+	    && getenv ("CAMEL_MIME_DISABLE_LAZY") == NULL
+	    && stream_is_file (source)) {
+		start = end = camel_mime_parser_tell (mp);
+		while (camel_mime_parser_step (mp, &buf, &len) != CAMEL_MIME_PARSER_STATE_BODY_END)
+			end += len;
+
+		d(printf("message part left in the source at %ld to %ld\n", (long) start, (long) end));
+
+		source = camel_seekable_substream_new ((CamelSeekableStream *) source, start, end);
+		camel_data_wrapper_construct_from_stream (dw, source);
+		camel_object_unref (source);
+		return;
+	}
+
 	/* read in the entire content */
 	buffer = g_byte_array_new ();
 	while (camel_mime_parser_step (mp, &buf, &len) != CAMEL_MIME_PARSER_STATE_BODY_END) {
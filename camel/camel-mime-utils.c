@@ -92,6 +92,30 @@ static const unsigned char tohex[16] = {
 	'8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
 };
 
+static const char base64_alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* the value of each base64 character, padding and anything else is
+   0xff and left to g_base64_decode_step() */
+static const unsigned char base64_rank[256] = {
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255, 62,255,255,255, 63,
+	 52, 53, 54, 55, 56, 57, 58, 59, 60, 61,255,255,255,255,255,255,
+	255,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,255,255,255,255,255,
+	255, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+	255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+};
+
 /**
  * camel_base64_encode_close:
  * @in: input stream
@@ -113,9 +137,9 @@ camel_base64_encode_close(unsigned char *in, size_t inlen, gboolean break_lines,
 	gsize bytes = 0;
 
 	if (inlen > 0)
-		bytes += g_base64_encode_step (in, inlen, break_lines, (gchar *) out, state, save);
+		bytes += camel_base64_encode_step (in, inlen, break_lines, out, state, save);
 
-	bytes += g_base64_encode_close (break_lines, (gchar *) out, state, save);
+	bytes += g_base64_encode_close (break_lines, (gchar *) out + bytes, state, save);
 
 	return bytes;
 }
@@ -140,7 +164,58 @@ camel_base64_encode_close(unsigned char *in, size_t inlen, gboolean break_lines,
 size_t
 camel_base64_encode_step(unsigned char *in, size_t len, gboolean break_lines, unsigned char *out, int *state, int *save)
 {
-	return g_base64_encode_step (in, len, break_lines, (gchar *) out, state, save);
+	register unsigned char *inptr, *outptr;
+	unsigned char *inend;
+	int already, c1, c2, c3;
+	size_t n;
+
+	inptr = in;
+	inend = in + len;
+	outptr = out;
+
+	/* finish off a group left over from last time */
+	if (((char *) save)[0] != 0 && inptr < inend) {
+		n = MIN (inend - inptr, 3 - ((char *) save)[0]);
+		outptr += g_base64_encode_step (inptr, n, break_lines, (gchar *) outptr, state, save);
+		inptr += n;
+	}
+
+	/* whole groups a line at a time, with the line length kept in
+	   *state the same way g_base64_encode_step() keeps it */
+	if (((char *) save)[0] == 0) {
+		already = *state;
+		while (inend - inptr >= 3) {
+			n = (inend - inptr) / 3;
+			if (break_lines) {
+				n = MIN (n, MAX (19 - already, 1));
+				already += n;
+			}
+
+			while (n--) {
+				c1 = inptr[0];
+				c2 = inptr[1];
+				c3 = inptr[2];
+				inptr += 3;
+				outptr[0] = base64_alphabet[c1 >> 2];
+				outptr[1] = base64_alphabet[((c1 & 0x3) << 4) | (c2 >> 4)];
+				outptr[2] = base64_alphabet[((c2 & 0x0f) << 2) | (c3 >> 6)];
+				outptr[3] = base64_alphabet[c3 & 0x3f];
+				outptr += 4;
+			}
+
+			if (break_lines && already >= 19) {
+				*outptr++ = '\n';
+				already = 0;
+			}
+		}
+		*state = already;
+	}
+
+	/* and save what's left for next time */
+	if (inptr < inend)
+		outptr += g_base64_encode_step (inptr, inend - inptr, break_lines, (gchar *) outptr, state, save);
+
+	return outptr - out;
 }
 
 
@@ -159,7 +234,69 @@ camel_base64_encode_step(unsigned char *in, size_t len, gboolean break_lines, un
 size_t
 camel_base64_decode_step(unsigned char *in, size_t len, unsigned char *out, int *state, unsigned int *save)
 {
-	return g_base64_decode_step ((gchar *) in, len, out, state, save);
+	register unsigned char *inptr, *outptr;
+	unsigned char *inend, *end, *eol, c;
+	guint32 v, q;
+	int i;
+
+	inptr = in;
+	inend = in + len;
+	outptr = out;
+
+	while (inptr < inend) {
+		/* whole groups of 4 at a time, while we're in step */
+		if (*state == 0) {
+			v = *save;
+			while (inptr < inend) {
+				/* line breaks between groups change nothing */
+				if (*inptr == '\n' || *inptr == '\r') {
+					inptr++;
+					continue;
+				}
+
+				if (inend - inptr < 4
+				    || ((base64_rank[inptr[0]] | base64_rank[inptr[1]]
+					 | base64_rank[inptr[2]] | base64_rank[inptr[3]]) & 0xc0))
+					break;
+
+				q = (base64_rank[inptr[0]] << 18) | (base64_rank[inptr[1]] << 12)
+					| (base64_rank[inptr[2]] << 6) | base64_rank[inptr[3]];
+				inptr += 4;
+				outptr[0] = q >> 16;
+				outptr[1] = q >> 8;
+				outptr[2] = q;
+				outptr += 3;
+
+				/* what g_base64_decode_step() would leave in *save */
+				v = (v << 24) | q;
+			}
+			*save = v;
+
+			if (inptr == inend)
+				break;
+		}
+
+		/* the rest of the line has a line break, padding or
+		   rubbish in it, or isn't in step, so let glib do it.
+		   It only knows about padding within one call, so don't
+		   stop it in the middle of a group. */
+		i = ABS (*state) & 3;
+		eol = NULL;
+		for (end = inptr; end < inend; ) {
+			c = *end++;
+			if (c == '\n')
+				eol = end;
+			else if (base64_rank[c] != 0xff || c == '=')
+				i = (i + 1) & 3;
+
+			if (eol && i == 0)
+				break;
+		}
+		outptr += g_base64_decode_step ((gchar *) inptr, end - inptr, outptr, state, save);
+		inptr = end;
+	}
+
+	return outptr - out;
 }
 
 
@@ -524,7 +661,8 @@ size_t
 camel_quoted_encode_step (unsigned char *in, size_t len, unsigned char *out, int *statep, int *save)
 {
 	register guchar *inptr, *outptr, *inend;
-	unsigned char c;
+	unsigned char c, *start;
+	size_t n;
 	register int sofar = *save;  /* keeps track of how many chars on a line */
 	register int last = *statep; /* keeps track if last char to end was a space cr etc */
 
@@ -532,6 +670,49 @@ camel_quoted_encode_step (unsigned char *in, size_t len, unsigned char *out, int
 	inend = in + len;
 	outptr = out;
 	while (inptr < inend) {
+		/* copy runs of characters that don't need encoding straight
+		   through, breaking lines where the loop below would */
+		start = inptr;
+		while (inptr < inend && camel_mime_is_qpsafe (*inptr)) {
+			/* a space or tab is only safe if it can't end the line */
+			if ((*inptr == ' ' || *inptr == '\t')
+			    && (inptr + 1 == inend || !camel_mime_is_qpsafe (inptr[1])
+				|| inptr[1] == ' ' || inptr[1] == '\t'))
+				break;
+			inptr++;
+		}
+
+		if (start < inptr) {
+			if (last != -1) {
+				if (camel_mime_is_qpsafe (last)) {
+					*outptr++ = last;
+					sofar++;
+				} else {
+					*outptr++ = '=';
+					*outptr++ = tohex[(last >> 4) & 0xf];
+					*outptr++ = tohex[last & 0xf];
+					sofar += 3;
+				}
+				last = -1;
+			}
+
+			while (start < inptr) {
+				if (sofar > 74) {
+					*outptr++ = '=';
+					*outptr++ = '\n';
+					sofar = 0;
+				}
+				n = MIN (inptr - start, 75 - sofar);
+				memcpy (outptr, start, n);
+				outptr += n;
+				start += n;
+				sofar += n;
+			}
+
+			if (inptr == inend)
+				break;
+		}
+
 		c = *inptr++;
 		if (c == '\r') {
 			if (last != -1) {
@@ -623,7 +804,7 @@ size_t
 camel_quoted_decode_step(unsigned char *in, size_t len, unsigned char *out, int *savestate, int *saveme)
 {
 	register unsigned char *inptr, *outptr;
-	unsigned char *inend, c;
+	unsigned char *inend, *start, c;
 	int state, save;
 
 	inend = in+len;
@@ -637,23 +818,15 @@ camel_quoted_decode_step(unsigned char *in, size_t len, unsigned char *out, int
 	while (inptr<inend) {
 		switch (state) {
 		case 0:
-			while (inptr<inend) {
-				c = *inptr++;
-				if (c=='=') {
-					state = 1;
-					break;
-				}
-#ifdef CANONICALISE_EOL
-				/*else if (c=='\r') {
-					state = 3;
-				} else if (c=='\n') {
-					*outptr++ = '\r';
-					*outptr++ = c;
-					} */
-#endif
-				else {
-					*outptr++ = c;
-				}
+			/* everything up to the next '=' is copied as is */
+			if ((start = memchr (inptr, '=', inend - inptr)) == NULL)
+				start = inend;
+			memmove (outptr, inptr, start - inptr);
+			outptr += start - inptr;
+			inptr = start;
+			if (inptr < inend) {
+				inptr++;
+				state = 1;
 			}
 			break;
 		case 1:
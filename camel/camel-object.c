@@ -151,6 +151,12 @@ CamelType camel_interface_type;
 #define CLASS_UNLOCK(k) (g_mutex_unlock((((CamelObjectClass *)k)->lock)))
 #define REF_LOCK() (g_mutex_lock(ref_lock))
 #define REF_UNLOCK() (g_mutex_unlock(ref_lock))
+/* CamelObject.ref_count has the count in its low 24 bits, and the
+   CamelObjectFlags above it */
+#define REF_COUNT_MASK (0x00ffffff)
+#define REF_FLAGS_SHIFT (24)
+#define REF_COUNT(o) (g_atomic_int_get(&(o)->ref_count) & REF_COUNT_MASK)
+
 #define TYPE_LOCK() (g_static_rec_mutex_lock(&type_lock))
 #define TYPE_UNLOCK() (g_static_rec_mutex_unlock(&type_lock))
 
@@ -215,7 +221,6 @@ cobject_init(CamelObject *o, CamelObjectClass *klass)
 	o->klass = klass;
 	o->magic = CAMEL_OBJECT_MAGIC;
 	o->ref_count = 1;
-	o->flags = 0;
 }
 
 static void
@@ -223,7 +228,7 @@ cobject_finalise(CamelObject *o)
 {
 	/*printf("%p: finalise %s\n", o, o->klass->name);*/
 
-	if (o->ref_count == 0)
+	if (REF_COUNT(o) == 0)
 		return;
 
 	camel_object_free_hooks(o);
@@ -863,12 +868,8 @@ camel_object_ref(void *vo)
 
 	g_return_if_fail(CAMEL_IS_OBJECT(o));
 
-	REF_LOCK();
-
-	o->ref_count++;
-	d(printf("%p: ref %s(%d)\n", o, o->klass->name, o->ref_count));
-
-	REF_UNLOCK();
+	g_atomic_int_inc(&o->ref_count);
+	d(printf("%p: ref %s(%d)\n", o, o->klass->name, REF_COUNT(o)));
 }
 
 void
@@ -877,30 +878,49 @@ camel_object_unref(void *vo)
 	register CamelObject *o = vo;
 	register CamelObjectClass *klass, *k;
 	CamelHookList *hooks = NULL;
+	int count, word;
 
 	g_return_if_fail(CAMEL_IS_OBJECT(o));
 
 	klass = o->klass;
 
+	/* Only the last unref needs the lock, so that the object can't
+	   be found in a bag after it has gone.  Bags only add refs with
+	   the lock held, so while there are others we can just drop ours. */
+	for (;;) {
+		word = g_atomic_int_get(&o->ref_count);
+		count = word & REF_COUNT_MASK;
+		if (count <= 1)
+			break;
+		if (g_atomic_int_compare_and_exchange(&o->ref_count, word, word - 1)) {
+			d(printf("%p: unref %s(%d)\n", o, o->klass->name, count - 1));
+			return;
+		}
+	}
+
 	if (o->hooks)
 		hooks = camel_object_get_hooks(o);
 
 	REF_LOCK();
 
-	o->ref_count--;
+	d(printf("%p: unref %s(%d)\n", o, o->klass->name, REF_COUNT(o) - 1));
 
-	d(printf("%p: unref %s(%d)\n", o, o->klass->name, o->ref_count));
+	/* drop the ref, and mark it for destruction with the same change
+	   if that was the last one */
+	do {
+		word = g_atomic_int_get(&o->ref_count);
+		count = (word & REF_COUNT_MASK) - 1;
+	} while (!g_atomic_int_compare_and_exchange(&o->ref_count, word,
+						    count == 0 ? (word - 1) | (CAMEL_OBJECT_DESTROY << REF_FLAGS_SHIFT) : word - 1));
 
-	if (o->ref_count > 0
-	    || (o->flags & CAMEL_OBJECT_DESTROY)) {
+	if (count != 0
+	    || (word >> REF_FLAGS_SHIFT) & CAMEL_OBJECT_DESTROY) {
 		REF_UNLOCK();
 		if (hooks)
 			camel_object_unget_hooks(o);
 		return;
 	}
 
-	o->flags |= CAMEL_OBJECT_DESTROY;
-
 	if (hooks)
 		camel_object_bag_remove_unlocked(NULL, o, hooks);
 
@@ -1911,7 +1931,7 @@ object_class_dump_tree_rec(CamelType root, int depth)
 #ifdef CAMEL_OBJECT_TRACK_INSTANCES
 		o = root->instances;
 		while (o) {
-			printf("%s instance %p [%d]\n", p, o, o->ref_count);
+			printf("%s instance %p [%d]\n", p, o, REF_COUNT(o));
 			/* todo: should lock hooks while it scans them */
 			if (o->hooks) {
 				CamelHookPair *pair = o->hooks->list;
@@ -2096,8 +2116,8 @@ camel_object_bag_get(CamelObjectBag *bag, const void *key)
 	if (o) {
 		b(printf("object bag get '%s' = %p\n", (char *)key, o));
 
-		/* we use the same lock as the refcount */
-		o->ref_count++;
+		/* bags only ref with the lock held, see camel_object_unref() */
+		g_atomic_int_inc(&o->ref_count);
 	} else {
 		struct _CamelObjectBagKey *res = bag->reserved;
 
@@ -2119,7 +2139,7 @@ camel_object_bag_get(CamelObjectBag *bag, const void *key)
 			/* re-check if it slipped in */
 			o = g_hash_table_lookup(bag->object_table, key);
 			if (o)
-				o->ref_count++;
+				g_atomic_int_inc(&o->ref_count);
 
 			b(printf("object bag get '%s', finished waiting, got %p\n", (char *)key, o));
 
@@ -2159,8 +2179,8 @@ camel_object_bag_peek(CamelObjectBag *bag, const void *key)
 
 	o = g_hash_table_lookup(bag->object_table, key);
 	if (o) {
-		/* we use the same lock as the refcount */
-		o->ref_count++;
+		/* bags only ref with the lock held, see camel_object_unref() */
+		g_atomic_int_inc(&o->ref_count);
 	}
 
 	REF_UNLOCK();
@@ -2195,7 +2215,7 @@ camel_object_bag_reserve(CamelObjectBag *bag, const void *key)
 
 	o = g_hash_table_lookup(bag->object_table, key);
 	if (o) {
-		o->ref_count++;
+		g_atomic_int_inc(&o->ref_count);
 	} else {
 		struct _CamelObjectBagKey *res = bag->reserved;
 
@@ -2215,7 +2235,7 @@ camel_object_bag_reserve(CamelObjectBag *bag, const void *key)
 			o = g_hash_table_lookup(bag->object_table, key);
 			if (o) {
 				b(printf("finished wait, someone else created '%s' = %p\n", (char *)key, o));
-				o->ref_count++;
+				g_atomic_int_inc(&o->ref_count);
 				/* in which case we dont need to reserve the bag either */
 				res->owner = pthread_self();
 				res->have_owner = TRUE;
@@ -2296,7 +2316,7 @@ static void
 save_bag(void *key, CamelObject *o, GPtrArray *list)
 {
 	/* we have the refcount lock already */
-	o->ref_count++;
+	g_atomic_int_inc(&o->ref_count);
 	g_ptr_array_add(list, o);
 }
 
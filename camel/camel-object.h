@@ -123,8 +123,10 @@ struct _CamelObject {
 	/* current hooks on this object */
 	struct _CamelHookList *hooks;
 
-	guint32 ref_count:24;
-	guint32 flags:8;
+	/* The reference count, with the CamelObjectFlags in the top 8
+	   bits.  One word, where the ref_count:24 and flags:8 bitfields
+	   were, so both can be changed atomically */
+	volatile gint ref_count;
 
 #ifdef CAMEL_OBJECT_TRACK_INSTANCES
 	struct _CamelObject *next, *prev;
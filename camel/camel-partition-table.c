@@ -142,6 +142,19 @@ static camel_hash_t hash_key(const char *key)
 	return hash;
 }
 
+/**
+ * camel_partition_table_hash:
+ * @key:
+ *
+ * Return value: the hash partition tables file @key under.  Adding
+ * keys in hash order touches each partition block in turn.
+ **/
+camel_hash_t
+camel_partition_table_hash(const char *key)
+{
+	return hash_key(key);
+}
+
 /* Call with lock held */
 static CamelBlock *find_partition(CamelPartitionTable *cpi, camel_hash_t id, int *indexp)
 {
@@ -153,7 +166,7 @@ static CamelBlock *find_partition(CamelPartitionTable *cpi, camel_hash_t id, int
 	/* first, find the block this key might be in, then binary search the block */
 	bl = (CamelBlock *)cpi->partition.head;
 	while (bl->next) {
-		ptb = (CamelPartitionMapBlock *)&bl->data;
+		ptb = (CamelPartitionMapBlock *)bl->data;
 		part = ptb->partition;
 		if (ptb->used > 0 && id <= part[ptb->used-1].hashid) {
 			index = ptb->used/2;
@@ -208,7 +221,7 @@ CamelPartitionTable *camel_partition_table_new(struct _CamelBlockFile *bs, camel
 		if (block == NULL)
 			goto fail;
 
-		ptb = (CamelPartitionMapBlock *)&block->data;
+		ptb = (CamelPartitionMapBlock *)block->data;
 
 		d(printf("Adding partition block, used = %d, hashid = %08x\n", ptb->used, ptb->partition[0].hashid));
 
@@ -219,7 +232,7 @@ CamelPartitionTable *camel_partition_table_new(struct _CamelBlockFile *bs, camel
 				camel_block_file_unref_block(bs, block);
 				goto fail;
 			}
-			kb = (CamelPartitionKeyBlock *)&pblock->data;
+			kb = (CamelPartitionKeyBlock *)pblock->data;
 			kb->used = 0;
 			ptb->used = 1;
 			ptb->partition[0].hashid = 0xffffffff;
@@ -288,14 +301,14 @@ camel_key_t camel_partition_table_lookup(CamelPartitionTable *cpi, const char *k
 		CAMEL_PARTITION_TABLE_UNLOCK(cpi, lock);
 		return 0;
 	}
-	ptb = (CamelPartitionMapBlock *)&ptblock->data;
+	ptb = (CamelPartitionMapBlock *)ptblock->data;
 	block = camel_block_file_get_block(cpi->blocks, ptb->partition[index].blockid);
 	if (block == NULL) {
 		CAMEL_PARTITION_TABLE_UNLOCK(cpi, lock);
 		return 0;
 	}
 
-	pkb = (CamelPartitionKeyBlock *)&block->data;
+	pkb = (CamelPartitionKeyBlock *)block->data;
 
 	/* What to do about duplicate hash's? */
 	for (i=0;i<pkb->used;i++) {
@@ -331,13 +344,13 @@ void camel_partition_table_remove(CamelPartitionTable *cpi, const char *key)
 		CAMEL_PARTITION_TABLE_UNLOCK(cpi, lock);
 		return;
 	}
-	ptb = (CamelPartitionMapBlock *)&ptblock->data;
+	ptb = (CamelPartitionMapBlock *)ptblock->data;
 	block = camel_block_file_get_block(cpi->blocks, ptb->partition[index].blockid);
 	if (block == NULL) {
 		CAMEL_PARTITION_TABLE_UNLOCK(cpi, lock);
 		return;
 	}
-	pkb = (CamelPartitionKeyBlock *)&block->data;
+	pkb = (CamelPartitionKeyBlock *)block->data;
 
 	/* What to do about duplicate hash's? */
 	for (i=0;i<pkb->used;i++) {
@@ -397,13 +410,13 @@ camel_partition_table_add(CamelPartitionTable *cpi, const char *key, camel_key_t
 		CAMEL_PARTITION_TABLE_UNLOCK(cpi, lock);
 		return -1;
 	}
-	ptb = (CamelPartitionMapBlock *)&ptblock->data;
+	ptb = (CamelPartitionMapBlock *)ptblock->data;
 	block = camel_block_file_get_block(cpi->blocks, ptb->partition[index].blockid);
 	if (block == NULL) {
 		CAMEL_PARTITION_TABLE_UNLOCK(cpi, lock);
 		return -1;
 	}
-	kb = (CamelPartitionKeyBlock *)&block->data;
+	kb = (CamelPartitionKeyBlock *)block->data;
 
 	/* TODO: Keep the key array in sorted order, cheaper lookups and split operation */
 
@@ -423,7 +436,7 @@ camel_partition_table_add(CamelPartitionTable *cpi, const char *key, camel_key_t
 			pblock = camel_block_file_get_block(cpi->blocks, ptb->partition[index-1].blockid);
 			if (pblock == NULL)
 				goto fail;
-			pkb = (CamelPartitionKeyBlock *)&pblock->data;
+			pkb = (CamelPartitionKeyBlock *)pblock->data;
 		}
 		if (index < (ptb->used-1)) {
 			nblock = camel_block_file_get_block(cpi->blocks, ptb->partition[index+1].blockid);
@@ -432,7 +445,7 @@ camel_partition_table_add(CamelPartitionTable *cpi, const char *key, camel_key_t
 					camel_block_file_unref_block(cpi->blocks, pblock);
 				goto fail;
 			}
-			nkb = (CamelPartitionKeyBlock *)&nblock->data;
+			nkb = (CamelPartitionKeyBlock *)nblock->data;
 		}
 
 		if (pblock && pkb->used < KEY_SIZE) {
@@ -471,7 +484,7 @@ camel_partition_table_add(CamelPartitionTable *cpi, const char *key, camel_key_t
 				camel_block_file_detach_block(cpi->blocks, ptnblock);
 
 				/* split block and link on-disk, always sorted */
-				ptn = (CamelPartitionMapBlock *)&ptnblock->data;
+				ptn = (CamelPartitionMapBlock *)ptnblock->data;
 				ptn->next = ptb->next;
 				ptb->next = ptnblock->id;
 				len = ptb->used / 2;
@@ -517,7 +530,7 @@ camel_partition_table_add(CamelPartitionTable *cpi, const char *key, camel_key_t
 			}
 			ptb->used++;
 
-			newkb = (CamelPartitionKeyBlock *)&newblock->data;
+			newkb = (CamelPartitionKeyBlock *)newblock->data;
 			newkb->used = 0;
 			newindex = index+1;
 
@@ -529,7 +542,7 @@ camel_partition_table_add(CamelPartitionTable *cpi, const char *key, camel_key_t
 			if (pblock)
 				camel_block_file_unref_block(cpi->blocks, pblock);
 		} else {
-			newkb = (CamelPartitionKeyBlock *)&newblock->data;
+			newkb = (CamelPartitionKeyBlock *)newblock->data;
 
 			if (newblock == pblock) {
 				if (nblock)
@@ -669,7 +682,7 @@ camel_key_table_new(CamelBlockFile *bs, camel_block_t root)
 		ki = NULL;
 	} else {
 		camel_block_file_detach_block(bs, ki->root_block);
-		ki->root = (CamelKeyRootBlock *)&ki->root_block->data;
+		ki->root = (CamelKeyRootBlock *)ki->root_block->data;
 
 		k(printf("Opening key index\n"));
 		k(printf(" first %u\n last %u\n free %u\n", ki->root->first, ki->root->last, ki->root->free));
@@ -717,7 +730,7 @@ camel_key_table_add(CamelKeyTable *ki, const char *key, camel_block_t data, unsi
 			goto fail;
 	}
 
-	kblast = (CamelKeyBlock *)&last->data;
+	kblast = (CamelKeyBlock *)last->data;
 
 	if (kblast->used >= 127)
 		goto fail;
@@ -735,7 +748,7 @@ camel_key_table_add(CamelKeyTable *ki, const char *key, camel_block_t data, unsi
 				camel_block_file_unref_block(ki->blocks, last);
 				goto fail;
 			}
-			kbnext = (CamelKeyBlock *)&next->data;
+			kbnext = (CamelKeyBlock *)next->data;
 			kblast->next = next->id;
 			ki->root->last = next->id;
 			d(printf("adding new block, first = %u, last = %u\n", ki->root->first, ki->root->last));
@@ -800,7 +813,7 @@ camel_key_table_set_data(CamelKeyTable *ki, camel_key_t keyid, camel_block_t dat
 	bl = camel_block_file_get_block(ki->blocks, blockid);
 	if (bl == NULL)
 		return;
-	kb = (CamelKeyBlock *)&bl->data;
+	kb = (CamelKeyBlock *)bl->data;
 
 	CAMEL_KEY_TABLE_LOCK(ki, lock);
 
@@ -832,7 +845,7 @@ camel_key_table_set_flags(CamelKeyTable *ki, camel_key_t keyid, unsigned int fla
 	bl = camel_block_file_get_block(ki->blocks, blockid);
 	if (bl == NULL)
 		return;
-	kb = (CamelKeyBlock *)&bl->data;
+	kb = (CamelKeyBlock *)bl->data;
 
 #if 0
 	g_assert(kb->used < 127); /* this should be more accurate */
@@ -880,7 +893,7 @@ camel_key_table_lookup(CamelKeyTable *ki, camel_key_t keyid, char **keyp, unsign
 	if (bl == NULL)
 		return 0;
 
-	kb = (CamelKeyBlock *)&bl->data;
+	kb = (CamelKeyBlock *)bl->data;
 
 #if 0
 	g_assert(kb->used < 127); /* this should be more accurate */
@@ -953,7 +966,7 @@ camel_key_table_next(CamelKeyTable *ki, camel_key_t next, char **keyp, unsigned
 			return 0;
 		}
 
-		kb = (CamelKeyBlock *)&bl->data;
+		kb = (CamelKeyBlock *)bl->data;
 
 		/* see if we need to goto the next block */
 		if (index >= kb->used) {
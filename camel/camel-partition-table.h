@@ -90,6 +90,7 @@ int camel_partition_table_sync(CamelPartitionTable *cpi);
 int camel_partition_table_add(CamelPartitionTable *cpi, const char *key, camel_key_t keyid);
 camel_key_t camel_partition_table_lookup(CamelPartitionTable *cpi, const char *key);
 void camel_partition_table_remove(CamelPartitionTable *cpi, const char *key);
+camel_hash_t camel_partition_table_hash(const char *key);
 
 /* ********************************************************************** */
 
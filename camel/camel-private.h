@@ -124,11 +124,26 @@ struct _CamelFolderSummaryPrivate {
 
 	struct _CamelIndex *index;
 
+	struct _CamelFolderSummaryMap *map;	/* summary file being loaded, only valid inside load */
+	GSList *maps;				/* files loaded which lazy infos still point into */
+	int map_hold;				/* loads and saves reading the maps, none are freed */
+	GHashTable *records;			/* lazy info -> its mapped record, until materialised, under map_lock */
+	struct _CamelFolderSummaryPool *pool;	/* string pool being written, only valid inside save */
+	long pool_start;			/* file offset of pool */
+	off_t meta_offset;			/* record offset for meta_message_info_save, only valid inside save */
+	gboolean meta_legacy;			/* the separate meta-summary file has been read, and needs removing once saved */
+
+	GHashTable *journal;		/* uid -> JOURNAL_* changes not yet saved */
+	gboolean journal_invalid;	/* something changed which can't be journalled */
+	guint32 journal_len;		/* length of the valid part of the journal, 0 if none */
+	guint32 base_len;		/* size and inode of the summary file the journal */
+	guint32 base_ino;		/* applies to, base_len is 0 if it can't have one */
+
 	GMutex *summary_lock;	/* for the summary hashtable/array */
 	GMutex *io_lock;	/* load/save lock, for access to saved_count, etc */
 	GMutex *filter_lock;	/* for accessing any of the filtering/indexing stuff, since we share them */
 	GMutex *alloc_lock;	/* for setting up and using allocators */
-	GMutex *ref_lock;	/* for reffing/unreffing messageinfo's ALWAYS obtain before summary_lock */
+	GMutex *map_lock;	/* for materialising lazy messageinfo's from a map */
 };
 
 #define CAMEL_SUMMARY_LOCK(f, l) \
@@ -29,6 +29,11 @@
 
 static CamelSeekableStreamClass *parent_class = NULL;
 
+/* Every read or write seeks the parent first, so substreams of one
+   parent used from different threads must not interleave the two.
+   Recursive, as the parent can be a substream too. */
+static GStaticRecMutex parent_lock = G_STATIC_REC_MUTEX_INIT;
+
 /* Returns the class for a CamelSeekableSubStream */
 #define CSS_CLASS(so) CAMEL_SEEKABLE_SUBSTREAM_CLASS (CAMEL_OBJECT(so)->klass)
 
@@ -107,6 +112,10 @@ camel_seekable_substream_get_type (void)
  * the current position of @parent_stream. After the substream has been
  * closed, @parent_stream will stabilize again.
  *
+ * Substreams of the same parent may be read from different threads,
+ * each read seeks and reads the parent as one step.  Reading the
+ * parent directly at the same time is still up to the caller.
+ *
  * Return value: the substream
  **/
 CamelStream *
@@ -155,8 +164,11 @@ stream_read (CamelStream *stream, char *buffer, size_t n)
 
 	parent = seekable_substream->parent_stream;
 
+	g_static_rec_mutex_lock (&parent_lock);
+
 	/* Go to our position in the parent stream. */
 	if (!parent_reset (seekable_substream, parent)) {
+		g_static_rec_mutex_unlock (&parent_lock);
 		stream->eos = TRUE;
 		return 0;
 	}
@@ -166,12 +178,15 @@ stream_read (CamelStream *stream, char *buffer, size_t n)
 		n = MIN (seekable_stream->bound_end -  seekable_stream->position, n);
 
 	if (n == 0) {
+		g_static_rec_mutex_unlock (&parent_lock);
 		stream->eos = TRUE;
 		return 0;
 	}
 
 	v = camel_stream_read (CAMEL_STREAM (parent), buffer, n);
 
+	g_static_rec_mutex_unlock (&parent_lock);
+
 	/* ignore <0 - it's an error, let the caller deal */
 	if (v > 0)
 		seekable_stream->position += v;
@@ -192,8 +207,11 @@ stream_write (CamelStream *stream, const char *buffer, size_t n)
 
 	parent = seekable_substream->parent_stream;
 
+	g_static_rec_mutex_lock (&parent_lock);
+
 	/* Go to our position in the parent stream. */
 	if (!parent_reset (seekable_substream, parent)) {
+		g_static_rec_mutex_unlock (&parent_lock);
 		stream->eos = TRUE;
 		return 0;
 	}
@@ -203,12 +221,15 @@ stream_write (CamelStream *stream, const char *buffer, size_t n)
 		n = MIN (seekable_stream->bound_end -  seekable_stream->position, n);
 
 	if (n == 0) {
+		g_static_rec_mutex_unlock (&parent_lock);
 		stream->eos = TRUE;
 		return 0;
 	}
 
 	v = camel_stream_write((CamelStream *)parent, buffer, n);
 
+	g_static_rec_mutex_unlock (&parent_lock);
+
 	/* ignore <0 - it's an error, let the caller deal */
 	if (v > 0)
 		seekable_stream->position += v;
@@ -244,10 +265,14 @@ eos (CamelStream *stream)
 		eos = TRUE;
 	else {
 		parent = seekable_substream->parent_stream;
-		if (!parent_reset (seekable_substream, parent))
+		g_static_rec_mutex_lock (&parent_lock);
+		if (!parent_reset (seekable_substream, parent)) {
+			g_static_rec_mutex_unlock (&parent_lock);
 			return TRUE;
+		}
 
 		eos = camel_stream_eos (CAMEL_STREAM (parent));
+		g_static_rec_mutex_unlock (&parent_lock);
 		if (!eos && (seekable_stream->bound_end != CAMEL_STREAM_UNBOUND)) {
 			eos = seekable_stream->position >= seekable_stream->bound_end;
 		}
@@ -0,0 +1,259 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* camel-stream-deflate.c : deflate compressed stream */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU Lesser General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "camel-stream-deflate.h"
+
+#define d(x)
+
+/* Both directions are raw deflate streams (no zlib header), as used
+   by IMAP COMPRESS=DEFLATE (rfc4978) and NNTP COMPRESS DEFLATE
+   (rfc8054).  Every write is sync flushed so a command reaches the
+   server whole, the way it would without compression. */
+
+#define INFLATE_SIZE (8192)
+#define DEFLATE_SIZE (8192)
+
+struct _CamelStreamDeflatePrivate {
+	z_stream inflate;
+	z_stream deflate;
+
+	unsigned char *inbuf;	/* INFLATE_SIZE compressed bytes read */
+	unsigned char *outbuf;	/* DEFLATE_SIZE compressed bytes to write */
+
+	guint inflate_init:1;
+	guint deflate_init:1;
+	guint inflate_full:1;	/* the last inflate() filled the buffer */
+};
+
+#define _PRIVATE(o) (((CamelStreamDeflate *)(o))->priv)
+
+static CamelStreamClass *parent_class = NULL;
+
+static ssize_t
+stream_read (CamelStream *stream, char *buffer, size_t n)
+{
+	CamelStreamDeflate *ds = (CamelStreamDeflate *) stream;
+	struct _CamelStreamDeflatePrivate *p = _PRIVATE (ds);
+	z_stream *z = &p->inflate;
+	ssize_t nread;
+	int retval;
+
+	if (n == 0)
+		return 0;
+
+	z->next_out = (unsigned char *) buffer;
+	z->avail_out = n;
+
+	/* a block may only hold a flush marker, so keep reading until
+	   there is something to return.  zlib may still have output left
+	   over from the last read that filled the buffer, with no input
+	   left, so only read more once inflate() can't make progress */
+	do {
+		if (z->avail_in == 0 && !p->inflate_full) {
+			nread = camel_stream_read (ds->source, (char *) p->inbuf, INFLATE_SIZE);
+			if (nread <= 0) {
+				if (nread == 0)
+					stream->eos = TRUE;
+				return nread;
+			}
+
+			z->next_in = p->inbuf;
+			z->avail_in = nread;
+		}
+
+		retval = inflate (z, Z_SYNC_FLUSH);
+		p->inflate_full = retval == Z_OK && z->avail_out == 0;
+		if (retval == Z_STREAM_END) {
+			stream->eos = TRUE;
+			break;
+		} else if (retval != Z_OK && retval != Z_BUF_ERROR) {
+			d(printf ("inflate failed: %d: %s\n", retval, z->msg ? z->msg : ""));
+			errno = EIO;
+			return -1;
+		}
+	} while (z->avail_out == n);
+
+	return n - z->avail_out;
+}
+
+static ssize_t
+stream_write (CamelStream *stream, const char *buffer, size_t n)
+{
+	CamelStreamDeflate *ds = (CamelStreamDeflate *) stream;
+	struct _CamelStreamDeflatePrivate *p = _PRIVATE (ds);
+	z_stream *z = &p->deflate;
+	size_t len;
+	int retval;
+
+	z->next_in = (unsigned char *) buffer;
+	z->avail_in = n;
+
+	do {
+		z->next_out = p->outbuf;
+		z->avail_out = DEFLATE_SIZE;
+
+		retval = deflate (z, Z_SYNC_FLUSH);
+		if (retval != Z_OK && retval != Z_BUF_ERROR) {
+			d(printf ("deflate failed: %d: %s\n", retval, z->msg ? z->msg : ""));
+			errno = EIO;
+			return -1;
+		}
+
+		len = DEFLATE_SIZE - z->avail_out;
+		if (len > 0 && camel_stream_write (ds->source, (char *) p->outbuf, len) == -1)
+			return -1;
+	} while (z->avail_out == 0);
+
+	return n;
+}
+
+static int
+stream_flush (CamelStream *stream)
+{
+	return camel_stream_flush (((CamelStreamDeflate *) stream)->source);
+}
+
+static int
+stream_close (CamelStream *stream)
+{
+	return camel_stream_close (((CamelStreamDeflate *) stream)->source);
+}
+
+static gboolean
+stream_eos (CamelStream *stream)
+{
+	CamelStreamDeflate *ds = (CamelStreamDeflate *) stream;
+
+	return stream->eos || (_PRIVATE (ds)->inflate.avail_in == 0 && !_PRIVATE (ds)->inflate_full
+			       && camel_stream_eos (ds->source));
+}
+
+static void
+camel_stream_deflate_class_init (CamelStreamDeflateClass *klass)
+{
+	CamelStreamClass *camel_stream_class = (CamelStreamClass *) klass;
+
+	parent_class = CAMEL_STREAM_CLASS (camel_type_get_global_classfuncs (camel_stream_get_type ()));
+
+	camel_stream_class->read = stream_read;
+	camel_stream_class->write = stream_write;
+	camel_stream_class->flush = stream_flush;
+	camel_stream_class->close = stream_close;
+	camel_stream_class->eos = stream_eos;
+}
+
+static void
+camel_stream_deflate_init (CamelStreamDeflate *ds)
+{
+	struct _CamelStreamDeflatePrivate *p;
+
+	_PRIVATE (ds) = p = g_malloc0 (sizeof (*p));
+	p->inbuf = g_malloc (INFLATE_SIZE);
+	p->outbuf = g_malloc (DEFLATE_SIZE);
+}
+
+static void
+camel_stream_deflate_finalize (CamelObject *object)
+{
+	CamelStreamDeflate *ds = (CamelStreamDeflate *) object;
+	struct _CamelStreamDeflatePrivate *p = _PRIVATE (ds);
+
+	if (p->inflate_init)
+		inflateEnd (&p->inflate);
+	if (p->deflate_init)
+		deflateEnd (&p->deflate);
+
+	g_free (p->inbuf);
+	g_free (p->outbuf);
+	g_free (p);
+
+	if (ds->source)
+		camel_object_unref (ds->source);
+}
+
+CamelType
+camel_stream_deflate_get_type (void)
+{
+	static CamelType type = CAMEL_INVALID_TYPE;
+
+	if (type == CAMEL_INVALID_TYPE) {
+		type = camel_type_register (camel_stream_get_type (),
+					    "CamelStreamDeflate",
+					    sizeof (CamelStreamDeflate),
+					    sizeof (CamelStreamDeflateClass),
+					    (CamelObjectClassInitFunc) camel_stream_deflate_class_init,
+					    NULL,
+					    (CamelObjectInitFunc) camel_stream_deflate_init,
+					    (CamelObjectFinalizeFunc) camel_stream_deflate_finalize);
+	}
+
+	return type;
+}
+
+/**
+ * camel_stream_deflate_new:
+ * @source: stream to compress to and decompress from
+ *
+ * Create a new stream which compresses everything written to it into
+ * @source, and decompresses everything read from @source, as raw
+ * deflate data.  Every write is flushed through to @source.
+ *
+ * This is the stream layer for IMAP COMPRESS=DEFLATE and NNTP
+ * COMPRESS DEFLATE, which start compressing both ways straight after
+ * the command completes.
+ *
+ * Returns a new #CamelStreamDeflate, or %NULL if zlib could not be
+ * initialised.
+ **/
+CamelStream *
+camel_stream_deflate_new (CamelStream *source)
+{
+	CamelStreamDeflate *ds;
+	struct _CamelStreamDeflatePrivate *p;
+
+	g_return_val_if_fail (CAMEL_IS_STREAM (source), NULL);
+
+	ds = (CamelStreamDeflate *) camel_object_new (camel_stream_deflate_get_type ());
+	ds->source = source;
+	camel_object_ref (source);
+
+	p = _PRIVATE (ds);
+	if (inflateInit2 (&p->inflate, -MAX_WBITS) != Z_OK) {
+		camel_object_unref (ds);
+		return NULL;
+	}
+	p->inflate_init = TRUE;
+
+	if (deflateInit2 (&p->deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+		camel_object_unref (ds);
+		return NULL;
+	}
+	p->deflate_init = TRUE;
+
+	return (CamelStream *) ds;
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* camel-stream-deflate.h : deflate compressed stream */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU Lesser General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+
+#ifndef _CAMEL_STREAM_DEFLATE_H
+#define _CAMEL_STREAM_DEFLATE_H
+
+#include <camel/camel-stream.h>
+
+#define CAMEL_STREAM_DEFLATE(obj)         CAMEL_CHECK_CAST (obj, camel_stream_deflate_get_type (), CamelStreamDeflate)
+#define CAMEL_STREAM_DEFLATE_CLASS(klass) CAMEL_CHECK_CLASS_CAST (klass, camel_stream_deflate_get_type (), CamelStreamDeflateClass)
+#define CAMEL_IS_STREAM_DEFLATE(obj)      CAMEL_CHECK_TYPE (obj, camel_stream_deflate_get_type ())
+
+G_BEGIN_DECLS
+
+typedef struct _CamelStreamDeflateClass CamelStreamDeflateClass;
+
+struct _CamelStreamDeflate {
+	CamelStream parent;
+
+	CamelStream *source;
+
+	struct _CamelStreamDeflatePrivate *priv;
+};
+
+struct _CamelStreamDeflateClass {
+	CamelStreamClass parent_class;
+};
+
+CamelType			camel_stream_deflate_get_type	(void);
+
+CamelStream            *camel_stream_deflate_new		(CamelStream *source);
+
+G_END_DECLS
+
+#endif /* ! _CAMEL_STREAM_DEFLATE_H */
@@ -39,8 +39,12 @@
 #include <libedataserver/e-memory.h>
 #include <libedataserver/e-msgport.h>
 
+#include <glib/gi18n-lib.h>
+
 #include "camel-block-file.h"
+#include "camel-file-utils.h"
 #include "camel-object.h"
+#include "camel-operation.h"
 #include "camel-partition-table.h"
 #include "camel-private.h"
 #include "camel-text-index.h"
@@ -110,7 +114,75 @@ CamelTextIndexKeyCursor *camel_text_index_key_cursor_new(CamelTextIndex *idx, Ca
 /* ********************************************************************** */
 
 #define CAMEL_TEXT_INDEX_VERSION "TEXT.000"
-#define CAMEL_TEXT_INDEX_KEY_VERSION "KEYS.000"
+#define CAMEL_TEXT_INDEX_KEY_VERSION "KEYS.001"
+/* key files written before records were packed, read and appended to
+   raw until the index is next compressed */
+#define CAMEL_TEXT_INDEX_KEY_VERSION_RAW "KEYS.000"
+
+/* the index is read and written 4 blocks at a time */
+#define CAMEL_TEXT_INDEX_IO_SIZE (4096)
+
+/* bulk loading: default memory for a run, runs merged at once, and
+   names per key file entry */
+#define CAMEL_TEXT_INDEX_BULK_RUN (8*1024*1024)
+#define CAMEL_TEXT_INDEX_BULK_FANIN (32)
+#define CAMEL_TEXT_INDEX_BULK_KEYS (256)
+
+/* Bulk loading collects (word, name) postings in memory instead of
+   adding them word by word.  When a run fills up it is sorted by
+   word hash then word and written to a temporary file.  At the next
+   sync the runs are merged, so each word is written once, with
+   its names in CAMEL_TEXT_INDEX_BULK_KEYS lots, and the word
+   partition table is updated in hash order. */
+struct _CamelTextIndexBulk {
+	size_t limit;		/* memory for a run */
+	size_t size;		/* memory used by the current run */
+	EMemPool *pool;		/* struct _bulk_word's of the current run */
+	GHashTable *words;	/* word -> struct _bulk_word */
+	GArray *postings;	/* struct _bulk_posting */
+	GPtrArray *runs;	/* FILE *'s of sorted runs */
+	guint32 serial;
+};
+
+struct _bulk_word {
+	camel_hash_t hash;
+	char word[1];
+};
+
+struct _bulk_posting {
+	struct _bulk_word *word;
+	camel_key_t nameid;
+};
+
+/* a sorted run being merged */
+struct _bulk_cursor {
+	FILE *fp;
+	camel_hash_t hash;
+	char *word;
+	guint32 count;
+	guint32 size;
+	camel_key_t *names;
+};
+
+/* Compaction copies the index to a new one without holding the index
+   lock, while the old one is still being searched and added to.
+   Names and words added meanwhile are picked up by carrying on from
+   the last keys copied, the rest is logged here.  Only catching up
+   with these and swapping the files over is done locked. */
+struct _CamelTextIndexCompact {
+	CamelTextIndex *newidx;
+	GHashTable *remap;	/* old name keyid -> new name keyid */
+	GHashTable *heads;	/* old word keyid -> posting list head copied */
+	GHashTable *dirty;	/* old word keyids given new postings */
+	GArray *deleted;	/* old name keyids deleted */
+	camel_key_t lastname;
+	camel_key_t lastword;
+	camel_key_t namebound;	/* lastname and lastword when catching up started */
+	camel_key_t wordbound;
+	guint32 done, total;
+	int pc;
+	int error;
+};
 
 struct _CamelTextIndexPrivate {
 	CamelBlockFile *blocks;
@@ -128,6 +200,12 @@ struct _CamelTextIndexPrivate {
 	EDList word_cache;
 	GHashTable *words;
 	GStaticRecMutex lock;
+
+	/* postings collected by a bulk load, until the next sync */
+	struct _CamelTextIndexBulk *bulk;
+
+	/* set while the index is being compacted */
+	struct _CamelTextIndexCompact *compact;
 };
 
 /* Root block of text index */
@@ -168,6 +246,14 @@ struct _CamelTextIndexWord {
 
 static CamelObjectClass *camel_text_index_parent;
 
+/* note new postings for @wordid if compacting, call locked */
+static void
+text_index_word_changed(struct _CamelTextIndexPrivate *p, camel_key_t wordid)
+{
+	if (p->compact)
+		g_hash_table_insert(p->compact->dirty, GUINT_TO_POINTER(wordid), GUINT_TO_POINTER(wordid));
+}
+
 /* call locked */
 static void
 text_index_add_name_to_word(CamelIndex *idx, const char *word, camel_key_t nameid)
@@ -225,6 +311,7 @@ text_index_add_name_to_word(CamelIndex *idx, const char *word, camel_key_t namei
 				camel_block_file_touch_block(p->blocks, p->blocks->root_block);
 				/* if this call fails - we still point to the old data - not fatal */
 				camel_key_table_set_data(p->word_index, ww->wordid, ww->data);
+				text_index_word_changed(p, ww->wordid);
 				e_dlist_remove((EDListNode *)ww);
 				g_hash_table_remove(p->words, ww->word);
 				g_free(ww->word);
@@ -246,6 +333,7 @@ text_index_add_name_to_word(CamelIndex *idx, const char *word, camel_key_t namei
 				camel_block_file_touch_block(p->blocks, p->blocks->root_block);
 				/* if this call fails - we still point to the old data - not fatal */
 				camel_key_table_set_data(p->word_index, w->wordid, w->data);
+				text_index_word_changed(p, w->wordid);
 			}
 			/* FIXME: what to on error?  lost data? */
 			w->used = 0;
@@ -253,33 +341,365 @@ text_index_add_name_to_word(CamelIndex *idx, const char *word, camel_key_t namei
 	}
 }
 
+static void
+text_index_bulk_add_word(char *word, void *data, CamelIndexName *idn)
+{
+	struct _CamelTextIndexBulk *bulk = CTI_PRIVATE(idn->index)->bulk;
+	struct _bulk_posting posting;
+	struct _bulk_word *bw;
+	size_t len;
+
+	bw = g_hash_table_lookup(bulk->words, word);
+	if (bw == NULL) {
+		len = strlen(word);
+		bw = e_mempool_alloc(bulk->pool, sizeof(*bw) + len);
+		bw->hash = camel_partition_table_hash(word);
+		memcpy(bw->word, word, len + 1);
+		g_hash_table_insert(bulk->words, bw->word, bw);
+		/* and roughly the hash table node */
+		bulk->size += sizeof(*bw) + len + 4 * sizeof(void *);
+	}
+
+	posting.word = bw;
+	posting.nameid = ((CamelTextIndexName *)idn)->priv->nameid;
+	g_array_append_val(bulk->postings, posting);
+	bulk->size += sizeof(posting);
+}
+
 static int
-text_index_sync(CamelIndex *idx)
+bulk_posting_cmp(const void *ap, const void *bp)
 {
-	struct _CamelTextIndexPrivate *p = CTI_PRIVATE(idx);
-	struct _CamelTextIndexWord *ww;
-	struct _CamelTextIndexRoot *rb;
-	int ret = 0, wfrag, nfrag, work = FALSE;
+	const struct _bulk_posting *a = ap, *b = bp;
+	int ret;
 
-	d(printf("sync: blocks = %p\n", p->blocks));
+	if (a->word->hash != b->word->hash)
+		return a->word->hash < b->word->hash ? -1 : 1;
 
-	if (p->blocks == NULL || p->links == NULL
-	    || p->word_index == NULL || p->word_hash == NULL
-	    || p->name_index == NULL || p->name_hash == NULL)
+	if (a->word != b->word && (ret = strcmp(a->word->word, b->word->word)) != 0)
+		return ret;
+
+	return a->nameid < b->nameid ? -1 : a->nameid > b->nameid ? 1 : 0;
+}
+
+/* create an anonymous run file beside the index */
+static FILE *
+text_index_bulk_run_new(CamelIndex *idx)
+{
+	struct _CamelTextIndexBulk *bulk = CTI_PRIVATE(idx)->bulk;
+	char *path;
+	FILE *fp;
+
+	path = g_strdup_printf("%s.run%u", idx->path, bulk->serial++);
+	fp = g_fopen(path, "w+b");
+	if (fp != NULL)
+		g_unlink(path);
+	else
+		g_warning("Could not create index run file '%s': %s", path, strerror(errno));
+	g_free(path);
+
+	return fp;
+}
+
+static int
+bulk_run_write(FILE *fp, camel_hash_t hash, const char *word, camel_key_t *names, guint32 count)
+{
+	guint32 i;
+
+	if (camel_file_util_encode_fixed_int32(fp, hash) == -1
+	    || camel_file_util_encode_string(fp, word) == -1
+	    || camel_file_util_encode_uint32(fp, count) == -1)
+		return -1;
+
+	for (i=0;i<count;i++)
+		if (camel_file_util_encode_uint32(fp, names[i]) == -1)
+			return -1;
+
+	return 0;
+}
+
+/* sort the postings collected so far and write them out as a run, call locked */
+static int
+text_index_bulk_flush(CamelIndex *idx)
+{
+	struct _CamelTextIndexBulk *bulk = CTI_PRIVATE(idx)->bulk;
+	struct _bulk_posting *postings = (struct _bulk_posting *)bulk->postings->data;
+	camel_key_t *names;
+	int i, j, ret = -1;
+	FILE *fp;
+
+	if (bulk->postings->len == 0)
 		return 0;
 
-	rb = (struct _CamelTextIndexRoot *)p->blocks->root;
+	io(printf("writing index run of %d postings, %d words\n", bulk->postings->len, g_hash_table_size(bulk->words)));
 
-	/* sync/flush word cache */
+	qsort(postings, bulk->postings->len, sizeof(postings[0]), bulk_posting_cmp);
 
-	CAMEL_TEXT_INDEX_LOCK(idx, lock);
+	if ((fp = text_index_bulk_run_new(idx)) == NULL)
+		goto done;
 
-	/* we sync, bump down the cache limits since we dont need them for reading */
-	p->blocks->block_cache_limit = 128;
-	/* this doesn't really need to be dropped, its only used in updates anyway */
-	p->word_cache_limit = 1024;
+	names = g_malloc(bulk->postings->len * sizeof(names[0]));
+	for (i=0;i<bulk->postings->len;i++)
+		names[i] = postings[i].nameid;
+
+	for (i=0;i<bulk->postings->len;i=j) {
+		for (j=i+1;j<bulk->postings->len && postings[j].word == postings[i].word;j++)
+			;
+		if (bulk_run_write(fp, postings[i].word->hash, postings[i].word->word, names + i, j - i) == -1)
+			break;
+	}
+	g_free(names);
+
+	if (i < bulk->postings->len || fflush(fp) != 0 || fseek(fp, 0, SEEK_SET) == -1) {
+		g_warning("Could not write index run: %s", strerror(errno));
+		fclose(fp);
+	} else {
+		g_ptr_array_add(bulk->runs, fp);
+		ret = 0;
+	}
+done:
+	g_hash_table_destroy(bulk->words);
+	bulk->words = g_hash_table_new(g_str_hash, g_str_equal);
+	e_mempool_flush(bulk->pool, FALSE);
+	g_array_set_size(bulk->postings, 0);
+	bulk->size = 0;
+
+	return ret;
+}
+
+/* returns 1 if the cursor has the next word, 0 at the end of the run, -1 on error */
+static int
+bulk_cursor_next(struct _bulk_cursor *c)
+{
+	gint32 hash;
+	guint32 i;
+
+	g_free(c->word);
+	c->word = NULL;
 
-	work = !e_dlist_empty(&p->word_cache);
+	if (camel_file_util_decode_fixed_int32(c->fp, &hash) == -1)
+		return feof(c->fp) ? 0 : -1;
+
+	if (camel_file_util_decode_string(c->fp, &c->word) == -1
+	    || camel_file_util_decode_uint32(c->fp, &c->count) == -1)
+		return -1;
+
+	c->hash = hash;
+	if (c->count > c->size) {
+		c->size = c->count;
+		c->names = g_realloc(c->names, c->size * sizeof(c->names[0]));
+	}
+
+	for (i=0;i<c->count;i++)
+		if (camel_file_util_decode_uint32(c->fp, &c->names[i]) == -1)
+			return -1;
+
+	return 1;
+}
+
+static int
+bulk_cursor_cmp(struct _bulk_cursor *a, struct _bulk_cursor *b)
+{
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+
+	return strcmp(a->word, b->word);
+}
+
+static void
+bulk_heap_down(struct _bulk_cursor **heap, int len, int i)
+{
+	struct _bulk_cursor *c = heap[i];
+	int child;
+
+	while ((child = i * 2 + 1) < len) {
+		if (child + 1 < len && bulk_cursor_cmp(heap[child + 1], heap[child]) < 0)
+			child++;
+		if (bulk_cursor_cmp(c, heap[child]) <= 0)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = c;
+}
+
+/* add @count names to @word, in one go, call locked */
+static int
+text_index_bulk_add(CamelIndex *idx, const char *word, camel_key_t *names, guint32 count)
+{
+	struct _CamelTextIndexPrivate *p = CTI_PRIVATE(idx);
+	struct _CamelTextIndexRoot *rb = (struct _CamelTextIndexRoot *)p->blocks->root;
+	camel_key_t wordid;
+	camel_block_t data = 0;
+	guint32 i, len;
+
+	wordid = camel_partition_table_lookup(p->word_hash, word);
+	if (wordid != 0)
+		data = camel_key_table_lookup(p->word_index, wordid, NULL, NULL);
+
+	for (i=0;i<count;i+=len) {
+		len = MIN(count - i, CAMEL_TEXT_INDEX_BULK_KEYS);
+		if (camel_key_file_write(p->links, &data, len, names + i) == -1) {
+			g_warning ("Could not write key file entry for word '%s': %s\n",
+				   word, strerror (errno));
+			return -1;
+		}
+	}
+
+	/* the names are counted as one key, like text_index_compress_nosync does */
+	rb->keys++;
+
+	if (wordid == 0) {
+		wordid = camel_key_table_add(p->word_index, word, data, 0);
+		if (wordid == 0) {
+			g_warning ("Could not create key entry for word '%s': %s\n",
+				   word, strerror (errno));
+			return -1;
+		}
+		if (camel_partition_table_add(p->word_hash, word, wordid) == -1) {
+			g_warning ("Could not create hash entry for word '%s': %s\n",
+				   word, strerror (errno));
+			return -1;
+		}
+		rb->words++;
+	} else {
+		camel_key_table_set_data(p->word_index, wordid, data);
+		text_index_word_changed(p, wordid);
+	}
+
+	return 0;
+}
+
+/* merge @count runs into @out, or the index itself if @out is NULL, call locked */
+static int
+text_index_bulk_merge(CamelIndex *idx, FILE **runs, int count, FILE *out)
+{
+	struct _bulk_cursor *cursors, **heap, *c;
+	camel_key_t *names = NULL;
+	guint32 len, size = 0;
+	camel_hash_t hash;
+	int i, n = 0, ret = -1;
+	char *word;
+
+	cursors = g_malloc0(count * sizeof(cursors[0]));
+	heap = g_malloc(count * sizeof(heap[0]));
+
+	for (i=0;i<count;i++) {
+		cursors[i].fp = runs[i];
+		switch (bulk_cursor_next(&cursors[i])) {
+		case -1:
+			goto fail;
+		case 1:
+			heap[n++] = &cursors[i];
+			break;
+		}
+	}
+
+	for (i=n/2-1;i>=0;i--)
+		bulk_heap_down(heap, n, i);
+
+	while (n > 0) {
+		/* take the word, and its names from every run which has it */
+		c = heap[0];
+		word = c->word;
+		c->word = NULL;
+		hash = c->hash;
+		len = 0;
+		do {
+			if (len + c->count > size) {
+				size = MAX(size * 2, len + c->count);
+				names = g_realloc(names, size * sizeof(names[0]));
+			}
+			memcpy(names + len, c->names, c->count * sizeof(names[0]));
+			len += c->count;
+
+			switch (bulk_cursor_next(c)) {
+			case -1:
+				g_free(word);
+				goto fail;
+			case 0:
+				heap[0] = heap[--n];
+				break;
+			}
+			if (n > 0)
+				bulk_heap_down(heap, n, 0);
+			c = heap[0];
+		} while (n > 0 && c->hash == hash && strcmp(c->word, word) == 0);
+
+		if (out)
+			i = bulk_run_write(out, hash, word, names, len);
+		else
+			i = text_index_bulk_add(idx, word, names, len);
+		g_free(word);
+		if (i == -1)
+			goto fail;
+	}
+
+	ret = 0;
+fail:
+	for (i=0;i<count;i++) {
+		g_free(cursors[i].word);
+		g_free(cursors[i].names);
+	}
+	g_free(cursors);
+	g_free(heap);
+	g_free(names);
+
+	return ret;
+}
+
+/* write out everything a bulk load collected, and end it, call locked */
+static int
+text_index_bulk_finish(CamelIndex *idx)
+{
+	struct _CamelTextIndexPrivate *p = CTI_PRIVATE(idx);
+	struct _CamelTextIndexBulk *bulk = p->bulk;
+	FILE *fp;
+	int i, ret;
+
+	ret = text_index_bulk_flush(idx);
+
+	/* merge runs a few at a time until they can all be merged at once */
+	while (ret == 0 && bulk->runs->len > CAMEL_TEXT_INDEX_BULK_FANIN) {
+		if ((fp = text_index_bulk_run_new(idx)) == NULL
+		    || text_index_bulk_merge(idx, (FILE **)bulk->runs->pdata, CAMEL_TEXT_INDEX_BULK_FANIN, fp) == -1
+		    || fflush(fp) != 0
+		    || fseek(fp, 0, SEEK_SET) == -1) {
+			if (fp)
+				fclose(fp);
+			ret = -1;
+			break;
+		}
+		for (i=0;i<CAMEL_TEXT_INDEX_BULK_FANIN;i++)
+			fclose(bulk->runs->pdata[i]);
+		g_ptr_array_remove_range(bulk->runs, 0, CAMEL_TEXT_INDEX_BULK_FANIN);
+		g_ptr_array_add(bulk->runs, fp);
+	}
+
+	if (ret == 0 && bulk->runs->len > 0) {
+		ret = text_index_bulk_merge(idx, (FILE **)bulk->runs->pdata, bulk->runs->len, NULL);
+		camel_block_file_touch_block(p->blocks, p->blocks->root_block);
+	}
+
+	for (i=0;i<bulk->runs->len;i++)
+		fclose(bulk->runs->pdata[i]);
+	g_ptr_array_free(bulk->runs, TRUE);
+	g_array_free(bulk->postings, TRUE);
+	g_hash_table_destroy(bulk->words);
+	e_mempool_destroy(bulk->pool);
+	g_free(bulk);
+	p->bulk = NULL;
+
+	return ret;
+}
+
+/* write out the word cache and any bulk load, call locked */
+static int
+text_index_flush_words(CamelIndex *idx)
+{
+	struct _CamelTextIndexPrivate *p = CTI_PRIVATE(idx);
+	struct _CamelTextIndexRoot *rb = (struct _CamelTextIndexRoot *)p->blocks->root;
+	struct _CamelTextIndexWord *ww;
+	int ret = 0;
 
 	while ( (ww = (struct _CamelTextIndexWord *)e_dlist_remhead(&p->word_cache)) ) {
 		if (ww->used > 0) {
@@ -289,6 +709,7 @@ text_index_sync(CamelIndex *idx)
 				rb->keys++;
 				camel_block_file_touch_block(p->blocks, p->blocks->root_block);
 				camel_key_table_set_data(p->word_index, ww->wordid, ww->data);
+				text_index_word_changed(p, ww->wordid);
 			} else {
 				ret = -1;
 			}
@@ -298,6 +719,42 @@ text_index_sync(CamelIndex *idx)
 		g_free(ww->word);
 		g_free(ww);
 	}
+	p->word_cache_count = 0;
+
+	if (p->bulk && text_index_bulk_finish(idx) == -1)
+		ret = -1;
+
+	return ret;
+}
+
+static int
+text_index_sync(CamelIndex *idx)
+{
+	struct _CamelTextIndexPrivate *p = CTI_PRIVATE(idx);
+	struct _CamelTextIndexRoot *rb;
+	int ret = 0, wfrag, nfrag, work = FALSE;
+
+	d(printf("sync: blocks = %p\n", p->blocks));
+
+	if (p->blocks == NULL || p->links == NULL
+	    || p->word_index == NULL || p->word_hash == NULL
+	    || p->name_index == NULL || p->name_hash == NULL)
+		return 0;
+
+	rb = (struct _CamelTextIndexRoot *)p->blocks->root;
+
+	/* sync/flush word cache */
+
+	CAMEL_TEXT_INDEX_LOCK(idx, lock);
+
+	/* we sync, bump down the cache limits since we dont need them for reading */
+	p->blocks->block_cache_limit = 128;
+	/* this doesn't really need to be dropped, its only used in updates anyway */
+	p->word_cache_limit = 1024;
+
+	work = !e_dlist_empty(&p->word_cache) || p->bulk != NULL;
+
+	ret = text_index_flush_words(idx);
 
 	if (camel_key_table_sync(p->word_index) == -1
 	    || camel_key_table_sync(p->name_index) == -1
@@ -342,34 +799,235 @@ text_index_compress(CamelIndex *idx)
 {
 	int ret;
 
-	CAMEL_TEXT_INDEX_LOCK(idx, lock);
-
+	/* not locked around the sync, compressing has to be entered with
+	   the lock held just the once */
 	ret = camel_index_sync(idx);
-	if (ret != -1)
+	if (ret != -1) {
+		CAMEL_TEXT_INDEX_LOCK(idx, lock);
 		ret = text_index_compress_nosync(idx);
-
-	CAMEL_TEXT_INDEX_UNLOCK(idx, lock);
+		CAMEL_TEXT_INDEX_UNLOCK(idx, lock);
+	}
 
 	return ret;
 }
 
-/* Attempt to recover index space by compressing the indices */
+static void
+text_index_compact_progress(struct _CamelTextIndexCompact *c)
+{
+	int pc;
+
+	c->done++;
+	pc = c->total ? MIN(c->done * 100 / c->total, 100) : 100;
+	if (pc != c->pc) {
+		c->pc = pc;
+		camel_operation_progress(NULL, pc);
+	}
+}
+
+/* copy the postings of @word from @data up to @stop into the new index,
+   only those of names with keys above @after */
 static int
-text_index_compress_nosync(CamelIndex *idx)
+text_index_compact_word(CamelIndex *idx, const char *word, unsigned int flags, camel_block_t data, camel_block_t stop, camel_key_t after)
 {
-	CamelTextIndex *newidx;
-	struct _CamelTextIndexPrivate *newp, *oldp;
+	struct _CamelTextIndexPrivate *oldp = CTI_PRIVATE(idx);
+	struct _CamelTextIndexCompact *c = oldp->compact;
+	struct _CamelTextIndexPrivate *newp = CTI_PRIVATE(c->newidx);
+	struct _CamelTextIndexRoot *rb = (struct _CamelTextIndexRoot *)newp->blocks->root;
+	camel_key_t *records, newrecords[256], newkeyid;
+	camel_block_t newdata = 0;
+	size_t i, count, newcount = 0;
+	int written = FALSE;
+
+	newkeyid = camel_partition_table_lookup(newp->word_hash, word);
+	if (newkeyid != 0)
+		newdata = camel_key_table_lookup(newp->word_index, newkeyid, NULL, NULL);
+
+	/* We re-block the data into 256 entry lots while we're at it, since we only
+	   have to do 1 at a time and its cheap */
+	while (data && data != stop) {
+		if (camel_key_file_read(oldp->links, &data, &count, &records) == -1) {
+			io(printf("could not read from old keys at %d for word '%s'\n", (int)data, word));
+			return -1;
+		}
+		for (i=0;i<count;i++) {
+			if (records[i] <= after)
+				continue;
+			newrecords[newcount] = (camel_key_t)GPOINTER_TO_INT(g_hash_table_lookup(c->remap, GINT_TO_POINTER(records[i])));
+			if (newrecords[newcount] == 0)
+				continue;
+			if (++newcount == sizeof(newrecords)/sizeof(newrecords[0])) {
+				if (camel_key_file_write(newp->links, &newdata, newcount, newrecords) == -1) {
+					g_free(records);
+					return -1;
+				}
+				newcount = 0;
+				written = TRUE;
+			}
+		}
+		g_free(records);
+	}
+
+	if (newcount > 0) {
+		if (camel_key_file_write(newp->links, &newdata, newcount, newrecords) == -1)
+			return -1;
+		written = TRUE;
+	}
+
+	if (!written)
+		return 0;
+
+	rb->keys++;
+	if (newkeyid == 0) {
+		newkeyid = camel_key_table_add(newp->word_index, word, newdata, flags);
+		if (newkeyid == 0)
+			return -1;
+		camel_partition_table_add(newp->word_hash, word, newkeyid);
+		rb->words++;
+	} else
+		camel_key_table_set_data(newp->word_index, newkeyid, newdata);
+
+	return 0;
+}
+
+/* copy names and words added since the last call to the new index */
+static int
+text_index_compact_copy(CamelIndex *idx)
+{
+	struct _CamelTextIndexPrivate *oldp = CTI_PRIVATE(idx);
+	struct _CamelTextIndexCompact *c = oldp->compact;
+	struct _CamelTextIndexPrivate *newp = CTI_PRIVATE(c->newidx);
+	struct _CamelTextIndexRoot *rb = (struct _CamelTextIndexRoot *)newp->blocks->root;
 	camel_key_t oldkeyid, newkeyid;
-	GHashTable *remap;
-	unsigned int deleted;
-	camel_block_t data, newdata;
-	int i, ret = -1;
-	char *name = NULL;
+	camel_block_t data;
+	unsigned int flags;
+	char *name;
+
+	/* Copy undeleted names to new index file, creating new indices */
+	io(printf("Copying undeleted names to new file\n"));
+	while ( (oldkeyid = camel_key_table_next(oldp->name_index, c->lastname, &name, &flags, &data)) ) {
+		c->lastname = oldkeyid;
+		if ((flags&1) == 0) {
+			io(printf("copying name '%s'\n", name));
+			newkeyid = camel_key_table_add(newp->name_index, name, data, flags);
+			if (newkeyid == 0) {
+				g_free(name);
+				return -1;
+			}
+			rb->names++;
+			camel_partition_table_add(newp->name_hash, name, newkeyid);
+			g_hash_table_insert(c->remap, GINT_TO_POINTER(oldkeyid), GINT_TO_POINTER(newkeyid));
+		} else
+			io(printf("deleted name '%s'\n", name));
+		g_free(name);
+		text_index_compact_progress(c);
+	}
+
+	/* Copy word data across, remapping/deleting and create new index for it */
+	while ( (oldkeyid = camel_key_table_next(oldp->word_index, c->lastword, &name, &flags, &data)) ) {
+		c->lastword = oldkeyid;
+		if (data) {
+			io(printf("copying word '%s'\n", name));
+			g_hash_table_insert(c->heads, GUINT_TO_POINTER(oldkeyid), GUINT_TO_POINTER(data));
+			if (text_index_compact_word(idx, name, flags, data, 0, 0) == -1) {
+				g_free(name);
+				return -1;
+			}
+		}
+		g_free(name);
+		text_index_compact_progress(c);
+	}
+
+	return 0;
+}
+
+static void
+text_index_compact_dirty(void *key, void *value, CamelIndex *idx)
+{
+	struct _CamelTextIndexPrivate *oldp = CTI_PRIVATE(idx);
+	struct _CamelTextIndexCompact *c = oldp->compact;
+	camel_block_t data, stop;
+	unsigned int flags;
+	char *name;
+
+	if (c->error)
+		return;
+
+	/* the postings added since the word was copied */
+	data = camel_key_table_lookup(oldp->word_index, GPOINTER_TO_UINT(key), &name, &flags);
+	stop = GPOINTER_TO_UINT(g_hash_table_lookup(c->heads, key));
+	if (name && data != stop
+	    && text_index_compact_word(idx, name, flags, data, stop, 0) == -1)
+		c->error = TRUE;
+
+	/* and if it was copied unlocked, any postings for names added after
+	   the names were copied, which were dropped then as they had no new
+	   key yet; they can only have been written while it was dirty */
+	if (name && stop != 0 && !c->error
+	    && c->lastname > c->namebound
+	    && GPOINTER_TO_UINT(key) <= c->wordbound
+	    && text_index_compact_word(idx, name, flags, stop, 0, c->namebound) == -1)
+		c->error = TRUE;
+	g_free(name);
+}
+
+/* catch up with everything done to the index since it was copied, call locked */
+static int
+text_index_compact_catchup(CamelIndex *idx)
+{
+	struct _CamelTextIndexPrivate *oldp = CTI_PRIVATE(idx);
+	struct _CamelTextIndexCompact *c = oldp->compact;
+	struct _CamelTextIndexPrivate *newp = CTI_PRIVATE(c->newidx);
+	struct _CamelTextIndexRoot *rb = (struct _CamelTextIndexRoot *)newp->blocks->root;
+	camel_key_t keyid, newkeyid;
 	unsigned int flags;
+	char *name;
+	int i;
+
+	c->namebound = c->lastname;
+	c->wordbound = c->lastword;
+	if (text_index_compact_copy(idx) == -1)
+		return -1;
+
+	for (i=0;i<c->deleted->len;i++) {
+		keyid = g_array_index(c->deleted, camel_key_t, i);
+		newkeyid = (camel_key_t)GPOINTER_TO_INT(g_hash_table_lookup(c->remap, GINT_TO_POINTER(keyid)));
+		if (newkeyid == 0)
+			continue;
+		camel_key_table_lookup(newp->name_index, newkeyid, &name, &flags);
+		if (name && (flags & 1) == 0) {
+			rb->deleted++;
+			camel_key_table_set_flags(newp->name_index, newkeyid, 1, 1);
+			if (camel_partition_table_lookup(newp->name_hash, name) == newkeyid)
+				camel_partition_table_remove(newp->name_hash, name);
+		}
+		g_free(name);
+	}
+
+	g_hash_table_foreach(c->dirty, (GHFunc)text_index_compact_dirty, idx);
+
+	return c->error ? -1 : 0;
+}
+
+/* Attempt to recover index space by compressing the indices, call
+   locked.  The lock is dropped while most of the index is copied,
+   unless a caller further up the stack holds it too.  Fails with
+   EBUSY if another thread is already compressing the index. */
+static int
+text_index_compress_nosync(CamelIndex *idx)
+{
+	struct _CamelTextIndexPrivate *newp, *oldp = CTI_PRIVATE(idx);
+	struct _CamelTextIndexRoot *rb = (struct _CamelTextIndexRoot *)oldp->blocks->root;
+	struct _CamelTextIndexCompact *c;
+	CamelTextIndex *newidx;
 	char *newpath, *savepath, *oldpath;
-	size_t count, newcount;
-	camel_key_t *records, newrecords[256];
-	struct _CamelTextIndexRoot *rb;
+	int i, ret = -1;
+	guint depth;
+
+	/* another thread is already at it */
+	if (oldp->compact) {
+		errno = EBUSY;
+		return -1;
+	}
 
 	i = strlen(idx->path)+16;
 	oldpath = alloca(i);
@@ -380,21 +1038,26 @@ text_index_compress_nosync(CamelIndex *idx)
 	oldpath[strlen(oldpath)-strlen(".index")] = 0;
 
 	tmp_name(oldpath, newpath);
-	sprintf(savepath, "%s~", oldpath);
 
 	d(printf("Old index: %s\n", idx->path));
 	d(printf("Old path: %s\n", oldpath));
 	d(printf("New: %s\n", newpath));
-	d(printf("Save: %s\n", savepath));
 
 	newidx = camel_text_index_new(newpath, O_RDWR|O_CREAT);
 	if (newidx == NULL)
 		return -1;
 
 	newp = CTI_PRIVATE(newidx);
-	oldp = CTI_PRIVATE(idx);
 
-	CAMEL_TEXT_INDEX_LOCK(idx, lock);
+	c = g_malloc0(sizeof(*c));
+	c->newidx = newidx;
+	c->remap = g_hash_table_new(NULL, NULL);
+	c->heads = g_hash_table_new(NULL, NULL);
+	c->dirty = g_hash_table_new(NULL, NULL);
+	c->deleted = g_array_new(FALSE, FALSE, sizeof(camel_key_t));
+	c->total = rb->names + rb->words;
+	c->pc = -1;
+	oldp->compact = c;
 
 	rb = (struct _CamelTextIndexRoot *)newp->blocks->root;
 
@@ -403,87 +1066,58 @@ text_index_compress_nosync(CamelIndex *idx)
 	rb->deleted = 0;
 	rb->keys = 0;
 
+	camel_operation_start(NULL, _("Compacting index"));
+
 	/* Process:
 	   For each name we still have:
 	   Add it to the new index & setup remap table
 
 	   For each word:
 	   Copy word's data to a new file
-	   Add new word to index(*) (can we just copy blocks?) */
+	   Add new word to index(*) (can we just copy blocks?)
 
-	/* Copy undeleted names to new index file, creating new indices */
-	io(printf("Copying undeleted names to new file\n"));
-	remap = g_hash_table_new(NULL, NULL);
-	oldkeyid = 0;
-	deleted = 0;
-	while ( (oldkeyid = camel_key_table_next(oldp->name_index, oldkeyid, &name, &flags, &data)) ) {
-		if ((flags&1) == 0) {
-			io(printf("copying name '%s'\n", name));
-			newkeyid = camel_key_table_add(newp->name_index, name, data, flags);
-			if (newkeyid == 0)
-				goto fail;
-			rb->names++;
-			camel_partition_table_add(newp->name_hash, name, newkeyid);
-			g_hash_table_insert(remap, GINT_TO_POINTER(oldkeyid), GINT_TO_POINTER(newkeyid));
-		} else
-			io(printf("deleted name '%s'\n", name));
-		g_free(name);
-		name = NULL;
-		deleted |= flags;
-	}
+	   Then locked, copy anything added meanwhile, apply the
+	   deletes and new postings logged, and swap the files over */
 
-	/* Copy word data across, remapping/deleting and create new index for it */
-	/* We re-block the data into 256 entry lots while we're at it, since we only
-	   have to do 1 at a time and its cheap */
-	oldkeyid = 0;
-	while ( (oldkeyid = camel_key_table_next(oldp->word_index, oldkeyid, &name, &flags, &data)) ) {
-		io(printf("copying word '%s'\n", name));
-		newdata = 0;
-		newcount = 0;
-		if (data) {
-			rb->words++;
-			rb->keys++;
-		}
-		while (data) {
-			if (camel_key_file_read(oldp->links, &data, &count, &records) == -1) {
-				io(printf("could not read from old keys at %d for word '%s'\n", (int)data, name));
-				goto fail;
-			}
-			for (i=0;i<count;i++) {
-				newkeyid = (camel_key_t)GPOINTER_TO_INT(g_hash_table_lookup(remap, GINT_TO_POINTER(records[i])));
-				if (newkeyid) {
-					newrecords[newcount++] = newkeyid;
-					if (newcount == sizeof(newrecords)/sizeof(newrecords[0])) {
-						if (camel_key_file_write(newp->links, &newdata, newcount, newrecords) == -1) {
-							g_free(records);
-							goto fail;
-						}
-						newcount = 0;
-					}
-				}
-			}
-			g_free(records);
-		}
+	depth = g_static_rec_mutex_unlock_full(&oldp->lock);
+	if (depth > 1) {
+		/* it mustn't go away under whoever took it before us, so
+		   copy the lot locked */
+		g_static_rec_mutex_lock_full(&oldp->lock, depth);
+		ret = text_index_compact_copy(idx);
+	} else {
+		ret = text_index_compact_copy(idx);
+		g_static_rec_mutex_lock_full(&oldp->lock, depth);
+	}
 
-		if (newcount > 0) {
-			if (camel_key_file_write(newp->links, &newdata, newcount, newrecords) == -1)
-				goto fail;
-		}
+	/* the word cache and any bulk load refer to the old index,
+	   so they have to be written to it before catching up */
+	if (ret == -1
+	    || text_index_flush_words(idx) == -1
+	    || text_index_compact_catchup(idx) == -1) {
+		ret = -1;
+		goto fail;
+	}
 
-		if (newdata != 0) {
-			newkeyid = camel_key_table_add(newp->word_index, name, newdata, flags);
-			if (newkeyid == 0)
-				goto fail;
-			camel_partition_table_add(newp->word_hash, name, newkeyid);
-		}
-		g_free(name);
-		name = NULL;
+	/* it was deleted while we weren't looking */
+	if (idx->state & CAMEL_INDEX_DELETED) {
+		ret = 0;
+		goto fail;
 	}
 
 	camel_block_file_touch_block(newp->blocks, newp->blocks->root_block);
 
-	if (camel_index_sync((CamelIndex *)newidx) == -1)
+	if (camel_index_sync((CamelIndex *)newidx) == -1) {
+		ret = -1;
 		goto fail;
+	}
+
+	/* or renamed */
+	strcpy(oldpath, idx->path);
+	oldpath[strlen(oldpath)-strlen(".index")] = 0;
+	sprintf(savepath, "%s~", oldpath);
+
+	d(printf("Save: %s\n", savepath));
 
 	/* Rename underlying files to match */
 	ret = camel_index_rename(idx, savepath);
@@ -508,13 +1142,17 @@ text_index_compress_nosync(CamelIndex *idx)
 
 	ret = 0;
 fail:
-	CAMEL_TEXT_INDEX_UNLOCK(idx, lock);
+	oldp->compact = NULL;
+	camel_operation_end(NULL);
 
 	camel_index_delete((CamelIndex *)newidx);
 
 	camel_object_unref((CamelObject *)newidx);
-	g_free(name);
-	g_hash_table_destroy(remap);
+	g_hash_table_destroy(c->remap);
+	g_hash_table_destroy(c->heads);
+	g_hash_table_destroy(c->dirty);
+	g_array_free(c->deleted, TRUE);
+	g_free(c);
 
 	/* clean up temp files always */
 	sprintf(savepath, "%s~.index", oldpath);
@@ -607,6 +1245,8 @@ text_index_add_name(CamelIndex *idx, const char *name)
 		rb->deleted++;
 		camel_key_table_set_flags(p->name_index, keyid, 1, 1);
 		camel_partition_table_remove(p->name_hash, name);
+		if (p->compact)
+			g_array_append_val(p->compact->deleted, keyid);
 	}
 
 	keyid = camel_key_table_add(p->name_index, name, 0, 0);
@@ -644,11 +1284,21 @@ text_index_write_name(CamelIndex *idx, CamelIndexName *idn)
 
 	/* see text_index_add_name for when this can be 0 */
 	if (((CamelTextIndexName *)idn)->priv->nameid != 0) {
+		struct _CamelTextIndexPrivate *p = CTI_PRIVATE(idx);
+		int ret = 0;
+
 		CAMEL_TEXT_INDEX_LOCK(idx, lock);
 
-		g_hash_table_foreach(idn->words, (GHFunc)hash_write_word, idn);
+		if (p->bulk) {
+			g_hash_table_foreach(idn->words, (GHFunc)text_index_bulk_add_word, idn);
+			if (p->bulk->size >= p->bulk->limit)
+				ret = text_index_bulk_flush(idx);
+		} else
+			g_hash_table_foreach(idn->words, (GHFunc)hash_write_word, idn);
 
 		CAMEL_TEXT_INDEX_UNLOCK(idx, lock);
+
+		return ret;
 	}
 
 	return 0;
@@ -680,6 +1330,8 @@ text_index_delete_name(CamelIndex *idx, const char *name)
 		camel_block_file_touch_block(p->blocks, p->blocks->root_block);
 		camel_key_table_set_flags(p->name_index, keyid, 1, 1);
 		camel_partition_table_remove(p->name_hash, name);
+		if (p->compact)
+			g_array_append_val(p->compact->deleted, keyid);
 	}
 
 	CAMEL_TEXT_INDEX_UNLOCK(idx, lock);
@@ -828,26 +1480,49 @@ text_index_normalise(CamelIndex *idx, const char *in, void *data)
 	return word;
 }
 
+/* open the key file of an index, which may still be in the old format */
+static CamelKeyFile *
+text_index_key_file_new(const char *path, int flags, gboolean *packed)
+{
+	CamelKeyFile *kf;
+
+	*packed = TRUE;
+	kf = camel_key_file_new(path, flags, CAMEL_TEXT_INDEX_KEY_VERSION);
+	if (kf == NULL && errno == EINVAL) {
+		*packed = FALSE;
+		kf = camel_key_file_new(path, flags, CAMEL_TEXT_INDEX_KEY_VERSION_RAW);
+	}
+
+	return kf;
+}
+
 CamelTextIndex *
 camel_text_index_new(const char *path, int flags)
 {
 	CamelTextIndex *idx = (CamelTextIndex *)camel_object_new(camel_text_index_get_type());
 	struct _CamelTextIndexPrivate *p = CTI_PRIVATE(idx);
 	struct _CamelTextIndexRoot *rb;
+	gboolean packed;
 	char *link;
 	CamelBlock *bl;
 
 	camel_index_construct((CamelIndex *)idx, path, flags);
 	camel_index_set_normalise((CamelIndex *)idx, text_index_normalise, NULL);
 
-	p->blocks = camel_block_file_new(idx->parent.path, flags, CAMEL_TEXT_INDEX_VERSION, CAMEL_BLOCK_SIZE);
+	p->blocks = camel_block_file_new(idx->parent.path, flags, CAMEL_TEXT_INDEX_VERSION, CAMEL_TEXT_INDEX_IO_SIZE);
 	link = alloca(strlen(idx->parent.path)+7);
 	sprintf(link, "%s.data", idx->parent.path);
-	p->links = camel_key_file_new(link, flags, CAMEL_TEXT_INDEX_KEY_VERSION);
+	p->links = text_index_key_file_new(link, flags, &packed);
 
 	if (p->blocks == NULL || p->links == NULL)
 		goto fail;
 
+	/* lookups on a read-only index can work straight off the file */
+	if ((flags & O_ACCMODE) == O_RDONLY)
+		camel_block_file_set_mapped(p->blocks, TRUE);
+	else if (packed)
+		camel_key_file_set_packed(p->links, TRUE);
+
 	rb = (struct _CamelTextIndexRoot *)p->blocks->root;
 
 	if (rb->word_index_root == 0) {
@@ -912,6 +1587,40 @@ fail:
 	return NULL;
 }
 
+/**
+ * camel_text_index_bulk_start:
+ * @idx:
+ * @memory: Memory to use for sorting, or 0 for the default.
+ *
+ * Start a bulk load of @idx, for when many names are added at once,
+ * such as when an index is rebuilt.  Until the next sync, the words
+ * written with camel_index_write_name() are collected in sorted runs
+ * of about @memory bytes instead of being added one at a time, so
+ * their names cannot be found until then.  The sync merges the runs
+ * and adds every word once.  Writing a name then takes little more
+ * than the index lock, so names can be tokenised in several threads.
+ **/
+void
+camel_text_index_bulk_start(CamelTextIndex *idx, size_t memory)
+{
+	struct _CamelTextIndexPrivate *p = CTI_PRIVATE(idx);
+	struct _CamelTextIndexBulk *bulk;
+
+	CAMEL_TEXT_INDEX_LOCK(idx, lock);
+
+	if (p->bulk == NULL) {
+		bulk = g_malloc0(sizeof(*bulk));
+		bulk->limit = memory ? memory : CAMEL_TEXT_INDEX_BULK_RUN;
+		bulk->pool = e_mempool_new(32*1024, 256, E_MEMPOOL_ALIGN_STRUCT);
+		bulk->words = g_hash_table_new(g_str_hash, g_str_equal);
+		bulk->postings = g_array_new(FALSE, FALSE, sizeof(struct _bulk_posting));
+		bulk->runs = g_ptr_array_new();
+		p->bulk = bulk;
+	}
+
+	CAMEL_TEXT_INDEX_UNLOCK(idx, lock);
+}
+
 /* returns 0 if the index exists, is valid, and synced, -1 otherwise */
 int
 camel_text_index_check(const char *path)
@@ -919,6 +1628,7 @@ camel_text_index_check(const char *path)
 	char *block, *key;
 	CamelBlockFile *blocks;
 	CamelKeyFile *keys;
+	gboolean packed;
 
 	block = alloca(strlen(path)+7);
 	sprintf(block, "%s.index", path);
@@ -929,7 +1639,7 @@ camel_text_index_check(const char *path)
 	}
 	key = alloca(strlen(path)+12);
 	sprintf(key, "%s.index.data", path);
-	keys = camel_key_file_new(key, O_RDONLY, CAMEL_TEXT_INDEX_KEY_VERSION);
+	keys = text_index_key_file_new(key, O_RDONLY, &packed);
 	if (keys == NULL) {
 		io(printf("Check failed: No key file: %s\n", strerror (errno)));
 		camel_object_unref((CamelObject *)blocks);
@@ -1055,7 +1765,7 @@ add_partition(GHashTable *map, CamelBlockFile *blocks, camel_block_t id)
 			return;
 		}
 
-		pm = (CamelPartitionMapBlock *)&bl->data;
+		pm = (CamelPartitionMapBlock *)bl->data;
 		if (pm->used > sizeof(pm->partition)/sizeof(pm->partition[0])) {
 			g_warning("Partition block %x invalid\n", id);
 			camel_block_file_unref_block(blocks, bl);
@@ -1083,7 +1793,7 @@ add_keys(GHashTable *map, CamelBlockFile *blocks, camel_block_t id)
 		g_warning("couldn't get key root: %x\n", id);
 		return;
 	}
-	root = (CamelKeyRootBlock *)&rbl->data;
+	root = (CamelKeyRootBlock *)rbl->data;
 	id = root->first;
 
 	while (id) {
@@ -1094,7 +1804,7 @@ add_keys(GHashTable *map, CamelBlockFile *blocks, camel_block_t id)
 			break;
 		}
 
-		kb = (CamelKeyBlock *)&bl->data;
+		kb = (CamelKeyBlock *)bl->data;
 		id = kb->next;
 		camel_block_file_unref_block(blocks, bl);
 	}
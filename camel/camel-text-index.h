@@ -102,6 +102,7 @@ struct _CamelTextIndexClass {
 
 CamelType	           camel_text_index_get_type	(void);
 CamelTextIndex    *camel_text_index_new(const char *path, int flags);
+void               camel_text_index_bulk_start(CamelTextIndex *idx, size_t memory);
 
 /* static utility functions */
 int camel_text_index_check(const char *path);
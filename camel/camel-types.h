@@ -61,6 +61,7 @@ typedef struct _CamelSession CamelSession;
 typedef struct _CamelSimpleDataWrapper CamelSimpleDataWrapper;
 typedef struct _CamelStore CamelStore;
 typedef struct _CamelStream CamelStream;
+typedef struct _CamelStreamDeflate CamelStreamDeflate;
 typedef struct _CamelStreamNull CamelStreamNull;
 typedef struct _CamelStreamBuffer CamelStreamBuffer;
 typedef struct _CamelStreamDataWrapper CamelStreamDataWrapper;
@@ -115,6 +115,7 @@
 #include <camel/camel-store-summary.h>
 #include <camel/camel-stream.h>
 #include <camel/camel-stream-buffer.h>
+#include <camel/camel-stream-deflate.h>
 #include <camel/camel-stream-filter.h>
 #include <camel/camel-stream-fs.h>
 #include <camel/camel-stream-mem.h>
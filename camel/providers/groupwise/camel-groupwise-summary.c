@@ -260,7 +260,7 @@ gw_info_set_flags (CamelMessageInfo *info, guint32 flags, guint32 set)
 	if (old != mi->flags) {
 		mi->flags |= CAMEL_MESSAGE_FOLDER_FLAGGED;
 		if (mi->summary)
-			camel_folder_summary_touch(mi->summary);
+			camel_folder_summary_touch_info(mi->summary, info);
 	}
 	/* This is a hack, we are using CAMEL_MESSAGE_JUNK justo to hide the item
 	 * we make sure this doesn't have any side effects*/
@@ -274,7 +274,7 @@ gw_info_set_flags (CamelMessageInfo *info, guint32 flags, guint32 set)
 		 */
 
 		if (mi->summary) {
-			camel_folder_summary_touch(mi->summary);
+			camel_folder_summary_touch_info(mi->summary, info);
 		}
 
 	} else	if ((old & ~CAMEL_MESSAGE_SYSTEM_MASK) == (mi->flags & ~CAMEL_MESSAGE_SYSTEM_MASK))
@@ -43,18 +43,31 @@
 
 #include "camel-imap-command.h"
 #include "camel-imap-folder.h"
+#include "camel-imap-message-cache.h"
+#include "camel-imap-private.h"
 #include "camel-imap-store-summary.h"
 #include "camel-imap-store.h"
 #include "camel-imap-utils.h"
 
 extern int camel_verbose_debug;
 
+/* message body literals at least this big are streamed into the cache */
+#define IMAP_LITERAL_CACHE_MIN (64 * 1024)
+
 static gboolean imap_command_start (CamelImapStore *store, CamelFolder *folder,
 				    const char *cmd, CamelException *ex);
+static gboolean imap_command_select (CamelImapStore *store, CamelFolder *folder,
+				     CamelException *ex);
+static gboolean imap_command_send (CamelImapStore *store, const char *cmd,
+				   CamelException *ex);
+static gboolean imap_status_ok (const char *respbuf, CamelException *ex);
 static CamelImapResponse *imap_read_response (CamelImapStore *store,
 					      CamelException *ex);
 static char *imap_read_untagged (CamelImapStore *store, char *line,
 				 CamelException *ex);
+static gboolean imap_read_literal_to_cache (CamelImapStore *store, const char *line,
+					    const char *lit, size_t length,
+					    CamelException *ex);
 static char *imap_command_strdup_vprintf (CamelImapStore *store,
 					  const char *fmt, va_list ap);
 static char *imap_command_strdup_printf (CamelImapStore *store,
@@ -177,28 +190,43 @@ static gboolean
 imap_command_start (CamelImapStore *store, CamelFolder *folder,
 		    const char *cmd, CamelException *ex)
 {
-	ssize_t nwritten;
-
 	g_return_val_if_fail(store->ostream!=NULL, FALSE);
 	g_return_val_if_fail(store->istream!=NULL, FALSE);
 
-	/* Check for current folder */
-	if (folder && folder != store->current_folder) {
-		CamelImapResponse *response;
-		CamelException internal_ex;
+	return imap_command_select (store, folder, ex)
+		&& imap_command_send (store, cmd, ex);
+}
 
-		response = camel_imap_command (store, folder, ex, NULL);
-		if (!response)
-			return FALSE;
-		camel_exception_init (&internal_ex);
-		camel_imap_folder_selected (folder, response, &internal_ex);
-		camel_imap_response_free (store, response);
-		if (camel_exception_is_set (&internal_ex)) {
-			camel_exception_xfer (ex, &internal_ex);
-			return FALSE;
-		}
+/* Make sure @folder (if non-%NULL) is the currently-selected folder */
+static gboolean
+imap_command_select (CamelImapStore *store, CamelFolder *folder,
+		     CamelException *ex)
+{
+	CamelImapResponse *response;
+	CamelException internal_ex;
+
+	if (!folder || folder == store->current_folder)
+		return TRUE;
+
+	response = camel_imap_command (store, folder, ex, NULL);
+	if (!response)
+		return FALSE;
+	camel_exception_init (&internal_ex);
+	camel_imap_folder_selected (folder, response, &internal_ex);
+	camel_imap_response_free (store, response);
+	if (camel_exception_is_set (&internal_ex)) {
+		camel_exception_xfer (ex, &internal_ex);
+		return FALSE;
 	}
 
+	return TRUE;
+}
+
+static gboolean
+imap_command_send (CamelImapStore *store, const char *cmd, CamelException *ex)
+{
+	ssize_t nwritten;
+
 	/* Send the command */
 	if (camel_verbose_debug) {
 		const char *mask;
@@ -357,7 +385,7 @@ imap_read_response (CamelImapStore *store, CamelException *ex)
 {
 	CamelImapResponse *response;
 	CamelImapResponseType type;
-	char *respbuf, *p;
+	char *respbuf;
 
 	/* Get another lock so that when we reach the tagged
 	 * response and camel_imap_command_response unlocks,
@@ -384,12 +412,27 @@ imap_read_response (CamelImapStore *store, CamelException *ex)
 
 	response->status = respbuf;
 
+	if (imap_status_ok (respbuf, ex))
+		return response;
+
+	camel_imap_response_free_without_processing (store, response);
+	return NULL;
+}
+
+/* Check the status line of a response, setting @ex unless it is an
+ * OK or continuation response.
+ */
+static gboolean
+imap_status_ok (const char *respbuf, CamelException *ex)
+{
+	const char *p;
+
 	/* Check for OK or continuation response. */
 	if (*respbuf == '+')
-		return response;
+		return TRUE;
 	p = strchr (respbuf, ' ');
 	if (p && !g_ascii_strncasecmp (p, " OK", 3))
-		return response;
+		return TRUE;
 
 	/* We should never get BAD, or anything else but +, OK, or NO
 	 * for that matter.  Well, we could get BAD, treat as NO.
@@ -400,8 +443,7 @@ imap_read_response (CamelImapStore *store, CamelException *ex)
 		camel_exception_setv (ex, CAMEL_EXCEPTION_SERVICE_UNAVAILABLE,
 				      _("Unexpected response from IMAP "
 					"server: %s"), respbuf);
-		camel_imap_response_free_without_processing (store, response);
-		return NULL;
+		return FALSE;
 	}
 
 	p += 3;
@@ -410,8 +452,7 @@ imap_read_response (CamelImapStore *store, CamelException *ex)
 	camel_exception_setv (ex, CAMEL_EXCEPTION_SERVICE_INVALID,
 			      _("IMAP command failed: %s"),
 			      p ? p : _("Unknown error"));
-	camel_imap_response_free_without_processing (store, response);
-	return NULL;
+	return FALSE;
 }
 
 /* Given a line that is the start of an untagged response, read and
@@ -460,6 +501,21 @@ imap_read_untagged (CamelImapStore *store, char *line, CamelException *ex)
 			break;
 		ldigits = end - (p + 1);
 
+		/* A big message body goes straight into the cache,
+		 * rather than being held here and copied on from the
+		 * response by parse_fetch_response() */
+		if (store->fetch_folder && length >= IMAP_LITERAL_CACHE_MIN && data->len == 1
+		    && imap_read_literal_to_cache (store, str->str, p, length, ex)) {
+			if (camel_exception_is_set (ex))
+				goto lose;
+
+			fulllen -= str->len;
+			g_string_truncate (str, p - str->str);
+			g_string_append (str, CAMEL_IMAP_LITERAL_CACHED);
+			fulllen += str->len;
+			goto next;
+		}
+
 		/* Read the literal */
 		str = g_string_sized_new (length + 2);
 		str->str[0] = '\n';
@@ -535,6 +591,7 @@ imap_read_untagged (CamelImapStore *store, char *line, CamelException *ex)
 		fulllen += str->len;
 		g_ptr_array_add (data, str);
 
+	next:
 		/* Read the next line. */
 		do {
 			if (camel_imap_store_readline (store, &line, ex) < 0)
@@ -566,6 +623,124 @@ imap_read_untagged (CamelImapStore *store, char *line, CamelException *ex)
 	return NULL;
 }
 
+/* Find the UID and part spec of the message body in @line, the start
+ * of an untagged FETCH response, whose literal starts at @lit */
+static gboolean
+imap_literal_cache_key (const char *line, const char *lit, char **uid, char **part_spec)
+{
+	const char *p, *spec;
+	int len;
+
+	if (strncmp (line, "* ", 2) != 0)
+		return FALSE;
+	strtoul (line + 2, (char **) &p, 10);
+	if (g_ascii_strncasecmp (p, " FETCH (", 8) != 0)
+		return FALSE;
+	p += 8;
+
+	if (lit - p >= 7 && !g_ascii_strncasecmp (lit - 7, "RFC822 ", 7)) {
+		spec = lit - 1;
+	} else {
+		/* not partial fetches, or the HEADER.FIELDS we don't cache */
+		if (lit - p < 8 || strncmp (lit - 2, "] ", 2) != 0)
+			return FALSE;
+		for (spec = lit - 2; spec > p && *spec != '['; spec--)
+			;
+		if (spec - p < 4 || g_ascii_strncasecmp (spec - 4, "BODY[", 5) != 0
+		    || !g_ascii_strncasecmp (spec + 1, "HEADER.FIELDS", 13))
+			return FALSE;
+		spec++;
+	}
+
+	for (; p < spec; p++) {
+		if ((p[-1] == '(' || p[-1] == ' ') && !g_ascii_strncasecmp (p, "UID ", 4))
+			break;
+	}
+	if (p >= spec)
+		return FALSE;
+	p += 4;
+	len = strspn (p, "0123456789");
+	if (len == 0)
+		return FALSE;
+
+	*uid = g_strndup (p, len);
+	*part_spec = *spec == ' ' ? g_strdup ("") : g_strndup (spec, lit - 2 - spec);
+
+	return TRUE;
+}
+
+/* Copy the @length byte literal at @lit in @line from the server into
+ * the message cache of @store's fetch_folder, fixing it up as
+ * imap_read_untagged() does the literals it keeps. Returns %FALSE if
+ * the literal isn't a message body to cache; otherwise the literal has
+ * been read, and @ex is set if the connection failed. */
+static gboolean
+imap_read_literal_to_cache (CamelImapStore *store, const char *line,
+			    const char *lit, size_t length, CamelException *ex)
+{
+	CamelImapFolder *imap_folder = store->fetch_folder;
+	char in[4096], out[4096 + 1], *d, *uid, *part_spec;
+	gboolean cr = FALSE, complete = TRUE;
+	CamelStream *stream;
+	size_t nread = 0;
+	ssize_t n;
+	int i;
+
+	if (!imap_literal_cache_key (line, lit, &uid, &part_spec))
+		return FALSE;
+
+	CAMEL_IMAP_FOLDER_REC_LOCK (imap_folder, cache_lock);
+
+	/* if it can't be cached it's still read, and lost */
+	stream = camel_imap_message_cache_insert_begin (imap_folder->cache, uid, part_spec, NULL);
+
+	while (nread < length) {
+		n = camel_stream_read (store->istream, in, MIN (sizeof (in), length - nread));
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				camel_exception_set (ex, CAMEL_EXCEPTION_USER_CANCEL,
+						     _("Operation cancelled"));
+			else if (n == -1)
+				camel_exception_set (ex, CAMEL_EXCEPTION_SERVICE_UNAVAILABLE,
+						     g_strerror (errno));
+			else
+				camel_exception_set (ex, CAMEL_EXCEPTION_SERVICE_UNAVAILABLE,
+						     _("Server response ended too soon."));
+			camel_service_disconnect (CAMEL_SERVICE (store), FALSE, NULL);
+			complete = FALSE;
+			break;
+		}
+		nread += n;
+
+		/* CRLF to LF, a CR at the end of one read waits for the next */
+		d = out;
+		for (i = 0; i < n; i++) {
+			if (cr && in[i] != '\n')
+				*d++ = '\r';
+			cr = in[i] == '\r';
+			if (!cr && in[i] != '\0')
+				*d++ = in[i];
+		}
+		if (cr && nread == length)
+			*d++ = '\r';
+
+		if (complete && camel_stream_write (stream, out, d - out) == -1)
+			complete = FALSE;
+	}
+
+	if (stream) {
+		stream = camel_imap_message_cache_insert_end (imap_folder->cache, uid, part_spec, stream, complete);
+		if (stream)
+			camel_object_unref (stream);
+	}
+
+	CAMEL_IMAP_FOLDER_REC_UNLOCK (imap_folder, cache_lock);
+
+	g_free (uid);
+	g_free (part_spec);
+
+	return TRUE;
+}
 
 /**
  * camel_imap_response_free:
@@ -580,6 +755,7 @@ camel_imap_response_free (CamelImapStore *store, CamelImapResponse *response)
 {
 	int i, number, exists = 0;
 	GArray *expunged = NULL;
+	GString *vanished = NULL;
 	char *resp, *p;
 
 	if (!response)
@@ -601,6 +777,15 @@ camel_imap_response_free (CamelImapStore *store, CamelImapResponse *response)
 								sizeof (int));
 				}
 				g_array_append_val (expunged, number);
+			} else if (!g_ascii_strncasecmp (p, "VANISHED ", 9)) {
+				/* With QRESYNC enabled expunges are reported by UID */
+				p += 9;
+				if (!g_ascii_strncasecmp (p, "(EARLIER) ", 10))
+					p += 10;
+				if (!vanished)
+					vanished = g_string_new (p);
+				else
+					g_string_append_printf (vanished, ",%s", p);
 			}
 		}
 		g_free (resp);
@@ -609,6 +794,14 @@ camel_imap_response_free (CamelImapStore *store, CamelImapResponse *response)
 	g_ptr_array_free (response->untagged, TRUE);
 	g_free (response->status);
 
+	if (vanished) {
+		/* all of them at once, they're numbered against the summary as it is now */
+		if (!expunged)
+			expunged = g_array_new (FALSE, FALSE, sizeof (int));
+		imap_uid_set_to_expunged (response->folder->summary, vanished->str, expunged);
+		g_string_free (vanished, TRUE);
+	}
+
 	if (response->folder) {
 		if (exists > 0 || expunged) {
 			/* Update the summary */
@@ -732,6 +925,288 @@ camel_imap_response_extract_continuation (CamelImapStore *store,
 	return NULL;
 }
 
+typedef struct {
+	guint32 tag;
+	CamelImapPipelineFunc done;
+	void *data;
+} CamelImapPipelineCommand;
+
+struct _CamelImapPipeline {
+	CamelImapStore *store;
+	int depth;
+
+	GPtrArray *active;	/* commands sent and not yet answered, in the order sent */
+	GPtrArray *untagged;	/* untagged responses since the last tagged one */
+
+	/* EXISTS, EXPUNGE and VANISHED responses. Processing them
+	 * may need to run commands of its own, so it has to wait
+	 * until the pipeline is empty. This response owns the lock
+	 * taken by camel_imap_pipeline_new(). */
+	CamelImapResponse *changes;
+
+	CamelException ex;	/* the first error */
+	gboolean broken;	/* the connection is gone */
+};
+
+/**
+ * camel_imap_pipeline_new:
+ * @store: the IMAP store
+ * @folder: The folder to perform the operations in (or %NULL if not
+ * relevant).
+ * @depth: how many commands to have outstanding at once
+ * @ex: a CamelException
+ *
+ * Creates a pipeline for sending a batch of commands to @store
+ * without waiting for each one to be answered before sending the
+ * next. @folder is selected first, if it isn't already.
+ *
+ * The store's connect_lock is held from now until
+ * camel_imap_pipeline_finish(), and nothing else may use the
+ * connection in between, including the pipeline's own callbacks.
+ *
+ * Return value: the new pipeline, or %NULL if @folder couldn't be
+ * selected (in which case @ex will be set).
+ **/
+CamelImapPipeline *
+camel_imap_pipeline_new (CamelImapStore *store, CamelFolder *folder,
+			 int depth, CamelException *ex)
+{
+	CamelImapPipeline *pipe;
+
+	CAMEL_SERVICE_REC_LOCK (store, connect_lock);
+
+	if (!camel_imap_store_connected (store, ex)
+	    || !imap_command_select (store, folder, ex)) {
+		CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
+		return NULL;
+	}
+
+	pipe = g_new0 (CamelImapPipeline, 1);
+	pipe->store = store;
+	pipe->depth = MAX (depth, 1);
+	pipe->active = g_ptr_array_new ();
+	pipe->untagged = g_ptr_array_new ();
+	camel_exception_init (&pipe->ex);
+
+	pipe->changes = g_new0 (CamelImapResponse, 1);
+	pipe->changes->untagged = g_ptr_array_new ();
+	if (store->current_folder && camel_disco_store_status (CAMEL_DISCO_STORE (store)) != CAMEL_DISCO_STORE_RESYNCING) {
+		pipe->changes->folder = store->current_folder;
+		camel_object_ref (CAMEL_OBJECT (pipe->changes->folder));
+	}
+
+	return pipe;
+}
+
+/* Fail every outstanding command once the connection is lost. The
+ * first @released of them have already had their locks released. */
+static void
+imap_pipeline_fail (CamelImapPipeline *pipe, int released)
+{
+	CamelImapPipelineCommand *ic;
+	int i;
+
+	pipe->broken = TRUE;
+
+	for (i = 0; i < pipe->active->len; i++) {
+		ic = pipe->active->pdata[i];
+		if (i >= released)
+			CAMEL_SERVICE_REC_UNLOCK (pipe->store, connect_lock);
+		ic->done (pipe->store, NULL, &pipe->ex, ic->data);
+		g_free (ic);
+	}
+	g_ptr_array_set_size (pipe->active, 0);
+}
+
+/* Untagged responses that camel_imap_response_free() acts on */
+static gboolean
+imap_pipeline_is_change (const char *resp)
+{
+	char *p;
+
+	strtoul (resp + 2, &p, 10);
+
+	return !g_ascii_strcasecmp (p, " EXISTS")
+		|| !g_ascii_strcasecmp (p, " EXPUNGE")
+		|| !g_ascii_strcasecmp (p, " XGWMOVE")
+		|| !g_ascii_strncasecmp (p, "VANISHED ", 9);
+}
+
+/* Read up to the next tagged response, and complete the command it
+ * answers, whichever of the outstanding ones that is. */
+static void
+imap_pipeline_step (CamelImapPipeline *pipe)
+{
+	CamelImapStore *store = pipe->store;
+	CamelImapPipelineCommand *ic = NULL;
+	CamelImapResponse *response;
+	CamelImapResponseType type;
+	CamelException ex;
+	char *respbuf, *p;
+	guint32 tag;
+	int i;
+
+	camel_exception_init (&ex);
+
+	while ((type = camel_imap_command_response (store, &respbuf, &ex))
+	       == CAMEL_IMAP_RESPONSE_UNTAGGED) {
+		if (imap_pipeline_is_change (respbuf))
+			g_ptr_array_add (pipe->changes->untagged, respbuf);
+		else
+			g_ptr_array_add (pipe->untagged, respbuf);
+	}
+
+	if (type == CAMEL_IMAP_RESPONSE_TAGGED && *respbuf == store->tag_prefix) {
+		tag = strtoul (respbuf + 1, &p, 10);
+		for (i = 0; i < pipe->active->len; i++) {
+			ic = pipe->active->pdata[i];
+			if (ic->tag == tag)
+				break;
+		}
+		if (i == pipe->active->len)
+			ic = NULL;
+	}
+
+	if (ic == NULL) {
+		if (type != CAMEL_IMAP_RESPONSE_ERROR) {
+			g_warning ("Unexpected response from IMAP server: %s", respbuf);
+			camel_exception_setv (&ex, CAMEL_EXCEPTION_SERVICE_UNAVAILABLE,
+					      _("Unexpected response from IMAP "
+						"server: %s"), respbuf);
+			camel_service_disconnect (CAMEL_SERVICE (store), FALSE, NULL);
+			g_free (respbuf);
+		}
+
+		if (!camel_exception_is_set (&pipe->ex))
+			camel_exception_xfer (&pipe->ex, &ex);
+		camel_exception_clear (&ex);
+
+		/* anything but a continuation has released a lock */
+		imap_pipeline_fail (pipe, type != CAMEL_IMAP_RESPONSE_CONTINUATION);
+		return;
+	}
+
+	g_ptr_array_remove_index (pipe->active, i);
+
+	/* the response takes over the lock just released */
+	CAMEL_SERVICE_REC_LOCK (store, connect_lock);
+	response = g_new0 (CamelImapResponse, 1);
+	response->untagged = pipe->untagged;
+	response->status = respbuf;
+	pipe->untagged = g_ptr_array_new ();
+
+	if (imap_status_ok (respbuf, &ex)) {
+		ic->done (store, response, &ex, ic->data);
+	} else {
+		ic->done (store, NULL, &ex, ic->data);
+		if (!camel_exception_is_set (&pipe->ex))
+			camel_exception_xfer (&pipe->ex, &ex);
+	}
+
+	camel_exception_clear (&ex);
+	camel_imap_response_free (store, response);
+	g_free (ic);
+}
+
+/**
+ * camel_imap_pipeline_queue:
+ * @pipe: the pipeline
+ * @done: function to call with the command's response
+ * @data: data for @done
+ * @fmt: a sort of printf-style format string, followed by arguments
+ *
+ * Sends a command on @pipe, first waiting for an earlier one to be
+ * answered if there are already as many outstanding as the pipeline
+ * allows. See camel_imap_command_start() for details on @fmt; as the
+ * command is not waited on, it can't need a continuation.
+ *
+ * @done is called when the command completes, which need not be in
+ * the order the commands were sent. It is passed the response, which
+ * it must not free and which will not include any EXISTS or EXPUNGE
+ * responses, or %NULL with its exception set if the command failed.
+ *
+ * Once a command has failed no more are sent, and @done is called
+ * with the error straight away.
+ *
+ * Return value: %TRUE if the command was sent, %FALSE if not.
+ **/
+gboolean
+camel_imap_pipeline_queue (CamelImapPipeline *pipe, CamelImapPipelineFunc done,
+			   void *data, const char *fmt, ...)
+{
+	CamelImapStore *store = pipe->store;
+	CamelImapPipelineCommand *ic;
+	va_list ap;
+	char *cmd;
+
+	while (!camel_exception_is_set (&pipe->ex)
+	       && pipe->active->len >= pipe->depth)
+		imap_pipeline_step (pipe);
+
+	if (camel_exception_is_set (&pipe->ex)) {
+		done (store, NULL, &pipe->ex, data);
+		return FALSE;
+	}
+
+	va_start (ap, fmt);
+	cmd = imap_command_strdup_vprintf (store, fmt, ap);
+	va_end (ap);
+
+	/* released by camel_imap_command_response() when it's answered */
+	CAMEL_SERVICE_REC_LOCK (store, connect_lock);
+
+	if (!imap_command_send (store, cmd, &pipe->ex)) {
+		g_free (cmd);
+		CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
+		imap_pipeline_fail (pipe, 0);
+		done (store, NULL, &pipe->ex, data);
+		return FALSE;
+	}
+	g_free (cmd);
+
+	ic = g_new (CamelImapPipelineCommand, 1);
+	ic->tag = store->command - 1;
+	ic->done = done;
+	ic->data = data;
+	g_ptr_array_add (pipe->active, ic);
+
+	return TRUE;
+}
+
+/**
+ * camel_imap_pipeline_finish:
+ * @pipe: the pipeline
+ * @ex: a CamelException
+ *
+ * Waits for the commands outstanding on @pipe to complete, processes
+ * any EXISTS and EXPUNGE responses received along the way, frees
+ * @pipe and releases @store's connect_lock. @ex is set to the first
+ * error, if any command failed.
+ **/
+void
+camel_imap_pipeline_finish (CamelImapPipeline *pipe, CamelException *ex)
+{
+	CamelImapStore *store = pipe->store;
+	int i;
+
+	while (pipe->active->len > 0)
+		imap_pipeline_step (pipe);
+
+	for (i = 0; i < pipe->untagged->len; i++)
+		g_free (pipe->untagged->pdata[i]);
+	g_ptr_array_free (pipe->untagged, TRUE);
+	g_ptr_array_free (pipe->active, TRUE);
+
+	if (pipe->broken)
+		camel_imap_response_free_without_processing (store, pipe->changes);
+	else
+		camel_imap_response_free (store, pipe->changes);
+
+	if (camel_exception_is_set (&pipe->ex))
+		camel_exception_xfer (ex, &pipe->ex);
+	g_free (pipe);
+}
+
 static char *
 imap_command_strdup_vprintf (CamelImapStore *store, const char *fmt,
 			     va_list ap)
@@ -45,6 +45,18 @@ struct _CamelImapResponse {
 	char *status;
 };
 
+/* stands in for a message body literal that was written straight
+ * into the message cache rather than kept in the response */
+#define CAMEL_IMAP_LITERAL_CACHED "{cached}"
+
+/* how many commands a pipeline keeps outstanding by default */
+#define CAMEL_IMAP_PIPELINE_DEPTH (32)
+
+typedef void (*CamelImapPipelineFunc) (CamelImapStore *store,
+				       CamelImapResponse *response,
+				       CamelException *ex,
+				       void *data);
+
 CamelImapResponse *camel_imap_command              (CamelImapStore *store,
 						    CamelFolder *folder,
 						    CamelException *ex,
@@ -74,6 +86,17 @@ CamelImapResponseType camel_imap_command_response  (CamelImapStore *store,
 						    char **respbuf,
 						    CamelException *ex);
 
+CamelImapPipeline *camel_imap_pipeline_new         (CamelImapStore *store,
+						    CamelFolder *folder,
+						    int depth,
+						    CamelException *ex);
+gboolean           camel_imap_pipeline_queue       (CamelImapPipeline *pipe,
+						    CamelImapPipelineFunc done,
+						    void *data,
+						    const char *fmt, ...);
+void               camel_imap_pipeline_finish      (CamelImapPipeline *pipe,
+						    CamelException *ex);
+
 G_END_DECLS
 
 #endif /* CAMEL_IMAP_COMMAND_H */
@@ -100,6 +100,7 @@ static void imap_expunge_uids_online (CamelFolder *folder, GPtrArray *uids, Came
 static void imap_expunge_uids_offline (CamelFolder *folder, GPtrArray *uids, CamelException *ex);
 static void imap_expunge_uids_resyncing (CamelFolder *folder, GPtrArray *uids, CamelException *ex);
 static void imap_cache_message (CamelDiscoFolder *disco_folder, const char *uid, CamelException *ex);
+static void imap_prepare_for_offline (CamelDiscoFolder *disco_folder, const char *expression, CamelException *ex);
 static void imap_rename (CamelFolder *folder, const char *new);
 
 /* message manipulation */
@@ -185,6 +186,7 @@ camel_imap_folder_class_init (CamelImapFolderClass *camel_imap_folder_class)
 	camel_disco_folder_class->transfer_offline = imap_transfer_offline;
 	camel_disco_folder_class->transfer_resyncing = imap_transfer_resyncing;
 	camel_disco_folder_class->cache_message = imap_cache_message;
+	camel_disco_folder_class->prepare_for_offline = imap_prepare_for_offline;
 }
 
 static void
@@ -234,6 +236,41 @@ camel_imap_folder_get_type (void)
 	return camel_imap_folder_type;
 }
 
+/* Checking a big cache against the summary is left to a thread,
+ * rather than holding up opening the folder */
+struct _cache_expire_msg {
+	CamelSessionThreadMsg msg;
+
+	CamelFolder *folder;
+};
+
+static void
+cache_expire_expire (CamelSession *session, CamelSessionThreadMsg *msg)
+{
+	struct _cache_expire_msg *m = (struct _cache_expire_msg *)msg;
+	CamelImapFolder *imap_folder = CAMEL_IMAP_FOLDER (m->folder);
+	int left;
+
+	do {
+		CAMEL_IMAP_FOLDER_REC_LOCK (imap_folder, cache_lock);
+		left = camel_imap_message_cache_expire (imap_folder->cache, m->folder->summary, 256);
+		CAMEL_IMAP_FOLDER_REC_UNLOCK (imap_folder, cache_lock);
+	} while (left > 0);
+}
+
+static void
+cache_expire_free (CamelSession *session, CamelSessionThreadMsg *msg)
+{
+	struct _cache_expire_msg *m = (struct _cache_expire_msg *)msg;
+
+	camel_object_unref (m->folder);
+}
+
+static CamelSessionThreadOps cache_expire_ops = {
+	cache_expire_expire,
+	cache_expire_free,
+};
+
 CamelFolder *
 camel_imap_folder_new (CamelStore *parent, const char *folder_name,
 		       const char *folder_dir, CamelException *ex)
@@ -283,6 +320,16 @@ camel_imap_folder_new (CamelStore *parent, const char *folder_name,
 		return NULL;
 	}
 
+	if (imap_folder->cache->unchecked->len > 0) {
+		CamelSession *session = ((CamelService *)parent)->session;
+		struct _cache_expire_msg *m;
+
+		m = camel_session_thread_msg_new (session, &cache_expire_ops, sizeof (*m));
+		m->folder = folder;
+		camel_object_ref (folder);
+		camel_session_thread_queue (session, &m->msg, 0);
+	}
+
 	if (!g_ascii_strcasecmp (folder_name, "INBOX")) {
 		if ((imap_store->parameters & IMAP_PARAM_FILTER_INBOX))
 			folder->folder_flags |= CAMEL_FOLDER_FILTER_RECENT;
@@ -298,6 +345,66 @@ camel_imap_folder_new (CamelStore *parent, const char *folder_name,
 	return folder;
 }
 
+/* Record that the summary is up to date with the server as of @modseq */
+static void
+imap_set_highestmodseq (CamelFolder *folder, guint64 modseq)
+{
+	CamelImapSummary *imap_summary = CAMEL_IMAP_SUMMARY (folder->summary);
+
+	if (imap_summary->highestmodseq != modseq) {
+		imap_summary->highestmodseq = modseq;
+		camel_folder_summary_touch_header (folder->summary);
+	}
+}
+
+/* Whether message @count on the server is the last one in the summary,
+ * that is, nothing we know about has been removed. Called with the
+ * store's connect_lock locked and the folder selected. */
+static gboolean
+imap_last_uid_matches (CamelFolder *folder, int count, unsigned long *exists, CamelException *ex)
+{
+	CamelImapFolder *imap_folder = CAMEL_IMAP_FOLDER (folder);
+	CamelImapStore *store = CAMEL_IMAP_STORE (folder->parent_store);
+	CamelImapResponse *response;
+	CamelMessageInfo *info;
+	unsigned long val, uid;
+	GData *fetch_data;
+	char *resp;
+	int i;
+
+	/* We pass NULL for the folder since we know that this folder
+	 * is selected, and we don't want camel_imap_command to worry
+	 * about it. */
+	response = camel_imap_command (store, NULL, ex, "FETCH %d UID", count);
+	if (!response)
+		return FALSE;
+	uid = 0;
+	for (i = 0; i < response->untagged->len; i++) {
+		resp = response->untagged->pdata[i];
+		val = strtoul (resp + 2, &resp, 10);
+		if (val == 0)
+			continue;
+		if (!g_ascii_strcasecmp (resp, " EXISTS")) {
+			/* Another one?? */
+			*exists = val;
+			continue;
+		}
+		if (uid != 0 || val != count || g_ascii_strncasecmp (resp, " FETCH (", 8) != 0)
+			continue;
+
+		fetch_data = parse_fetch_response (imap_folder, resp + 7);
+		uid = strtoul (g_datalist_get_data (&fetch_data, "UID"), NULL, 10);
+		g_datalist_clear (&fetch_data);
+	}
+	camel_imap_response_free_without_processing (store, response);
+
+	info = camel_folder_summary_index (folder->summary, count - 1);
+	val = strtoul (camel_message_info_uid (info), NULL, 10);
+	camel_message_info_free(info);
+
+	return uid != 0 && uid == val;
+}
+
 /* Called with the store's connect_lock locked */
 void
 camel_imap_folder_selected (CamelFolder *folder, CamelImapResponse *response,
@@ -305,10 +412,9 @@ camel_imap_folder_selected (CamelFolder *folder, CamelImapResponse *response,
 {
 	CamelImapFolder *imap_folder = CAMEL_IMAP_FOLDER (folder);
 	CamelImapSummary *imap_summary = CAMEL_IMAP_SUMMARY (folder->summary);
-	unsigned long exists = 0, validity = 0, val, uid;
-	CamelMessageInfo *info;
+	unsigned long exists = 0, validity = 0;
+	guint64 modseq = 0;
 	guint32 perm_flags = 0;
-	GData *fetch_data;
 	int i, count;
 	char *resp;
 
@@ -330,6 +436,8 @@ camel_imap_folder_selected (CamelFolder *folder, CamelImapResponse *response,
 				folder->permanent_flags = perm_flags;
 		} else if (!g_ascii_strncasecmp (resp, "OK [UIDVALIDITY ", 16)) {
 			validity = strtoul (resp + 16, NULL, 10);
+		} else if (!g_ascii_strncasecmp (resp, "OK [HIGHESTMODSEQ ", 18)) {
+			modseq = g_ascii_strtoull (resp + 18, NULL, 10);
 		} else if (isdigit ((unsigned char)*resp)) {
 			unsigned long num = strtoul (resp, &resp, 10);
 
@@ -347,6 +455,10 @@ camel_imap_folder_selected (CamelFolder *folder, CamelImapResponse *response,
 	if (camel_strstrcase (response->status, "OK [READ-ONLY]"))
 		imap_folder->read_only = TRUE;
 
+	/* a server without CONDSTORE, or a mailbox without
+	 * mod-sequences (NOMODSEQ), doesn't send HIGHESTMODSEQ */
+	imap_folder->modseq = modseq;
+
 	if (camel_disco_store_status (CAMEL_DISCO_STORE (folder->parent_store)) == CAMEL_DISCO_STORE_RESYNCING) {
 		if (validity != imap_summary->validity) {
 			camel_exception_setv (ex, CAMEL_EXCEPTION_FOLDER_SUMMARY_INVALID,
@@ -367,6 +479,8 @@ camel_imap_folder_selected (CamelFolder *folder, CamelImapResponse *response,
 		camel_imap_message_cache_clear (imap_folder->cache);
 		CAMEL_IMAP_FOLDER_REC_UNLOCK (imap_folder, cache_lock);
 		imap_folder->need_rescan = FALSE;
+		/* everything is fetched afresh, so it is up to date with the server */
+		imap_set_highestmodseq (folder, modseq);
 		camel_imap_folder_changed (folder, exists, NULL, ex);
 		return;
 	}
@@ -374,45 +488,30 @@ camel_imap_folder_selected (CamelFolder *folder, CamelImapResponse *response,
 	/* If we've lost messages, we have to rescan everything */
 	if (exists < count)
 		imap_folder->need_rescan = TRUE;
-	else if (count != 0 && !imap_folder->need_rescan) {
+	else if (count != 0 && !imap_folder->need_rescan && modseq != 0
+		 && imap_summary->highestmodseq != 0) {
 		CamelImapStore *store = CAMEL_IMAP_STORE (folder->parent_store);
 
+		/* With CONDSTORE any change since we last looked
+		 * bumps HIGHESTMODSEQ, and the rescan only asks for
+		 * what changed, so it's cheap. QRESYNC servers bump
+		 * it for expunges too, so if it hasn't moved nothing
+		 * but new messages can have happened. */
+		if (modseq != imap_summary->highestmodseq)
+			imap_folder->need_rescan = TRUE;
+		else if (!(store->capabilities & IMAP_CAPABILITY_QRESYNC))
+			imap_folder->need_rescan = !imap_last_uid_matches (folder, count, &exists, ex);
+		if (camel_exception_is_set (ex))
+			return;
+	} else if (count != 0 && !imap_folder->need_rescan) {
 		/* Similarly, if the UID of the highest message we
 		 * know about has changed, then that indicates that
 		 * messages have been both added and removed, so we
-		 * have to rescan to find the removed ones. (We pass
-		 * NULL for the folder since we know that this folder
-		 * is selected, and we don't want camel_imap_command
-		 * to worry about it.)
+		 * have to rescan to find the removed ones.
 		 */
-		response = camel_imap_command (store, NULL, ex, "FETCH %d UID", count);
-		if (!response)
+		imap_folder->need_rescan = !imap_last_uid_matches (folder, count, &exists, ex);
+		if (camel_exception_is_set (ex))
 			return;
-		uid = 0;
-		for (i = 0; i < response->untagged->len; i++) {
-			resp = response->untagged->pdata[i];
-			val = strtoul (resp + 2, &resp, 10);
-			if (val == 0)
-				continue;
-			if (!g_ascii_strcasecmp (resp, " EXISTS")) {
-				/* Another one?? */
-				exists = val;
-				continue;
-			}
-			if (uid != 0 || val != count || g_ascii_strncasecmp (resp, " FETCH (", 8) != 0)
-				continue;
-
-			fetch_data = parse_fetch_response (imap_folder, resp + 7);
-			uid = strtoul (g_datalist_get_data (&fetch_data, "UID"), NULL, 10);
-			g_datalist_clear (&fetch_data);
-		}
-		camel_imap_response_free_without_processing (store, response);
-
-		info = camel_folder_summary_index (folder->summary, count - 1);
-		val = strtoul (camel_message_info_uid (info), NULL, 10);
-		camel_message_info_free(info);
-		if (uid == 0 || uid != val)
-			imap_folder->need_rescan = TRUE;
 	}
 
 	/* Now rescan if we need to */
@@ -421,6 +520,10 @@ camel_imap_folder_selected (CamelFolder *folder, CamelImapResponse *response,
 		return;
 	}
 
+	/* An empty summary is about to get everything there is */
+	if (count == 0)
+		imap_set_highestmodseq (folder, modseq);
+
 	/* If we don't need to rescan completely, but new messages
 	 * have been added, find out about them.
 	 */
@@ -802,6 +905,163 @@ merge_custom_flags (CamelMessageInfo *mi, const char *custom_flags)
 	return changed;
 }
 
+/* Merge what the server has for a message into its info, returns
+ * whether anything changed */
+static gboolean
+imap_rescan_merge (CamelFolder *folder, CamelMessageInfo *info, guint32 flags, const char *custom_flags)
+{
+	CamelImapMessageInfo *iinfo = (CamelImapMessageInfo *)info;
+	gboolean changed = FALSE;
+
+	/* Update summary flags */
+	if (flags != iinfo->server_flags) {
+		guint32 server_set, server_cleared;
+
+		server_set = flags & ~iinfo->server_flags;
+		server_cleared = iinfo->server_flags & ~flags;
+
+		iinfo->info.flags = (iinfo->info.flags | server_set) & ~server_cleared;
+		iinfo->server_flags = flags;
+
+		changed = TRUE;
+	}
+
+	/* Do not merge custom flags when server doesn't support it.
+	   Because server always reports NULL, which means none, which
+	   will remove user's flags from local machine, which is bad.
+	*/
+	if ((folder->permanent_flags & CAMEL_MESSAGE_USER) != 0 && merge_custom_flags (info, custom_flags))
+		changed = TRUE;
+
+	return changed;
+}
+
+/* Ask only for the flags that changed since the summary's
+ * HIGHESTMODSEQ and, with QRESYNC, for the UIDs that vanished.
+ * Returns FALSE if everything has to be rescanned after all.
+ * Called with the store's connect_lock locked */
+static gboolean
+imap_rescan_changed (CamelFolder *folder, int exists, CamelException *ex)
+{
+	CamelImapFolder *imap_folder = CAMEL_IMAP_FOLDER (folder);
+	CamelImapStore *store = CAMEL_IMAP_STORE (folder->parent_store);
+	CamelImapSummary *imap_summary = CAMEL_IMAP_SUMMARY (folder->summary);
+	extern int camel_application_is_exiting;
+	CamelFolderChangeInfo *changes = NULL;
+	CamelImapResponseType type;
+	CamelMessageInfo *info;
+	GString *vanished = NULL;
+	GArray *removed;
+	guint64 modseq, highest;
+	char *resp, *since, *last;
+	int summary_len, qresync;
+	gboolean ok;
+
+	qresync = (store->capabilities & IMAP_CAPABILITY_QRESYNC) != 0;
+	summary_len = camel_folder_summary_count (folder->summary);
+
+	/* Without VANISHED we can only tell that nothing was
+	 * removed, not what was */
+	if (!qresync) {
+		unsigned long count = exists;
+
+		if (exists < summary_len)
+			return FALSE;
+		if (!imap_last_uid_matches (folder, summary_len, &count, ex))
+			return camel_exception_is_set (ex);
+		exists = count;
+	}
+
+	info = camel_folder_summary_index (folder->summary, summary_len - 1);
+	last = g_strdup (camel_message_info_uid (info));
+	camel_message_info_free(info);
+	since = g_strdup_printf ("%" G_GUINT64_FORMAT, imap_summary->highestmodseq);
+
+	camel_operation_start (NULL, _("Scanning for changed messages in %s"), folder->name);
+	ok = camel_imap_command_start (store, folder, ex,
+				       "UID FETCH 1:%s (FLAGS) (CHANGEDSINCE %s%s)",
+				       last, since, qresync ? " VANISHED" : "");
+	g_free (last);
+	g_free (since);
+	if (!ok) {
+		camel_operation_end (NULL);
+		return TRUE;
+	}
+
+	highest = imap_folder->modseq;
+	while ((type = camel_imap_command_response (store, &resp, ex)) == CAMEL_IMAP_RESPONSE_UNTAGGED && !camel_application_is_exiting) {
+		GData *data;
+		char *uid, *p;
+
+		if (!g_ascii_strncasecmp (resp, "* VANISHED ", 11)) {
+			p = resp + 11;
+			if (!g_ascii_strncasecmp (p, "(EARLIER) ", 10))
+				p += 10;
+			if (!vanished)
+				vanished = g_string_new (p);
+			else
+				g_string_append_printf (vanished, ",%s", p);
+			g_free (resp);
+			continue;
+		}
+
+		data = parse_fetch_response (imap_folder, resp);
+		g_free (resp);
+		if (!data)
+			continue;
+
+		if ((p = g_datalist_get_data (&data, "MODSEQ"))) {
+			modseq = g_ascii_strtoull (p, NULL, 10);
+			if (modseq > highest)
+				highest = modseq;
+		}
+
+		uid = g_datalist_get_data (&data, "UID");
+		if (uid && (info = camel_folder_summary_uid (folder->summary, uid))) {
+			if (imap_rescan_merge (folder, info, GPOINTER_TO_UINT (g_datalist_get_data (&data, "FLAGS")),
+					       g_datalist_get_data (&data, "CUSTOM.FLAGS"))) {
+				if (changes == NULL)
+					changes = camel_folder_change_info_new();
+				camel_folder_change_info_change_uid(changes, uid);
+			}
+			camel_message_info_free(info);
+		}
+		g_datalist_clear (&data);
+	}
+
+	camel_operation_end (NULL);
+	if (type == CAMEL_IMAP_RESPONSE_ERROR || camel_application_is_exiting) {
+		if (type != CAMEL_IMAP_RESPONSE_ERROR && type != CAMEL_IMAP_RESPONSE_TAGGED)
+			CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
+		if (changes)
+			camel_folder_change_info_free(changes);
+		if (vanished)
+			g_string_free (vanished, TRUE);
+
+		return TRUE;
+	}
+
+	/* Free the final tagged response */
+	g_free (resp);
+
+	if (changes) {
+		camel_object_trigger_event(CAMEL_OBJECT (folder), "folder_changed", changes);
+		camel_folder_change_info_free(changes);
+	}
+
+	removed = g_array_new (FALSE, FALSE, sizeof (int));
+	if (vanished) {
+		imap_uid_set_to_expunged (folder->summary, vanished->str, removed);
+		g_string_free (vanished, TRUE);
+	}
+
+	imap_set_highestmodseq (folder, highest);
+	camel_imap_folder_changed (folder, exists, removed, ex);
+	g_array_free (removed, TRUE);
+
+	return TRUE;
+}
+
 /* Called with the store's connect_lock locked */
 static void
 imap_rescan (CamelFolder *folder, int exists, CamelException *ex)
@@ -818,7 +1078,6 @@ imap_rescan (CamelFolder *folder, int exists, CamelException *ex)
 	CamelImapResponseType type;
 	int i, seq, summary_len, summary_got;
 	CamelMessageInfo *info;
-	CamelImapMessageInfo *iinfo;
 	GArray *removed;
 	gboolean ok;
 	CamelFolderChangeInfo *changes = NULL;
@@ -830,11 +1089,19 @@ imap_rescan (CamelFolder *folder, int exists, CamelException *ex)
 
 	summary_len = camel_folder_summary_count (folder->summary);
 	if (summary_len == 0) {
+		imap_set_highestmodseq (folder, imap_folder->modseq);
 		if (exists)
 			camel_imap_folder_changed (folder, exists, NULL, ex);
 		return;
 	}
 
+	/* With CONDSTORE, only what changed since we last looked */
+	if (imap_folder->modseq != 0
+	    && CAMEL_IMAP_SUMMARY (folder->summary)->highestmodseq != 0
+	    && (store->capabilities & (IMAP_CAPABILITY_CONDSTORE | IMAP_CAPABILITY_QRESYNC))
+	    && imap_rescan_changed (folder, exists, ex))
+		return;
+
 	/* Check UIDs and flags of all messages we already know of. */
 	camel_operation_start (NULL, _("Scanning for changed messages in %s"), folder->name);
 	info = camel_folder_summary_index (folder->summary, summary_len - 1);
@@ -901,10 +1168,7 @@ imap_rescan (CamelFolder *folder, int exists, CamelException *ex)
 	 */
 	removed = g_array_new (FALSE, FALSE, sizeof (int));
 	for (i = 0; i < summary_len && new[i].uid; i++) {
-		gboolean changed = FALSE;
-
 		info = camel_folder_summary_index (folder->summary, i);
-		iinfo = (CamelImapMessageInfo *)info;
 
 		if (strcmp (camel_message_info_uid (info), new[i].uid) != 0) {
 			camel_message_info_free(info);
@@ -915,27 +1179,7 @@ imap_rescan (CamelFolder *folder, int exists, CamelException *ex)
 			continue;
 		}
 
-		/* Update summary flags */
-		if (new[i].flags != iinfo->server_flags) {
-			guint32 server_set, server_cleared;
-
-			server_set = new[i].flags & ~iinfo->server_flags;
-			server_cleared = iinfo->server_flags & ~new[i].flags;
-
-			iinfo->info.flags = (iinfo->info.flags | server_set) & ~server_cleared;
-			iinfo->server_flags = new[i].flags;
-
-			changed = TRUE;
-		}
-
-		/* Do not merge custom flags when server doesn't support it.
-		   Because server always reports NULL, which means none, which
-		   will remove user's flags from local machine, which is bad.
-		*/
-		if ((folder->permanent_flags & CAMEL_MESSAGE_USER) != 0 && merge_custom_flags (info, new[i].custom_flags))
-			changed = TRUE;
-
-		if (changed) {
+		if (imap_rescan_merge (folder, info, new[i].flags, new[i].custom_flags)) {
 			if (changes == NULL)
 				changes = camel_folder_change_info_new();
 			camel_folder_change_info_change_uid(changes, new[i].uid);
@@ -969,6 +1213,9 @@ imap_rescan (CamelFolder *folder, int exists, CamelException *ex)
 	for (i = seq; i <= summary_len; i++)
 		g_array_append_val (removed, seq);
 
+	/* Everything as of when the folder was selected has been seen */
+	imap_set_highestmodseq (folder, imap_folder->modseq);
+
 	/* And finally update the summary. */
 	camel_imap_folder_changed (folder, exists, removed, ex);
 	g_array_free (removed, TRUE);
@@ -1118,18 +1365,48 @@ imap_sync_offline (CamelFolder *folder, CamelException *ex)
 
 	camel_folder_summary_save (folder->summary);
 	camel_store_summary_save((CamelStoreSummary *)((CamelImapStore *)folder->parent_store)->summary);
+
+	CAMEL_IMAP_FOLDER_REC_LOCK (folder, cache_lock);
+	camel_imap_message_cache_save (CAMEL_IMAP_FOLDER (folder)->cache);
+	CAMEL_IMAP_FOLDER_REC_UNLOCK (folder, cache_lock);
+}
+
+typedef struct {
+	CamelFolder *folder;
+	GPtrArray *matches;
+} ImapSyncFlags;
+
+static void
+imap_sync_flags_done (CamelImapStore *store, CamelImapResponse *response,
+		      CamelException *ex, void *data)
+{
+	ImapSyncFlags *sf = data;
+	CamelImapMessageInfo *info;
+	int j;
+
+	for (j = 0; j < sf->matches->len; j++) {
+		info = sf->matches->pdata[j];
+		if (response) {
+			info->server_flags = info->info.flags & CAMEL_IMAP_SERVER_FLAGS;
+			camel_folder_summary_touch_info (sf->folder->summary, (CamelMessageInfo *) info);
+		} else
+			info->info.flags |= CAMEL_MESSAGE_FOLDER_FLAGGED;
+		camel_message_info_free(&info->info);
+	}
+	g_ptr_array_free (sf->matches, TRUE);
+	g_free (sf);
 }
 
 static void
 imap_sync_online (CamelFolder *folder, CamelException *ex)
 {
 	CamelImapStore *store = CAMEL_IMAP_STORE (folder->parent_store);
-	CamelImapResponse *response = NULL;
+	CamelImapPipeline *pipe;
 	CamelImapMessageInfo *info;
-	CamelException local_ex;
+	ImapSyncFlags *sf;
 	GPtrArray *matches;
 	char *set, *flaglist;
-	gboolean unset;
+	gboolean unset, queued;
 	int i, j, max;
 
 	if (folder->permanent_flags == 0) {
@@ -1137,13 +1414,13 @@ imap_sync_online (CamelFolder *folder, CamelException *ex)
 		return;
 	}
 
-	camel_exception_init (&local_ex);
 	CAMEL_SERVICE_REC_LOCK (store, connect_lock);
 
 	/* Find a message with changed flags, find all of the other
 	 * messages like it, sync them as a group, mark them as
 	 * updated, and continue.
 	 */
+	pipe = NULL;
 	max = camel_folder_summary_count (folder->summary);
 	for (i = 0; i < max; i++) {
 		if (!(info = (CamelImapMessageInfo *)camel_folder_summary_index (folder->summary, i)))
@@ -1171,7 +1448,11 @@ imap_sync_online (CamelFolder *folder, CamelException *ex)
 			continue;
 
 		/* Make sure we're connected before issuing commands */
-		if (!camel_imap_store_connected(store, ex)) {
+		if (pipe == NULL
+		    && (pipe = camel_imap_pipeline_new (store, folder, CAMEL_IMAP_PIPELINE_DEPTH, ex)) == NULL) {
+			for (j = 0; j < matches->len; j++)
+				camel_message_info_free(matches->pdata[j]);
+			g_ptr_array_free (matches, TRUE);
 			g_free(set);
 			break;
 		}
@@ -1181,42 +1462,36 @@ imap_sync_online (CamelFolder *folder, CamelException *ex)
 		/* FIXME: Sankar: What about custom flags ? */
 		flaglist = imap_create_flag_list (unset ? folder->permanent_flags : info->info.flags & folder->permanent_flags, (CamelMessageInfo *)info, folder->permanent_flags);
 
-		/* Note: to `unset' flags, use -FLAGS.SILENT (<flag list>) */
-		response = camel_imap_command (store, folder, &local_ex,
-					       "UID STORE %s %sFLAGS.SILENT %s",
-					       set, unset ? "-" : "", flaglist);
-		g_free (set);
-		g_free (flaglist);
-
-		if (response)
-			camel_imap_response_free (store, response);
-
-		if (!camel_exception_is_set (&local_ex)) {
-			for (j = 0; j < matches->len; j++) {
-				info = matches->pdata[j];
-				info->info.flags &= ~CAMEL_MESSAGE_FOLDER_FLAGGED;
-				((CamelImapMessageInfo *) info)->server_flags =	info->info.flags & CAMEL_IMAP_SERVER_FLAGS;
-			}
-			camel_folder_summary_touch (folder->summary);
-		}
-
+		/* Mark them as updated now, so get_matching() doesn't
+		 * find them again while the STORE is outstanding. They
+		 * are flagged again if it fails.
+		 */
 		for (j = 0; j < matches->len; j++) {
 			info = matches->pdata[j];
-			camel_message_info_free(&info->info);
+			info->info.flags &= ~CAMEL_MESSAGE_FOLDER_FLAGGED;
 		}
-		g_ptr_array_free (matches, TRUE);
 
-		/* We unlock here so that other threads can have a chance to grab the connect_lock */
-		CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
+		sf = g_new (ImapSyncFlags, 1);
+		sf->folder = folder;
+		sf->matches = matches;
+
+		/* Note: to `unset' flags, use -FLAGS.SILENT (<flag list>) */
+		queued = camel_imap_pipeline_queue (pipe, imap_sync_flags_done, sf,
+						    "UID STORE %s %sFLAGS.SILENT %s",
+						    set, unset ? "-" : "", flaglist);
+		g_free (set);
+		g_free (flaglist);
+
+		if (!queued)
+			break;
+	}
 
-		/* check for an exception */
-		if (camel_exception_is_set (&local_ex)) {
-			camel_exception_xfer (ex, &local_ex);
+	if (pipe) {
+		camel_imap_pipeline_finish (pipe, ex);
+		if (camel_exception_is_set (ex)) {
+			CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
 			return;
 		}
-
-		/* Re-lock the connect_lock */
-		CAMEL_SERVICE_REC_LOCK (store, connect_lock);
 	}
 
 	/* Save the summary */
@@ -1769,7 +2044,7 @@ imap_transfer_offline (CamelFolder *source, GPtrArray *uids,
 }
 
 static void
-handle_copyuid (CamelImapResponse *response, CamelFolder *source,
+handle_copyuid (const char *status, CamelFolder *source,
 		CamelFolder *destination)
 {
 	CamelImapMessageCache *scache = CAMEL_IMAP_FOLDER (source)->cache;
@@ -1778,7 +2053,7 @@ handle_copyuid (CamelImapResponse *response, CamelFolder *source,
 	GPtrArray *src, *dest;
 	int i;
 
-	validity = camel_strstrcase (response->status, "[COPYUID ");
+	validity = camel_strstrcase (status, "[COPYUID ");
 	if (!validity)
 		return;
 	validity += 9;
@@ -1825,14 +2100,14 @@ handle_copyuid (CamelImapResponse *response, CamelFolder *source,
 }
 
 static void
-handle_copyuid_copy_user_tags (CamelImapResponse *response, CamelFolder *source, CamelFolder *destination)
+handle_copyuid_copy_user_tags (const char *status, CamelFolder *source, CamelFolder *destination)
 {
 	char *validity, *srcset, *destset;
 	GPtrArray *src, *dest;
 	int i;
 	CamelException ex;
 
-	validity = camel_strstrcase (response->status, "[COPYUID ");
+	validity = camel_strstrcase (status, "[COPYUID ");
 	if (!validity)
 		return;
 	validity += 9;
@@ -1898,38 +2173,95 @@ handle_copyuid_copy_user_tags (CamelImapResponse *response, CamelFolder *source,
 	g_warning ("Bad COPYUID response from server");
 }
 
+typedef struct {
+	CamelFolder *source;
+	GPtrArray *uids;
+	int first, last;
+	gboolean delete_originals;
+	char *status;
+} ImapCopyChunk;
+
+static void
+imap_copy_done (CamelImapStore *store, CamelImapResponse *response,
+		CamelException *ex, void *data)
+{
+	ImapCopyChunk *cc = data;
+	int i;
+
+	if (!response)
+		return;
+
+	/* the COPYUID has to wait, handling it may run commands */
+	cc->status = g_strdup (response->status);
+
+	if (cc->delete_originals) {
+		for (i = cc->first; i < cc->last; i++)
+			camel_folder_delete_message (cc->source, cc->uids->pdata[i]);
+	}
+}
+
 static void
 do_copy (CamelFolder *source, GPtrArray *uids,
 	 CamelFolder *destination, int delete_originals, CamelException *ex)
 {
 	CamelImapStore *store = CAMEL_IMAP_STORE (source->parent_store);
-	CamelImapResponse *response;
+	gboolean move, queued;
+	CamelImapPipeline *pipe;
+	ImapCopyChunk *cc;
+	GPtrArray *chunks;
 	char *uidset;
-	int uid = 0, last=0, i;
+	int uid = 0, i;
+
+	move = (store->capabilities & IMAP_CAPABILITY_XGWMOVE) && delete_originals;
+
+	/* Held until the COPYUIDs have been handled, for the cache locks */
+	CAMEL_SERVICE_REC_LOCK (store, connect_lock);
+
+	pipe = camel_imap_pipeline_new (store, source, CAMEL_IMAP_PIPELINE_DEPTH, ex);
+	if (!pipe) {
+		CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
+		return;
+	}
+
+	chunks = g_ptr_array_new ();
+	while (uid < uids->len) {
+		cc = g_new0 (ImapCopyChunk, 1);
+		cc->source = source;
+		cc->uids = uids;
+		cc->first = uid;
+		cc->delete_originals = delete_originals && !move;
+		g_ptr_array_add (chunks, cc);
 
-	while (uid < uids->len && !camel_exception_is_set (ex)) {
 		uidset = imap_uid_array_to_set (source->summary, uids, uid, UID_SET_LIMIT, &uid);
+		cc->last = uid;
 
-		if ((store->capabilities & IMAP_CAPABILITY_XGWMOVE) && delete_originals) {
-			response = camel_imap_command (store, source, ex, "UID XGWMOVE %s %F", uidset, destination->full_name);
+		if (move) {
 			/* TODO: EXPUNGE returns??? */
-			camel_imap_response_free (store, response);
+			queued = camel_imap_pipeline_queue (pipe, imap_copy_done, cc, "UID XGWMOVE %s %F", uidset, destination->full_name);
 		} else {
-			response = camel_imap_command (store, source, ex, "UID COPY %s %F", uidset, destination->full_name);
-			if (response && (store->capabilities & IMAP_CAPABILITY_UIDPLUS))
-				handle_copyuid (response, source, destination);
-			if (response)
-				handle_copyuid_copy_user_tags (response, source, destination);
-			camel_imap_response_free (store, response);
-
-			if (!camel_exception_is_set(ex) && delete_originals) {
-				for (i=last;i<uid;i++)
-					camel_folder_delete_message(source, uids->pdata[i]);
-				last = uid;
-			}
+			queued = camel_imap_pipeline_queue (pipe, imap_copy_done, cc, "UID COPY %s %F", uidset, destination->full_name);
 		}
 		g_free (uidset);
+
+		if (!queued)
+			break;
+	}
+
+	camel_imap_pipeline_finish (pipe, ex);
+
+	for (i = 0; i < chunks->len; i++) {
+		cc = chunks->pdata[i];
+		if (cc->status && !move) {
+			if (store->capabilities & IMAP_CAPABILITY_UIDPLUS)
+				handle_copyuid (cc->status, source, destination);
+			handle_copyuid_copy_user_tags (cc->status, source, destination);
+		}
+		g_free (cc->status);
+		g_free (cc);
 	}
+	g_ptr_array_free (chunks, TRUE);
+
+	CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
 }
 
 static void
@@ -2508,7 +2840,7 @@ imap_get_message (CamelFolder *folder, const char *uid, CamelException *ex)
 					if (body) {
 						/* NB: small race here, setting the info.content */
 						imap_parse_body ((const char **) &body, folder, mi->info.content);
-						camel_folder_summary_touch (folder->summary);
+						camel_folder_summary_touch_info (folder->summary, (CamelMessageInfo *) mi);
 					}
 
 					if (fetch_data)
@@ -2562,6 +2894,122 @@ imap_cache_message (CamelDiscoFolder *disco_folder, const char *uid,
 		camel_object_unref (CAMEL_OBJECT (stream));
 }
 
+typedef struct {
+	CamelImapFolder *imap_folder;
+	int done, total;
+} ImapCacheProgress;
+
+static void
+imap_cache_message_done (CamelImapStore *store, CamelImapResponse *response,
+			 CamelException *ex, void *data)
+{
+	ImapCacheProgress *cp = data;
+	GData *fetch_data;
+	int i;
+
+	cp->done++;
+	camel_operation_progress (NULL, cp->done * 100 / cp->total);
+
+	if (!response)
+		return;
+
+	/* parse_fetch_response() puts the bodies in the cache. Any
+	 * FETCH in the response will do, whichever command it came
+	 * with. */
+	CAMEL_IMAP_FOLDER_REC_LOCK (cp->imap_folder, cache_lock);
+	for (i = 0; i < response->untagged->len; i++) {
+		fetch_data = parse_fetch_response (cp->imap_folder, response->untagged->pdata[i]);
+		g_datalist_clear (&fetch_data);
+	}
+	CAMEL_IMAP_FOLDER_REC_UNLOCK (cp->imap_folder, cache_lock);
+}
+
+static void
+imap_prepare_for_offline (CamelDiscoFolder *disco_folder,
+			  const char *expression,
+			  CamelException *ex)
+{
+	CamelFolder *folder = CAMEL_FOLDER (disco_folder);
+	CamelImapFolder *imap_folder = CAMEL_IMAP_FOLDER (disco_folder);
+	CamelImapStore *store = CAMEL_IMAP_STORE (folder->parent_store);
+	CamelImapStore *conn;
+	CamelImapPipeline *pipe;
+	ImapCacheProgress cp;
+	CamelStream *stream;
+	GPtrArray *uids;
+	int i;
+
+	camel_operation_start(NULL, _("Preparing folder '%s' for offline"), folder->full_name);
+
+	if (expression)
+		uids = camel_folder_search_by_expression (folder, expression, ex);
+	else
+		uids = camel_folder_get_uids (folder);
+
+	if (!uids) {
+		camel_operation_end(NULL);
+		return;
+	}
+
+	/* Rather than a round trip per message as
+	 * camel_disco_folder_cache_message() would take, keep a
+	 * pipeline of fetches going, on the connection kept for
+	 * downloads like this if there is one. */
+	conn = camel_imap_store_pool_get (store, folder, TRUE);
+	if (conn)
+		pipe = camel_imap_pipeline_new (conn, NULL, CAMEL_IMAP_PIPELINE_DEPTH, ex);
+	else
+		pipe = camel_imap_pipeline_new (store, folder, CAMEL_IMAP_PIPELINE_DEPTH, ex);
+
+	/* big messages are written to the cache as they arrive; the
+	 * extra hold on the connect_lock keeps that to our fetches */
+	if (pipe) {
+		CAMEL_SERVICE_REC_LOCK (conn ? conn : store, connect_lock);
+		(conn ? conn : store)->fetch_folder = imap_folder;
+	}
+
+	cp.imap_folder = imap_folder;
+	cp.done = 0;
+	cp.total = uids->len;
+
+	for (i = 0; pipe && i < uids->len; i++) {
+		CAMEL_IMAP_FOLDER_REC_LOCK (imap_folder, cache_lock);
+		stream = camel_imap_message_cache_get (imap_folder->cache, uids->pdata[i], "", NULL);
+		CAMEL_IMAP_FOLDER_REC_UNLOCK (imap_folder, cache_lock);
+
+		if (stream) {
+			camel_object_unref (CAMEL_OBJECT (stream));
+			imap_cache_message_done (store, NULL, NULL, &cp);
+			continue;
+		}
+
+		if (store->server_level < IMAP_LEVEL_IMAP4REV1) {
+			if (!camel_imap_pipeline_queue (pipe, imap_cache_message_done, &cp,
+							"UID FETCH %s RFC822.PEEK", uids->pdata[i]))
+				break;
+		} else {
+			if (!camel_imap_pipeline_queue (pipe, imap_cache_message_done, &cp,
+							"UID FETCH %s BODY.PEEK[]", uids->pdata[i]))
+				break;
+		}
+	}
+
+	if (pipe) {
+		camel_imap_pipeline_finish (pipe, ex);
+		(conn ? conn : store)->fetch_folder = NULL;
+		CAMEL_SERVICE_REC_UNLOCK (conn ? conn : store, connect_lock);
+	}
+	if (conn)
+		camel_imap_store_pool_put (store, conn);
+
+	if (expression)
+		camel_folder_search_free (folder, uids);
+	else
+		camel_folder_free_uids (folder, uids);
+
+	camel_operation_end(NULL);
+}
+
 /* We pretend that a FLAGS or RFC822.SIZE response is always exactly
  * 20 bytes long, and a BODY[HEADERS] response is always 2000 bytes
  * long. Since we know how many of each kind of response we're
@@ -3144,6 +3592,24 @@ imap_thaw (CamelFolder *folder)
 }
 
 
+static CamelImapResponse *
+imap_fetch_data_command (CamelImapStore *store, CamelFolder *folder,
+			 const char *uid, const char *section_text,
+			 CamelException *ex)
+{
+	CamelImapStore *master = store->master ? store->master : store;
+
+	if (master->server_level < IMAP_LEVEL_IMAP4REV1 && !*section_text) {
+		return camel_imap_command (store, folder, ex,
+					   "UID FETCH %s RFC822.PEEK",
+					   uid);
+	} else {
+		return camel_imap_command (store, folder, ex,
+					   "UID FETCH %s BODY.PEEK[%s]",
+					   uid, section_text);
+	}
+}
+
 CamelStream *
 camel_imap_folder_fetch_data (CamelImapFolder *imap_folder, const char *uid,
 			      const char *section_text, gboolean cache_only,
@@ -3151,6 +3617,7 @@ camel_imap_folder_fetch_data (CamelImapFolder *imap_folder, const char *uid,
 {
 	CamelFolder *folder = CAMEL_FOLDER (imap_folder);
 	CamelImapStore *store = CAMEL_IMAP_STORE (folder->parent_store);
+	CamelImapStore *conn;
 	CamelImapResponse *response;
 	CamelStream *stream;
 	GData *fetch_data;
@@ -3180,32 +3647,40 @@ camel_imap_folder_fetch_data (CamelImapFolder *imap_folder, const char *uid,
 
 	camel_exception_clear(ex);
 
-	CAMEL_SERVICE_REC_LOCK (store, connect_lock);
-	CAMEL_IMAP_FOLDER_REC_LOCK (imap_folder, cache_lock);
+	/* Fetch over one of the extra connections if we can, so a
+	 * big download doesn't keep everything else waiting */
+	conn = camel_imap_store_pool_get (store, folder, FALSE);
+	if (conn) {
+		conn->fetch_folder = imap_folder;
+		response = imap_fetch_data_command (conn, NULL, uid, section_text, ex);
+		conn->fetch_folder = NULL;
+		CAMEL_IMAP_FOLDER_REC_LOCK (imap_folder, cache_lock);
+	} else {
+		conn = store;
 
-	if (!camel_imap_store_connected(store, ex)) {
-		camel_exception_set (ex, CAMEL_EXCEPTION_SERVICE_UNAVAILABLE,
-				     _("This message is not currently available"));
-		CAMEL_IMAP_FOLDER_REC_UNLOCK (imap_folder, cache_lock);
-		CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
-		return NULL;
-	}
+		CAMEL_SERVICE_REC_LOCK (store, connect_lock);
+		CAMEL_IMAP_FOLDER_REC_LOCK (imap_folder, cache_lock);
 
-	camel_exception_clear (ex);
-	if (store->server_level < IMAP_LEVEL_IMAP4REV1 && !*section_text) {
-		response = camel_imap_command (store, folder, ex,
-					       "UID FETCH %s RFC822.PEEK",
-					       uid);
-	} else {
-		response = camel_imap_command (store, folder, ex,
-					       "UID FETCH %s BODY.PEEK[%s]",
-					       uid, section_text);
+		if (!camel_imap_store_connected(store, ex)) {
+			camel_exception_set (ex, CAMEL_EXCEPTION_SERVICE_UNAVAILABLE,
+					     _("This message is not currently available"));
+			CAMEL_IMAP_FOLDER_REC_UNLOCK (imap_folder, cache_lock);
+			CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
+			return NULL;
+		}
+
+		camel_exception_clear (ex);
+		store->fetch_folder = imap_folder;
+		response = imap_fetch_data_command (store, folder, uid, section_text, ex);
+		store->fetch_folder = NULL;
+		/* We won't need the connect_lock again after this. */
+		CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
 	}
-	/* We won't need the connect_lock again after this. */
-	CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
 
 	if (!response) {
 		CAMEL_IMAP_FOLDER_REC_UNLOCK (imap_folder, cache_lock);
+		if (conn != store)
+			camel_imap_store_pool_put (store, conn);
 		return NULL;
 	}
 
@@ -3219,8 +3694,10 @@ camel_imap_folder_fetch_data (CamelImapFolder *imap_folder, const char *uid,
 		g_datalist_clear (&fetch_data);
 		stream = NULL;
 	}
-	camel_imap_response_free (store, response);
+	camel_imap_response_free (conn, response);
 	CAMEL_IMAP_FOLDER_REC_UNLOCK (imap_folder, cache_lock);
+	if (conn != store)
+		camel_imap_store_pool_put (store, conn);
 	if (!stream) {
 		camel_exception_setv (ex, CAMEL_EXCEPTION_SERVICE_UNAVAILABLE,
 				      _("Could not find message body in FETCH response."));
@@ -3237,7 +3714,7 @@ parse_fetch_response (CamelImapFolder *imap_folder, char *response)
 {
 	GData *data = NULL;
 	char *start, *part_spec = NULL, *body = NULL, *uid = NULL, *idate = NULL;
-	gboolean cache_header = TRUE, header = FALSE;
+	gboolean cache_header = TRUE, header = FALSE, cached = FALSE;
 	size_t body_len = 0;
 
 	if (*response != '(') {
@@ -3310,6 +3787,14 @@ parse_fetch_response (CamelImapFolder *imap_folder, char *response)
 					header = TRUE;
 			}
 
+			/* imap_read_untagged() already put it in the cache */
+			if (!strncmp (response, CAMEL_IMAP_LITERAL_CACHED, strlen (CAMEL_IMAP_LITERAL_CACHED))) {
+				response += strlen (CAMEL_IMAP_LITERAL_CACHED);
+				cached = TRUE;
+				g_datalist_set_data_full (&data, "BODY_PART_SPEC", part_spec, g_free);
+				continue;
+			}
+
 			body = imap_parse_nstring ((const char **) &response, &body_len);
 			if (!response) {
 				g_free (part_spec);
@@ -3348,6 +3833,16 @@ parse_fetch_response (CamelImapFolder *imap_folder, char *response)
 				g_datalist_set_data_full (&data, "INTERNALDATE", idate, g_free);
 				response += len + 1;
 			}
+		} else if (!g_ascii_strncasecmp (response, "MODSEQ (", 8)) {
+			int len;
+
+			/* 64 bits, so kept as a string */
+			response += 8;
+			len = strcspn (response, ")");
+			g_datalist_set_data_full (&data, "MODSEQ", g_strndup (response, len), g_free);
+			response += len;
+			if (*response == ')')
+				response++;
 		} else {
 			g_warning ("Unexpected FETCH response from server: (%s", response);
 			break;
@@ -3359,7 +3854,17 @@ parse_fetch_response (CamelImapFolder *imap_folder, char *response)
 		return NULL;
 	}
 
-	if (uid && body) {
+	if (uid && cached) {
+		CamelStream *stream;
+
+		CAMEL_IMAP_FOLDER_REC_LOCK (imap_folder, cache_lock);
+		stream = camel_imap_message_cache_get (imap_folder->cache, uid, part_spec, NULL);
+		CAMEL_IMAP_FOLDER_REC_UNLOCK (imap_folder, cache_lock);
+
+		if (stream)
+			g_datalist_set_data_full (&data, "BODY_PART_STREAM", stream,
+						  (GDestroyNotify) camel_object_unref);
+	} else if (uid && body) {
 		CamelStream *stream;
 
 		if (header && !cache_header) {
@@ -55,6 +55,9 @@ struct _CamelImapFolder {
 	CamelFolderSearch *search;
 	CamelImapMessageCache *cache;
 
+	/* HIGHESTMODSEQ when the folder was last selected, 0 without CONDSTORE */
+	guint64 modseq;
+
 	unsigned int need_rescan:1;
 	unsigned int need_refresh:1;
 	unsigned int read_only:1;
@@ -26,7 +26,11 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <glib/gi18n-lib.h>
@@ -42,6 +46,18 @@
 #define O_BINARY 0
 #endif
 
+/* The manifest lists every cached part with its size and when it was
+ * last used, so opening the cache needn't scan the directory. It is
+ * removed as soon as the cache changes and written again when the
+ * cache is saved, so one that exists can always be trusted. */
+#define MANIFEST_NAME "manifest"
+#define MANIFEST_VERSION "camel-imap-message-cache 1"
+
+typedef struct {
+	guint32 size;
+	time_t atime;
+} CachePart;
+
 static void finalize (CamelImapMessageCache *cache);
 static void stream_finalize (CamelObject *stream, gpointer event_data, gpointer user_data);
 
@@ -82,6 +98,17 @@ free_part (gpointer key, gpointer value, gpointer data)
 static void
 finalize (CamelImapMessageCache *cache)
 {
+	int i;
+
+	if (cache->manifest) {
+		camel_imap_message_cache_save (cache);
+		g_hash_table_destroy (cache->manifest);
+	}
+	if (cache->unchecked) {
+		for (i = 0; i < cache->unchecked->len; i++)
+			g_free (cache->unchecked->pdata[i]);
+		g_ptr_array_free (cache->unchecked, TRUE);
+	}
 	if (cache->path)
 		g_free (cache->path);
 	if (cache->parts) {
@@ -122,6 +149,7 @@ cache_put (CamelImapMessageCache *cache, const char *uid, const char *key,
 	} else {
 		hash_key = g_strdup (key);
 		g_ptr_array_add (subparts, hash_key);
+		g_hash_table_insert (cache->manifest, hash_key, g_new0 (CachePart, 1));
 	}
 
 	g_hash_table_insert (cache->parts, hash_key, stream);
@@ -133,15 +161,107 @@ cache_put (CamelImapMessageCache *cache, const char *uid, const char *key,
 	}
 }
 
+/* The manifest is about to go out of date */
+static void
+manifest_changed (CamelImapMessageCache *cache)
+{
+	char *path;
+
+	if (cache->manifest_dirty)
+		return;
+
+	path = g_strdup_printf ("%s/" MANIFEST_NAME, cache->path);
+	g_unlink (path);
+	g_free (path);
+	cache->manifest_dirty = TRUE;
+}
+
+static gboolean
+manifest_load (CamelImapMessageCache *cache)
+{
+	char *path, *contents, *line, *next, *p, *end, *uid;
+	unsigned long size, atime;
+	CachePart *part;
+	gboolean new;
+
+	path = g_strdup_printf ("%s/" MANIFEST_NAME, cache->path);
+	if (!g_file_get_contents (path, &contents, NULL, NULL)) {
+		g_free (path);
+		return FALSE;
+	}
+	g_free (path);
+
+	if (strncmp (contents, MANIFEST_VERSION "\n", strlen (MANIFEST_VERSION "\n")) != 0)
+		goto bad;
+
+	/* "<uid>.<part_spec> <size> <atime>" lines */
+	for (line = contents + strlen (MANIFEST_VERSION "\n"); *line; line = next) {
+		if (!(next = strchr (line, '\n')))
+			goto bad;
+		*next++ = '\0';
+
+		if (!(p = strrchr (line, ' ')))
+			goto bad;
+		*p++ = '\0';
+		atime = strtoul (p, &end, 10);
+		if (*end || !(p = strrchr (line, ' ')))
+			goto bad;
+		*p++ = '\0';
+		size = strtoul (p, &end, 10);
+		if (*end || !isdigit (line[0]) || !(p = strchr (line, '.')))
+			goto bad;
+
+		uid = g_strndup (line, p - line);
+		new = g_hash_table_lookup (cache->parts, uid) == NULL;
+		cache_put (cache, uid, line, NULL);
+		if (new)
+			g_ptr_array_add (cache->unchecked, uid);
+		else
+			g_free (uid);
+
+		part = g_hash_table_lookup (cache->manifest, line);
+		part->size = size;
+		part->atime = atime;
+	}
+
+	g_free (contents);
+	return TRUE;
+
+ bad:
+	g_free (contents);
+	return FALSE;
+}
+
+static CamelImapMessageCache *
+cache_new (const char *path)
+{
+	CamelImapMessageCache *cache;
+
+	cache = (CamelImapMessageCache *)camel_object_new (CAMEL_IMAP_MESSAGE_CACHE_TYPE);
+	cache->path = g_strdup (path);
+
+	cache->parts = g_hash_table_new (g_str_hash, g_str_equal);
+	cache->cached = g_hash_table_new (NULL, NULL);
+	cache->manifest = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+	cache->unchecked = g_ptr_array_new ();
+
+	return cache;
+}
+
 /**
  * camel_imap_message_cache_new:
  * @path: directory to use for storage
  * @summary: CamelFolderSummary for the folder we are caching
  * @ex: a CamelException
  *
+ * If @path has a manifest saved by camel_imap_message_cache_save(),
+ * the cache is loaded from that and any files that do not correspond
+ * to messages in @summary are left for
+ * camel_imap_message_cache_expire() to delete. Otherwise the files in
+ * @path are scanned, and those files are deleted straight away.
+ *
  * Return value: a new CamelImapMessageCache object using @path for
- * storage. If cache files already exist in @path, then any that do not
- * correspond to messages in @summary will be deleted.
+ * storage.
  **/
 CamelImapMessageCache *
 camel_imap_message_cache_new (const char *path, CamelFolderSummary *summary,
@@ -150,10 +270,17 @@ camel_imap_message_cache_new (const char *path, CamelFolderSummary *summary,
 	CamelImapMessageCache *cache;
 	GDir *dir;
 	const char *dname;
-	char *uid, *p;
+	char *uid, *p, *file;
 	GPtrArray *deletes;
 	CamelMessageInfo *info;
+	CachePart *part;
 	GError *error = NULL;
+	struct stat st;
+
+	cache = cache_new (path);
+	if (manifest_load (cache))
+		return cache;
+	camel_object_unref (cache);
 
 	dir = g_dir_open (path, 0, &error);
 	if (!dir) {
@@ -164,11 +291,9 @@ camel_imap_message_cache_new (const char *path, CamelFolderSummary *summary,
 		return NULL;
 	}
 
-	cache = (CamelImapMessageCache *)camel_object_new (CAMEL_IMAP_MESSAGE_CACHE_TYPE);
-	cache->path = g_strdup (path);
+	cache = cache_new (path);
+	manifest_changed (cache);
 
-	cache->parts = g_hash_table_new (g_str_hash, g_str_equal);
-	cache->cached = g_hash_table_new (NULL, NULL);
 	deletes = g_ptr_array_new ();
 	while ((dname = g_dir_read_name (dir))) {
 		if (!isdigit (dname[0]))
@@ -179,12 +304,19 @@ camel_imap_message_cache_new (const char *path, CamelFolderSummary *summary,
 		else
 			uid = g_strdup (dname);
 
+		file = g_strdup_printf ("%s/%s", cache->path, dname);
 		info = camel_folder_summary_uid (summary, uid);
 		if (info) {
 			camel_message_info_free(info);
 			cache_put (cache, uid, dname, NULL);
+			part = g_hash_table_lookup (cache->manifest, dname);
+			if (part && g_stat (file, &st) == 0) {
+				part->size = st.st_size;
+				part->atime = st.st_atime;
+			}
+			g_free (file);
 		} else
-			g_ptr_array_add (deletes, g_strdup_printf ("%s/%s", cache->path, dname));
+			g_ptr_array_add (deletes, file);
 		g_free (uid);
 	}
 	g_dir_close (dir);
@@ -211,6 +343,88 @@ camel_imap_message_cache_max_uid (CamelImapMessageCache *cache)
 	return cache->max_uid;
 }
 
+static void
+manifest_write (gpointer key, gpointer value, gpointer data)
+{
+	CachePart *part = value;
+
+	fprintf (data, "%s %lu %lu\n", (char *) key,
+		 (unsigned long) part->size, (unsigned long) part->atime);
+}
+
+/**
+ * camel_imap_message_cache_save:
+ * @cache: the cache
+ *
+ * Saves the manifest of the data in @cache, if it has changed, for
+ * camel_imap_message_cache_new() to load.
+ *
+ * Return value: 0 on success or -1 on error.
+ **/
+int
+camel_imap_message_cache_save (CamelImapMessageCache *cache)
+{
+	char *path, *tmp;
+	FILE *out;
+	int ret = -1;
+
+	if (!cache->manifest_dirty && !cache->manifest_touched)
+		return 0;
+
+	path = g_strdup_printf ("%s/" MANIFEST_NAME, cache->path);
+	tmp = g_strdup_printf ("%s~", path);
+	out = g_fopen (tmp, "wb");
+	if (out) {
+		fputs (MANIFEST_VERSION "\n", out);
+		g_hash_table_foreach (cache->manifest, manifest_write, out);
+		if (ferror (out) == 0 && fclose (out) == 0 && g_rename (tmp, path) == 0) {
+			cache->manifest_dirty = FALSE;
+			cache->manifest_touched = FALSE;
+			ret = 0;
+		} else
+			g_unlink (tmp);
+	}
+	g_free (tmp);
+	g_free (path);
+
+	return ret;
+}
+
+/**
+ * camel_imap_message_cache_expire:
+ * @cache: the cache
+ * @summary: CamelFolderSummary for the folder we are caching
+ * @max: how many messages to check
+ *
+ * Checks up to @max of the messages loaded from the manifest against
+ * @summary, removing the data of those that have gone. This is the
+ * check that camel_imap_message_cache_new() makes when it scans the
+ * directory, done a little at a time.
+ *
+ * Return value: the number of messages still to check.
+ **/
+int
+camel_imap_message_cache_expire (CamelImapMessageCache *cache,
+				 CamelFolderSummary *summary, int max)
+{
+	CamelMessageInfo *info;
+	char *uid;
+
+	while (max-- > 0 && cache->unchecked->len > 0) {
+		uid = cache->unchecked->pdata[cache->unchecked->len - 1];
+		g_ptr_array_set_size (cache->unchecked, cache->unchecked->len - 1);
+
+		info = camel_folder_summary_uid (summary, uid);
+		if (info)
+			camel_message_info_free (info);
+		else
+			camel_imap_message_cache_remove (cache, uid);
+		g_free (uid);
+	}
+
+	return cache->unchecked->len;
+}
+
 /**
  * camel_imap_message_cache_set_path:
  * @cache:
@@ -239,13 +453,9 @@ stream_finalize (CamelObject *stream, gpointer event_data, gpointer user_data)
 }
 
 
-static CamelStream *
-insert_setup (CamelImapMessageCache *cache, const char *uid, const char *part_spec,
-	      char **path, char **key, CamelException *ex)
+static char *
+insert_path (CamelImapMessageCache *cache, const char *uid, const char *part_spec)
 {
-	CamelStream *stream;
-	int fd;
-
 #ifdef G_OS_WIN32
 	/* Trailing periods in file names are silently dropped on
 	 * Win32, argh. The code in this file requires the period to
@@ -255,12 +465,27 @@ insert_setup (CamelImapMessageCache *cache, const char *uid, const char *part_sp
 	if (!*part_spec)
 		part_spec = "~";
 #endif
-	*path = g_strdup_printf ("%s/%s.%s", cache->path, uid, part_spec);
+	return g_strdup_printf ("%s/%s.%s", cache->path, uid, part_spec);
+}
+
+static CamelStream *
+insert_setup (CamelImapMessageCache *cache, const char *uid, const char *part_spec,
+	      char **path, char **key, CamelException *ex)
+{
+	CamelStream *stream;
+	int fd;
+
+	*path = insert_path (cache, uid, part_spec);
 	*key = strrchr (*path, '/') + 1;
 	stream = g_hash_table_lookup (cache->parts, *key);
 	if (stream)
 		camel_object_unref (CAMEL_OBJECT (stream));
 
+	manifest_changed (cache);
+
+	/* messages read from the old file may still be reading their
+	   content from it, so leave it to them */
+	g_unlink (*path);
 	fd = g_open (*path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0600);
 	if (fd == -1) {
 		camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
@@ -286,9 +511,17 @@ static CamelStream *
 insert_finish (CamelImapMessageCache *cache, const char *uid, char *path,
 	       char *key, CamelStream *stream)
 {
+	CachePart *part;
+	off_t size;
+
 	camel_stream_flush (stream);
+	size = camel_seekable_stream_tell (CAMEL_SEEKABLE_STREAM (stream));
 	camel_stream_reset (stream);
 	cache_put (cache, uid, key, stream);
+
+	part = g_hash_table_lookup (cache->manifest, key);
+	part->size = size;
+	part->atime = time (NULL);
 	g_free (path);
 
 	return stream;
@@ -361,6 +594,63 @@ camel_imap_message_cache_insert_stream (CamelImapMessageCache *cache,
 	}
 }
 
+/**
+ * camel_imap_message_cache_insert_begin:
+ * @cache: the cache
+ * @uid: UID of the message data to cache
+ * @part_spec: the IMAP part_spec of the data
+ * @ex: a CamelException
+ *
+ * Starts caching data into @cache for data that arrives a piece at a
+ * time. The caller writes the data to the returned stream and then
+ * passes it to camel_imap_message_cache_insert_end().
+ *
+ * Return value: the stream to write to, or %NULL if the data can't be
+ * cached.
+ **/
+CamelStream *
+camel_imap_message_cache_insert_begin (CamelImapMessageCache *cache,
+				       const char *uid, const char *part_spec,
+				       CamelException *ex)
+{
+	char *path, *key;
+	CamelStream *stream;
+
+	stream = insert_setup (cache, uid, part_spec, &path, &key, ex);
+	if (stream)
+		g_free (path);
+
+	return stream;
+}
+
+/**
+ * camel_imap_message_cache_insert_end:
+ * @cache: the cache
+ * @uid: UID of the message data to cache
+ * @part_spec: the IMAP part_spec of the data
+ * @stream: the stream from camel_imap_message_cache_insert_begin()
+ * @complete: whether all of the data was written to @stream
+ *
+ * Finishes caching the data written to @stream, or throws it away if
+ * it is not @complete.
+ *
+ * Return value: a CamelStream containing the cached data, which the
+ * caller must unref, or %NULL if it was thrown away.
+ **/
+CamelStream *
+camel_imap_message_cache_insert_end (CamelImapMessageCache *cache,
+				     const char *uid, const char *part_spec,
+				     CamelStream *stream, gboolean complete)
+{
+	char *path;
+
+	path = insert_path (cache, uid, part_spec);
+	if (!complete)
+		return insert_abort (path, stream);
+
+	return insert_finish (cache, uid, path, strrchr (path, '/') + 1, stream);
+}
+
 /**
  * camel_imap_message_cache_insert_wrapper:
  * @cache: the cache
@@ -410,6 +700,8 @@ camel_imap_message_cache_get (CamelImapMessageCache *cache, const char *uid,
 {
 	CamelStream *stream;
 	char *path, *key;
+	CachePart *part;
+	struct stat st;
 
 	if (uid[0] == 0)
 		return NULL;
@@ -426,13 +718,27 @@ camel_imap_message_cache_get (CamelImapMessageCache *cache, const char *uid,
 	if (stream) {
 		camel_stream_reset (CAMEL_STREAM (stream));
 		camel_object_ref (CAMEL_OBJECT (stream));
+		part = g_hash_table_lookup (cache->manifest, key);
+		part->atime = time (NULL);
+		cache->manifest_touched = TRUE;
 		g_free (path);
 		return stream;
 	}
 
+	part = g_hash_table_lookup (cache->manifest, key);
 	stream = camel_stream_fs_new_with_name (path, O_RDONLY, 0);
 	if (stream) {
-		cache_put (cache, uid, key, stream);
+		if (part == NULL) {
+			/* a file we didn't know about */
+			manifest_changed (cache);
+			cache_put (cache, uid, key, stream);
+			part = g_hash_table_lookup (cache->manifest, key);
+			if (g_stat (path, &st) == 0)
+				part->size = st.st_size;
+		} else
+			cache_put (cache, uid, key, stream);
+		part->atime = time (NULL);
+		cache->manifest_touched = TRUE;
 	} else {
 		camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
 				      _("Failed to cache %s: %s"),
@@ -462,6 +768,7 @@ camel_imap_message_cache_remove (CamelImapMessageCache *cache, const char *uid)
 	subparts = g_hash_table_lookup (cache->parts, uid);
 	if (!subparts)
 		return;
+	manifest_changed (cache);
 	for (i = 0; i < subparts->len; i++) {
 		key = subparts->pdata[i];
 		path = g_strdup_printf ("%s/%s", cache->path, key);
@@ -475,6 +782,7 @@ camel_imap_message_cache_remove (CamelImapMessageCache *cache, const char *uid)
 			g_hash_table_remove (cache->cached, stream);
 		}
 		g_hash_table_remove (cache->parts, key);
+		g_hash_table_remove (cache->manifest, key);
 		g_free (key);
 	}
 	g_hash_table_remove (cache->parts, uid);
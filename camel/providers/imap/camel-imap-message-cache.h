@@ -43,6 +43,11 @@ struct _CamelImapMessageCache {
 	char *path;
 	GHashTable *parts, *cached;
 	guint32 max_uid;
+
+	GHashTable *manifest;	/* part key -> size and atime */
+	GPtrArray *unchecked;	/* uids from the manifest not yet checked against the summary */
+	guint manifest_dirty:1;	/* the manifest on disk is out of date, or missing */
+	guint manifest_touched:1; /* only atimes have changed since it was saved */
 };
 
 
@@ -64,6 +69,11 @@ void camel_imap_message_cache_set_path (CamelImapMessageCache *cache,
 
 guint32     camel_imap_message_cache_max_uid (CamelImapMessageCache *cache);
 
+int         camel_imap_message_cache_save    (CamelImapMessageCache *cache);
+int         camel_imap_message_cache_expire  (CamelImapMessageCache *cache,
+					      CamelFolderSummary *summary,
+					      int max);
+
 CamelStream *camel_imap_message_cache_insert (CamelImapMessageCache *cache,
 					      const char *uid,
 					      const char *part_spec,
@@ -75,6 +85,15 @@ void camel_imap_message_cache_insert_stream  (CamelImapMessageCache *cache,
 					      const char *part_spec,
 					      CamelStream *data_stream,
 					      CamelException *ex);
+CamelStream *camel_imap_message_cache_insert_begin (CamelImapMessageCache *cache,
+						    const char *uid,
+						    const char *part_spec,
+						    CamelException *ex);
+CamelStream *camel_imap_message_cache_insert_end   (CamelImapMessageCache *cache,
+						    const char *uid,
+						    const char *part_spec,
+						    CamelStream *stream,
+						    gboolean complete);
 void camel_imap_message_cache_insert_wrapper (CamelImapMessageCache *cache,
 					      const char *uid,
 					      const char *part_spec,
@@ -27,6 +27,7 @@
 #include <config.h>
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,6 +47,7 @@
 #include "camel/camel-sasl.h"
 #include "camel/camel-session.h"
 #include "camel/camel-stream-buffer.h"
+#include "camel/camel-stream-deflate.h"
 #include "camel/camel-stream-fs.h"
 #include "camel/camel-stream-process.h"
 #include "camel/camel-stream.h"
@@ -81,6 +83,9 @@ static CamelDiscoStoreClass *parent_class = NULL;
 
 static char imap_tag_prefix = 'A';
 
+/* guards every store's pool of extra connections */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void construct (CamelService *service, CamelSession *session,
 		       CamelProvider *provider, CamelURL *url,
 		       CamelException *ex);
@@ -211,6 +216,7 @@ camel_imap_store_finalize (CamelObject *object)
 	}
 
 	g_free (imap_store->custom_headers);
+	g_free (imap_store->pool_folder);
 }
 
 static void
@@ -262,6 +268,7 @@ construct (CamelService *service, CamelSession *session,
 	CamelDiscoStore *disco_store = CAMEL_DISCO_STORE (service);
 	char *tmp, *path;
 	CamelURL *summary_url;
+	const char *connections;
 
 	CAMEL_SERVICE_CLASS (parent_class)->construct (service, session, provider, url, ex);
 	if (camel_exception_is_set (ex))
@@ -305,6 +312,19 @@ construct (CamelService *service, CamelSession *session,
 		imap_store->custom_headers = g_strdup(camel_url_get_param (url, "imap_custom_headers"));
 	}
 
+	/* An extra connection shares its master's summary, and
+	 * never works offline itself */
+	if (imap_store->master) {
+		imap_store->summary = imap_store->master->summary;
+		camel_object_ref (imap_store->summary);
+		return;
+	}
+
+	/* Besides this one, a connection for offline downloads, and
+	 * the rest for fetching messages */
+	imap_store->pool_max = 2;
+	if ((connections = camel_url_get_param (url, "connections")))
+		imap_store->pool_max = MAX (strtol (connections, NULL, 10) - 1, 0);
 
 	/* setup journal*/
 	path = g_strdup_printf ("%s/journal", imap_store->storage_path);
@@ -487,6 +507,9 @@ static struct {
 	{ "XGWMOVE",            IMAP_CAPABILITY_XGWMOVE },
 	{ "LOGINDISABLED",      IMAP_CAPABILITY_LOGINDISABLED },
 	{ "QUOTA",              IMAP_CAPABILITY_QUOTA },
+	{ "CONDSTORE",          IMAP_CAPABILITY_CONDSTORE },
+	{ "QRESYNC",            IMAP_CAPABILITY_QRESYNC },
+	{ "COMPRESS=DEFLATE",   IMAP_CAPABILITY_COMPRESS },
 	{ NULL, 0 }
 };
 
@@ -512,6 +535,20 @@ parse_capability(CamelImapStore *store, char *capa)
 	}
 }
 
+/* Servers may list more capabilities once logged in, in the
+ * [CAPABILITY ...] code of the tagged OK */
+static void
+imap_status_capability (CamelImapStore *store, const char *status)
+{
+	char *capa;
+
+	if (status && (capa = strstr (status, "[CAPABILITY "))) {
+		capa = g_strndup (capa + 12, strcspn (capa + 12, "]"));
+		parse_capability (store, capa);
+		g_free (capa);
+	}
+}
+
 static gboolean
 imap_get_capability (CamelService *service, CamelException *ex)
 {
@@ -1419,6 +1456,7 @@ imap_auth_loop (CamelService *service, CamelException *ex)
 						       service->url->user,
 						       service->url->passwd);
 			if (response) {
+				imap_status_capability (store, response->status);
 				camel_imap_response_free (store, response);
 				authenticated = TRUE;
 			}
@@ -1445,6 +1483,43 @@ can_work_offline (CamelDiscoStore *disco_store)
 	return camel_store_summary_count((CamelStoreSummary *)store->summary) != 0;
 }
 
+static gboolean
+imap_compress (CamelImapStore *store, CamelException *ex)
+{
+	CamelImapResponse *response;
+	CamelStream *stream;
+
+	response = camel_imap_command (store, NULL, ex, "COMPRESS DEFLATE");
+	if (!response) {
+		if (!store->connected)
+			return FALSE;
+
+		/* not critical if the server refuses */
+		camel_exception_clear (ex);
+		return TRUE;
+	}
+	camel_imap_response_free (store, response);
+
+	/* The server starts compressing straight after its OK, and
+	 * doesn't send anything more until we do, so there is nothing
+	 * left in the read buffer to carry over. */
+	stream = camel_stream_deflate_new (store->ostream);
+	if (stream == NULL) {
+		camel_exception_set (ex, CAMEL_EXCEPTION_SYSTEM,
+				     _("Could not start compression"));
+		return FALSE;
+	}
+
+	camel_object_unref (store->istream);
+	camel_object_unref (store->ostream);
+	store->ostream = stream;
+	store->istream = camel_stream_buffer_new (stream, CAMEL_STREAM_BUFFER_READ);
+
+	d(printf ("IMAP compression started\n"));
+
+	return TRUE;
+}
+
 static gboolean
 imap_connect_online (CamelService *service, CamelException *ex)
 {
@@ -1463,6 +1538,31 @@ imap_connect_online (CamelService *service, CamelException *ex)
 		return FALSE;
 	}
 
+	/* rfc4978: from here on everything is compressed both ways */
+	if ((store->capabilities & IMAP_CAPABILITY_COMPRESS) && !imap_compress (store, ex)) {
+		CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
+		camel_service_disconnect (service, TRUE, NULL);
+		return FALSE;
+	}
+
+	/* Extra connections only ever fetch in an EXAMINEd folder, the
+	 * namespace and folder list are the master's business */
+	if (store->master) {
+		CAMEL_SERVICE_REC_UNLOCK (store, connect_lock);
+		return TRUE;
+	}
+
+	/* QRESYNC has to be enabled before the server will report
+	 * VANISHED messages, and after that it sends VANISHED instead
+	 * of EXPUNGE, which camel_imap_response_free() understands. */
+	if (store->capabilities & IMAP_CAPABILITY_QRESYNC) {
+		response = camel_imap_command (store, NULL, NULL, "ENABLE QRESYNC");
+		if (response)
+			camel_imap_response_free (store, response);
+		else
+			store->capabilities &= ~IMAP_CAPABILITY_QRESYNC;
+	}
+
 	/* Get namespace and hierarchy separator */
 	if ((store->capabilities & IMAP_CAPABILITY_NAMESPACE) &&
 	    !(store->parameters & IMAP_PARAM_OVERRIDE_NAMESPACE)) {
@@ -1606,6 +1706,29 @@ static gboolean
 imap_disconnect_offline (CamelService *service, gboolean clean, CamelException *ex)
 {
 	CamelImapStore *store = CAMEL_IMAP_STORE (service);
+	CamelImapStore *conn;
+	GSList *pool;
+
+	/* Close the idle extra connections, busy ones are closed when
+	 * they are put back */
+	pthread_mutex_lock (&pool_lock);
+	pool = store->pool;
+	store->pool = NULL;
+	store->pool_size -= g_slist_length (pool);
+	if (!store->pool_bulk_busy && store->pool_bulk) {
+		pool = g_slist_prepend (pool, store->pool_bulk);
+		store->pool_bulk = NULL;
+	}
+	pthread_mutex_unlock (&pool_lock);
+
+	while (pool) {
+		conn = pool->data;
+		camel_object_unref (conn);
+		pool = g_slist_delete_link (pool, pool);
+	}
+
+	g_free (store->pool_folder);
+	store->pool_folder = NULL;
 
 	if (store->istream) {
 		camel_stream_close(store->istream);
@@ -3112,3 +3235,180 @@ imap_can_refresh_folder (CamelStore *store, CamelFolderInfo *info, CamelExceptio
 
 	return res;
 }
+
+static CamelImapStore *
+imap_pool_connect (CamelImapStore *store)
+{
+	CamelService *service = (CamelService *)store;
+	CamelImapStore *conn;
+	CamelException ex;
+
+	camel_exception_init (&ex);
+
+	conn = (CamelImapStore *)camel_object_new (CAMEL_IMAP_STORE_TYPE);
+	conn->master = store;
+	camel_service_construct ((CamelService *)conn, service->session, service->provider, service->url, &ex);
+	if (!camel_exception_is_set (&ex))
+		camel_service_connect ((CamelService *)conn, &ex);
+
+	if (camel_exception_is_set (&ex)) {
+		d(printf("Couldn't open an extra connection: %s\n", camel_exception_get_description (&ex)));
+		camel_exception_clear (&ex);
+		camel_object_unref (conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+/* EXAMINE @folder on @conn, unless it's open already. The folder is
+ * not made @conn's current_folder, so responses on @conn never touch
+ * the folder's summary; only the master connection does that. */
+static gboolean
+imap_pool_examine (CamelImapStore *conn, CamelFolder *folder)
+{
+	CamelImapResponse *response;
+	guint32 validity = 0;
+	char *resp;
+	int i;
+
+	if (conn->pool_folder && !strcmp (conn->pool_folder, folder->full_name))
+		return TRUE;
+
+	g_free (conn->pool_folder);
+	conn->pool_folder = NULL;
+
+	response = camel_imap_command (conn, NULL, NULL, "EXAMINE %F", folder->full_name);
+	if (!response)
+		return FALSE;
+
+	for (i = 0; i < response->untagged->len; i++) {
+		resp = camel_strstrcase (response->untagged->pdata[i], "[UIDVALIDITY ");
+		if (resp)
+			validity = strtoul (resp + 13, NULL, 10);
+	}
+	camel_imap_response_free (conn, response);
+
+	/* the master will notice and sort out the summary */
+	if (validity != CAMEL_IMAP_SUMMARY (folder->summary)->validity)
+		return FALSE;
+
+	conn->pool_folder = g_strdup (folder->full_name);
+
+	return TRUE;
+}
+
+/**
+ * camel_imap_store_pool_get:
+ * @store: the IMAP store
+ * @folder: the folder to fetch from
+ * @bulk: %TRUE for background downloads, %FALSE for fetches someone
+ * is waiting on
+ *
+ * Gets one of @store's extra connections, with @folder open
+ * read-only, for fetching message data without holding @store's
+ * connect_lock. Idle connections that already have @folder open are
+ * preferred. @bulk fetches all go through the one connection kept
+ * for them, so they never hold up the others.
+ *
+ * The connection must only be used for commands that don't change
+ * the folder, and given back with camel_imap_store_pool_put().
+ *
+ * Return value: the connection, or %NULL if none is free (or extra
+ * connections are turned off), in which case @store itself should be
+ * used.
+ **/
+CamelImapStore *
+camel_imap_store_pool_get (CamelImapStore *store, CamelFolder *folder, gboolean bulk)
+{
+	CamelImapStore *conn = NULL;
+	GSList *l;
+
+	if (!store->connected
+	    || camel_disco_store_status (CAMEL_DISCO_STORE (store)) != CAMEL_DISCO_STORE_ONLINE)
+		return NULL;
+
+	pthread_mutex_lock (&pool_lock);
+	if (bulk) {
+		if (store->pool_max < 1 || store->pool_bulk_busy) {
+			pthread_mutex_unlock (&pool_lock);
+			return NULL;
+		}
+		store->pool_bulk_busy = TRUE;
+		conn = store->pool_bulk;
+	} else {
+		for (l = store->pool; l; l = l->next) {
+			conn = l->data;
+			if (conn->pool_folder && !strcmp (conn->pool_folder, folder->full_name))
+				break;
+		}
+		if (l == NULL)
+			l = store->pool;
+
+		if (l) {
+			conn = l->data;
+			store->pool = g_slist_delete_link (store->pool, l);
+		} else if (store->pool_size < store->pool_max - 1) {
+			store->pool_size++;
+			conn = NULL;
+		} else {
+			pthread_mutex_unlock (&pool_lock);
+			return NULL;
+		}
+	}
+	pthread_mutex_unlock (&pool_lock);
+
+	if (conn == NULL) {
+		conn = imap_pool_connect (store);
+
+		pthread_mutex_lock (&pool_lock);
+		if (bulk) {
+			store->pool_bulk = conn;
+			if (conn == NULL)
+				store->pool_bulk_busy = FALSE;
+		} else if (conn == NULL) {
+			store->pool_size--;
+		}
+		pthread_mutex_unlock (&pool_lock);
+
+		if (conn == NULL)
+			return NULL;
+	}
+
+	if (!imap_pool_examine (conn, folder)) {
+		camel_imap_store_pool_put (store, conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+/**
+ * camel_imap_store_pool_put:
+ * @store: the IMAP store
+ * @conn: a connection from camel_imap_store_pool_get()
+ *
+ * Gives @conn back to @store, to be used again if it is still
+ * connected.
+ **/
+void
+camel_imap_store_pool_put (CamelImapStore *store, CamelImapStore *conn)
+{
+	gboolean keep;
+
+	pthread_mutex_lock (&pool_lock);
+	keep = conn->connected && store->connected;
+	if (conn == store->pool_bulk) {
+		if (!keep)
+			store->pool_bulk = NULL;
+		store->pool_bulk_busy = FALSE;
+	} else if (keep) {
+		store->pool = g_slist_prepend (store->pool, conn);
+	} else {
+		store->pool_size--;
+	}
+	pthread_mutex_unlock (&pool_lock);
+
+	if (!keep)
+		camel_object_unref (conn);
+}
@@ -99,6 +99,9 @@ typedef enum {
 #define IMAP_CAPABILITY_XGWMOVE			(1 << 10)
 #define IMAP_CAPABILITY_LOGINDISABLED		(1 << 11)
 #define IMAP_CAPABILITY_QUOTA			(1 << 12)
+#define IMAP_CAPABILITY_CONDSTORE		(1 << 13)
+#define IMAP_CAPABILITY_QRESYNC			(1 << 14)
+#define IMAP_CAPABILITY_COMPRESS		(1 << 15)
 
 #define IMAP_PARAM_OVERRIDE_NAMESPACE		(1 << 0)
 #define IMAP_PARAM_CHECK_ALL			(1 << 1)
@@ -144,6 +147,19 @@ struct _CamelImapStore {
 
 	guint32 headers;
 	char *custom_headers;
+
+	/* Extra connections, so fetching message bodies doesn't hold
+	 * up everything else. See camel_imap_store_pool_get(). */
+	struct _CamelImapStore *master;	/* on an extra connection, the store it works for */
+	char *pool_folder;		/* on an extra connection, the folder it has open */
+	GSList *pool;			/* idle extra connections */
+	int pool_size, pool_max;
+	struct _CamelImapStore *pool_bulk;
+	guint pool_bulk_busy:1;
+
+	/* big message bodies fetched while this is set go straight
+	 * into its message cache, see imap_read_untagged() */
+	struct _CamelImapFolder *fetch_folder;
 };
 
 typedef struct {
@@ -160,6 +176,9 @@ gboolean camel_imap_store_connected (CamelImapStore *store, CamelException *ex);
 
 ssize_t camel_imap_store_readline (CamelImapStore *store, char **dest, CamelException *ex);
 
+CamelImapStore *camel_imap_store_pool_get (CamelImapStore *store, CamelFolder *folder, gboolean bulk);
+void camel_imap_store_pool_put (CamelImapStore *store, CamelImapStore *conn);
+
 G_END_DECLS
 
 #endif /* CAMEL_IMAP_STORE_H */
@@ -36,7 +36,7 @@
 #include "camel-imap-summary.h"
 #include "camel-imap-utils.h"
 
-#define CAMEL_IMAP_SUMMARY_VERSION (3)
+#define CAMEL_IMAP_SUMMARY_VERSION (4)
 
 static int summary_header_load (CamelFolderSummary *, FILE *);
 static int summary_header_save (CamelFolderSummary *, FILE *);
@@ -172,6 +172,17 @@ summary_header_load (CamelFolderSummary *s, FILE *in)
 	if (camel_file_util_decode_fixed_int32(in, &ims->validity) == -1)
 		return -1;
 
+	ims->highestmodseq = 0;
+	if (ims->version >= 4) {
+		/* Version 4: the HIGHESTMODSEQ, high word first */
+		guint32 hi, lo;
+
+		if (camel_file_util_decode_fixed_int32(in, &hi) == -1
+		    || camel_file_util_decode_fixed_int32(in, &lo) == -1)
+			return -1;
+		ims->highestmodseq = ((guint64)hi << 32) | lo;
+	}
+
 	if (ims->version > CAMEL_IMAP_SUMMARY_VERSION) {
 		g_warning("Unkown summary version\n");
 		errno = EINVAL;
@@ -190,8 +201,10 @@ summary_header_save (CamelFolderSummary *s, FILE *out)
 		return -1;
 
 	camel_file_util_encode_fixed_int32(out, CAMEL_IMAP_SUMMARY_VERSION);
+	camel_file_util_encode_fixed_int32(out, ims->validity);
+	camel_file_util_encode_fixed_int32(out, (guint32)(ims->highestmodseq >> 32));
 
-	return camel_file_util_encode_fixed_int32(out, ims->validity);
+	return camel_file_util_encode_fixed_int32(out, (guint32)ims->highestmodseq);
 }
 
 static CamelMessageInfo *
@@ -61,6 +61,7 @@ struct _CamelImapSummary {
 
 	guint32 version;
 	guint32 validity;
+	guint64 highestmodseq;	/* CONDSTORE HIGHESTMODSEQ the summary is up to date with, or 0 */
 };
 
 struct _CamelImapSummaryClass {
@@ -28,6 +28,7 @@ G_BEGIN_DECLS
 
 typedef struct _CamelImapFolder       CamelImapFolder;
 typedef struct _CamelImapMessageCache CamelImapMessageCache;
+typedef struct _CamelImapPipeline     CamelImapPipeline;
 typedef struct _CamelImapResponse     CamelImapResponse;
 typedef struct _CamelImapSearch       CamelImapSearch;
 typedef struct _CamelImapStore        CamelImapStore;
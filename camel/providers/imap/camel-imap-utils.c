@@ -28,6 +28,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -1068,9 +1069,9 @@ imap_body_decode (const char **in, CamelMessageContentInfo *ci, CamelFolder *fol
 			goto exception;
 
 		ci->type = ctype;
-		ci->id = id;
-		ci->description = description;
-		ci->encoding = encoding;
+		ci->id = (char *) camel_pstring_add (id, TRUE);
+		ci->description = (char *) camel_pstring_add (description, TRUE);
+		ci->encoding = (char *) camel_pstring_add (encoding, TRUE);
 		ci->size = size;
 		ci->childs = child;
 	}
@@ -1349,6 +1350,93 @@ imap_uid_array_free (GPtrArray *arr)
 	g_ptr_array_free (arr, TRUE);
 }
 
+struct _uid_range {
+	unsigned long first, last;
+};
+
+static int
+uid_range_compar (const void *va, const void *vb)
+{
+	const struct _uid_range *a = va, *b = vb;
+
+	return a->first < b->first ? -1 : a->first > b->first;
+}
+
+/**
+ * imap_uid_set_to_expunged:
+ * @summary: summary for the folder the UIDs come from
+ * @uids: one or more comma separated IMAP "set"s of UIDs, as from a
+ * VANISHED response
+ * @expunged: array to add sequence numbers to
+ *
+ * Appends to @expunged the sequence numbers of the messages in
+ * @summary whose UIDs are in @uids, as a series of EXPUNGE responses
+ * removing them would have listed them, so the array can be passed to
+ * camel_imap_folder_changed(). UIDs not in @summary are ignored, so
+ * @uids may cover ranges much larger than the folder.
+ *
+ * Return value: 0 on success or -1 if @uids can't be parsed.
+ **/
+int
+imap_uid_set_to_expunged (CamelFolderSummary *summary, const char *uids, GArray *expunged)
+{
+	struct _uid_range range, *ranges;
+	GArray *arr;
+	unsigned long uid;
+	int i, r, count, removed;
+	char *p, *q;
+
+	arr = g_array_new (FALSE, FALSE, sizeof (struct _uid_range));
+
+	p = (char *)uids;
+	do {
+		range.first = strtoul (p, &q, 10);
+		if (p == q)
+			goto lose;
+		range.last = range.first;
+		if (*q == ':') {
+			range.last = strtoul (q + 1, &p, 10);
+			if (p == q + 1)
+				goto lose;
+			if (range.last < range.first) {
+				uid = range.first;
+				range.first = range.last;
+				range.last = uid;
+			}
+		} else
+			p = q;
+		g_array_append_val (arr, range);
+	} while (*p++ == ',');
+
+	/* walk the summary and the sorted ranges together */
+	qsort (arr->data, arr->len, sizeof (struct _uid_range), uid_range_compar);
+	ranges = (struct _uid_range *)arr->data;
+
+	count = camel_folder_summary_count (summary);
+	removed = 0;
+	r = 0;
+	for (i = 0; i < count && r < arr->len; i++) {
+		uid = get_summary_uid_numeric (summary, i);
+		while (r < arr->len && ranges[r].last < uid)
+			r++;
+		if (r < arr->len && ranges[r].first <= uid) {
+			/* each one is numbered as if the ones before it had gone */
+			int seq = i + 1 - removed++;
+
+			g_array_append_val (expunged, seq);
+		}
+	}
+
+	g_array_free (arr, TRUE);
+
+	return 0;
+
+ lose:
+	g_warning ("Invalid uid set %s", uids);
+	g_array_free (arr, TRUE);
+	return -1;
+}
+
 char *
 imap_concat (CamelImapStore *imap_store, const char *prefix, const char *suffix)
 {
@@ -77,6 +77,7 @@ void     imap_skip_list            (const char **str_p);
 char    *imap_uid_array_to_set     (CamelFolderSummary *summary, GPtrArray *uids, int uid, ssize_t maxlen, int *lastuid);
 GPtrArray *imap_uid_set_to_array   (CamelFolderSummary *summary, const char *uids);
 void     imap_uid_array_free       (GPtrArray *arr);
+int      imap_uid_set_to_expunged  (CamelFolderSummary *summary, const char *uids, GArray *expunged);
 
 char *imap_concat (CamelImapStore *imap_store, const char *prefix, const char *suffix);
 char *imap_namespace_concat (CamelImapStore *store, const char *name);
@@ -32,6 +32,7 @@
 
 #include "camel-sasl.h"
 #include "camel-stream-buffer.h"
+#include "camel-stream-deflate.h"
 
 #include "camel-imap4-command.h"
 #include "camel-imap4-engine.h"
@@ -285,6 +286,65 @@ camel_imap4_engine_capability (CamelIMAP4Engine *engine, CamelException *ex)
 }
 
 
+/**
+ * camel_imap4_engine_compress:
+ * @engine: IMAP4 engine
+ * @ex: exception
+ *
+ * Asks the IMAP4 server to compress the connection, if it supports
+ * COMPRESS=DEFLATE, and from then on compresses everything sent and
+ * decompresses everything received.
+ *
+ * Returns 0 on success, including when the server doesn't compress,
+ * or -1 on fail.
+ **/
+int
+camel_imap4_engine_compress (CamelIMAP4Engine *engine, CamelException *ex)
+{
+	CamelIMAP4Command *ic;
+	CamelStream *stream;
+	int id, result;
+
+	if (!(engine->capa & CAMEL_IMAP4_CAPABILITY_COMPRESS))
+		return 0;
+
+	ic = camel_imap4_engine_prequeue (engine, NULL, "COMPRESS DEFLATE\r\n");
+
+	while ((id = camel_imap4_engine_iterate (engine)) < ic->id && id != -1)
+		;
+
+	if (id == -1 || ic->status != CAMEL_IMAP4_COMMAND_COMPLETE) {
+		camel_exception_xfer (ex, &ic->ex);
+		camel_imap4_command_unref (ic);
+		return -1;
+	}
+
+	result = ic->result;
+	camel_imap4_command_unref (ic);
+
+	/* not critical if the server refuses */
+	if (result != CAMEL_IMAP4_RESULT_OK)
+		return 0;
+
+	/* the server sends nothing more until we do, so there is
+	 * nothing left in the read buffer to carry over */
+	if (!(stream = camel_stream_deflate_new (engine->istream->stream))) {
+		camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
+				      _("Could not start compression with IMAP server %s"),
+				      engine->url->host);
+		return -1;
+	}
+
+	camel_object_unref (engine->istream->stream);
+	engine->istream->stream = stream;
+
+	camel_object_unref (engine->ostream);
+	engine->ostream = camel_stream_buffer_new (stream, CAMEL_STREAM_BUFFER_WRITE);
+
+	return 0;
+}
+
+
 /**
  * camel_imap4_engine_namespace:
  * @engine: IMAP4 engine
@@ -466,6 +526,7 @@ static struct {
 	{ "IDLE",          CAMEL_IMAP4_CAPABILITY_IDLE          }, /* rfc2177 */
 	{ "MULTIAPPEND",   CAMEL_IMAP4_CAPABILITY_MULTIAPPEND   }, /* rfc3502 */
 	{ "UNSELECT",      CAMEL_IMAP4_CAPABILITY_UNSELECT      },
+	{ "COMPRESS=DEFLATE", CAMEL_IMAP4_CAPABILITY_COMPRESS   }, /* rfc4978 */
 	{ "XGWEXTENSIONS", CAMEL_IMAP4_CAPABILITY_XGWEXTENSIONS }, /* GroupWise extensions */
 	{ NULL,            0                                    }
 };
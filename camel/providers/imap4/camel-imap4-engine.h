@@ -78,6 +78,7 @@ enum {
 	CAMEL_IMAP4_CAPABILITY_ACL              = (1 << 10),
 	CAMEL_IMAP4_CAPABILITY_MULTIAPPEND      = (1 << 11),
 	CAMEL_IMAP4_CAPABILITY_UNSELECT         = (1 << 12),
+	CAMEL_IMAP4_CAPABILITY_COMPRESS         = (1 << 13),
 
 	CAMEL_IMAP4_CAPABILITY_XGWEXTENSIONS    = (1 << 16),
 	CAMEL_IMAP4_CAPABILITY_XGWMOVE          = (1 << 17),
@@ -202,6 +203,7 @@ int camel_imap4_engine_take_stream (CamelIMAP4Engine *engine, CamelStream *strea
 
 int camel_imap4_engine_capability (CamelIMAP4Engine *engine, CamelException *ex);
 int camel_imap4_engine_namespace (CamelIMAP4Engine *engine, CamelException *ex);
+int camel_imap4_engine_compress (CamelIMAP4Engine *engine, CamelException *ex);
 
 int camel_imap4_engine_select_folder (CamelIMAP4Engine *engine, CamelFolder *folder, CamelException *ex);
 
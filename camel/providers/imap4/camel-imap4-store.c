@@ -555,6 +555,9 @@ imap4_reconnect (CamelIMAP4Engine *engine, CamelException *ex)
 		}
 	}
 
+	if (camel_imap4_engine_compress (engine, ex) == -1)
+		return FALSE;
+
 	if (camel_imap4_engine_namespace (engine, ex) == -1)
 		return FALSE;
 
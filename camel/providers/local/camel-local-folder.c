@@ -278,6 +278,9 @@ camel_local_folder_construct(CamelLocalFolder *lf, CamelStore *parent_store, con
 			forceindex = FALSE;
 			/* record that we dont have an index afterall */
 			lf->flags &= ~CAMEL_STORE_FOLDER_BODY_INDEX;
+		} else if (forceindex) {
+			/* everything is about to be reindexed, load it in bulk until the next sync */
+			camel_text_index_bulk_start((CamelTextIndex *)lf->index, 0);
 		}
 	} else {
 		/* if we do have an index file, remove it (?) */
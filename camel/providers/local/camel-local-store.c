@@ -394,6 +394,9 @@ rename_folder(CamelStore *store, const char *old, const char *new, CamelExceptio
 	if (xrename(old, new, path, ".ev-summary-meta", TRUE, ex))
 		goto summary_failed;
 
+	if (xrename(old, new, path, ".ev-summary-journal", TRUE, ex))
+		goto summary_failed;
+
 	if (xrename(old, new, path, ".cmeta", TRUE, ex))
 		goto cmeta_failed;
 
@@ -416,6 +419,7 @@ base_failed:
 cmeta_failed:
 	xrename(new, old, path, ".ev-summary", TRUE, ex);
 	xrename(new, old, path, ".ev-summary-meta", TRUE, ex);
+	xrename(new, old, path, ".ev-summary-journal", TRUE, ex);
 summary_failed:
 	if (folder) {
 		if (folder->index)
@@ -466,6 +470,16 @@ delete_folder(CamelStore *store, const char *folder_name, CamelException *ex)
 		return;
 	}
 	g_free(str);
+	str = g_strdup_printf("%s.ev-summary-journal", name);
+	if (g_unlink(str) == -1 && errno != ENOENT) {
+		camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
+				      _("Could not delete folder summary file `%s': %s"),
+				      str, g_strerror (errno));
+		g_free(str);
+		g_free (name);
+		return;
+	}
+	g_free(str);
 	str = g_strdup_printf("%s.ibex", name);
 	if (camel_text_index_remove(str) == -1 && errno != ENOENT) {
 		camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
@@ -33,6 +33,9 @@
 #include <sys/types.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include <glib/gi18n-lib.h>
 
@@ -73,6 +76,14 @@ struct _CamelMaildirSummaryPrivate {
 
 	GHashTable *load_map;
 	GMutex *summary_lock;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	/* cur/ and new/ are watched once scanned, so later checks only
+	   need to look at the names that changed */
+	int notify_fd;
+	int notify_cur, notify_new;
+	unsigned int notify_valid:1;	/* summary matches cur/ bar the events queued */
+#endif
 };
 
 static CamelLocalSummaryClass *parent_class;
@@ -140,6 +151,9 @@ camel_maildir_summary_init (CamelMaildirSummary *o)
 		o->priv->hostname = g_strdup("localhost");
 	}
 	o->priv->summary_lock = g_mutex_new ();
+#ifdef HAVE_SYS_INOTIFY_H
+	o->priv->notify_fd = -1;
+#endif
 }
 
 static void
@@ -149,6 +163,10 @@ camel_maildir_summary_finalise(CamelObject *obj)
 
 	g_free(o->priv->hostname);
 	g_mutex_free (o->priv->summary_lock);
+#ifdef HAVE_SYS_INOTIFY_H
+	if (o->priv->notify_fd != -1)
+		close(o->priv->notify_fd);
+#endif
 	g_free(o->priv);
 }
 
@@ -534,25 +552,141 @@ sort_receive_cmp(const void *ap, const void *bp)
 	return 0;
 }
 
+/* the message's file has been renamed, by us or another client */
+static void
+maildir_summary_set_filename(CamelLocalSummary *cls, CamelMessageInfo *info, const char *name)
+{
+	CamelMaildirMessageInfo *mdi = (CamelMaildirMessageInfo *)info;
+	const char *filename;
+#ifdef DOESTRV
+	CamelFolderSummary *s = (CamelFolderSummary *)cls;
+#endif
+
+	filename = camel_maildir_info_filename(mdi);
+	/* TODO: only store the extension in the mdi->filename struct, not the whole lot */
+	if (filename == NULL || strcmp(filename, name) != 0) {
+#ifdef DOESTRV
+#warning "cannot modify the estrv after its been setup, for mt-safe code"
+		CAMEL_SUMMARY_LOCK(s, summary_lock);
+		/* need to update the summary hash ref */
+		g_hash_table_remove(s->messages_uid, camel_message_info_uid(info));
+		info->strings = e_strv_set_ref(info->strings, CAMEL_MAILDIR_INFO_FILENAME, name);
+		info->strings = e_strv_pack(info->strings);
+		g_hash_table_insert(s->messages_uid, (char *)camel_message_info_uid(info), info);
+		CAMEL_SUMMARY_UNLOCK(s, summary_lock);
+#else
+# ifdef DOEPOOLV
+		info->strings = e_poolv_set(info->strings, CAMEL_MAILDIR_INFO_FILENAME, name, FALSE);
+# else
+		g_free(mdi->filename);
+		mdi->filename = g_strdup(name);
+# endif
+#endif
+	}
+}
+
+/* move everything in new/ to cur/ and add it */
+static void
+maildir_summary_check_new(CamelLocalSummary *cls, CamelFolderChangeInfo *changes, int forceindex)
+{
+	CamelFolderSummary *s = (CamelFolderSummary *)cls;
+	CamelMessageInfo *info;
+	struct dirent *d;
+	char *new, *cur;
+	int count, total;
+	DIR *dir;
+
+	new = g_strdup_printf("%s/new", cls->folder_path);
+	cur = g_strdup_printf("%s/cur", cls->folder_path);
+
+	camel_operation_start(NULL, _("Checking for new messages"));
+
+	/* now, scan new for new messages, and copy them to cur, and so forth */
+	dir = opendir(new);
+	if (dir != NULL) {
+		total = 0;
+		count = 0;
+		while ( (d = readdir(dir)) )
+			total++;
+		rewinddir(dir);
+
+		while ( (d = readdir(dir)) ) {
+			char *name, *newname, *destname, *destfilename;
+			char *src, *dest;
+			int pc = count * 100 / total;
+
+			camel_operation_progress(NULL, pc);
+			count++;
+
+			name = d->d_name;
+			if (name[0] == '.')
+				continue;
+
+			/* already in summary?  shouldn't happen, but just incase ... */
+			if ((info = camel_folder_summary_uid((CamelFolderSummary *)cls, name))) {
+				camel_message_info_free(info);
+				newname = destname = camel_folder_summary_next_uid_string(s);
+			} else {
+				newname = NULL;
+				destname = name;
+			}
+
+			/* copy this to the destination folder, use 'standard' semantics for maildir info field */
+			src = g_strdup_printf("%s/%s", new, name);
+			destfilename = g_strdup_printf("%s:2,", destname);
+			dest = g_strdup_printf("%s/%s", cur, destfilename);
+
+			/* FIXME: This should probably use link/unlink */
+
+			if (rename(src, dest) == 0) {
+				camel_maildir_summary_add (cls, destfilename, forceindex);
+				if (changes) {
+					camel_folder_change_info_add_uid(changes, destname);
+					camel_folder_change_info_recent_uid(changes, destname);
+				}
+			} else {
+				/* else?  we should probably care about failures, but wont */
+				g_warning("Failed to move new maildir message %s to cur %s", src, dest);
+			}
+
+			/* c strings are painful to work with ... */
+			g_free(destfilename);
+			g_free(newname);
+			g_free(src);
+			g_free(dest);
+		}
+		closedir(dir);
+	}
+	camel_operation_end(NULL);
+
+	g_free(new);
+	g_free(cur);
+}
+
+/* sort the summary based on receive time, since the directory order is not useful */
+static void
+maildir_summary_sort(CamelFolderSummary *s)
+{
+	CAMEL_SUMMARY_LOCK(s, summary_lock);
+	qsort(s->messages->pdata, s->messages->len, sizeof(CamelMessageInfo *), sort_receive_cmp);
+	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
+}
+
+/* check everything in cur/ against the summary, then new/ */
 static int
-maildir_summary_check(CamelLocalSummary *cls, CamelFolderChangeInfo *changes, CamelException *ex)
+maildir_summary_scan(CamelLocalSummary *cls, CamelFolderChangeInfo *changes, CamelException *ex)
 {
 	DIR *dir;
 	struct dirent *d;
 	char *p;
 	CamelMessageInfo *info;
-	CamelMaildirMessageInfo *mdi;
-	CamelFolderSummary *s = (CamelFolderSummary *)cls;
 	GHashTable *left;
 	int i, count, total;
 	int forceindex;
-	char *new, *cur;
+	char *cur;
 	char *uid;
 	struct _remove_data rd = { cls, changes };
 
-	g_mutex_lock (((CamelMaildirSummary *) cls)->priv->summary_lock);
-
-	new = g_strdup_printf("%s/new", cls->folder_path);
 	cur = g_strdup_printf("%s/cur", cls->folder_path);
 
 	d(printf("checking summary ...\n"));
@@ -567,9 +701,7 @@ maildir_summary_check(CamelLocalSummary *cls, CamelFolderChangeInfo *changes, Ca
 			_("Cannot open maildir directory path: %s: %s"),
 			cls->folder_path, g_strerror (errno));
 		g_free(cur);
-		g_free(new);
 		camel_operation_end(NULL);
-		g_mutex_unlock (((CamelMaildirSummary *) cls)->priv->summary_lock);
 		return -1;
 	}
 
@@ -622,35 +754,12 @@ maildir_summary_check(CamelLocalSummary *cls, CamelFolderChangeInfo *changes, Ca
 				if (changes)
 					camel_folder_change_info_add_uid(changes, uid);
 		} else {
-			const char *filename;
-
 			if (cls->index && (!camel_index_has_name(cls->index, uid))) {
 				/* message_info_new will handle duplicates */
 				camel_maildir_summary_add(cls, d->d_name, forceindex);
 			}
 
-			mdi = (CamelMaildirMessageInfo *)info;
-			filename = camel_maildir_info_filename(mdi);
-			/* TODO: only store the extension in the mdi->filename struct, not the whole lot */
-			if (filename == NULL || strcmp(filename, d->d_name) != 0) {
-#ifdef DOESTRV
-#warning "cannot modify the estrv after its been setup, for mt-safe code"
-				CAMEL_SUMMARY_LOCK(s, summary_lock);
-				/* need to update the summary hash ref */
-				g_hash_table_remove(s->messages_uid, camel_message_info_uid(info));
-				info->strings = e_strv_set_ref(info->strings, CAMEL_MAILDIR_INFO_FILENAME, d->d_name);
-				info->strings = e_strv_pack(info->strings);
-				g_hash_table_insert(s->messages_uid, (char *)camel_message_info_uid(info), info);
-				CAMEL_SUMMARY_UNLOCK(s, summary_lock);
-#else
-# ifdef DOEPOOLV
-				info->strings = e_poolv_set(info->strings, CAMEL_MAILDIR_INFO_FILENAME, d->d_name, FALSE);
-# else
-				g_free(mdi->filename);
-				mdi->filename = g_strdup(d->d_name);
-# endif
-#endif
-			}
+			maildir_summary_set_filename(cls, info, d->d_name);
 			camel_message_info_free(info);
 		}
 		g_free(uid);
@@ -661,78 +770,222 @@ maildir_summary_check(CamelLocalSummary *cls, CamelFolderChangeInfo *changes, Ca
 
 	camel_operation_end(NULL);
 
-	camel_operation_start(NULL, _("Checking for new messages"));
+	maildir_summary_check_new(cls, changes, forceindex);
 
-	/* now, scan new for new messages, and copy them to cur, and so forth */
-	dir = opendir(new);
-	if (dir != NULL) {
-		total = 0;
-		count = 0;
-		while ( (d = readdir(dir)) )
-			total++;
-		rewinddir(dir);
+	g_free(cur);
 
-		while ( (d = readdir(dir)) ) {
-			char *name, *newname, *destname, *destfilename;
-			char *src, *dest;
-			int pc = count * 100 / total;
+	maildir_summary_sort((CamelFolderSummary *)cls);
 
-			camel_operation_progress(NULL, pc);
-			count++;
+	return 0;
+}
 
-			name = d->d_name;
-			if (name[0] == '.')
-				continue;
+#ifdef HAVE_SYS_INOTIFY_H
+#define NOTIFY_EVENTS (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
 
-			/* already in summary?  shouldn't happen, but just incase ... */
-			if ((info = camel_folder_summary_uid((CamelFolderSummary *)cls, name))) {
-				camel_message_info_free(info);
-				newname = destname = camel_folder_summary_next_uid_string(s);
-			} else {
-				newname = NULL;
-				destname = name;
+/* called before a full scan, anything that happens from here on is
+   left for the next check to pick up */
+static void
+maildir_summary_notify_start(CamelLocalSummary *cls)
+{
+	struct _CamelMaildirSummaryPrivate *p = _PRIVATE(cls);
+	char buf[4096], *path;
+	int flags;
+
+	p->notify_valid = FALSE;
+
+	if (p->notify_fd == -1) {
+		/* manual override */
+		if (getenv("CAMEL_MAILDIR_DISABLE_NOTIFY") != NULL)
+			return;
+
+		p->notify_fd = inotify_init();
+		if (p->notify_fd == -1)
+			return;
+
+		if ((flags = fcntl(p->notify_fd, F_GETFL)) == -1
+		    || fcntl(p->notify_fd, F_SETFL, flags | O_NONBLOCK) == -1
+		    || fcntl(p->notify_fd, F_SETFD, FD_CLOEXEC) == -1) {
+			close(p->notify_fd);
+			p->notify_fd = -1;
+			return;
+		}
+	} else {
+		/* the scan covers anything queued so far */
+		while (read(p->notify_fd, buf, sizeof(buf)) > 0)
+			;
+	}
+
+	/* adding a watch again just returns the same one */
+	path = g_strdup_printf("%s/cur", cls->folder_path);
+	p->notify_cur = inotify_add_watch(p->notify_fd, path, NOTIFY_EVENTS);
+	g_free(path);
+	path = g_strdup_printf("%s/new", cls->folder_path);
+	p->notify_new = inotify_add_watch(p->notify_fd, path, NOTIFY_EVENTS);
+	g_free(path);
+
+	p->notify_valid = p->notify_cur != -1 && p->notify_new != -1;
+}
+
+struct _notify_data {
+	CamelLocalSummary *cls;
+	CamelFolderChangeInfo *changes;
+	int forceindex;
+	int added;
+};
+
+static void
+notify_apply(char *uid, char *name, struct _notify_data *nd)
+{
+	CamelLocalSummary *cls = nd->cls;
+	CamelMessageInfo *info;
+	struct _remove_data rd = { cls, nd->changes };
+	struct stat st;
+	char *path;
+
+	info = camel_folder_summary_uid((CamelFolderSummary *)cls, uid);
+	if (name == NULL) {
+		if (info == NULL)
+			return;
+
+		/* gone, unless it was only a name it had before */
+		path = g_strdup_printf("%s/cur/%s", cls->folder_path, camel_maildir_info_filename(info));
+		if (stat(path, &st) == -1 && errno == ENOENT)
+			remove_summary(uid, info, &rd);
+		else
+			camel_message_info_free(info);
+		g_free(path);
+	} else if (info == NULL) {
+		/* must be a message incorporated by another client, this is not a 'recent' uid */
+		if (camel_maildir_summary_add(cls, name, nd->forceindex) == 0) {
+			if (nd->changes)
+				camel_folder_change_info_add_uid(nd->changes, uid);
+			nd->added = TRUE;
+		}
+	} else {
+		maildir_summary_set_filename(cls, info, name);
+		camel_message_info_free(info);
+	}
+}
+
+/* apply the changes to cur/ and new/ since the last check, returns -1
+   if that can't be done and the directories need scanning */
+static int
+maildir_summary_notify_check(CamelLocalSummary *cls, CamelFolderChangeInfo *changes)
+{
+	struct _CamelMaildirSummaryPrivate *p = _PRIVATE(cls);
+	union {
+		struct inotify_event event;
+		char buf[16384];
+	} events;
+	struct inotify_event *event;
+	struct _notify_data nd;
+	GHashTable *names;
+	gboolean new = FALSE, rescan = FALSE;
+	char *uid, *name, *key, *old;
+	ssize_t len, i;
+
+	if (!p->notify_valid || getenv("CAMEL_MAILDIR_DISABLE_NOTIFY") != NULL)
+		return -1;
+
+	/* uid -> the name it has now in cur/, or NULL if it's gone */
+	names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	while (!rescan) {
+		do {
+			len = read(p->notify_fd, events.buf, sizeof(events.buf));
+		} while (len == -1 && errno == EINTR);
+
+		if (len <= 0) {
+			rescan = len == 0 || errno != EAGAIN;
+			break;
+		}
+
+		for (i=0;i<len;i+=sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event *)(events.buf + i);
+
+			/* lost events, or the directory itself changed */
+			if (event->mask & (IN_Q_OVERFLOW|IN_IGNORED|IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT)) {
+				rescan = TRUE;
+				break;
 			}
 
-			/* copy this to the destination folder, use 'standard' semantics for maildir info field */
-			src = g_strdup_printf("%s/%s", new, name);
-			destfilename = g_strdup_printf("%s:2,", destname);
-			dest = g_strdup_printf("%s/%s", cur, destfilename);
+			if (event->len == 0 || event->name[0] == '.' || (event->mask & IN_ISDIR))
+				continue;
 
-			/* FIXME: This should probably use link/unlink */
+			if (event->wd == p->notify_new) {
+				new |= (event->mask & (IN_CREATE|IN_MOVED_TO)) != 0;
+				continue;
+			} else if (event->wd != p->notify_cur)
+				continue;
 
-			if (rename(src, dest) == 0) {
-				camel_maildir_summary_add (cls, destfilename, forceindex);
-				if (changes) {
-					camel_folder_change_info_add_uid(changes, destname);
-					camel_folder_change_info_recent_uid(changes, destname);
-				}
+			d(printf("cur/%s %s\n", event->name, (event->mask & (IN_CREATE|IN_MOVED_TO)) ? "added" : "removed"));
+
+			if ((name = strchr(event->name, ':')))
+				uid = g_strndup(event->name, name - event->name);
+			else
+				uid = g_strdup(event->name);
+
+			if (event->mask & (IN_CREATE|IN_MOVED_TO)) {
+				g_hash_table_replace(names, uid, g_strdup(event->name));
+			} else if (!g_hash_table_lookup_extended(names, uid, (void **)&key, (void **)&old)
+				   || (old && !strcmp(old, event->name))) {
+				g_hash_table_replace(names, uid, NULL);
 			} else {
-				/* else?  we should probably care about failures, but wont */
-				g_warning("Failed to move new maildir message %s to cur %s", src, dest);
+				g_free(uid);
 			}
-
-			/* c strings are painful to work with ... */
-			g_free(destfilename);
-			g_free(newname);
-			g_free(src);
-			g_free(dest);
 		}
-		camel_operation_end(NULL);
 	}
-	closedir(dir);
 
-	g_free(new);
-	g_free(cur);
+	if (rescan) {
+		d(printf("lost track of %s, rescanning\n", cls->folder_path));
+		g_hash_table_destroy(names);
+		return -1;
+	}
 
-	/* sort the summary based on receive time, since the directory order is not useful */
-	CAMEL_SUMMARY_LOCK(s, summary_lock);
-	qsort(s->messages->pdata, s->messages->len, sizeof(CamelMessageInfo *), sort_receive_cmp);
-	CAMEL_SUMMARY_UNLOCK(s, summary_lock);
+	nd.cls = cls;
+	nd.changes = changes;
+	nd.forceindex = camel_folder_summary_count((CamelFolderSummary *)cls) == 0;
+	nd.added = FALSE;
+	g_hash_table_foreach(names, (GHFunc)notify_apply, &nd);
+	g_hash_table_destroy(names);
 
-	g_mutex_unlock (((CamelMaildirSummary *) cls)->priv->summary_lock);
+	if (new) {
+		maildir_summary_check_new(cls, changes, nd.forceindex);
+		nd.added = TRUE;
+	}
+
+	if (nd.added)
+		maildir_summary_sort((CamelFolderSummary *)cls);
 
 	return 0;
 }
+#endif
+
+static int
+maildir_summary_check(CamelLocalSummary *cls, CamelFolderChangeInfo *changes, CamelException *ex)
+{
+	int ret;
+
+	g_mutex_lock (((CamelMaildirSummary *) cls)->priv->summary_lock);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if (!cls->check_force && maildir_summary_notify_check(cls, changes) == 0) {
+		ret = 0;
+	} else {
+		maildir_summary_notify_start(cls);
+		ret = maildir_summary_scan(cls, changes, ex);
+		if (ret == -1)
+			_PRIVATE(cls)->notify_valid = FALSE;
+	}
+#else
+	ret = maildir_summary_scan(cls, changes, ex);
+#endif
+	cls->check_force = 0;
+
+	g_mutex_unlock (((CamelMaildirSummary *) cls)->priv->summary_lock);
+
+	return ret;
+}
 
 /* sync the summary with the ondisk files. */
 static int
@@ -101,7 +101,8 @@ camel_mbox_store_get_type(void)
 }
 
 static char *extensions[] = {
-	".msf", ".ev-summary", ".ev-summary-meta", ".ibex.index", ".ibex.index.data", ".cmeta", ".lock"
+	".msf", ".ev-summary", ".ev-summary-meta", ".ev-summary-journal", ".ibex.index", ".ibex.index.data",
+	".cmeta", ".lock", ".compact"
 };
 
 static gboolean
@@ -294,6 +295,18 @@ delete_folder(CamelStore *store, const char *folder_name, CamelException *ex)
 
 	g_free(path);
 
+	path = camel_local_store_get_meta_path(store, folder_name, ".ev-summary-journal");
+	if (g_unlink(path) == -1 && errno != ENOENT) {
+		camel_exception_setv(ex, CAMEL_EXCEPTION_SYSTEM,
+				     _("Could not delete folder summary file `%s': %s"),
+				     path, g_strerror(errno));
+		g_free(path);
+		g_free(name);
+		return;
+	}
+
+	g_free(path);
+
 	path = camel_local_store_get_meta_path(store, folder_name, ".ibex");
 	if (camel_text_index_remove(path) == -1 && errno != ENOENT) {
 		camel_exception_setv(ex, CAMEL_EXCEPTION_SYSTEM,
@@ -532,6 +545,11 @@ rename_folder(CamelStore *store, const char *old, const char *new, CamelExceptio
 		goto summary_failed;
 	}
 
+	if (xrename(store, old, new, ".ev-summary-journal", TRUE) == -1) {
+		errnosav = errno;
+		goto summary_failed;
+	}
+
 	if (xrename(store, old, new, ".cmeta", TRUE) == -1) {
 		errnosav = errno;
 		goto cmeta_failed;
@@ -562,6 +580,7 @@ subdir_failed:
 cmeta_failed:
 	xrename(store, new, old, ".ev-summary", TRUE);
 	xrename(store, new, old, ".ev-summary-meta", TRUE);
+	xrename(store, new, old, ".ev-summary-journal", TRUE);
 summary_failed:
 	if (folder) {
 		if (folder->index)
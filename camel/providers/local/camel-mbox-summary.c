@@ -69,6 +69,8 @@ static CamelMessageInfo *mbox_summary_add(CamelLocalSummary *cls, CamelMimeMessa
 
 static int mbox_summary_sync_quick(CamelMboxSummary *cls, gboolean expunge, CamelFolderChangeInfo *changeinfo, CamelException *ex);
 static int mbox_summary_sync_full(CamelMboxSummary *cls, gboolean expunge, CamelFolderChangeInfo *changeinfo, CamelException *ex);
+static int mbox_summary_sync_expunge(CamelMboxSummary *cls, CamelFolderChangeInfo *changeinfo, CamelException *ex);
+static int mbox_summary_compact_resume(CamelLocalSummary *cls, CamelException *ex);
 
 static void camel_mbox_summary_class_init (CamelMboxSummaryClass *klass);
 static void camel_mbox_summary_init       (CamelMboxSummary *obj);
@@ -176,6 +178,7 @@ camel_mbox_summary_class_init(CamelMboxSummaryClass *klass)
 
 	klass->sync_quick = mbox_summary_sync_quick;
 	klass->sync_full = mbox_summary_sync_full;
+	klass->sync_expunge = mbox_summary_sync_expunge;
 }
 
 static void
@@ -415,11 +418,344 @@ message_info_save(CamelFolderSummary *s, FILE *out, CamelMessageInfo *mi)
 	return 0;
 }
 
+/* Large mboxes are split at From lines into segments which are parsed
+   and decoded on a pool of threads, each into a private summary.  The
+   segments are then replayed into the real summary in file order, so
+   uids, flags and change info come out just as a serial build would
+   leave them. */
+
+#define SUMMARY_SEGMENT_MIN (4 * 1024 * 1024)	/* smallest segment worth a thread */
+#define SUMMARY_SEGMENTS_PER_THREAD (4)
+#define SUMMARY_MAX_THREADS (8)
+
+struct _summary_message {
+	off_t frompos;
+	guint32 size;
+	struct _camel_header_raw *headers;	/* only those the mbox and local summaries decode */
+	CamelMessageInfo *info;			/* everything else, from the private summary */
+};
+
+struct _summary_segment {
+	off_t start;		/* From line of the first message */
+	off_t end;		/* From line of the next segment, or -1 for the end of the file */
+	off_t error;		/* where the parser gave up, or -1 */
+	GPtrArray *messages;
+	CamelFolderSummary *summary;	/* the messages' infos came from, kept until they're freed */
+	gboolean done;
+};
+
+struct _summary_build {
+	const char *path;
+	GMutex *lock;
+	GCond *cond;
+};
+
+/* headers a message info needs decoded against the folder's own summary */
+static const char *summary_replay_headers[] = { "X-Evolution", "Status", "X-Status" };
+
+static int
+summary_update_threads(void)
+{
+	const char *env;
+	long count = 1;
+
+	if ((env = getenv("CAMEL_MBOX_SUMMARY_THREADS")) != NULL)
+		count = strtol(env, NULL, 10);
+#ifdef _SC_NPROCESSORS_ONLN
+	else
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	return CLAMP(count, 1, SUMMARY_MAX_THREADS);
+}
+
+/* offset of the first line at or after @pos which starts with "From ", or -1 */
+static off_t
+summary_find_from(int fd, off_t pos, off_t size)
+{
+	char buf[8192], *p, *e;
+	ssize_t len;
+
+	/* a From line follows a newline, so start looking just before */
+	pos--;
+	while (pos < size) {
+		len = pread(fd, buf, MIN(sizeof(buf), size - pos), pos);
+		if (len < 6)
+			return -1;
+
+		p = buf;
+		e = buf + len - 5;
+		while (p < e && (p = memchr(p, '\n', e - p)) != NULL) {
+			if (!strncmp(p + 1, "From ", 5))
+				return pos + (p - buf) + 1;
+			p++;
+		}
+
+		/* leave enough of the end to catch a From line split across reads */
+		pos += len - 5;
+	}
+
+	return -1;
+}
+
+/* the From lines between @offset and @size to start segments at,
+   checked with the parser so they fall where a serial scan would
+   find them */
+static GArray *
+summary_find_segments(CamelMimeParser *mp, int fd, off_t offset, off_t size, int threads)
+{
+	GArray *starts;
+	off_t want, pos, step;
+	int count;
+
+	count = MIN(threads * SUMMARY_SEGMENTS_PER_THREAD, (size - offset) / SUMMARY_SEGMENT_MIN);
+	step = (size - offset) / MAX(count, 1);
+
+	starts = g_array_new(FALSE, FALSE, sizeof(off_t));
+	g_array_append_val(starts, offset);
+
+	want = offset + step;
+	while (starts->len < count && want < size) {
+		pos = summary_find_from(fd, MAX(want, g_array_index(starts, off_t, starts->len - 1) + 1), size);
+		if (pos == -1)
+			break;
+
+		camel_mime_parser_seek(mp, pos, SEEK_SET);
+		if (camel_mime_parser_step(mp, NULL, NULL) == CAMEL_MIME_PARSER_STATE_FROM
+		    && camel_mime_parser_tell_start_from(mp) == pos) {
+			g_array_append_val(starts, pos);
+			want += step;
+		} else {
+			d(printf("From line at %ld isn't a message start\n", (long)pos));
+			want = pos + 1;
+		}
+		camel_mime_parser_drop_step(mp);
+	}
+
+	return starts;
+}
+
+static void
+summary_segment_build(struct _summary_segment *seg, struct _summary_build *build)
+{
+	CamelFolderSummary *s;
+	CamelMimeParser *mp;
+	struct _summary_message *msg;
+	struct _camel_header_raw *headers;
+	const char *value;
+	off_t start;
+	int fd, i, offset;
+
+	fd = g_open(build->path, O_LARGEFILE | O_RDONLY | O_BINARY, 0);
+	if (fd == -1) {
+		seg->error = seg->start;
+		goto done;
+	}
+
+	mp = camel_mime_parser_new();
+	camel_mime_parser_init_with_fd(mp, fd);
+	camel_mime_parser_scan_from(mp, TRUE);
+	camel_mime_parser_seek(mp, seg->start, SEEK_SET);
+
+	/* no index, and no content info, like the folder's own summary */
+	s = seg->summary = camel_folder_summary_new(NULL);
+	camel_folder_summary_set_build_content(s, FALSE);
+
+	while (camel_mime_parser_step(mp, NULL, NULL) == CAMEL_MIME_PARSER_STATE_FROM) {
+		if (seg->end != -1 && camel_mime_parser_tell_start_from(mp) >= seg->end)
+			break;
+
+		msg = g_malloc0(sizeof(*msg));
+		msg->frompos = camel_mime_parser_tell_start_from(mp);
+		start = camel_mime_parser_tell(mp);
+		g_ptr_array_add(seg->messages, msg);
+
+		/* take a copy of the headers the folder summary needs before
+		   they're gone, then let the summary step over them again */
+		if (camel_mime_parser_step(mp, NULL, NULL) == CAMEL_MIME_PARSER_STATE_EOF) {
+			seg->error = camel_mime_parser_tell(mp);
+			break;
+		}
+		headers = camel_mime_parser_headers_raw(mp);
+		for (i=0;i<G_N_ELEMENTS(summary_replay_headers);i++) {
+			if ((value = camel_header_raw_find(&headers, summary_replay_headers[i], &offset)))
+				camel_header_raw_append(&msg->headers, summary_replay_headers[i], value, offset);
+		}
+		camel_mime_parser_unstep(mp);
+
+		msg->info = camel_folder_summary_info_new_from_parser(s, mp);
+		if (msg->info == NULL) {
+			seg->error = camel_mime_parser_tell(mp);
+			break;
+		}
+		msg->size = camel_mime_parser_tell(mp) - start;
+
+		if (camel_mime_parser_step(mp, NULL, NULL) != CAMEL_MIME_PARSER_STATE_FROM_END) {
+			seg->error = camel_mime_parser_tell(mp);
+			break;
+		}
+	}
+
+	camel_object_unref(mp);
+done:
+	g_mutex_lock(build->lock);
+	seg->done = TRUE;
+	g_cond_broadcast(build->cond);
+	g_mutex_unlock(build->lock);
+}
+
+/* add the messages from a segment to the summary, as summary_update() would have */
+static int
+summary_segment_merge(CamelLocalSummary *cls, struct _summary_segment *seg, off_t size, CamelException *ex)
+{
+	CamelFolderSummary *s = (CamelFolderSummary *)cls;
+	CamelMessageInfoBase *mi, *wi;
+	CamelMessageInfo *old;
+	struct _summary_message *msg;
+	const char *tmp;
+	CamelSummaryReferences *refs;
+	guint32 flags;
+	int i;
+
+	for (i=0;i<seg->messages->len;i++) {
+		msg = seg->messages->pdata[i];
+		if ((wi = (CamelMessageInfoBase *)msg->info) == NULL)
+			break;
+
+		camel_operation_progress(NULL, (int) (((float) (msg->frompos + 1) / size) * 100));
+
+		mi = (CamelMessageInfoBase *)camel_folder_summary_info_new_from_header(s, msg->headers);
+		if (mi == NULL) {
+			seg->error = msg->frompos;
+			break;
+		}
+
+		/* a message we already had keeps what it had, a new one takes
+		   what the worker decoded */
+		old = camel_folder_summary_uid(s, camel_message_info_uid(mi));
+		if (old != (CamelMessageInfo *)mi) {
+#define swap(a, b) (tmp = (a), (a) = (b), (b) = tmp)
+			swap(mi->subject, wi->subject);
+			swap(mi->from, wi->from);
+			swap(mi->to, wi->to);
+			swap(mi->cc, wi->cc);
+			swap(mi->mlist, wi->mlist);
+#undef swap
+			refs = mi->references;
+			mi->references = wi->references;
+			wi->references = refs;
+			mi->date_sent = wi->date_sent;
+			mi->date_received = wi->date_received;
+			mi->message_id = wi->message_id;
+		}
+		if (old)
+			camel_message_info_free(old);
+
+		flags = wi->flags & (CAMEL_MESSAGE_ATTACHMENTS | CAMEL_MESSAGE_SECURE);
+		if (flags)
+			camel_message_info_set_flags((CamelMessageInfo *)mi, flags, flags);
+
+		((CamelMboxMessageInfo *)mi)->frompos = msg->frompos;
+		mi->size = msg->size;
+
+		camel_folder_summary_add(s, (CamelMessageInfo *)mi);
+	}
+
+	if (seg->error != -1) {
+		camel_exception_setv(ex, 1, _("Fatal mail parser error near position %ld in folder %s"),
+				     (long)seg->error, cls->folder_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+summary_segment_free(struct _summary_segment *seg)
+{
+	struct _summary_message *msg;
+	int i;
+
+	for (i=0;i<seg->messages->len;i++) {
+		msg = seg->messages->pdata[i];
+		if (msg->info)
+			camel_message_info_free(msg->info);
+		camel_header_raw_clear(&msg->headers);
+		g_free(msg);
+	}
+	g_ptr_array_free(seg->messages, TRUE);
+
+	/* only now, the infos were allocated from it */
+	if (seg->summary)
+		camel_object_unref(seg->summary);
+}
+
+/* summary_update()'s parsing loop, over segments of the mbox at once */
+static int
+summary_update_parallel(CamelLocalSummary *cls, CamelMimeParser *mp, int fd, off_t offset, off_t size, int threads, CamelException *ex)
+{
+	struct _summary_segment *segs;
+	struct _summary_build build;
+	GThreadPool *pool;
+	GArray *starts;
+	int i, count, ok = 0;
+
+	/* forget the check of the first From line */
+	camel_mime_parser_drop_step(mp);
+
+	starts = summary_find_segments(mp, fd, offset, size, threads);
+	count = starts->len;
+	segs = g_malloc0(count * sizeof(*segs));
+	for (i=0;i<count;i++) {
+		segs[i].start = g_array_index(starts, off_t, i);
+		segs[i].end = i + 1 < count ? g_array_index(starts, off_t, i + 1) : -1;
+		segs[i].error = -1;
+		segs[i].messages = g_ptr_array_new();
+	}
+	g_array_free(starts, TRUE);
+
+	d(printf("building summary of %s in %d segments on %d threads\n", cls->folder_path, count, threads));
+
+	build.path = cls->folder_path;
+	build.lock = g_mutex_new();
+	build.cond = g_cond_new();
+
+	/* if we can't get any threads, just do them one after the other */
+	pool = g_thread_pool_new((GFunc)summary_segment_build, &build, MIN(threads, count), FALSE, NULL);
+	for (i=0;i<count;i++) {
+		if (pool)
+			g_thread_pool_push(pool, &segs[i], NULL);
+		else
+			summary_segment_build(&segs[i], &build);
+	}
+
+	/* merge each segment as soon as it's ready, while the later ones
+	   are still being parsed */
+	for (i=0;i<count;i++) {
+		g_mutex_lock(build.lock);
+		while (!segs[i].done)
+			g_cond_wait(build.cond, build.lock);
+		g_mutex_unlock(build.lock);
+
+		if (ok == 0)
+			ok = summary_segment_merge(cls, &segs[i], size, ex);
+		summary_segment_free(&segs[i]);
+	}
+
+	if (pool)
+		g_thread_pool_free(pool, FALSE, TRUE);
+	g_mutex_free(build.lock);
+	g_cond_free(build.cond);
+	g_free(segs);
+
+	return ok;
+}
+
 /* like summary_rebuild, but also do changeinfo stuff (if supplied) */
 static int
 summary_update(CamelLocalSummary *cls, off_t offset, CamelFolderChangeInfo *changeinfo, CamelException *ex)
 {
-	int i, count;
+	int i, count, threads;
 	CamelFolderSummary *s = (CamelFolderSummary *)cls;
 	CamelMboxSummary *mbs = (CamelMboxSummary *)cls;
 	CamelMimeParser *mp;
@@ -479,21 +815,29 @@ summary_update(CamelLocalSummary *cls, off_t offset, CamelFolderChangeInfo *chan
 	}
 	mbs->changes = changeinfo;
 
-	while (camel_mime_parser_step(mp, NULL, NULL) == CAMEL_MIME_PARSER_STATE_FROM) {
-		CamelMessageInfo *info;
-		off_t pc = camel_mime_parser_tell_start_from (mp) + 1;
-
-		camel_operation_progress (NULL, (int) (((float) pc / size) * 100));
+	/* index names go by uid, and the shared filters are only good for
+	   one message at a time, so only a plain summary can be split up */
+	if (cls->index == NULL && !s->build_content
+	    && size - offset >= 2 * SUMMARY_SEGMENT_MIN
+	    && (threads = summary_update_threads()) > 1) {
+		ok = summary_update_parallel(cls, mp, fd, offset, size, threads, ex);
+	} else {
+		while (camel_mime_parser_step(mp, NULL, NULL) == CAMEL_MIME_PARSER_STATE_FROM) {
+			CamelMessageInfo *info;
+			off_t pc = camel_mime_parser_tell_start_from (mp) + 1;
+
+			camel_operation_progress (NULL, (int) (((float) pc / size) * 100));
+
+			info = camel_folder_summary_add_from_parser(s, mp);
+			if (info == NULL) {
+				camel_exception_setv(ex, 1, _("Fatal mail parser error near position %ld in folder %s"),
+						     camel_mime_parser_tell(mp), cls->folder_path);
+				ok = -1;
+				break;
+			}
 
-		info = camel_folder_summary_add_from_parser(s, mp);
-		if (info == NULL) {
-			camel_exception_setv(ex, 1, _("Fatal mail parser error near position %ld in folder %s"),
-					     camel_mime_parser_tell(mp), cls->folder_path);
-			ok = -1;
-			break;
+			g_assert(camel_mime_parser_step(mp, NULL, NULL) == CAMEL_MIME_PARSER_STATE_FROM_END);
 		}
-
-		g_assert(camel_mime_parser_step(mp, NULL, NULL) == CAMEL_MIME_PARSER_STATE_FROM_END);
 	}
 
 	camel_object_unref(CAMEL_OBJECT (mp));
@@ -539,6 +883,11 @@ mbox_summary_check(CamelLocalSummary *cls, CamelFolderChangeInfo *changes, Camel
 
 	d(printf("Checking summary\n"));
 
+	/* finish an in-place expunge cut short last time, before
+	   anything looks at the mbox */
+	if (mbox_summary_compact_resume(cls, ex) == -1)
+		return -1;
+
 	/* check if the summary is up-to-date */
 	if (g_stat(cls->folder_path, &st) == -1) {
 		camel_folder_summary_clear(s);
@@ -880,14 +1229,532 @@ mbox_summary_sync_quick(CamelMboxSummary *mbs, gboolean expunge, CamelFolderChan
 	return -1;
 }
 
+/* In-place expunge.  The messages kept after the first deleted one
+   are moved down over the gaps and the file truncated, so deleting
+   near the end of a big mbox only rewrites its tail, and no second
+   copy of the mbox is needed.
+
+   Progress is kept in <mbox>.compact: the ranges being kept, then a
+   record before each chunk is moved of how far it got, with a copy of
+   the chunk whenever writing it could overwrite its own source.  The
+   mbox is synced before each record, so after a crash the last whole
+   record says which chunk to redo, and the next check finishes the
+   move.  A last empty record past the end of the data goes in before
+   the mbox is cut off, as the sources of the last chunk may be gone
+   after that.  The summary is not saved until the move is done, so it
+   gets rebuilt then. */
+
+#define COMPACT_VERSION (1)
+#define COMPACT_MAGIC (0x636d7078)
+
+/* the data is moved this much at a time, or by the size of the gap
+   if that is smaller, but no less than COMPACT_MIN_CHUNK; smaller
+   gaps have each chunk copied into the journal too */
+#define COMPACT_CHUNK (1024*1024)
+#define COMPACT_MIN_CHUNK (64*1024)
+/* up to this much kept after the first deleted message is moved in
+   one piece, with one journal record */
+#define COMPACT_TAIL (4*1024*1024)
+
+struct _compact_range {
+	off_t src;
+	off_t len;
+};
+
+static char *
+compact_journal_path(CamelLocalSummary *cls)
+{
+	return g_strdup_printf("%s.compact", cls->folder_path);
+}
+
+static int
+compact_read(int fd, off_t offset, char *buf, size_t len)
+{
+	ssize_t n;
+
+	if (lseek(fd, offset, SEEK_SET) == -1)
+		return -1;
+
+	while (len > 0) {
+		do {
+			n = read(fd, buf, len);
+		} while (n == -1 && errno == EINTR);
+
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+compact_write(int fd, off_t offset, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	if (lseek(fd, offset, SEEK_SET) == -1)
+		return -1;
+
+	while (len > 0) {
+		do {
+			n = write(fd, buf, len);
+		} while (n == -1 && errno == EINTR);
+
+		if (n == -1)
+			return -1;
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* where the kept byte done bytes in starts in the file */
+static off_t
+compact_source(GArray *ranges, off_t done)
+{
+	struct _compact_range *r;
+	int i;
+
+	for (i=0;i<ranges->len;i++) {
+		r = &g_array_index(ranges, struct _compact_range, i);
+		if (done < r->len)
+			return r->src + done;
+		done -= r->len;
+	}
+
+	return -1;
+}
+
+/* read len kept bytes, from done bytes in, which may span ranges */
+static int
+compact_gather(int fd, GArray *ranges, off_t done, char *buf, size_t len)
+{
+	struct _compact_range *r;
+	size_t n;
+	int i;
+
+	for (i=0;len > 0 && i<ranges->len;i++) {
+		r = &g_array_index(ranges, struct _compact_range, i);
+		if (done >= r->len) {
+			done -= r->len;
+			continue;
+		}
+
+		n = MIN(len, r->len - done);
+		if (compact_read(fd, r->src + done, buf, n) == -1)
+			return -1;
+
+		buf += n;
+		len -= n;
+		done = 0;
+	}
+
+	if (len > 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static FILE *
+compact_journal_new(const char *path, off_t dst, GArray *ranges)
+{
+	struct _compact_range *r;
+	FILE *out;
+	int i;
+
+	out = g_fopen(path, "wb");
+	if (out == NULL)
+		return NULL;
+
+	if (camel_file_util_encode_uint32(out, COMPACT_VERSION) == -1
+	    || camel_file_util_encode_off_t(out, dst) == -1
+	    || camel_file_util_encode_uint32(out, ranges->len) == -1)
+		goto error;
+
+	for (i=0;i<ranges->len;i++) {
+		r = &g_array_index(ranges, struct _compact_range, i);
+		if (camel_file_util_encode_off_t(out, r->src) == -1
+		    || camel_file_util_encode_off_t(out, r->len) == -1)
+			goto error;
+	}
+
+	if (fflush(out) == -1 || fsync(fileno(out)) == -1)
+		goto error;
+
+	return out;
+ error:
+	fclose(out);
+	g_unlink(path);
+
+	return NULL;
+}
+
+static int
+compact_journal_record(FILE *out, off_t done, guint32 len, const char *saved)
+{
+	if (camel_file_util_encode_off_t(out, done) == -1
+	    || camel_file_util_encode_uint32(out, len) == -1
+	    || camel_file_util_encode_uint32(out, saved != NULL) == -1
+	    || (saved && fwrite(saved, len, 1, out) != 1)
+	    || camel_file_util_encode_uint32(out, COMPACT_MAGIC ^ (guint32)done ^ len) == -1
+	    || fflush(out) == -1
+	    || fsync(fileno(out)) == -1)
+		return -1;
+
+	return 0;
+}
+
+/* move the kept data from done bytes in down to dst onwards, and cut
+   the file off after it */
+static int
+compact_run(int fd, FILE *journal, off_t dst, GArray *ranges, off_t done)
+{
+	off_t total = 0, gap;
+	size_t chunk, len;
+	char *buf;
+	int i;
+
+	for (i=0;i<ranges->len;i++)
+		total += g_array_index(ranges, struct _compact_range, i).len;
+
+	chunk = total <= COMPACT_TAIL ? total : COMPACT_CHUNK;
+	buf = g_malloc(MAX(chunk, 1));
+
+	while (done < total) {
+		gap = compact_source(ranges, done) - (dst + done);
+		len = MIN(chunk, total - done);
+		if (chunk == COMPACT_CHUNK && len > gap && gap >= COMPACT_MIN_CHUNK)
+			len = gap;
+
+		camel_operation_progress(NULL, done * 100 / total);
+
+		/* the last chunk has to be on disk before the journal
+		   moves on past it */
+		if (compact_gather(fd, ranges, done, buf, len) == -1
+		    || fsync(fd) == -1
+		    || compact_journal_record(journal, done, len, len > gap ? buf : NULL) == -1
+		    || compact_write(fd, dst + done, buf, len) == -1) {
+			g_free(buf);
+			return -1;
+		}
+
+		done += len;
+	}
+
+	g_free(buf);
+
+	/* everything is in place, so there is nothing left to redo if
+	   we're cut short after the truncate */
+	if (fsync(fd) == -1
+	    || compact_journal_record(journal, total, 0, NULL) == -1
+	    || ftruncate(fd, dst + total) == -1
+	    || fsync(fd) == -1)
+		return -1;
+
+	return 0;
+}
+
+/* finish off a move cut short by a crash */
+static int
+mbox_summary_compact_resume(CamelLocalSummary *cls, CamelException *ex)
+{
+	struct _compact_range r;
+	guint32 version, count, len, saved, magic, lastlen = 0, lastsaved = 0;
+	off_t dst, done, last = -1;
+	char *path, *buf = NULL, *tmp = NULL;
+	GArray *ranges = NULL;
+	FILE *journal;
+	long pos = 0;
+	int fd, i, ret = -1;
+
+	path = compact_journal_path(cls);
+	journal = g_fopen(path, "r+b");
+	if (journal == NULL) {
+		g_free(path);
+		return 0;
+	}
+
+	d(printf("Finishing interrupted expunge of %s\n", cls->folder_path));
+
+	/* nothing is moved until the ranges and a record are on disk,
+	   so if they aren't whole there is nothing to finish */
+	ranges = g_array_new(FALSE, FALSE, sizeof(struct _compact_range));
+	if (camel_file_util_decode_uint32(journal, &version) == -1
+	    || version != COMPACT_VERSION
+	    || camel_file_util_decode_off_t(journal, &dst) == -1
+	    || camel_file_util_decode_uint32(journal, &count) == -1)
+		goto done;
+
+	for (i=0;i<count;i++) {
+		if (camel_file_util_decode_off_t(journal, &r.src) == -1
+		    || camel_file_util_decode_off_t(journal, &r.len) == -1)
+			goto done;
+		g_array_append_val(ranges, r);
+	}
+
+	/* find the last whole record, a torn one after it is ignored */
+	buf = g_malloc(COMPACT_TAIL);
+	tmp = g_malloc(COMPACT_TAIL);
+	while (camel_file_util_decode_off_t(journal, &done) == 0
+	       && camel_file_util_decode_uint32(journal, &len) == 0
+	       && len <= COMPACT_TAIL
+	       && camel_file_util_decode_uint32(journal, &saved) == 0
+	       && (!saved || fread(tmp, len, 1, journal) == 1)
+	       && camel_file_util_decode_uint32(journal, &magic) == 0
+	       && magic == (COMPACT_MAGIC ^ (guint32)done ^ len)) {
+		char *swap = buf;
+
+		buf = tmp;
+		tmp = swap;
+		last = done;
+		lastlen = len;
+		lastsaved = saved;
+		pos = ftell(journal);
+	}
+
+	if (last == -1)
+		goto done;
+
+	fd = g_open(cls->folder_path, O_LARGEFILE|O_RDWR|O_BINARY, 0);
+	if (fd == -1) {
+		camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
+				      _("Could not open file: %s: %s"),
+				      cls->folder_path, g_strerror (errno));
+		goto error;
+	}
+
+	camel_operation_start(NULL, _("Storing folder"));
+
+	/* redo the last chunk, from the journal's copy if it could
+	   have overwritten itself, then carry on after any torn record.
+	   If the last is the empty record past the end only the truncate
+	   is redone */
+	if ((!lastsaved && compact_gather(fd, ranges, last, buf, lastlen) == -1)
+	    || compact_write(fd, dst + last, buf, lastlen) == -1
+	    || fflush(journal) == -1
+	    || ftruncate(fileno(journal), pos) == -1
+	    || fseek(journal, pos, SEEK_SET) == -1
+	    || compact_run(fd, journal, dst, ranges, last + lastlen) == -1) {
+		camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
+				      _("Could not finish expunging folder %s: %s"),
+				      cls->folder_path, g_strerror (errno));
+		close(fd);
+		camel_operation_end(NULL);
+		goto error;
+	}
+
+	close(fd);
+	camel_operation_end(NULL);
+
+	/* the summary on disk is from before the move */
+	cls->check_force = 1;
+ done:
+	ret = 0;
+ error:
+	fclose(journal);
+	if (ret == 0)
+		g_unlink(path);
+	g_array_free(ranges, TRUE);
+	g_free(buf);
+	g_free(tmp);
+	g_free(path);
+
+	return ret;
+}
+
+static int
+mbox_summary_sync_expunge(CamelMboxSummary *mbs, CamelFolderChangeInfo *changeinfo, CamelException *ex)
+{
+	CamelLocalSummary *cls = (CamelLocalSummary *)mbs;
+	CamelFolderSummary *s = (CamelFolderSummary *)mbs;
+	CamelMboxMessageInfo *info;
+	struct _compact_range range, *r;
+	off_t dst = -1, last = 0, total = 0, base;
+	GArray *ranges;
+	FILE *journal;
+	char *path = NULL, from[5];
+	struct stat st;
+	int fd, i, j, count;
+
+	d(printf("Performing in-place expunge\n"));
+
+	fd = g_open(cls->folder_path, O_LARGEFILE|O_RDWR|O_BINARY, 0);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
+				      _("Could not open file: %s: %s"),
+				      cls->folder_path, g_strerror (errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	camel_operation_start(NULL, _("Storing folder"));
+
+	/* work out what stays after the first deleted message, checking
+	   every place we cut is really the start of a message */
+	ranges = g_array_new(FALSE, FALSE, sizeof(struct _compact_range));
+	range.src = -1;
+	count = camel_folder_summary_count(s);
+	for (i=0;i<count;i++) {
+		gboolean deleted;
+		off_t frompos;
+
+		info = (CamelMboxMessageInfo *)camel_folder_summary_index(s, i);
+		g_assert(info);
+		frompos = info->frompos;
+		deleted = (info->info.info.flags & CAMEL_MESSAGE_DELETED) != 0;
+		camel_message_info_free((CamelMessageInfo *)info);
+
+		if (frompos < last || frompos >= st.st_size)
+			goto mismatch;
+		last = frompos;
+
+		if (deleted) {
+			if (dst == -1)
+				dst = frompos;
+			if (range.src != -1) {
+				range.len = frompos - range.src;
+				g_array_append_val(ranges, range);
+				range.src = -1;
+			}
+		} else if (dst == -1 || range.src != -1)
+			continue;
+		else
+			range.src = frompos;
+
+		if (compact_read(fd, frompos, from, 5) == -1 || strncmp(from, "From ", 5) != 0)
+			goto mismatch;
+	}
+
+	if (range.src != -1) {
+		range.len = st.st_size - range.src;
+		g_array_append_val(ranges, range);
+	}
+
+	if (dst == -1)
+		goto done;
+
+	/* Moving most of the file with small gaps costs more than
+	   copying it, as all of it goes through the journal too */
+	for (i=0;i<ranges->len;i++)
+		total += g_array_index(ranges, struct _compact_range, i).len;
+	if (total > 0) {
+		off_t io = 2 * total, gap = g_array_index(ranges, struct _compact_range, 0).src - dst;
+
+		if (gap < (total <= COMPACT_TAIL ? total : COMPACT_MIN_CHUNK))
+			io += total;
+		if (io >= 2 * st.st_size) {
+			d(printf("Expunge would move too much in place, copying instead\n"));
+			close(fd);
+			g_array_free(ranges, TRUE);
+			camel_operation_end(NULL);
+
+			return ((CamelMboxSummaryClass *)((CamelObject *)mbs)->klass)->sync_full(mbs, TRUE, changeinfo, ex);
+		}
+	}
+
+	/* only deleting off the end needs nothing moved */
+	if (ranges->len == 0) {
+		if (ftruncate(fd, dst) == -1) {
+			camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
+					      _("Could not expunge folder %s: %s"),
+					      cls->folder_path, g_strerror (errno));
+			goto error;
+		}
+	} else {
+		path = compact_journal_path(cls);
+		journal = compact_journal_new(path, dst, ranges);
+		if (journal == NULL) {
+			camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
+					      _("Could not create expunge journal %s: %s"),
+					      path, g_strerror (errno));
+			goto error;
+		}
+
+		if (compact_run(fd, journal, dst, ranges, 0) == -1) {
+			/* leave the journal for the next check to finish with */
+			camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
+					      _("Could not finish expunging folder %s: %s"),
+					      cls->folder_path, g_strerror (errno));
+			fclose(journal);
+			goto error;
+		}
+
+		fclose(journal);
+		g_unlink(path);
+	}
+
+	/* drop the deleted messages and move the rest down with the data */
+	j = 0;
+	base = dst;
+	for (i=0;i<count;i++) {
+		info = (CamelMboxMessageInfo *)camel_folder_summary_index(s, i);
+
+		if (info->info.info.flags & CAMEL_MESSAGE_DELETED) {
+			const char *uid = camel_message_info_uid(info);
+
+			d(printf("Deleting %s\n", uid));
+
+			if (cls->index)
+				camel_index_delete_name(cls->index, uid);
+
+			camel_folder_change_info_remove_uid(changeinfo, uid);
+			camel_folder_summary_remove(s, (CamelMessageInfo *)info);
+			count--;
+			i--;
+		} else if (info->frompos >= dst) {
+			r = &g_array_index(ranges, struct _compact_range, j);
+			while (info->frompos >= r->src + r->len) {
+				base += r->len;
+				r = &g_array_index(ranges, struct _compact_range, ++j);
+			}
+			info->frompos = base + info->frompos - r->src;
+		}
+
+		camel_message_info_free((CamelMessageInfo *)info);
+	}
+
+	camel_folder_summary_touch(s);
+ done:
+	close(fd);
+	g_array_free(ranges, TRUE);
+	g_free(path);
+
+	camel_operation_end(NULL);
+
+	return 0;
+ mismatch:
+	camel_exception_setv(ex, CAMEL_EXCEPTION_SYSTEM,
+			     _("Detected a corrupt mbox file or an invalid 'From' header"));
+ error:
+	close(fd);
+	g_array_free(ranges, TRUE);
+	g_free(path);
+
+	camel_operation_end(NULL);
+
+	return -1;
+}
+
 static int
 mbox_summary_sync(CamelLocalSummary *cls, gboolean expunge, CamelFolderChangeInfo *changeinfo, CamelException *ex)
 {
 	struct stat st;
 	CamelMboxSummary *mbs = (CamelMboxSummary *)cls;
 	CamelFolderSummary *s = (CamelFolderSummary *)cls;
+	CamelMboxSummaryClass *klass = (CamelMboxSummaryClass *)((CamelObject *)cls)->klass;
 	int i, count;
-	int quick = TRUE, work=FALSE;
+	int quick = TRUE, work=FALSE, deleted=FALSE;
 	int ret;
 
 	/* first, sync ourselves up, just to make sure */
@@ -903,9 +1770,10 @@ mbox_summary_sync(CamelLocalSummary *cls, gboolean expunge, CamelFolderChangeInf
 		CamelMboxMessageInfo *info = (CamelMboxMessageInfo *)camel_folder_summary_index(s, i);
 
 		g_assert(info);
-		if ((expunge && (info->info.info.flags & CAMEL_MESSAGE_DELETED)) ||
-		    (info->info.info.flags & (CAMEL_MESSAGE_FOLDER_NOXEV|CAMEL_MESSAGE_FOLDER_XEVCHANGE)))
+		if (info->info.info.flags & (CAMEL_MESSAGE_FOLDER_NOXEV|CAMEL_MESSAGE_FOLDER_XEVCHANGE))
 			quick = FALSE;
+		else if (expunge && (info->info.info.flags & CAMEL_MESSAGE_DELETED))
+			deleted = TRUE;
 		else
 			work |= (info->info.info.flags & CAMEL_MESSAGE_FOLDER_FLAGGED) != 0;
 		camel_message_info_free(info);
@@ -914,19 +1782,36 @@ mbox_summary_sync(CamelLocalSummary *cls, gboolean expunge, CamelFolderChangeInf
 	/* yuck i hate this logic, but its to simplify the 'all ok, update summary' and failover cases */
 	ret = -1;
 	if (quick) {
-		if (work) {
-			ret = ((CamelMboxSummaryClass *)((CamelObject *)cls)->klass)->sync_quick(mbs, expunge, changeinfo, ex);
+		ret = 0;
+		/* no headers change size, so deleted messages can be cut out in place */
+		if (deleted) {
+			if (klass->sync_expunge == NULL || getenv("CAMEL_MBOX_DISABLE_COMPACT") != NULL) {
+				ret = -1;
+			} else if ((ret = klass->sync_expunge(mbs, changeinfo, ex)) == -1) {
+				char *path = compact_journal_path(cls);
+				gboolean moving = g_file_test(path, G_FILE_TEST_EXISTS);
+
+				g_free(path);
+				/* part moved already, it can only be finished by the next check */
+				if (moving)
+					return -1;
+
+				g_warning("failed an in-place expunge, trying a full sync");
+				camel_exception_clear(ex);
+			}
+		}
+
+		if (ret == 0 && work) {
+			ret = klass->sync_quick(mbs, expunge, changeinfo, ex);
 			if (ret == -1) {
 				g_warning("failed a quick-sync, trying a full sync");
 				camel_exception_clear(ex);
 			}
-		} else {
-			ret = 0;
 		}
 	}
 
 	if (ret == -1)
-		ret = ((CamelMboxSummaryClass *)((CamelObject *)cls)->klass)->sync_full(mbs, expunge, changeinfo, ex);
+		ret = klass->sync_full(mbs, expunge, changeinfo, ex);
 	if (ret == -1)
 		return -1;
 
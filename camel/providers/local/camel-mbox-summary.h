@@ -63,6 +63,8 @@ struct _CamelMboxSummaryClass {
 	int (*sync_quick)(CamelMboxSummary *cls, gboolean expunge, CamelFolderChangeInfo *changeinfo, CamelException *ex);
 	/* sync requires copy */
 	int (*sync_full)(CamelMboxSummary *cls, gboolean expunge, CamelFolderChangeInfo *changeinfo, CamelException *ex);
+	/* expunge in-place, only system flags have changed otherwise */
+	int (*sync_expunge)(CamelMboxSummary *cls, CamelFolderChangeInfo *changeinfo, CamelException *ex);
 };
 
 CamelType		camel_mbox_summary_get_type	(void);
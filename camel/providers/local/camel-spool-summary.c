@@ -86,6 +86,8 @@ camel_spool_summary_class_init(CamelSpoolSummaryClass *klass)
 	lklass->check = spool_summary_check;
 
 	mklass->sync_full = spool_summary_sync_full;
+	/* no journal files beside a system spool */
+	mklass->sync_expunge = NULL;
 }
 
 static void
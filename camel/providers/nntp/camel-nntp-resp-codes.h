@@ -27,10 +27,13 @@
 #define CAMEL_NNTP_ERR(x) (!CAMEL_NNTP_OK(x) && (x) < 500)
 #define CAMEL_NNTP_FAIL(x) (!CAMEL_NNTP_OK(x) && !CAMEL_NNTP_ERR(x))
 
+#define NNTP_CAPABILITIES_FOLLOW    101
+
 #define NNTP_GREETING_POSTING_OK    200
 #define NNTP_GREETING_NO_POSTING    201
 
 #define NNTP_EXTENSIONS_SUPPORTED     202
+#define NNTP_COMPRESSION_ACTIVE       206
 #define NNTP_GROUP_SELECTED           211
 #define NNTP_LIST_FOLLOWS             215
 #define NNTP_ARTICLE_FOLLOWS          220
@@ -41,6 +41,7 @@
 #include "camel/camel-net-utils.h"
 #include "camel/camel-private.h"
 #include "camel/camel-session.h"
+#include "camel/camel-stream-deflate.h"
 #include "camel/camel-stream-mem.h"
 #include "camel/camel-string-utils.h"
 #include "camel/camel-tcp-stream-raw.h"
@@ -95,6 +96,76 @@ static struct {
 	{ "bytes", 2 },
 };
 
+/* rfc3977: the capabilities list can change after authentication
+   and mode reader, so it is asked for again once they are done */
+static int
+capabilities_setup(CamelNNTPStore *store, CamelException *ex)
+{
+	char *line, **args;
+	unsigned int len;
+	int ret, i;
+
+	store->extensions &= ~CAMEL_NNTP_EXT_COMPRESS;
+
+	ret = camel_nntp_raw_command_auth(store, ex, &line, "capabilities");
+	if (ret == -1) {
+		return -1;
+	} else if (ret != NNTP_CAPABILITIES_FOLLOW)
+		/* pre rfc3977 server?  it has none of the ones we use */
+		return 0;
+
+	while ((ret = camel_nntp_stream_line(store->stream, (unsigned char **)&line, &len)) > 0) {
+		if (g_ascii_strncasecmp(line, "compress ", 9) != 0)
+			continue;
+
+		args = g_strsplit(line + 9, " ", -1);
+		for (i=0;args[i];i++) {
+			if (g_ascii_strcasecmp(args[i], "deflate") == 0)
+				store->extensions |= CAMEL_NNTP_EXT_COMPRESS;
+		}
+		g_strfreev(args);
+	}
+
+	return ret;
+}
+
+/* rfc8054: once the server answers 206 everything is compressed
+   both ways.  It sends nothing more until we do, so there is
+   nothing left in the stream's buffer to carry over. */
+static int
+compress_setup(CamelNNTPStore *store, CamelException *ex)
+{
+	CamelStream *stream;
+	char *line;
+	int ret;
+
+	/* manual override */
+	if (getenv("CAMEL_NNTP_DISABLE_COMPRESS") != NULL)
+		return 0;
+
+	/* only ask servers that said they can, after authenticating */
+	if ((store->extensions & CAMEL_NNTP_EXT_COMPRESS) == 0)
+		return 0;
+
+	ret = camel_nntp_raw_command(store, ex, &line, "compress deflate");
+	if (ret == -1) {
+		return -1;
+	} else if (ret != NNTP_COMPRESSION_ACTIVE)
+		/* unsupported command?  ignore */
+		return 0;
+
+	stream = camel_stream_deflate_new(store->stream->source);
+	if (stream == NULL) {
+		camel_exception_set(ex, CAMEL_EXCEPTION_SYSTEM, _("Could not start compression"));
+		return -1;
+	}
+
+	camel_object_unref(store->stream->source);
+	store->stream->source = stream;
+
+	return 0;
+}
+
 static int
 xover_setup(CamelNNTPStore *store, CamelException *ex)
 {
@@ -246,7 +317,9 @@ connect_to_server (CamelService *service, struct addrinfo *ai, int ssl_mode, Cam
 	    || camel_nntp_raw_command_auth (store, ex, (char **) &buf, "date") == -1)
   		goto fail;
 
-	if (xover_setup(store, ex) == -1)
+	if (capabilities_setup(store, ex) == -1
+	    || compress_setup(store, ex) == -1
+	    || xover_setup(store, ex) == -1)
 		goto fail;
 
 	path = g_build_filename (store->storage_path, ".ev-journal", NULL);
@@ -1271,7 +1344,7 @@ camel_nntp_raw_commandv (CamelNNTPStore *store, CamelException *ex, char **line,
 	u = strtoul (*line, NULL, 10);
 
 	/* Handle all switching to data mode here, to make callers job easier */
-	if (u == 215 || (u >= 220 && u <=224) || (u >= 230 && u <= 231))
+	if (u == 101 || u == 215 || (u >= 220 && u <=224) || (u >= 230 && u <= 231))
 		camel_nntp_stream_set_mode(store->stream, CAMEL_NNTP_STREAM_DATA);
 
 	return u;
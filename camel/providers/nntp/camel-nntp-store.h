@@ -42,6 +42,7 @@
 #define CAMEL_NNTP_EXT_LISTMOTD   (1<<5)
 #define CAMEL_NNTP_EXT_LISTSUBSCR (1<<6)
 #define CAMEL_NNTP_EXT_LISTPNAMES (1<<7)
+#define CAMEL_NNTP_EXT_COMPRESS   (1<<8)
 
 G_BEGIN_DECLS
 
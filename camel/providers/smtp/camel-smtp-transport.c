@@ -52,6 +52,7 @@
 #include "camel-smtp-transport.h"
 #include "camel-stream-buffer.h"
 #include "camel-stream-filter.h"
+#include "camel-stream-null.h"
 #include "camel-tcp-stream-raw.h"
 #include "camel-tcp-stream.h"
 
@@ -66,6 +67,9 @@ extern int camel_verbose_debug;
 #define SMTP_PORT "25"
 #define SMTPS_PORT "465"
 
+/* the most commands written before reading their replies, when pipelining */
+#define SMTP_PIPELINE_MAX 100
+
 /* camel smtp transport class prototypes */
 static gboolean smtp_send_to (CamelTransport *transport, CamelMimeMessage *message,
 			      CamelAddress *from, CamelAddress *recipients, CamelException *ex);
@@ -85,7 +89,10 @@ static gboolean smtp_auth (CamelSmtpTransport *transport, const char *mech, Came
 static gboolean smtp_mail (CamelSmtpTransport *transport, const char *sender,
 			   gboolean has_8bit_parts, CamelException *ex);
 static gboolean smtp_rcpt (CamelSmtpTransport *transport, const char *recipient, CamelException *ex);
+static gboolean smtp_envelope (CamelSmtpTransport *transport, const char *sender, gboolean has_8bit_parts,
+			       GPtrArray *recipients, CamelException *ex);
 static gboolean smtp_data (CamelSmtpTransport *transport, CamelMimeMessage *message, CamelException *ex);
+static gboolean smtp_bdat (CamelSmtpTransport *transport, CamelMimeMessage *message, CamelException *ex);
 static gboolean smtp_rset (CamelSmtpTransport *transport, CamelException *ex);
 static gboolean smtp_quit (CamelSmtpTransport *transport, CamelException *ex);
 
@@ -694,7 +701,7 @@ smtp_send_to (CamelTransport *transport, CamelMimeMessage *message,
 {
 	CamelSmtpTransport *smtp_transport = CAMEL_SMTP_TRANSPORT (transport);
 	const CamelInternetAddress *cia;
-	gboolean has_8bit_parts;
+	gboolean has_8bit_parts, ok;
 	const char *addr;
 	int i, len;
 
@@ -710,47 +717,87 @@ smtp_send_to (CamelTransport *transport, CamelMimeMessage *message,
 		return FALSE;
 	}
 
-	camel_operation_start (NULL, _("Sending message"));
-
-	/* find out if the message has 8bit mime parts */
-	has_8bit_parts = camel_mime_message_has_8bit_parts (message);
-
-	/* rfc1652 (8BITMIME) requires that you notify the ESMTP daemon that
-	   you'll be sending an 8bit mime message at "MAIL FROM:" time. */
-	if (!smtp_mail (smtp_transport, addr, has_8bit_parts, ex)) {
-		camel_operation_end (NULL);
-		return FALSE;
-	}
-
 	len = camel_address_length (recipients);
 	if (len == 0) {
 		camel_exception_setv (ex, CAMEL_EXCEPTION_SYSTEM,
 				      _("Cannot send message: no recipients defined."));
-		camel_operation_end (NULL);
 		return FALSE;
 	}
 
-	cia = CAMEL_INTERNET_ADDRESS (recipients);
-	for (i = 0; i < len; i++) {
-		char *enc;
+	camel_operation_start (NULL, _("Sending message"));
+
+	/* find out if the message has 8bit mime parts */
+	has_8bit_parts = camel_mime_message_has_8bit_parts (message);
+
+	if (smtp_transport->flags & CAMEL_SMTP_TRANSPORT_PIPELINING) {
+		GPtrArray *rcpts;
+
+		rcpts = g_ptr_array_new ();
+		cia = CAMEL_INTERNET_ADDRESS (recipients);
+		for (i = 0; i < len; i++) {
+			const char *rcpt;
 
-		if (!camel_internet_address_get (cia, i, NULL, &addr)) {
+			if (!camel_internet_address_get (cia, i, NULL, &rcpt))
+				break;
+
+			g_ptr_array_add (rcpts, camel_internet_address_encode_address (NULL, NULL, rcpt));
+		}
+
+		if (i < len) {
 			camel_exception_set (ex, CAMEL_EXCEPTION_SYSTEM,
 					     _("Cannot send message: one or more invalid recipients"));
+			ok = FALSE;
+		} else {
+			/* rfc2920: send MAIL FROM and the RCPT TOs without
+			   waiting for each reply */
+			ok = smtp_envelope (smtp_transport, addr, has_8bit_parts, rcpts, ex);
+		}
+
+		for (i = 0; i < rcpts->len; i++)
+			g_free (rcpts->pdata[i]);
+		g_ptr_array_free (rcpts, TRUE);
+
+		if (!ok) {
 			camel_operation_end (NULL);
 			return FALSE;
 		}
-
-		enc = camel_internet_address_encode_address(NULL, NULL, addr);
-		if (!smtp_rcpt (smtp_transport, enc, ex)) {
-			g_free(enc);
+	} else {
+		/* rfc1652 (8BITMIME) requires that you notify the ESMTP daemon that
+		   you'll be sending an 8bit mime message at "MAIL FROM:" time. */
+		if (!smtp_mail (smtp_transport, addr, has_8bit_parts, ex)) {
 			camel_operation_end (NULL);
 			return FALSE;
 		}
-		g_free(enc);
+
+		cia = CAMEL_INTERNET_ADDRESS (recipients);
+		for (i = 0; i < len; i++) {
+			char *enc;
+
+			if (!camel_internet_address_get (cia, i, NULL, &addr)) {
+				camel_exception_set (ex, CAMEL_EXCEPTION_SYSTEM,
+						     _("Cannot send message: one or more invalid recipients"));
+				camel_operation_end (NULL);
+				return FALSE;
+			}
+
+			enc = camel_internet_address_encode_address(NULL, NULL, addr);
+			if (!smtp_rcpt (smtp_transport, enc, ex)) {
+				g_free(enc);
+				camel_operation_end (NULL);
+				return FALSE;
+			}
+			g_free(enc);
+		}
 	}
 
-	if (!smtp_data (smtp_transport, message, ex)) {
+	/* rfc3030: BDAT sends the message as is, without dot stuffing
+	   or waiting for the server to ask for it */
+	if (smtp_transport->flags & CAMEL_SMTP_TRANSPORT_CHUNKING)
+		ok = smtp_bdat (smtp_transport, message, ex);
+	else
+		ok = smtp_data (smtp_transport, message, ex);
+
+	if (!ok) {
 		camel_operation_end (NULL);
 		return FALSE;
 	}
@@ -957,7 +1004,9 @@ smtp_helo (CamelSmtpTransport *transport, CamelException *ex)
 	   are being called a second time (ie, after a STARTTLS) */
 	transport->flags &= ~(CAMEL_SMTP_TRANSPORT_8BITMIME |
 			      CAMEL_SMTP_TRANSPORT_ENHANCEDSTATUSCODES |
-			      CAMEL_SMTP_TRANSPORT_STARTTLS);
+			      CAMEL_SMTP_TRANSPORT_STARTTLS |
+			      CAMEL_SMTP_TRANSPORT_PIPELINING |
+			      CAMEL_SMTP_TRANSPORT_CHUNKING);
 
 	if (transport->authtypes) {
 		g_hash_table_foreach (transport->authtypes, authtypes_free, NULL);
@@ -1023,6 +1072,10 @@ smtp_helo (CamelSmtpTransport *transport, CamelException *ex)
 				transport->flags |= CAMEL_SMTP_TRANSPORT_ENHANCEDSTATUSCODES;
 			} else if (!strncmp (token, "STARTTLS", 8)) {
 				transport->flags |= CAMEL_SMTP_TRANSPORT_STARTTLS;
+			} else if (!strncmp (token, "PIPELINING", 10)) {
+				transport->flags |= CAMEL_SMTP_TRANSPORT_PIPELINING;
+			} else if (!strncmp (token, "CHUNKING", 8)) {
+				transport->flags |= CAMEL_SMTP_TRANSPORT_CHUNKING;
 			} else if (!strncmp (token, "AUTH", 4)) {
 				if (!transport->authtypes || transport->flags & CAMEL_SMTP_TRANSPORT_AUTH_EQUAL) {
 					/* Don't bother parsing any authtypes if we already have a list.
@@ -1271,11 +1324,135 @@ smtp_rcpt (CamelSmtpTransport *transport, const char *recipient, CamelException
 	return TRUE;
 }
 
+static gboolean
+smtp_skip_reply (CamelSmtpTransport *transport, char *respbuf)
+{
+	/* read the rest of a "250-" reply */
+	while (strlen (respbuf) > 3 && *(respbuf+3) == '-') {
+		g_free (respbuf);
+		respbuf = camel_stream_buffer_read_line (CAMEL_STREAM_BUFFER (transport->istream));
+
+		d(fprintf (stderr, "received: %s\n", respbuf ? respbuf : "(null)"));
+
+		if (!respbuf)
+			return FALSE;
+	}
+	g_free (respbuf);
+
+	return TRUE;
+}
+
+static gboolean
+smtp_envelope (CamelSmtpTransport *transport, const char *sender, gboolean has_8bit_parts, GPtrArray *recipients, CamelException *ex)
+{
+	/* The MAIL FROM and RCPT TO commands are written
+	 * SMTP_PIPELINE_MAX at a time, then their replies read in order.
+	 * After the first failure the rest of the replies are still
+	 * read so the next command sees its own reply. */
+	char *respbuf, *message;
+	GString *cmds;
+	int start, i, j;
+	gboolean failed = FALSE;
+
+	cmds = g_string_new ("");
+
+	/* command -1 is the MAIL FROM */
+	i = -1;
+	while (i < (int) recipients->len && !failed) {
+		g_string_truncate (cmds, 0);
+		start = i;
+		for (; i < (int) recipients->len && i - start < SMTP_PIPELINE_MAX; i++) {
+			if (i == -1) {
+				if (transport->flags & CAMEL_SMTP_TRANSPORT_8BITMIME && has_8bit_parts)
+					g_string_append_printf (cmds, "MAIL FROM:<%s> BODY=8BITMIME\r\n", sender);
+				else
+					g_string_append_printf (cmds, "MAIL FROM:<%s>\r\n", sender);
+			} else
+				g_string_append_printf (cmds, "RCPT TO:<%s>\r\n", (char *) recipients->pdata[i]);
+		}
+
+		d(fprintf (stderr, "sending : %s", cmds->str));
+
+		if (camel_stream_write (transport->ostream, cmds->str, cmds->len) == -1) {
+			camel_exception_setv (ex, errno == EINTR ? CAMEL_EXCEPTION_USER_CANCEL : CAMEL_EXCEPTION_SYSTEM,
+					      start == -1 ? _("MAIL FROM command failed: %s: mail not sent")
+					      : _("RCPT TO command failed: %s: mail not sent"),
+					      g_strerror (errno));
+			g_string_free (cmds, TRUE);
+
+			camel_service_disconnect ((CamelService *) transport, FALSE, NULL);
+
+			return FALSE;
+		}
+
+		for (j = start; j < i; j++) {
+			/* Check for "250 Sender OK..." or "250 Recipient OK..." */
+			respbuf = camel_stream_buffer_read_line (CAMEL_STREAM_BUFFER (transport->istream));
+
+			d(fprintf (stderr, "received: %s\n", respbuf ? respbuf : "(null)"));
+
+			if (respbuf && (failed || !strncmp (respbuf, "250", 3))) {
+				if (smtp_skip_reply (transport, respbuf))
+					continue;
+				respbuf = NULL;
+			}
+
+			if (j == -1)
+				message = g_strdup (_("MAIL FROM command failed"));
+			else
+				message = g_strdup_printf (_("RCPT TO <%s> failed"), (char *) recipients->pdata[j]);
+			smtp_set_exception (transport, TRUE, respbuf, message, failed ? NULL : ex);
+			g_free (message);
+			failed = TRUE;
+
+			if (!respbuf)
+				break;
+			g_free (respbuf);
+		}
+	}
+
+	g_string_free (cmds, TRUE);
+
+	return !failed;
+}
+
+static ssize_t
+smtp_write_message (CamelMimeMessage *message, CamelStream *stream)
+{
+	struct _camel_header_raw *header, *savedbcc, *n, *tail;
+	ssize_t ret;
+
+	/* unlink the bcc headers */
+	savedbcc = NULL;
+	tail = (struct _camel_header_raw *) &savedbcc;
+
+	header = (struct _camel_header_raw *) &CAMEL_MIME_PART (message)->headers;
+	n = header->next;
+	while (n != NULL) {
+		if (!g_ascii_strcasecmp (n->name, "Bcc")) {
+			header->next = n->next;
+			tail->next = n;
+			n->next = NULL;
+			tail = n;
+		} else {
+			header = n;
+		}
+
+		n = header->next;
+	}
+
+	ret = camel_data_wrapper_write_to_stream (CAMEL_DATA_WRAPPER (message), stream);
+
+	/* restore the bcc headers */
+	header->next = savedbcc;
+
+	return ret;
+}
+
 static gboolean
 smtp_data (CamelSmtpTransport *transport, CamelMimeMessage *message, CamelException *ex)
 {
 	CamelBestencEncoding enctype = CAMEL_BESTENC_8BIT;
-	struct _camel_header_raw *header, *savedbcc, *n, *tail;
 	char *cmdbuf, *respbuf = NULL;
 	CamelStreamFilter *filtered_stream;
 	CamelMimeFilter *crlffilter;
@@ -1329,31 +1506,8 @@ smtp_data (CamelSmtpTransport *transport, CamelMimeMessage *message, CamelExcept
 	camel_stream_filter_add (filtered_stream, CAMEL_MIME_FILTER (crlffilter));
 	camel_object_unref (crlffilter);
 
-	/* unlink the bcc headers */
-	savedbcc = NULL;
-	tail = (struct _camel_header_raw *) &savedbcc;
-
-	header = (struct _camel_header_raw *) &CAMEL_MIME_PART (message)->headers;
-	n = header->next;
-	while (n != NULL) {
-		if (!g_ascii_strcasecmp (n->name, "Bcc")) {
-			header->next = n->next;
-			tail->next = n;
-			n->next = NULL;
-			tail = n;
-		} else {
-			header = n;
-		}
-
-		n = header->next;
-	}
-
 	/* write the message */
-	ret = camel_data_wrapper_write_to_stream (CAMEL_DATA_WRAPPER (message), CAMEL_STREAM (filtered_stream));
-
-	/* restore the bcc headers */
-	header->next = savedbcc;
-
+	ret = smtp_write_message (message, CAMEL_STREAM (filtered_stream));
 	if (ret == -1) {
 		camel_exception_setv (ex, errno == EINTR ? CAMEL_EXCEPTION_USER_CANCEL : CAMEL_EXCEPTION_SYSTEM,
 				      _("DATA command failed: %s: mail not sent"),
@@ -1401,6 +1555,98 @@ smtp_data (CamelSmtpTransport *transport, CamelMimeMessage *message, CamelExcept
 	return TRUE;
 }
 
+static gboolean
+smtp_bdat (CamelSmtpTransport *transport, CamelMimeMessage *message, CamelException *ex)
+{
+	CamelBestencEncoding enctype = CAMEL_BESTENC_8BIT;
+	char *cmdbuf, *respbuf = NULL;
+	CamelStreamFilter *filtered_stream;
+	CamelMimeFilter *crlffilter;
+	CamelStream *null;
+	ssize_t ret;
+
+	/* If the server doesn't support 8BITMIME, set our required encoding to be 7bit */
+	if (!(transport->flags & CAMEL_SMTP_TRANSPORT_8BITMIME))
+		enctype = CAMEL_BESTENC_7BIT;
+
+	camel_mime_message_set_best_encoding (message, CAMEL_BESTENC_GET_ENCODING, enctype);
+
+	/* The message is sent as a single last chunk, so find its size
+	 * first by writing it to a null stream.  This costs writing it
+	 * twice, but doesn't need it kept in memory. */
+	crlffilter = camel_mime_filter_crlf_new (CAMEL_MIME_FILTER_CRLF_ENCODE, CAMEL_MIME_FILTER_CRLF_MODE_CRLF_ONLY);
+	null = camel_stream_null_new ();
+	filtered_stream = camel_stream_filter_new_with_stream (null);
+	camel_stream_filter_add (filtered_stream, crlffilter);
+	ret = smtp_write_message (message, CAMEL_STREAM (filtered_stream));
+	camel_stream_flush (CAMEL_STREAM (filtered_stream));
+	camel_object_unref (filtered_stream);
+	if (ret == -1) {
+		camel_exception_setv (ex, errno == EINTR ? CAMEL_EXCEPTION_USER_CANCEL : CAMEL_EXCEPTION_SYSTEM,
+				      _("BDAT command failed: %s: mail not sent"),
+				      g_strerror (errno));
+		camel_object_unref (null);
+		camel_object_unref (crlffilter);
+
+		return FALSE;
+	}
+
+	cmdbuf = g_strdup_printf ("BDAT %lu LAST\r\n", (unsigned long) CAMEL_STREAM_NULL (null)->written);
+	camel_object_unref (null);
+
+	d(fprintf (stderr, "sending : %s", cmdbuf));
+
+	if (camel_stream_write (transport->ostream, cmdbuf, strlen (cmdbuf)) == -1) {
+		g_free (cmdbuf);
+		camel_object_unref (crlffilter);
+		camel_exception_setv (ex, errno == EINTR ? CAMEL_EXCEPTION_USER_CANCEL : CAMEL_EXCEPTION_SYSTEM,
+				      _("BDAT command failed: %s: mail not sent"),
+				      g_strerror (errno));
+
+		camel_service_disconnect ((CamelService *) transport, FALSE, NULL);
+
+		return FALSE;
+	}
+	g_free (cmdbuf);
+
+	/* the chunk follows straight on, there is no reply to wait for */
+	camel_mime_filter_reset (crlffilter);
+	filtered_stream = camel_stream_filter_new_with_stream (transport->ostream);
+	camel_stream_filter_add (filtered_stream, crlffilter);
+	camel_object_unref (crlffilter);
+
+	ret = smtp_write_message (message, CAMEL_STREAM (filtered_stream));
+	if (ret == -1 || camel_stream_flush (CAMEL_STREAM (filtered_stream)) == -1) {
+		camel_exception_setv (ex, errno == EINTR ? CAMEL_EXCEPTION_USER_CANCEL : CAMEL_EXCEPTION_SYSTEM,
+				      _("BDAT command failed: %s: mail not sent"),
+				      g_strerror (errno));
+
+		camel_object_unref (filtered_stream);
+
+		camel_service_disconnect ((CamelService *) transport, FALSE, NULL);
+
+		return FALSE;
+	}
+	camel_object_unref (filtered_stream);
+
+	do {
+		/* Check for "250 Message OK..." */
+		g_free (respbuf);
+		respbuf = camel_stream_buffer_read_line (CAMEL_STREAM_BUFFER (transport->istream));
+
+		d(fprintf (stderr, "received: %s\n", respbuf ? respbuf : "(null)"));
+
+		if (!respbuf || strncmp (respbuf, "250", 3)) {
+			smtp_set_exception (transport, TRUE, respbuf, _("BDAT command failed"), ex);
+			g_free (respbuf);
+			return FALSE;
+		}
+	} while (*(respbuf+3) == '-'); /* if we got "250-" then loop again */
+	g_free (respbuf);
+
+	return TRUE;
+}
+
 static gboolean
 smtp_rset (CamelSmtpTransport *transport, CamelException *ex)
 {
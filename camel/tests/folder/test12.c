@@ -0,0 +1,199 @@
+/* folder summary save/load, timing and size of full and journalled saves */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <glib.h>
+
+#include "camel-test.h"
+
+#include <camel/camel-folder-summary.h>
+#include <camel/camel-string-utils.h>
+
+#define SUMMARY_PATH "/tmp/camel-test/summary"
+#define MAX_MESSAGES (20000)
+#define MAX_CHANGED (10)
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static off_t
+file_size(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) == -1)
+		return 0;
+
+	return st.st_size;
+}
+
+static CamelFolderSummary *
+summary_new(void)
+{
+	CamelFolderSummary *s;
+
+	s = camel_folder_summary_new(NULL);
+	camel_folder_summary_set_filename(s, SUMMARY_PATH);
+
+	return s;
+}
+
+static void
+summary_fill(CamelFolderSummary *s, int count)
+{
+	CamelMessageInfoBase *mi;
+	char *str;
+	int i;
+
+	for (i=0;i<count;i++) {
+		mi = (CamelMessageInfoBase *)camel_message_info_new(s);
+		mi->uid = g_strdup_printf("%d", i);
+		str = g_strdup_printf("Test message %08x subject", i);
+		mi->subject = camel_pstring_strdup(str);
+		g_free(str);
+		str = g_strdup_printf("Sender %d <sender%d@camel.host>", i % 97, i % 97);
+		mi->from = camel_pstring_strdup(str);
+		g_free(str);
+		mi->to = camel_pstring_strdup("Camel Test <test@camel.host>");
+		mi->size = 1000 + i;
+		mi->date_sent = mi->date_received = 1000000000 + i * 60;
+		mi->message_id.id.part.hi = i;
+		mi->message_id.id.part.lo = ~i;
+		camel_folder_summary_add(s, (CamelMessageInfo *)mi);
+	}
+}
+
+static void
+summary_check(CamelFolderSummary *s, int count)
+{
+	CamelMessageInfo *mi;
+	char *str;
+	int i;
+
+	check(camel_folder_summary_count(s) == count);
+	for (i=0;i<count;i++) {
+		mi = camel_folder_summary_index(s, i);
+		str = g_strdup_printf("Test message %08x subject", atoi(camel_message_info_uid(mi)));
+		check(string_equal(camel_message_info_subject(mi), str));
+		check(string_equal(camel_message_info_to(mi), "Camel Test <test@camel.host>"));
+		g_free(str);
+		camel_message_info_free(mi);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	CamelFolderSummary *s;
+	CamelMessageInfo *mi;
+	double start, full_time, journal_time;
+	off_t full_size, journal_size;
+	guint32 major, minor;
+	int i;
+
+	camel_test_init(argc, argv);
+
+	system("/bin/rm -rf /tmp/camel-test");
+	system("/bin/mkdir /tmp/camel-test");
+
+	camel_test_start("Folder summary save and load");
+
+	push("writing a summary in full");
+	s = summary_new();
+	summary_fill(s, MAX_MESSAGES);
+	start = now();
+	check(camel_folder_summary_save(s) == 0);
+	full_time = now() - start;
+	full_size = file_size(SUMMARY_PATH);
+	check(full_size > 0);
+	/* the meta-summary is a section of the summary file now */
+	check(file_size(SUMMARY_PATH "-meta") == 0);
+	major = s->meta_summary->major;
+	minor = s->meta_summary->minor;
+	check_unref(s, 1);
+	pull();
+
+	push("loading it back");
+	s = summary_new();
+	check(camel_folder_summary_load(s) == 0);
+	summary_check(s, MAX_MESSAGES);
+	check(s->meta_summary->major == major);
+	check(s->meta_summary->minor == minor);
+	pull();
+
+	push("changing flags on %d messages", MAX_CHANGED);
+	for (i=0;i<MAX_CHANGED;i++) {
+		mi = camel_folder_summary_index(s, i * (MAX_MESSAGES / MAX_CHANGED));
+		camel_message_info_set_flags(mi, CAMEL_MESSAGE_SEEN, CAMEL_MESSAGE_SEEN);
+		camel_message_info_set_user_flag(mi, "test", TRUE);
+		camel_message_info_free(mi);
+	}
+	camel_folder_summary_remove_index(s, MAX_MESSAGES - 1);
+	start = now();
+	check(camel_folder_summary_save(s) == 0);
+	journal_time = now() - start;
+	journal_size = file_size(SUMMARY_PATH "-journal");
+	/* only the changes should have been written */
+	check(file_size(SUMMARY_PATH) == full_size);
+	check(journal_size > 0 && journal_size < full_size / 100);
+	check_unref(s, 1);
+	pull();
+
+	push("loading the summary and journal");
+	s = summary_new();
+	check(camel_folder_summary_load(s) == 0);
+	summary_check(s, MAX_MESSAGES - 1);
+	for (i=0;i<MAX_CHANGED;i++) {
+		mi = camel_folder_summary_index(s, i * (MAX_MESSAGES / MAX_CHANGED));
+		check((camel_message_info_flags(mi) & CAMEL_MESSAGE_SEEN) != 0);
+		check(camel_message_info_user_flag(mi, "test"));
+		camel_message_info_free(mi);
+	}
+	mi = camel_folder_summary_uid(s, "1");
+	check(mi != NULL);
+	check((camel_message_info_flags(mi) & CAMEL_MESSAGE_SEEN) == 0);
+	camel_message_info_free(mi);
+	check(camel_folder_summary_uid(s, "19999") == NULL);
+	pull();
+
+	push("journalling a header change");
+	camel_folder_summary_set_uid(s, 100000);
+	camel_folder_summary_touch_header(s);
+	check(camel_folder_summary_save(s) == 0);
+	check(file_size(SUMMARY_PATH) == full_size);
+	check(file_size(SUMMARY_PATH "-journal") > journal_size);
+	check_unref(s, 1);
+	s = summary_new();
+	check(camel_folder_summary_load(s) == 0);
+	summary_check(s, MAX_MESSAGES - 1);
+	check(s->nextuid == 100000);
+	pull();
+
+	push("header only load");
+	check_unref(s, 1);
+	s = summary_new();
+	check(camel_folder_summary_header_load(s) == 0);
+	check(s->saved_count == MAX_MESSAGES - 1);
+	check(s->unread_count == MAX_MESSAGES - 1 - MAX_CHANGED);
+	check_unref(s, 1);
+	pull();
+
+	printf("%d messages: full save %ld bytes in %.3fs, %d changes journalled in %ld bytes in %.3fs\n",
+	       MAX_MESSAGES, (long)full_size, full_time, MAX_CHANGED + 1, (long)journal_size, journal_time);
+
+	camel_test_end();
+
+	return 0;
+}
@@ -0,0 +1,145 @@
+/* folder search timing, body searches narrowed by cheaper predicates */
+
+#include <string.h>
+#include <sys/time.h>
+
+#include "camel-test.h"
+#include "camel-test-provider.h"
+#include "messages.h"
+#include "folders.h"
+#include "session.h"
+
+#include <camel/camel-exception.h>
+#include <camel/camel-service.h>
+#include <camel/camel-store.h>
+
+#include <camel/camel-folder.h>
+#include <camel/camel-mime-message.h>
+
+#define MAX_MESSAGES (1000)
+#define MAX_UNREAD (10)
+
+static const char *local_drivers[] = { "local" };
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double
+test_search(CamelFolder *folder, const char *expr, int expected)
+{
+	CamelException *ex = camel_exception_new();
+	GPtrArray *uids;
+	double start;
+
+	push("Testing search: %s", expr);
+	start = now();
+	uids = camel_folder_search_by_expression(folder, expr, ex);
+	start = now() - start;
+	check(uids != NULL);
+	check_msg(uids->len == expected, "search %s expected %d got %d", expr, expected, uids->len);
+	check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+	camel_folder_search_free(folder, uids);
+	camel_exception_free(ex);
+	pull();
+
+	return start;
+}
+
+int main(int argc, char **argv)
+{
+	CamelSession *session;
+	CamelStore *store;
+	CamelException *ex;
+	CamelFolder *folder;
+	CamelMimeMessage *msg;
+	GPtrArray *uids;
+	double all_time, unread_time, header_time;
+	int i, indexed, flags;
+
+	camel_test_init(argc, argv);
+	camel_test_provider_init(1, local_drivers);
+
+	ex = camel_exception_new();
+
+	/* clear out any camel-test data */
+	system("/bin/rm -rf /tmp/camel-test");
+
+	session = camel_test_session_new ("/tmp/camel-test");
+
+	for (indexed = 0;indexed<2;indexed++) {
+		char *what = g_strdup_printf("folder search timing: mbox (%sindexed)", indexed?"":"non-");
+
+		camel_test_start(what);
+		test_free(what);
+
+		push("getting store");
+		store = camel_session_get_store(session, "mbox:///tmp/camel-test/mbox", ex);
+		check_msg(!camel_exception_is_set(ex), "getting store: %s", camel_exception_get_description(ex));
+		check(store != NULL);
+		pull();
+
+		push("creating folder");
+		flags = CAMEL_STORE_FOLDER_CREATE;
+		if (indexed)
+			flags |= CAMEL_STORE_FOLDER_BODY_INDEX;
+		folder = camel_store_get_folder(store, indexed?"indexed":"plain", flags, ex);
+		check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+		check(folder != NULL);
+		pull();
+
+		push("appending %d messages", MAX_MESSAGES);
+		for (i=0;i<MAX_MESSAGES;i++) {
+			char *content, *subject;
+
+			msg = test_message_create_simple();
+			content = g_strdup_printf("common text of message%d\n", i);
+			test_message_set_content_simple((CamelMimePart *)msg, 0, "text/plain",
+							content, strlen(content));
+			test_free(content);
+			subject = g_strdup_printf("Test%d subject", i);
+			camel_mime_message_set_subject(msg, subject);
+			test_free(subject);
+
+			camel_folder_append_message(folder, msg, NULL, NULL, ex);
+			check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+			check_unref(msg, 1);
+		}
+		pull();
+
+		push("marking all but %d read", MAX_UNREAD);
+		uids = camel_folder_get_uids(folder);
+		check(uids->len == MAX_MESSAGES);
+		for (i=MAX_UNREAD;i<uids->len;i++)
+			camel_folder_set_message_flags(folder, uids->pdata[i], CAMEL_MESSAGE_SEEN, CAMEL_MESSAGE_SEEN);
+		camel_folder_free_uids(folder, uids);
+		camel_folder_sync(folder, FALSE, ex);
+		check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+		pull();
+
+		push("searching");
+		all_time = test_search(folder, "(match-all (body-contains \"common\"))", MAX_MESSAGES);
+		/* written most expensive first, the planner has to reorder them */
+		unread_time = test_search(folder, "(match-all (and (body-contains \"common\") (not (system-flag \"Seen\"))))", MAX_UNREAD);
+		header_time = test_search(folder, "(match-all (and (body-contains \"message1\") (header-contains \"subject\" \"Test1\")))", 1 + 10 + 100);
+		pull();
+
+		printf("%d messages, %sindexed: body %.3fs, body and unread %.3fs, body and header %.3fs\n",
+		       MAX_MESSAGES, indexed?"":"non-", all_time, unread_time, header_time);
+
+		check_unref(folder, 1);
+		check_unref(store, 1);
+		camel_test_end();
+	}
+
+	check_unref(session, 1);
+	camel_exception_free(ex);
+
+	return 0;
+}
@@ -0,0 +1,735 @@
+/* IMAP folder refresh against a scripted server, bytes sent per refresh with and without CONDSTORE/QRESYNC,
+   and pipelined flag sync and offline download over an extra connection,
+   with a big message streamed into the cache, and reopening the cache
+   from its manifest */
+
+#include <config.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include "camel-test.h"
+#include "camel-test-provider.h"
+#include "session.h"
+
+#include <camel/camel-exception.h>
+#include <camel/camel-service.h>
+#include <camel/camel-store.h>
+#include <camel/camel-stream-mem.h>
+#include <camel/camel-url.h>
+
+#include <camel/camel-disco-folder.h>
+#include <camel/camel-folder.h>
+#include <camel/camel-mime-message.h>
+
+#define SCRIPT_PATH "/tmp/camel-test/imap-script"
+#define SENT_PATH "/tmp/camel-test/imap-sent"
+#define CONNECTIONS_PATH "/tmp/camel-test/imap-connections"
+#define MAX_MESSAGES (1000)
+#define MAX_CHANGED (10)
+#define BIG_LINES (64 * 1024)
+
+static const char *imap_drivers[] = { "imap" };
+
+static const char *modes[] = { "plain", "condstore", "qresync" };
+#define MAX_MODES (sizeof(modes)/sizeof(modes[0]))
+
+/* ********************************************************************** */
+
+/* The stand-in server.  The test runs itself as the connection
+   command of the store, and talks IMAP on stdin/stdout to a single
+   INBOX of MAX_MESSAGES messages.  Changes are scripted by appending
+   lines to SCRIPT_PATH, which are applied when the INBOX is selected,
+   and the number of bytes sent so far is written to SENT_PATH before
+   every tagged response.  Flags the client stores are added to the
+   script too, so the next connection sees them.  A "big" line gives a
+   message a body of BIG_LINES lines.  Every connection adds a line to
+   CONNECTIONS_PATH. */
+
+#define SEEN (1<<0)
+#define FLAGGED (1<<1)
+
+static struct {
+	unsigned int uid;
+	unsigned int flags;
+	unsigned long modseq;
+	int expunged;
+	int big;
+} server_msgs[MAX_MESSAGES];
+
+static unsigned long server_modseq = 1;
+static unsigned long server_sent;
+static long server_script_pos;
+static int server_condstore, server_qresync, server_enabled;
+
+static void
+server_out(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	server_sent += vprintf(fmt, ap);
+	va_end(ap);
+}
+
+static void
+server_tagged(const char *tag, const char *status)
+{
+	FILE *fp;
+
+	server_sent += strlen(tag) + strlen(status) + 3;
+	fp = fopen(SENT_PATH, "w");
+	if (fp) {
+		fprintf(fp, "%lu\n", server_sent);
+		fclose(fp);
+	}
+	printf("%s %s\r\n", tag, status);
+	fflush(stdout);
+}
+
+static int
+server_find(unsigned int uid)
+{
+	int i;
+
+	for (i=0;i<MAX_MESSAGES;i++)
+		if (server_msgs[i].uid == uid)
+			return i;
+
+	return -1;
+}
+
+static void
+server_apply_script(void)
+{
+	char line[256], what[32];
+	unsigned int uid;
+	FILE *fp;
+	int i;
+
+	fp = fopen(SCRIPT_PATH, "r");
+	if (fp == NULL)
+		return;
+	fseek(fp, server_script_pos, SEEK_SET);
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%31s %u", what, &uid) != 2
+		    || (i = server_find(uid)) == -1
+		    || server_msgs[i].expunged)
+			continue;
+		server_msgs[i].modseq = ++server_modseq;
+		if (!strcmp(what, "seen"))
+			server_msgs[i].flags |= SEEN;
+		else if (!strcmp(what, "flag"))
+			server_msgs[i].flags |= FLAGGED;
+		else if (!strcmp(what, "expunge"))
+			server_msgs[i].expunged = TRUE;
+		else if (!strcmp(what, "big"))
+			server_msgs[i].big = TRUE;
+	}
+	server_script_pos = ftell(fp);
+	fclose(fp);
+}
+
+static int
+server_exists(int *unseen)
+{
+	int i, count = 0;
+
+	*unseen = 0;
+	for (i=0;i<MAX_MESSAGES;i++) {
+		if (server_msgs[i].expunged)
+			continue;
+		count++;
+		if ((server_msgs[i].flags & SEEN) == 0)
+			(*unseen)++;
+	}
+
+	return count;
+}
+
+static const char *
+server_flags(int i)
+{
+	static const char *flags[] = { "", "\\Seen", "\\Flagged", "\\Seen \\Flagged" };
+
+	return flags[server_msgs[i].flags & 3];
+}
+
+static void
+server_fetch(const char *tag, const char *args, int byuid)
+{
+	unsigned int first, last = 0, max = 0, tmp;
+	unsigned long since = 0;
+	const char *p;
+	GString *vanished;
+	int i, seq, headers, body;
+	char *end;
+
+	first = strtoul(args, &end, 10);
+	if (*end == ':') {
+		if (end[1] == '*')
+			last = ~0;
+		else
+			last = strtoul(end + 1, NULL, 10);
+	} else
+		last = first;
+
+	body = strstr(args, "BODY.PEEK[]") != NULL;
+	headers = !body && strstr(args, "BODY.PEEK[") != NULL;
+	if ((p = strstr(args, "CHANGEDSINCE ")))
+		since = strtoul(p + 13, NULL, 10);
+	if (since)
+		server_enabled = TRUE;
+
+	for (i=0;i<MAX_MESSAGES;i++)
+		if (!server_msgs[i].expunged)
+			max = server_msgs[i].uid;
+	/* n:* always includes the last message */
+	if (byuid && last == ~0 && first > max)
+		first = max;
+	if (last < first) {
+		tmp = first;
+		first = last;
+		last = tmp;
+	}
+
+	if (byuid && since && strstr(args, "VANISHED") && server_qresync) {
+		vanished = g_string_new("");
+		for (i=0;i<MAX_MESSAGES;i++) {
+			if (server_msgs[i].expunged && server_msgs[i].modseq > since
+			    && server_msgs[i].uid >= first && server_msgs[i].uid <= last)
+				g_string_append_printf(vanished, "%s%u", vanished->len?",":"", server_msgs[i].uid);
+		}
+		if (vanished->len)
+			server_out("* VANISHED (EARLIER) %s\r\n", vanished->str);
+		g_string_free(vanished, TRUE);
+	}
+
+	seq = 0;
+	for (i=0;i<MAX_MESSAGES;i++) {
+		if (server_msgs[i].expunged)
+			continue;
+		seq++;
+		if ((byuid ? server_msgs[i].uid : seq) < first
+		    || (byuid ? server_msgs[i].uid : seq) > last
+		    || server_msgs[i].modseq <= since)
+			continue;
+
+		server_out("* %d FETCH (UID %u", seq, server_msgs[i].uid);
+		if (strstr(args, "FLAGS"))
+			server_out(" FLAGS (%s)", server_flags(i));
+		if (server_enabled)
+			server_out(" MODSEQ (%lu)", server_msgs[i].modseq);
+		if (headers) {
+			char *header;
+
+			header = g_strdup_printf("From: Sender %u <sender%u@camel.host>\r\n"
+						 "Subject: Test message %u\r\n"
+						 "\r\n", server_msgs[i].uid % 97, server_msgs[i].uid % 97, server_msgs[i].uid);
+			server_out(" RFC822.SIZE %d INTERNALDATE \"17-Oct-2006 12:00:00 +0000\""
+				   " BODY[HEADER.FIELDS (FROM SUBJECT)] {%d}\r\n%s",
+				   (int)strlen(header) + 100, (int)strlen(header), header);
+			g_free(header);
+		}
+		if (body) {
+			char *message;
+
+			message = g_strdup_printf("From: Sender %u <sender%u@camel.host>\r\n"
+						  "Subject: Test message %u\r\n"
+						  "\r\n"
+						  "Body of message %u\r\n", server_msgs[i].uid % 97, server_msgs[i].uid % 97,
+						  server_msgs[i].uid, server_msgs[i].uid);
+			if (server_msgs[i].big) {
+				int j;
+
+				server_out(" BODY[] {%d}\r\n%s", (int)strlen(message) + BIG_LINES * 65, message);
+				for (j=0;j<BIG_LINES;j++)
+					server_out("%.63s\r\n", "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+			} else
+				server_out(" BODY[] {%d}\r\n%s", (int)strlen(message), message);
+			g_free(message);
+		}
+		server_out(")\r\n");
+	}
+
+	server_tagged(tag, "OK FETCH completed");
+}
+
+static void
+server_store(const char *tag, const char *args)
+{
+	unsigned int first, last, uid, flags = 0;
+	const char *p;
+	char *end;
+	FILE *fp;
+	int i;
+
+	/* only setting flags can be scripted */
+	if (strstr(args, "-FLAGS")) {
+		server_tagged(tag, "OK STORE completed");
+		return;
+	}
+	if (strstr(args, "\\Seen"))
+		flags |= SEEN;
+	if (strstr(args, "\\Flagged"))
+		flags |= FLAGGED;
+
+	fp = fopen(SCRIPT_PATH, "a");
+	p = args;
+	do {
+		first = strtoul(p, &end, 10);
+		last = first;
+		if (*end == ':')
+			last = strtoul(end + 1, &end, 10);
+		for (uid=first;uid<=last;uid++) {
+			if ((i = server_find(uid)) == -1 || server_msgs[i].expunged)
+				continue;
+			server_msgs[i].flags |= flags;
+			server_msgs[i].modseq = ++server_modseq;
+			if (fp && (flags & SEEN))
+				fprintf(fp, "seen %u\n", uid);
+			if (fp && (flags & FLAGGED))
+				fprintf(fp, "flag %u\n", uid);
+		}
+		p = end + 1;
+	} while (*end == ',');
+	if (fp)
+		fclose(fp);
+
+	server_tagged(tag, "OK STORE completed");
+}
+
+static int
+server_main(const char *mode)
+{
+	char line[4096], tag[64], *cmd, *p;
+	int i, exists, unseen;
+	FILE *fp;
+
+	server_condstore = strcmp(mode, "plain") != 0;
+	server_qresync = strcmp(mode, "qresync") == 0;
+
+	for (i=0;i<MAX_MESSAGES;i++) {
+		server_msgs[i].uid = i + 1;
+		server_msgs[i].modseq = 1;
+	}
+
+	fp = fopen(CONNECTIONS_PATH, "a");
+	if (fp) {
+		fprintf(fp, "%s\n", mode);
+		fclose(fp);
+	}
+
+	server_out("* PREAUTH IMAP stand-in ready\r\n");
+	fflush(stdout);
+
+	while (fgets(line, sizeof(line), stdin)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (sscanf(line, "%63s", tag) != 1)
+			continue;
+		cmd = line + strlen(tag);
+		while (*cmd == ' ')
+			cmd++;
+
+		if (!g_ascii_strcasecmp(cmd, "CAPABILITY")) {
+			server_out("* CAPABILITY IMAP4rev1%s%s\r\n",
+				   server_condstore?" CONDSTORE":"", server_qresync?" QRESYNC ENABLE":"");
+			server_tagged(tag, "OK CAPABILITY completed");
+		} else if (!g_ascii_strcasecmp(cmd, "ENABLE QRESYNC") && server_qresync) {
+			server_enabled = TRUE;
+			server_out("* ENABLED QRESYNC\r\n");
+			server_tagged(tag, "OK ENABLE completed");
+		} else if (!g_ascii_strncasecmp(cmd, "LIST ", 5)) {
+			server_out("* LIST (\\Noselect) \"/\" \"\"\r\n");
+			server_tagged(tag, "OK LIST completed");
+		} else if (!g_ascii_strcasecmp(cmd, "SELECT INBOX")
+			   || !g_ascii_strcasecmp(cmd, "EXAMINE INBOX")) {
+			server_apply_script();
+			exists = server_exists(&unseen);
+			server_out("* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n");
+			server_out("* OK [PERMANENTFLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft \\*)] Flags permitted\r\n");
+			server_out("* %d EXISTS\r\n", exists);
+			server_out("* 0 RECENT\r\n");
+			server_out("* OK [UIDVALIDITY 1] UIDs valid\r\n");
+			server_out("* OK [UIDNEXT %d] Predicted next UID\r\n", MAX_MESSAGES + 1);
+			if (server_condstore)
+				server_out("* OK [HIGHESTMODSEQ %lu] Highest\r\n", server_modseq);
+			if (!g_ascii_strncasecmp(cmd, "EXAMINE", 7))
+				server_tagged(tag, "OK [READ-ONLY] EXAMINE completed");
+			else
+				server_tagged(tag, "OK [READ-WRITE] SELECT completed");
+		} else if (!g_ascii_strncasecmp(cmd, "STATUS INBOX ", 13)) {
+			exists = server_exists(&unseen);
+			server_out("* STATUS INBOX (MESSAGES %d UNSEEN %d)\r\n", exists, unseen);
+			server_tagged(tag, "OK STATUS completed");
+		} else if (!g_ascii_strncasecmp(cmd, "UID STORE ", 10)) {
+			server_store(tag, cmd + 10);
+		} else if (!g_ascii_strncasecmp(cmd, "UID FETCH ", 10)) {
+			server_fetch(tag, cmd + 10, TRUE);
+		} else if (!g_ascii_strncasecmp(cmd, "FETCH ", 6)) {
+			server_fetch(tag, cmd + 6, FALSE);
+		} else if (!g_ascii_strcasecmp(cmd, "NOOP")) {
+			server_tagged(tag, "OK NOOP completed");
+		} else if (!g_ascii_strcasecmp(cmd, "LOGOUT")) {
+			server_out("* BYE IMAP stand-in logging out\r\n");
+			server_tagged(tag, "OK LOGOUT completed");
+			break;
+		} else {
+			p = g_strdup_printf("BAD %s not scripted", cmd);
+			server_tagged(tag, p);
+			g_free(p);
+		}
+	}
+
+	return 0;
+}
+
+/* ********************************************************************** */
+
+static unsigned long
+bytes_sent(void)
+{
+	unsigned long sent = 0;
+	FILE *fp;
+
+	fp = fopen(SENT_PATH, "r");
+	if (fp) {
+		fscanf(fp, "%lu", &sent);
+		fclose(fp);
+	}
+
+	return sent;
+}
+
+static int
+connections(void)
+{
+	char line[64];
+	int count = 0;
+	FILE *fp;
+
+	fp = fopen(CONNECTIONS_PATH, "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp))
+			count++;
+		fclose(fp);
+	}
+
+	return count;
+}
+
+static long
+max_rss(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_maxrss;
+}
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+script_add(const char *what, int first, int step)
+{
+	FILE *fp;
+	int i;
+
+	fp = fopen(SCRIPT_PATH, "a");
+	check(fp != NULL);
+	for (i=0;i<MAX_CHANGED;i++)
+		fprintf(fp, "%s %d\n", what, first + i * step);
+	fclose(fp);
+}
+
+static unsigned long
+refresh(CamelFolder *folder)
+{
+	CamelException *ex = camel_exception_new();
+	unsigned long sent;
+
+	sent = bytes_sent();
+	camel_folder_refresh_info(folder, ex);
+	check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+	camel_exception_free(ex);
+
+	return bytes_sent() - sent;
+}
+
+static void
+check_flags(CamelFolder *folder, int first, int step, guint32 flags)
+{
+	CamelMessageInfo *info;
+	char uid[16];
+	int i;
+
+	for (i=0;i<MAX_CHANGED;i++) {
+		sprintf(uid, "%d", first + i * step);
+		info = camel_folder_get_message_info(folder, uid);
+		check_msg(info != NULL, "uid %s missing", uid);
+		check_msg((camel_message_info_flags(info) & flags) == flags, "uid %s flags not updated", uid);
+		camel_folder_free_message_info(folder, info);
+	}
+}
+
+static void
+check_expunged(CamelFolder *folder, int first, int step)
+{
+	CamelMessageInfo *info;
+	char uid[16];
+	int i;
+
+	check(camel_folder_get_message_count(folder) == MAX_MESSAGES - MAX_CHANGED);
+	for (i=0;i<MAX_CHANGED;i++) {
+		sprintf(uid, "%d", first + i * step);
+		info = camel_folder_get_message_info(folder, uid);
+		check_msg(info == NULL, "uid %s not removed", uid);
+	}
+}
+
+static char *
+store_uri(const char *argv0, const char *mode)
+{
+	CamelException *ex = camel_exception_new();
+	CamelURL *url;
+	char *command, *uri;
+
+	url = camel_url_new("imap://test@localhost/", ex);
+	check(url != NULL);
+	command = g_strdup_printf("%s --server %s", argv0, mode);
+	camel_url_set_param(url, "use_command", "");
+	camel_url_set_param(url, "command", command);
+	uri = camel_url_to_string(url, 0);
+	g_free(command);
+	camel_url_free(url);
+	camel_exception_free(ex);
+
+	return uri;
+}
+
+static CamelFolder *
+open_inbox(CamelSession *session, const char *uri, CamelStore **store)
+{
+	CamelException *ex = camel_exception_new();
+	CamelFolder *folder;
+
+	*store = camel_session_get_store(session, uri, ex);
+	check_msg(!camel_exception_is_set(ex), "getting store: %s", camel_exception_get_description(ex));
+	check(*store != NULL);
+	folder = camel_store_get_folder(*store, "INBOX", 0, ex);
+	check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+	check(folder != NULL);
+	camel_exception_free(ex);
+
+	return folder;
+}
+
+static void
+close_store(CamelStore *store, CamelFolder *folder)
+{
+	CamelException *ex = camel_exception_new();
+
+	/* the store holds on to the selected folder until it disconnects */
+	camel_service_disconnect((CamelService *)store, TRUE, ex);
+	check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+	check_unref(folder, 1);
+	check_unref(store, 1);
+	camel_exception_free(ex);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long unchanged[MAX_MODES], flagged[MAX_MODES], expunged[MAX_MODES], reopened[MAX_MODES];
+	CamelSession *session;
+	CamelStore *store;
+	CamelException *ex;
+	CamelFolder *folder;
+	CamelMimeMessage *msg;
+	CamelStreamMem *content;
+	FILE *fp;
+	unsigned long sent;
+	char uid[16], *uri;
+	int i, count;
+	long rss;
+	double start;
+
+	if (argc == 3 && !strcmp(argv[1], "--server"))
+		return server_main(argv[2]);
+
+	camel_test_init(argc, argv);
+	camel_test_provider_init(1, imap_drivers);
+
+	ex = camel_exception_new();
+
+	for (i=0;i<MAX_MODES;i++) {
+		char *what = g_strdup_printf("IMAP refresh against a %s server", modes[i]);
+
+		camel_test_start(what);
+		test_free(what);
+
+		/* clear out any camel-test data */
+		system("/bin/rm -rf /tmp/camel-test");
+		system("/bin/mkdir /tmp/camel-test");
+
+		session = camel_test_session_new ("/tmp/camel-test");
+		uri = store_uri(argv[0], modes[i]);
+
+		push("opening the INBOX of %d messages", MAX_MESSAGES);
+		folder = open_inbox(session, uri, &store);
+		check(camel_folder_get_message_count(folder) == MAX_MESSAGES);
+		pull();
+
+		push("refreshing with nothing changed");
+		unchanged[i] = refresh(folder);
+		check(camel_folder_get_message_count(folder) == MAX_MESSAGES);
+		pull();
+
+		push("refreshing after %d flag changes", MAX_CHANGED);
+		script_add("seen", 1, 37);
+		flagged[i] = refresh(folder);
+		check_flags(folder, 1, 37, CAMEL_MESSAGE_SEEN);
+		pull();
+
+		push("refreshing after %d expunges", MAX_CHANGED);
+		script_add("expunge", 500, 41);
+		expunged[i] = refresh(folder);
+		check_expunged(folder, 500, 41);
+		pull();
+
+		push("reopening after %d more flag changes", MAX_CHANGED);
+		close_store(store, folder);
+		script_add("seen", 2, 53);
+		folder = open_inbox(session, uri, &store);
+		refresh(folder);
+		reopened[i] = bytes_sent();
+		check_flags(folder, 2, 53, CAMEL_MESSAGE_SEEN);
+		check_flags(folder, 1, 37, CAMEL_MESSAGE_SEEN);
+		check_expunged(folder, 500, 41);
+		close_store(store, folder);
+		pull();
+
+		g_free(uri);
+		check_unref(session, 1);
+
+		printf("%s server: bytes sent refreshing unchanged %lu, after flag changes %lu, after expunges %lu, reopening %lu\n",
+		       modes[i], unchanged[i], flagged[i], expunged[i], reopened[i]);
+
+		camel_test_end();
+	}
+
+	camel_test_start("IMAP refresh sends only what changed");
+	push("comparing bytes sent");
+	for (i=1;i<MAX_MODES;i++) {
+		check_msg(flagged[i] < flagged[0] / 10, "%s: %lu bytes for flag changes, plain %lu", modes[i], flagged[i], flagged[0]);
+		check_msg(reopened[i] < reopened[0] / 2, "%s: %lu bytes reopening, plain %lu", modes[i], reopened[i], reopened[0]);
+	}
+	/* without QRESYNC expunges still need everything fetched */
+	check_msg(expunged[2] < expunged[0] / 10, "qresync: %lu bytes for expunges, plain %lu", expunged[2], expunged[0]);
+	pull();
+	camel_test_end();
+
+	camel_test_start("IMAP pipelined flag sync and offline download");
+
+	system("/bin/rm -rf /tmp/camel-test");
+	system("/bin/mkdir /tmp/camel-test");
+
+	session = camel_test_session_new ("/tmp/camel-test");
+	uri = store_uri(argv[0], "plain");
+	folder = open_inbox(session, uri, &store);
+
+	push("syncing flags on %d messages", MAX_CHANGED * 2);
+	for (i=0;i<MAX_CHANGED;i++) {
+		sprintf(uid, "%d", 3 + i * 29);
+		camel_folder_set_message_flags(folder, uid, CAMEL_MESSAGE_SEEN, CAMEL_MESSAGE_SEEN);
+		sprintf(uid, "%d", 4 + i * 31);
+		camel_folder_set_message_flags(folder, uid, CAMEL_MESSAGE_FLAGGED, CAMEL_MESSAGE_FLAGGED);
+	}
+	camel_folder_sync(folder, FALSE, ex);
+	check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+	pull();
+
+	push("downloading %d messages for offline use", MAX_MESSAGES);
+	fp = fopen(SCRIPT_PATH, "a");
+	check(fp != NULL);
+	fprintf(fp, "big 7\n");
+	fclose(fp);
+	count = connections();
+	rss = max_rss();
+	start = now();
+	camel_disco_folder_prepare_for_offline((CamelDiscoFolder *)folder, NULL, ex);
+	start = now() - start;
+	rss = max_rss() - rss;
+	check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+	/* on a connection of its own */
+	check_msg(connections() == count + 1, "%d connections opened downloading", connections() - count);
+	/* the big body went to the cache without passing through memory */
+	check_msg(rss < BIG_LINES * 64 / 1024 / 2, "peak RSS grew %ldkB downloading", rss);
+	printf("offline download of %d messages, one of %dkB: %.3fs, peak RSS grew %ldkB\n",
+	       MAX_MESSAGES, BIG_LINES * 64 / 1024, start, rss);
+	sent = bytes_sent();
+	for (i=0;i<MAX_MESSAGES;i++) {
+		sprintf(uid, "%d", i + 1);
+		msg = camel_folder_get_message(folder, uid, ex);
+		check_msg(msg != NULL, "uid %s not cached: %s", uid, camel_exception_get_description(ex));
+		if (i + 1 == 7) {
+			content = (CamelStreamMem *)camel_stream_mem_new();
+			camel_data_wrapper_decode_to_stream(camel_medium_get_content_object((CamelMedium *)msg), (CamelStream *)content);
+			check_msg(content->buffer->len == BIG_LINES * 64 + strlen("Body of message 7\n"),
+				  "big message has %d bytes", content->buffer->len);
+			camel_object_unref(content);
+		}
+		camel_object_unref(msg);
+	}
+	check_msg(bytes_sent() == sent, "%lu bytes sent reading cached messages", bytes_sent() - sent);
+	close_store(store, folder);
+	check_unref(session, 1);
+	pull();
+
+	push("reopening with the cache manifest");
+	check_msg(system("find /tmp/camel-test -name manifest | grep -q .") == 0, "no cache manifest saved");
+	session = camel_test_session_new ("/tmp/camel-test");
+	start = now();
+	folder = open_inbox(session, uri, &store);
+	start = now() - start;
+	sent = bytes_sent();
+	for (i=0;i<MAX_MESSAGES;i++) {
+		sprintf(uid, "%d", i + 1);
+		msg = camel_folder_get_message(folder, uid, ex);
+		check_msg(msg != NULL, "uid %s not cached: %s", uid, camel_exception_get_description(ex));
+		camel_object_unref(msg);
+	}
+	check_msg(bytes_sent() == sent, "%lu bytes sent reading cached messages", bytes_sent() - sent);
+	printf("reopening the folder with %d cached messages: %.3fs\n", MAX_MESSAGES, start);
+	close_store(store, folder);
+	check_unref(session, 1);
+	pull();
+
+	push("checking the flags reached the server");
+	session = camel_test_session_new ("/tmp/camel-test/fresh");
+	folder = open_inbox(session, uri, &store);
+	check_flags(folder, 3, 29, CAMEL_MESSAGE_SEEN);
+	check_flags(folder, 4, 31, CAMEL_MESSAGE_FLAGGED);
+	close_store(store, folder);
+	check_unref(session, 1);
+	pull();
+
+	g_free(uri);
+	camel_test_end();
+
+	camel_exception_free(ex);
+
+	return 0;
+}
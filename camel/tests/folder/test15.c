@@ -0,0 +1,347 @@
+/* mbox expunge, bytes read and written in place and by a full copy,
+   and finishing one cut short */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "camel-test.h"
+#include "camel-test-provider.h"
+#include "session.h"
+
+#include <camel/camel-exception.h>
+#include <camel/camel-file-utils.h>
+#include <camel/camel-service.h>
+#include <camel/camel-store.h>
+
+#include <camel/camel-folder.h>
+#include <camel/camel-mime-message.h>
+
+#define MBOX_PATH "/tmp/camel-test/mbox"
+#define MAX_MESSAGES (1000)
+#define BODY_LINES (250)
+
+static const char *local_drivers[] = { "local" };
+
+static const char *modes[] = { "in place", "copy" };
+#define MAX_MODES (sizeof(modes)/sizeof(modes[0]))
+
+static struct {
+	const char *name;
+	int first, count;
+	int small;		/* in place has to do much less i/o than a copy */
+} deletes[] = {
+	{ "last 5", MAX_MESSAGES - 5, 5, TRUE },
+	{ "1 near the end", MAX_MESSAGES - 20, 1, TRUE },
+	{ "10 in the middle", MAX_MESSAGES / 2, 10, FALSE },
+	{ "1 in the middle", MAX_MESSAGES / 2, 1, FALSE },
+	{ "the first", 0, 1, FALSE },
+};
+#define MAX_DELETES (sizeof(deletes)/sizeof(deletes[0]))
+
+/* the expunge journal, as camel-mbox-summary.c writes it */
+#define COMPACT_VERSION (1)
+#define COMPACT_MAGIC (0x636d7078)
+
+/* a gap as big as what is moved after it, so the journal has no copy */
+#define CRASH_FIRST (MAX_MESSAGES - 20)
+#define CRASH_COUNT (10)
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* bytes read and written by this process, if the kernel counts them */
+static gboolean
+io_bytes(guint64 *rchar, guint64 *wchar)
+{
+	char line[128];
+	FILE *fp;
+	int found = 0;
+
+	if ((fp = fopen("/proc/self/io", "r")) == NULL)
+		return FALSE;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "rchar: %" G_GUINT64_FORMAT, rchar) == 1
+		    || sscanf(line, "wchar: %" G_GUINT64_FORMAT, wchar) == 1)
+			found++;
+	}
+	fclose(fp);
+
+	return found == 2;
+}
+
+/* an mbox nothing has touched yet, so the first sync adds the
+   X-Evolution headers; where each message starts goes in offsets,
+   and the size after them */
+static void
+mbox_write(const char *name, off_t *offsets)
+{
+	char *path;
+	FILE *fp;
+	int i, j;
+
+	path = g_strdup_printf("%s/%s", MBOX_PATH, name);
+	fp = fopen(path, "w");
+	check_msg(fp != NULL, "cannot create %s", path);
+	for (i=0;i<MAX_MESSAGES;i++) {
+		if (offsets)
+			offsets[i] = ftell(fp);
+		fprintf(fp, "From sender%d@example.com Mon Oct 13 12:%02d:00 2008\n", i % 10, i % 60);
+		fprintf(fp, "From: Sender %d <sender%d@example.com>\n", i % 10, i % 10);
+		fprintf(fp, "To: list@example.com\n");
+		fprintf(fp, "Subject: message %d\n", i);
+		fprintf(fp, "Message-Id: <%d@example.com>\n\n", i);
+		for (j=0;j<BODY_LINES;j++)
+			fprintf(fp, "line %d of message %d, some text to make up the size\n", j, i);
+		fprintf(fp, "\n");
+	}
+	if (offsets)
+		offsets[MAX_MESSAGES] = ftell(fp);
+	fclose(fp);
+	test_free(path);
+}
+
+static void
+check_subject(CamelFolder *folder, const char *uid, int expected)
+{
+	CamelException *ex = camel_exception_new();
+	CamelMimeMessage *msg;
+	char *subject;
+
+	msg = camel_folder_get_message(folder, uid, ex);
+	check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+	check(msg != NULL);
+	subject = g_strdup_printf("message %d", expected);
+	check_msg(!strcmp(camel_mime_message_get_subject(msg), subject),
+		  "uid %s: subject '%s' != '%s'", uid, camel_mime_message_get_subject(msg), subject);
+	test_free(subject);
+	check_unref(msg, 1);
+	camel_exception_free(ex);
+}
+
+static void
+journal_record(FILE *out, off_t done, guint32 len)
+{
+	check(camel_file_util_encode_off_t(out, done) != -1);
+	check(camel_file_util_encode_uint32(out, len) != -1);
+	check(camel_file_util_encode_uint32(out, 0) != -1);
+	check(camel_file_util_encode_uint32(out, COMPACT_MAGIC ^ (guint32)done ^ len) != -1);
+}
+
+/* leave things as an in-place expunge of CRASH_COUNT messages from
+   CRASH_FIRST does if it dies after cutting the mbox off, but before
+   removing its journal; the sources of the last chunk are gone */
+static void
+crash_after_truncate(const char *name)
+{
+	off_t offsets[MAX_MESSAGES + 1], dst, src, total;
+	char *path, *journal, *buf;
+	FILE *out;
+	int fd;
+
+	mbox_write(name, offsets);
+
+	dst = offsets[CRASH_FIRST];
+	src = offsets[CRASH_FIRST + CRASH_COUNT];
+	total = offsets[MAX_MESSAGES] - src;
+	check(total <= src - dst);
+
+	path = g_strdup_printf("%s/%s", MBOX_PATH, name);
+	buf = g_malloc(total);
+	fd = open(path, O_RDWR);
+	check(fd != -1);
+	check(lseek(fd, src, SEEK_SET) == src && read(fd, buf, total) == total);
+	check(lseek(fd, dst, SEEK_SET) == dst && write(fd, buf, total) == total);
+	check(ftruncate(fd, dst + total) == 0);
+	close(fd);
+	g_free(buf);
+
+	journal = g_strdup_printf("%s.compact", path);
+	out = fopen(journal, "wb");
+	check_msg(out != NULL, "cannot create %s", journal);
+	check(camel_file_util_encode_uint32(out, COMPACT_VERSION) != -1);
+	check(camel_file_util_encode_off_t(out, dst) != -1);
+	check(camel_file_util_encode_uint32(out, 1) != -1);
+	check(camel_file_util_encode_off_t(out, src) != -1);
+	check(camel_file_util_encode_off_t(out, total) != -1);
+	journal_record(out, 0, total);
+	journal_record(out, total, 0);
+	fclose(out);
+
+	test_free(journal);
+	test_free(path);
+}
+
+int main(int argc, char **argv)
+{
+	guint64 rstart, wstart, rchar[MAX_DELETES][MAX_MODES], wchar[MAX_DELETES][MAX_MODES];
+	double times[MAX_DELETES][MAX_MODES];
+	CamelSession *session;
+	CamelStore *store;
+	CamelException *ex;
+	CamelFolder *folder;
+	GPtrArray *uids;
+	gboolean have_io = TRUE;
+	int i, d, m, kept;
+	char *name, *path;
+
+	camel_test_init(argc, argv);
+	camel_test_provider_init(1, local_drivers);
+
+	ex = camel_exception_new();
+
+	/* clear out any camel-test data */
+	system("/bin/rm -rf /tmp/camel-test");
+
+	session = camel_test_session_new ("/tmp/camel-test");
+
+	store = camel_session_get_store(session, "mbox://" MBOX_PATH, ex);
+	check_msg(!camel_exception_is_set(ex), "getting store: %s", camel_exception_get_description(ex));
+	check(store != NULL);
+
+	for (d=0;d<MAX_DELETES;d++) {
+		for (m=0;m<MAX_MODES;m++) {
+			char *what = g_strdup_printf("mbox expunge %s, %s", deletes[d].name, modes[m]);
+
+			camel_test_start(what);
+			test_free(what);
+
+			name = g_strdup_printf("expunge%d-%d", d, m);
+			mbox_write(name, NULL);
+
+			push("opening and syncing a new mbox");
+			folder = camel_store_get_folder(store, name, 0, ex);
+			check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+			check(folder != NULL);
+			camel_folder_sync(folder, FALSE, ex);
+			check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+			pull();
+
+			push("expunging %d from %d", deletes[d].count, deletes[d].first);
+			uids = camel_folder_get_uids(folder);
+			check(uids->len == MAX_MESSAGES);
+			for (i=deletes[d].first;i<deletes[d].first+deletes[d].count;i++)
+				camel_folder_set_message_flags(folder, uids->pdata[i], CAMEL_MESSAGE_DELETED, CAMEL_MESSAGE_DELETED);
+			/* and a flag change after, which has to land where the message moved */
+			camel_folder_set_message_flags(folder, uids->pdata[MAX_MESSAGES - 1], CAMEL_MESSAGE_SEEN, CAMEL_MESSAGE_SEEN);
+			camel_folder_free_uids(folder, uids);
+
+			if (m == 1)
+				setenv("CAMEL_MBOX_DISABLE_COMPACT", "1", 1);
+			else
+				unsetenv("CAMEL_MBOX_DISABLE_COMPACT");
+
+			have_io &= io_bytes(&rstart, &wstart);
+			times[d][m] = now();
+			camel_folder_sync(folder, TRUE, ex);
+			times[d][m] = now() - times[d][m];
+			have_io &= io_bytes(&rchar[d][m], &wchar[d][m]);
+			rchar[d][m] -= rstart;
+			wchar[d][m] -= wstart;
+			check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+			pull();
+
+			push("checking the messages kept");
+			kept = MAX_MESSAGES - deletes[d].count;
+			uids = camel_folder_get_uids(folder);
+			check_msg(uids->len == kept, "%d messages, expected %d", uids->len, kept);
+			if (deletes[d].first > 0)
+				check_subject(folder, uids->pdata[deletes[d].first - 1], deletes[d].first - 1);
+			if (deletes[d].first < kept)
+				check_subject(folder, uids->pdata[deletes[d].first], deletes[d].first + deletes[d].count);
+			check_subject(folder, uids->pdata[kept - 1], MAX_MESSAGES - 1);
+			check((camel_folder_get_message_flags(folder, uids->pdata[kept - 1]) & CAMEL_MESSAGE_SEEN) != 0);
+			camel_folder_free_uids(folder, uids);
+			check_unref(folder, 1);
+			pull();
+
+			push("checking the mbox rescans the same");
+			path = g_strdup_printf("%s/%s.ev-summary", MBOX_PATH, name);
+			unlink(path);
+			test_free(path);
+			folder = camel_store_get_folder(store, name, 0, ex);
+			check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+			check(folder != NULL);
+			uids = camel_folder_get_uids(folder);
+			check_msg(uids->len == kept, "%d messages, expected %d", uids->len, kept);
+			check((camel_folder_get_message_flags(folder, uids->pdata[kept - 1]) & CAMEL_MESSAGE_SEEN) != 0);
+			camel_folder_free_uids(folder, uids);
+			check_unref(folder, 1);
+			pull();
+
+			test_free(name);
+			camel_test_end();
+		}
+
+		if (have_io) {
+			camel_test_start("mbox expunge i/o, in place against copy");
+			check_msg(rchar[d][0] + wchar[d][0] <= (rchar[d][1] + wchar[d][1]) * 11 / 10,
+				  "%s: %" G_GUINT64_FORMAT " bytes in place, %" G_GUINT64_FORMAT " copying",
+				  deletes[d].name, rchar[d][0] + wchar[d][0], rchar[d][1] + wchar[d][1]);
+			if (deletes[d].small)
+				check_msg((rchar[d][0] + wchar[d][0]) * 10 < rchar[d][1] + wchar[d][1],
+					  "%s: %" G_GUINT64_FORMAT " bytes in place, %" G_GUINT64_FORMAT " copying",
+					  deletes[d].name, rchar[d][0] + wchar[d][0], rchar[d][1] + wchar[d][1]);
+			camel_test_end();
+		}
+	}
+
+	unsetenv("CAMEL_MBOX_DISABLE_COMPACT");
+
+	camel_test_start("mbox expunge cut short after the truncate");
+
+	push("writing the mbox and journal left behind");
+	crash_after_truncate("crashed");
+	pull();
+
+	push("opening the folder");
+	folder = camel_store_get_folder(store, "crashed", 0, ex);
+	check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+	check(folder != NULL);
+	path = g_strdup_printf("%s/crashed.compact", MBOX_PATH);
+	check_msg(access(path, F_OK) == -1, "%s left behind", path);
+	test_free(path);
+	pull();
+
+	push("checking the messages kept");
+	kept = MAX_MESSAGES - CRASH_COUNT;
+	uids = camel_folder_get_uids(folder);
+	check_msg(uids->len == kept, "%d messages, expected %d", uids->len, kept);
+	check_subject(folder, uids->pdata[CRASH_FIRST - 1], CRASH_FIRST - 1);
+	check_subject(folder, uids->pdata[CRASH_FIRST], CRASH_FIRST + CRASH_COUNT);
+	check_subject(folder, uids->pdata[kept - 1], MAX_MESSAGES - 1);
+	camel_folder_free_uids(folder, uids);
+	check_unref(folder, 1);
+	pull();
+
+	camel_test_end();
+
+	check_unref(store, 1);
+	check_unref(session, 1);
+
+	camel_exception_free(ex);
+
+	printf("expunging from %d messages:\n", MAX_MESSAGES);
+	for (d=0;d<MAX_DELETES;d++) {
+		for (m=0;m<MAX_MODES;m++) {
+			if (have_io)
+				printf("%-18s %-8s read %7.2f MB, written %7.2f MB, %.3fs\n", m == 0 ? deletes[d].name : "", modes[m],
+				       rchar[d][m] / (1024.0 * 1024.0), wchar[d][m] / (1024.0 * 1024.0), times[d][m]);
+			else
+				printf("%-18s %-8s %.3fs\n", m == 0 ? deletes[d].name : "", modes[m], times[d][m]);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,245 @@
+/* maildir refresh, with and without change notification */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "camel-test.h"
+#include "camel-test-provider.h"
+#include "session.h"
+
+#include <camel/camel-exception.h>
+#include <camel/camel-service.h>
+#include <camel/camel-store.h>
+
+#include <camel/camel-folder.h>
+#include <camel/camel-mime-message.h>
+
+#define MAILDIR_PATH "/tmp/camel-test/maildir"
+#define MAX_MESSAGES (20000)
+#define MAX_CHANGES (10)
+
+static const char *local_drivers[] = { "local" };
+
+static const char *modes[] = { "notify", "scan" };
+#define MAX_MODES (sizeof(modes)/sizeof(modes[0]))
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+message_write(const char *path, int i)
+{
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	check_msg(fp != NULL, "cannot create %s", path);
+	fprintf(fp, "From: Sender %d <sender%d@example.com>\n", i % 10, i % 10);
+	fprintf(fp, "To: list@example.com\n");
+	fprintf(fp, "Subject: message %d\n", i);
+	fprintf(fp, "Date: Mon, 13 Oct 2008 12:%02d:%02d +0000\n", (i / 60) % 60, i % 60);
+	fprintf(fp, "Message-Id: <%d@example.com>\n\n", i);
+	fprintf(fp, "body of message %d\n", i);
+	fclose(fp);
+}
+
+/* what other clients do: deliver to new/, change flags in cur/, delete */
+static void
+maildir_change(const char *dir, int first, int count)
+{
+	char *src, *dest;
+	int i;
+
+	for (i=first;i<first+count;i++) {
+		src = g_strdup_printf("%s/tmp/new%d.test", dir, i);
+		dest = g_strdup_printf("%s/new/new%d.test", dir, i);
+		message_write(src, MAX_MESSAGES + i);
+		check(rename(src, dest) == 0);
+		test_free(src);
+		test_free(dest);
+
+		src = g_strdup_printf("%s/cur/%d.test:2,", dir, i);
+		dest = g_strdup_printf("%s/cur/%d.test:2,S", dir, i);
+		check(rename(src, dest) == 0);
+		test_free(src);
+		test_free(dest);
+
+		src = g_strdup_printf("%s/cur/%d.test:2,", dir, MAX_MESSAGES - 1 - i);
+		check(unlink(src) == 0);
+		test_free(src);
+	}
+}
+
+static void
+check_message(CamelFolder *folder, const char *uid, int expected)
+{
+	CamelException *ex = camel_exception_new();
+	CamelMimeMessage *msg;
+	char *subject;
+
+	msg = camel_folder_get_message(folder, uid, ex);
+	check_msg(!camel_exception_is_set(ex), "%s: %s", uid, camel_exception_get_description(ex));
+	check(msg != NULL);
+	subject = g_strdup_printf("message %d", expected);
+	check_msg(!strcmp(camel_mime_message_get_subject(msg), subject),
+		  "uid %s: subject '%s' != '%s'", uid, camel_mime_message_get_subject(msg), subject);
+	test_free(subject);
+	check_unref(msg, 1);
+	camel_exception_free(ex);
+}
+
+static void
+check_changes(CamelFolder *folder, int first, int count)
+{
+	CamelMessageInfo *info;
+	char *uid;
+	int i;
+
+	for (i=first;i<first+count;i++) {
+		uid = g_strdup_printf("%d.test", i);
+		check_message(folder, uid, i);
+		test_free(uid);
+
+		uid = g_strdup_printf("new%d.test", i);
+		check_message(folder, uid, MAX_MESSAGES + i);
+		test_free(uid);
+
+		uid = g_strdup_printf("%d.test", MAX_MESSAGES - 1 - i);
+		info = camel_folder_get_message_info(folder, uid);
+		check_msg(info == NULL, "deleted message %s still there", uid);
+		test_free(uid);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	double open_time[MAX_MODES], idle_time[MAX_MODES], change_time[MAX_MODES];
+	CamelSession *session;
+	CamelStore *store;
+	CamelException *ex;
+	CamelFolder *folder;
+	char *dir, *path;
+	int i, m;
+
+	camel_test_init(argc, argv);
+	camel_test_provider_init(1, local_drivers);
+
+	ex = camel_exception_new();
+
+	/* clear out any camel-test data */
+	system("/bin/rm -rf /tmp/camel-test");
+
+	session = camel_test_session_new ("/tmp/camel-test");
+
+	store = camel_session_get_store(session, "maildir://" MAILDIR_PATH, ex);
+	check_msg(!camel_exception_is_set(ex), "getting store: %s", camel_exception_get_description(ex));
+	check(store != NULL);
+
+	for (m=0;m<MAX_MODES;m++) {
+		char *what = g_strdup_printf("maildir refresh, %s", modes[m]);
+
+		camel_test_start(what);
+		test_free(what);
+
+		if (m == 1)
+			setenv("CAMEL_MAILDIR_DISABLE_NOTIFY", "1", 1);
+		else
+			unsetenv("CAMEL_MAILDIR_DISABLE_NOTIFY");
+
+		push("writing %d messages", MAX_MESSAGES);
+		dir = g_strdup_printf("%s/%s", MAILDIR_PATH, modes[m]);
+		mkdir(MAILDIR_PATH, 0700);
+		mkdir(dir, 0700);
+		path = g_strdup_printf("%s/cur", dir);
+		mkdir(path, 0700);
+		test_free(path);
+		path = g_strdup_printf("%s/new", dir);
+		mkdir(path, 0700);
+		test_free(path);
+		path = g_strdup_printf("%s/tmp", dir);
+		mkdir(path, 0700);
+		test_free(path);
+		for (i=0;i<MAX_MESSAGES;i++) {
+			path = g_strdup_printf("%s/cur/%d.test:2,", dir, i);
+			message_write(path, i);
+			test_free(path);
+		}
+		pull();
+
+		push("opening folder");
+		open_time[m] = now();
+		folder = camel_store_get_folder(store, modes[m], 0, ex);
+		open_time[m] = now() - open_time[m];
+		check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+		check(folder != NULL);
+		check(camel_folder_get_message_count(folder) == MAX_MESSAGES);
+		pull();
+
+		push("refreshing unchanged");
+		idle_time[m] = now();
+		camel_folder_refresh_info(folder, ex);
+		idle_time[m] = now() - idle_time[m];
+		check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+		check(camel_folder_get_message_count(folder) == MAX_MESSAGES);
+		pull();
+
+		push("refreshing after %d deliveries, renames and deletes", MAX_CHANGES);
+		maildir_change(dir, 0, MAX_CHANGES);
+		change_time[m] = now();
+		camel_folder_refresh_info(folder, ex);
+		change_time[m] = now() - change_time[m];
+		check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+		check(camel_folder_get_message_count(folder) == MAX_MESSAGES);
+		check_changes(folder, 0, MAX_CHANGES);
+		pull();
+
+		/* a rename of every message is more events than the
+		   kernel queues by default, so it has to rescan */
+		push("refreshing after renaming every message");
+		for (i=MAX_CHANGES;i<MAX_MESSAGES-MAX_CHANGES;i++) {
+			char *src, *dest;
+
+			src = g_strdup_printf("%s/cur/%d.test:2,", dir, i);
+			dest = g_strdup_printf("%s/cur/%d.test:2,F", dir, i);
+			check(rename(src, dest) == 0);
+			test_free(src);
+			test_free(dest);
+		}
+		camel_folder_refresh_info(folder, ex);
+		check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+		check(camel_folder_get_message_count(folder) == MAX_MESSAGES);
+		check_message(folder, "1000.test", 1000);
+		check_message(folder, "15000.test", 15000);
+		check_changes(folder, 0, MAX_CHANGES);
+		pull();
+
+		check_unref(folder, 1);
+		test_free(dir);
+
+		camel_test_end();
+	}
+
+	unsetenv("CAMEL_MAILDIR_DISABLE_NOTIFY");
+
+	check_unref(store, 1);
+	check_unref(session, 1);
+
+	camel_exception_free(ex);
+
+	for (m=0;m<MAX_MODES;m++)
+		printf("%d messages, %-6s open %.3fs, refresh unchanged %.4fs, refresh after %d changes %.4fs\n",
+		       MAX_MESSAGES, modes[m], open_time[m], idle_time[m], MAX_CHANGES * 3, change_time[m]);
+
+	return 0;
+}
@@ -0,0 +1,247 @@
+/* building the summary of a large new mbox, on one thread and on several */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "camel-test.h"
+#include "camel-test-provider.h"
+#include "session.h"
+
+#include <camel/camel-exception.h>
+#include <camel/camel-service.h>
+#include <camel/camel-store.h>
+
+#include <camel/camel-folder.h>
+#include <camel/camel-mime-message.h>
+#include <camel/camel-mime-utils.h>
+
+#define MBOX_PATH "/tmp/camel-test/mbox"
+#define MAX_MESSAGES (12000)
+#define BODY_LINES (30)
+#define ATTACHMENT_SIZE (8 * 1024)
+
+static const char *local_drivers[] = { "local" };
+
+/* threads to build with, NULL for the default */
+static const char *modes[] = { "1", "2", "4", NULL };
+#define MAX_MODES (sizeof(modes)/sizeof(modes[0]))
+
+struct _result {
+	char *uid;
+	char *subject;
+	guint32 flags;
+	guint32 size;
+	time_t date_sent;
+};
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* the first half has been seen by evolution before, the second half
+   is new mail; some messages have attachments or pine status headers,
+   and some bodies have quoted From lines */
+static off_t
+mbox_write(const char *name)
+{
+	unsigned char data[ATTACHMENT_SIZE], *out;
+	int state, save;
+	char *path;
+	size_t len;
+	off_t size;
+	FILE *fp;
+	int i, j;
+
+	out = g_malloc(ATTACHMENT_SIZE * 2);
+
+	path = g_strdup_printf("%s/%s", MBOX_PATH, name);
+	fp = fopen(path, "w");
+	check_msg(fp != NULL, "cannot create %s", path);
+	for (i=0;i<MAX_MESSAGES;i++) {
+		fprintf(fp, "From sender%d@example.com Mon Oct 13 12:%02d:00 2008\n", i % 10, i % 60);
+		fprintf(fp, "From: Sender %d <sender%d@example.com>\n", i % 10, i % 10);
+		fprintf(fp, "To: list@example.com\n");
+		fprintf(fp, "Subject: message %d\n", i);
+		fprintf(fp, "Date: Mon, 13 Oct 2008 12:%02d:%02d +0000\n", (i / 60) % 60, i % 60);
+		fprintf(fp, "Message-Id: <%d@example.com>\n", i);
+		if (i > 0)
+			fprintf(fp, "References: <%d@example.com>\n", i - 1);
+		if (i < MAX_MESSAGES / 2)
+			fprintf(fp, "X-Evolution: %08x-%04x\n", i * 3 + 1, (i % 3) ? 0x10 : 0);
+		if (i % 7 == 0)
+			fprintf(fp, "Status: RO\n");
+		if (i % 4 == 0) {
+			fprintf(fp, "MIME-Version: 1.0\n");
+			fprintf(fp, "Content-Type: multipart/mixed; boundary=\"=-part%d\"\n\n", i);
+			fprintf(fp, "--=-part%d\n", i);
+			fprintf(fp, "Content-Type: text/plain\n\n");
+		} else
+			fprintf(fp, "\n");
+		for (j=0;j<BODY_LINES;j++) {
+			if (j % 10 == 5)
+				fprintf(fp, ">From the body of message %d, quoted\n", i);
+			else
+				fprintf(fp, "line %d of message %d, some text to make up the size\n", j, i);
+		}
+		if (i % 4 == 0) {
+			fprintf(fp, "--=-part%d\n", i);
+			fprintf(fp, "Content-Type: application/octet-stream\n");
+			fprintf(fp, "Content-Disposition: attachment; filename=\"part%d.bin\"\n", i);
+			fprintf(fp, "Content-Transfer-Encoding: base64\n\n");
+			for (j=0;j<ATTACHMENT_SIZE;j++)
+				data[j] = (j * 7 + i * 13 + (j >> 8)) & 0xff;
+			state = save = 0;
+			len = camel_base64_encode_close(data, ATTACHMENT_SIZE, TRUE, out, &state, &save);
+			fwrite(out, 1, len, fp);
+			fprintf(fp, "--=-part%d--\n", i);
+		}
+		fprintf(fp, "\n");
+	}
+	size = ftell(fp);
+	fclose(fp);
+	test_free(path);
+	g_free(out);
+
+	return size;
+}
+
+static void
+check_subject(CamelFolder *folder, const char *uid, int expected)
+{
+	CamelException *ex = camel_exception_new();
+	CamelMimeMessage *msg;
+	char *subject;
+
+	msg = camel_folder_get_message(folder, uid, ex);
+	check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+	check(msg != NULL);
+	subject = g_strdup_printf("message %d", expected);
+	check_msg(!strcmp(camel_mime_message_get_subject(msg), subject),
+		  "uid %s: subject '%s' != '%s'", uid, camel_mime_message_get_subject(msg), subject);
+	test_free(subject);
+	check_unref(msg, 1);
+	camel_exception_free(ex);
+}
+
+int main(int argc, char **argv)
+{
+	struct _result *results[MAX_MODES], *r;
+	double times[MAX_MODES];
+	CamelSession *session;
+	CamelStore *store;
+	CamelException *ex;
+	CamelFolder *folder;
+	CamelMessageInfo *info;
+	GPtrArray *infos;
+	char name[16];
+	off_t size = 0;
+	int i, m;
+
+	camel_test_init(argc, argv);
+	camel_test_provider_init(1, local_drivers);
+
+	ex = camel_exception_new();
+
+	/* clear out any camel-test data */
+	system("/bin/rm -rf /tmp/camel-test");
+
+	session = camel_test_session_new ("/tmp/camel-test");
+
+	store = camel_session_get_store(session, "mbox://" MBOX_PATH, ex);
+	check_msg(!camel_exception_is_set(ex), "getting store: %s", camel_exception_get_description(ex));
+	check(store != NULL);
+
+	for (m=0;m<MAX_MODES;m++) {
+		char *what = g_strdup_printf("building a large mbox summary, %s threads", modes[m] ? modes[m] : "default");
+
+		camel_test_start(what);
+		test_free(what);
+
+		if (modes[m])
+			setenv("CAMEL_MBOX_SUMMARY_THREADS", modes[m], 1);
+		else
+			unsetenv("CAMEL_MBOX_SUMMARY_THREADS");
+
+		push("writing %d messages", MAX_MESSAGES);
+		sprintf(name, "mbox%d", m);
+		size = mbox_write(name);
+		pull();
+
+		push("opening folder");
+		times[m] = now();
+		folder = camel_store_get_folder(store, name, 0, ex);
+		times[m] = now() - times[m];
+		check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+		check(folder != NULL);
+		check(camel_folder_get_message_count(folder) == MAX_MESSAGES);
+		pull();
+
+		push("comparing with the summary built on one thread");
+		infos = camel_folder_get_summary(folder);
+		check(infos->len == MAX_MESSAGES);
+		results[m] = g_malloc0(MAX_MESSAGES * sizeof(*results[m]));
+		for (i=0;i<infos->len;i++) {
+			info = infos->pdata[i];
+			r = &results[m][i];
+			r->uid = g_strdup(camel_message_info_uid(info));
+			r->subject = g_strdup(camel_message_info_subject(info));
+			r->flags = camel_message_info_flags(info);
+			r->size = camel_message_info_size(info);
+			r->date_sent = camel_message_info_date_sent(info);
+
+			check_msg(((r->flags & CAMEL_MESSAGE_ATTACHMENTS) != 0) == (i % 4 == 0),
+				  "message %d flags %08x", i, r->flags);
+			if (m > 0)
+				check_msg(!strcmp(r->uid, results[0][i].uid)
+					  && !strcmp(r->subject, results[0][i].subject)
+					  && r->flags == results[0][i].flags
+					  && r->size == results[0][i].size
+					  && r->date_sent == results[0][i].date_sent,
+					  "message %d uid %s '%s' %08x %u, on one thread %s '%s' %08x %u", i,
+					  r->uid, r->subject, r->flags, r->size, results[0][i].uid,
+					  results[0][i].subject, results[0][i].flags, results[0][i].size);
+		}
+		pull();
+
+		/* messages either side of where segments may have started */
+		push("reading messages back");
+		for (i=0;i<MAX_MESSAGES;i+=499)
+			check_subject(folder, results[m][i].uid, i);
+		check_subject(folder, results[m][MAX_MESSAGES-1].uid, MAX_MESSAGES-1);
+		pull();
+
+		camel_folder_free_summary(folder, infos);
+		check_unref(folder, 1);
+
+		camel_test_end();
+	}
+
+	unsetenv("CAMEL_MBOX_SUMMARY_THREADS");
+
+	check_unref(store, 1);
+	check_unref(session, 1);
+
+	camel_exception_free(ex);
+
+	for (m=0;m<MAX_MODES;m++) {
+		printf("%d messages, %.2f MB, %-7s threads %.3fs, %7.1f MB/s, %.2fx\n", MAX_MESSAGES, size / (1024.0 * 1024.0),
+		       modes[m] ? modes[m] : "default", times[m], size / times[m] / (1024 * 1024), times[0] / times[m]);
+
+		for (i=0;i<MAX_MESSAGES;i++) {
+			g_free(results[m][i].uid);
+			g_free(results[m][i].subject);
+		}
+		g_free(results[m]);
+	}
+
+	return 0;
+}
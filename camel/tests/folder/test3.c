@@ -76,6 +76,10 @@ static struct {
 
 	{ { 100, 50, 0 }, "(body-contains \"content\")" },
 	{ { 100, 50, 0 }, "(body-contains \"Content\")" },
+	{ { 100/13+1, 50/13+1, 0 }, "(and (body-contains \"content\") (user-flag \"every13\"))" },
+	{ { 1, 1, 0 }, "(and (body-contains \"data1\") (user-flag \"every13\"))" },
+	{ { 11, 6, 0 }, "(and (body-contains \"data1\") (header-contains \"subject\" \"subject\"))" },
+	{ { 0, 0, 0 }, "(and (body-contains \"nothere\") (header-contains \"subject\" \"subject\"))" },
 
 	{ { 0, 0, 0 }, "(user-flag \"every7\")" },
 	{ { 100/13+1, 50/13+1, 0 }, "(user-flag \"every13\")" },
@@ -0,0 +1,320 @@
+/* large multipart messages read from a file, content left in the file
+   and kept in memory, memory used and time to open and decode, and
+   decoding parts left in the file from several threads at once */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "camel-test.h"
+
+#include <camel/camel-mime-message.h>
+#include <camel/camel-mime-utils.h>
+#include <camel/camel-multipart.h>
+#include <camel/camel-stream-fs.h>
+#include <camel/camel-stream-mem.h>
+
+#define MESSAGE_PATH "/tmp/camel-test/big.msg"
+#define MAX_PARTS (40)
+#define PART_SIZE (512 * 1024)
+#define MAX_THREADS (4)
+
+static const char *modes[] = { "in file", "in memory" };
+#define MAX_MODES (sizeof(modes)/sizeof(modes[0]))
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* resident size of this process, if the kernel tells us */
+static gboolean
+rss_bytes(guint64 *rss)
+{
+	char line[128];
+	FILE *fp;
+	int found = 0;
+
+	if ((fp = fopen("/proc/self/status", "r")) == NULL)
+		return FALSE;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "VmRSS: %" G_GUINT64_FORMAT, rss) == 1) {
+			*rss *= 1024;
+			found++;
+		}
+	}
+	fclose(fp);
+
+	return found == 1;
+}
+
+/* the content of attachment i */
+static unsigned char *
+part_data(int i)
+{
+	unsigned char *data;
+	int j;
+
+	data = g_malloc(PART_SIZE);
+	for (j=0;j<PART_SIZE;j++)
+		data[j] = (j * 7 + i * 13 + (j >> 8)) & 0xff;
+
+	return data;
+}
+
+static void
+write_base64(FILE *fp, int i)
+{
+	unsigned char *data, *out;
+	int state = 0, save = 0;
+	size_t len;
+
+	data = part_data(i);
+	out = g_malloc(PART_SIZE * 2);
+	len = camel_base64_encode_close(data, PART_SIZE, TRUE, out, &state, &save);
+	fwrite(out, 1, len, fp);
+	g_free(out);
+	g_free(data);
+}
+
+/* a text part, MAX_PARTS attachments, and a forwarded message with one more */
+static void
+message_write(void)
+{
+	FILE *fp;
+	int i;
+
+	fp = fopen(MESSAGE_PATH, "w");
+	check_msg(fp != NULL, "cannot create %s", MESSAGE_PATH);
+	fprintf(fp, "From: Sender <sender@example.com>\n");
+	fprintf(fp, "To: list@example.com\n");
+	fprintf(fp, "Subject: big attachments\n");
+	fprintf(fp, "Message-Id: <big@example.com>\n");
+	fprintf(fp, "MIME-Version: 1.0\n");
+	fprintf(fp, "Content-Type: multipart/mixed; boundary=\"=-outer\"\n\n");
+	fprintf(fp, "This is a multi-part message in MIME format.\n");
+	fprintf(fp, "--=-outer\n");
+	fprintf(fp, "Content-Type: text/plain; charset=us-ascii\n");
+	fprintf(fp, "Content-Transfer-Encoding: quoted-printable\n\n");
+	fprintf(fp, "Some text =3D here\n");
+	for (i=0;i<MAX_PARTS;i++) {
+		fprintf(fp, "--=-outer\n");
+		fprintf(fp, "Content-Type: application/octet-stream; name=\"part%d.bin\"\n", i);
+		fprintf(fp, "Content-Disposition: attachment; filename=\"part%d.bin\"\n", i);
+		fprintf(fp, "Content-Transfer-Encoding: base64\n\n");
+		write_base64(fp, i);
+	}
+	fprintf(fp, "--=-outer\n");
+	fprintf(fp, "Content-Type: message/rfc822\n\n");
+	fprintf(fp, "Subject: forwarded\n");
+	fprintf(fp, "MIME-Version: 1.0\n");
+	fprintf(fp, "Content-Type: multipart/mixed; boundary=\"=-inner\"\n\n");
+	fprintf(fp, "--=-inner\n");
+	fprintf(fp, "Content-Type: application/octet-stream\n");
+	fprintf(fp, "Content-Transfer-Encoding: base64\n\n");
+	write_base64(fp, MAX_PARTS);
+	fprintf(fp, "--=-inner--\n");
+	fprintf(fp, "--=-outer--\n");
+	fclose(fp);
+}
+
+static void
+check_part(CamelMimePart *part, int i)
+{
+	CamelStreamMem *mem;
+	unsigned char *data;
+
+	mem = (CamelStreamMem *)camel_stream_mem_new();
+	camel_data_wrapper_decode_to_stream(camel_medium_get_content_object((CamelMedium *)part), (CamelStream *)mem);
+	check_msg(mem->buffer->len == PART_SIZE, "part %d decoded to %d bytes", i, mem->buffer->len);
+	data = part_data(i);
+	check_msg(memcmp(mem->buffer->data, data, PART_SIZE) == 0, "part %d decoded wrong", i);
+	g_free(data);
+	check_unref(mem, 1);
+}
+
+static void
+check_message(CamelMimeMessage *msg)
+{
+	CamelMultipart *mp;
+	CamelDataWrapper *content;
+	CamelStreamMem *mem;
+	CamelMimePart *part;
+	int i;
+
+	mp = (CamelMultipart *)camel_medium_get_content_object((CamelMedium *)msg);
+	check(CAMEL_IS_MULTIPART(mp));
+	check_msg(camel_multipart_get_number(mp) == MAX_PARTS + 2, "%d parts", camel_multipart_get_number(mp));
+
+	/* backwards, so every part has to go back in the file */
+	part = camel_multipart_get_part(mp, MAX_PARTS + 1);
+	content = camel_medium_get_content_object((CamelMedium *)part);
+	check(CAMEL_IS_MIME_MESSAGE(content));
+	check(!strcmp(camel_mime_message_get_subject((CamelMimeMessage *)content), "forwarded"));
+	content = camel_medium_get_content_object((CamelMedium *)content);
+	check(CAMEL_IS_MULTIPART(content));
+	check_part(camel_multipart_get_part((CamelMultipart *)content, 0), MAX_PARTS);
+
+	for (i=MAX_PARTS-1;i>=0;i--)
+		check_part(camel_multipart_get_part(mp, i + 1), i);
+
+	mem = (CamelStreamMem *)camel_stream_mem_new();
+	camel_data_wrapper_decode_to_stream(camel_medium_get_content_object((CamelMedium *)camel_multipart_get_part(mp, 0)), (CamelStream *)mem);
+	check_msg(mem->buffer->len >= 16 && !memcmp(mem->buffer->data, "Some text = here", 16),
+		  "text part '%.*s'", mem->buffer->len, mem->buffer->data);
+	check_unref(mem, 1);
+}
+
+struct _decode {
+	CamelMultipart *mp;
+	int first;
+	int bad;
+};
+
+/* decode every attachment, starting from a different one in each
+   thread, counting the ones that come out wrong */
+static void *
+decode_thread(void *data)
+{
+	struct _decode *dec = data;
+	CamelStreamMem *mem;
+	CamelMimePart *part;
+	unsigned char *expect;
+	int i, j;
+
+	for (j=0;j<MAX_PARTS;j++) {
+		i = (dec->first + j) % MAX_PARTS;
+		part = camel_multipart_get_part(dec->mp, i + 1);
+		mem = (CamelStreamMem *)camel_stream_mem_new();
+		camel_data_wrapper_decode_to_stream(camel_medium_get_content_object((CamelMedium *)part), (CamelStream *)mem);
+		expect = part_data(i);
+		if (mem->buffer->len != PART_SIZE || memcmp(mem->buffer->data, expect, PART_SIZE) != 0)
+			dec->bad++;
+		g_free(expect);
+		camel_object_unref(mem);
+	}
+
+	return NULL;
+}
+
+static void
+check_threads(CamelMimeMessage *msg)
+{
+	struct _decode dec[MAX_THREADS];
+	pthread_t id[MAX_THREADS];
+	int i;
+
+	for (i=0;i<MAX_THREADS;i++) {
+		dec[i].mp = (CamelMultipart *)camel_medium_get_content_object((CamelMedium *)msg);
+		dec[i].first = i * MAX_PARTS / MAX_THREADS;
+		dec[i].bad = 0;
+		check(pthread_create(&id[i], NULL, decode_thread, &dec[i]) == 0);
+	}
+
+	for (i=0;i<MAX_THREADS;i++) {
+		pthread_join(id[i], NULL);
+		check_msg(dec[i].bad == 0, "thread %d decoded %d parts wrong", i, dec[i].bad);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	double open_time[MAX_MODES], decode_time[MAX_MODES];
+	guint64 before, rss[MAX_MODES];
+	CamelMimeMessage *msg;
+	CamelStream *stream;
+	CamelStreamMem *mem;
+	GByteArray *written = NULL;
+	gboolean have_rss = TRUE;
+	int m;
+
+	camel_test_init(argc, argv);
+
+	camel_test_start("writing a large multipart message");
+	message_write();
+	camel_test_end();
+
+	for (m=0;m<MAX_MODES;m++) {
+		char *what = g_strdup_printf("large multipart message, content %s", modes[m]);
+
+		camel_test_start(what);
+		test_free(what);
+
+		if (m == 1)
+			setenv("CAMEL_MIME_DISABLE_LAZY", "1", 1);
+		else
+			unsetenv("CAMEL_MIME_DISABLE_LAZY");
+
+		push("opening the message");
+		have_rss &= rss_bytes(&before);
+		open_time[m] = now();
+		stream = camel_stream_fs_new_with_name(MESSAGE_PATH, O_RDONLY, 0);
+		check(stream != NULL);
+		msg = camel_mime_message_new();
+		check(camel_data_wrapper_construct_from_stream((CamelDataWrapper *)msg, stream) == 0);
+		camel_object_unref(stream);
+		open_time[m] = now() - open_time[m];
+		have_rss &= rss_bytes(&rss[m]);
+		rss[m] -= MIN(before, rss[m]);
+		pull();
+
+		push("decoding every part");
+		decode_time[m] = now();
+		check_message(msg);
+		decode_time[m] = now() - decode_time[m];
+		pull();
+
+		if (m == 0) {
+			push("decoding from %d threads at once", MAX_THREADS);
+			check_threads(msg);
+			pull();
+		}
+
+		push("writing the message back out");
+		mem = (CamelStreamMem *)camel_stream_mem_new();
+		camel_data_wrapper_write_to_stream((CamelDataWrapper *)msg, (CamelStream *)mem);
+		if (written == NULL) {
+			written = g_byte_array_new();
+			g_byte_array_append(written, mem->buffer->data, mem->buffer->len);
+		} else {
+			check_msg(written->len == mem->buffer->len
+				  && memcmp(written->data, mem->buffer->data, written->len) == 0,
+				  "%d bytes written, %d before", mem->buffer->len, written->len);
+		}
+		check_unref(mem, 1);
+		pull();
+
+		check_unref(msg, 1);
+
+		camel_test_end();
+	}
+
+	unsetenv("CAMEL_MIME_DISABLE_LAZY");
+	g_byte_array_free(written, TRUE);
+
+	if (have_rss) {
+		camel_test_start("large multipart message, memory in file against in memory");
+		check_msg(rss[0] * 4 < rss[1], "%" G_GUINT64_FORMAT " bytes in file, %" G_GUINT64_FORMAT " in memory", rss[0], rss[1]);
+		camel_test_end();
+	}
+
+	for (m=0;m<MAX_MODES;m++) {
+		if (have_rss)
+			printf("%d parts of %d bytes, content %-9s open %.3fs, %7.2f MB more resident, decode all %.3fs\n",
+			       MAX_PARTS + 1, PART_SIZE, modes[m], open_time[m], rss[m] / (1024.0 * 1024.0), decode_time[m]);
+		else
+			printf("%d parts of %d bytes, content %-9s open %.3fs, decode all %.3fs\n",
+			       MAX_PARTS + 1, PART_SIZE, modes[m], open_time[m], decode_time[m]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,179 @@
+/* mime parser throughput over a large mbox, with the old small read
+   window and the default one */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "camel-test.h"
+
+#include <camel/camel-mime-parser.h>
+#include <camel/camel-mime-utils.h>
+
+#define MBOX_PATH "/tmp/camel-test/parse.mbox"
+#define MAX_MESSAGES (4000)
+#define BODY_LINES (40)
+#define ATTACHMENT_SIZE (6 * 1024)
+
+static const char *modes[] = { "4096", NULL };
+#define MAX_MODES (sizeof(modes)/sizeof(modes[0]))
+
+struct _totals {
+	int messages;
+	int parts;
+	off_t from_sum;
+	size_t content;
+};
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* multipart messages, with body lines that start like boundaries and
+   From lines but aren't */
+static off_t
+mbox_write(void)
+{
+	unsigned char data[ATTACHMENT_SIZE], *out;
+	int state, save;
+	size_t len;
+	off_t size;
+	FILE *fp;
+	int i, j;
+
+	out = g_malloc(ATTACHMENT_SIZE * 2);
+
+	fp = fopen(MBOX_PATH, "w");
+	check_msg(fp != NULL, "cannot create %s", MBOX_PATH);
+	for (i=0;i<MAX_MESSAGES;i++) {
+		fprintf(fp, "From sender%d@example.com Mon Oct 13 12:%02d:00 2008\n", i % 10, i % 60);
+		fprintf(fp, "From: Sender %d <sender%d@example.com>\n", i % 10, i % 10);
+		fprintf(fp, "To: list@example.com\n");
+		fprintf(fp, "Subject: message %d\n", i);
+		fprintf(fp, "Message-Id: <%d@example.com>\n", i);
+		fprintf(fp, "MIME-Version: 1.0\n");
+		fprintf(fp, "Content-Type: multipart/mixed; boundary=\"=-part%d\"\n\n", i);
+		fprintf(fp, "--=-part%d\n", i);
+		fprintf(fp, "Content-Type: text/plain\n\n");
+		for (j=0;j<BODY_LINES;j++) {
+			if (j % 10 == 9)
+				fprintf(fp, "--=-part%d is not the boundary when it goes on like this\n", i + 1);
+			else if (j % 10 == 5)
+				fprintf(fp, "Fromage and other words that start with F, line %d\n", j);
+			else
+				fprintf(fp, "line %d of message %d, some text to make up the size\n", j, i);
+		}
+		fprintf(fp, "-- \nSender %d\n", i % 10);
+		fprintf(fp, "--=-part%d\n", i);
+		fprintf(fp, "Content-Type: application/octet-stream\n");
+		fprintf(fp, "Content-Transfer-Encoding: base64\n\n");
+		for (j=0;j<ATTACHMENT_SIZE;j++)
+			data[j] = (j * 7 + i * 13 + (j >> 8)) & 0xff;
+		state = save = 0;
+		len = camel_base64_encode_close(data, ATTACHMENT_SIZE, TRUE, out, &state, &save);
+		fwrite(out, 1, len, fp);
+		fprintf(fp, "--=-part%d--\n\n", i);
+	}
+	size = ftell(fp);
+	fclose(fp);
+	g_free(out);
+
+	return size;
+}
+
+static void
+mbox_parse(struct _totals *totals)
+{
+	CamelMimeParser *mp;
+	char *buf;
+	size_t len;
+	int fd;
+
+	memset(totals, 0, sizeof(*totals));
+
+	fd = open(MBOX_PATH, O_RDONLY);
+	check(fd != -1);
+	mp = camel_mime_parser_new();
+	camel_mime_parser_scan_from(mp, TRUE);
+	check(camel_mime_parser_init_with_fd(mp, fd) == 0);
+
+	while (camel_mime_parser_step(mp, &buf, &len) != CAMEL_MIME_PARSER_STATE_EOF) {
+		switch (camel_mime_parser_state(mp)) {
+		case CAMEL_MIME_PARSER_STATE_FROM:
+			totals->messages++;
+			totals->from_sum += camel_mime_parser_tell_start_from(mp);
+			break;
+		case CAMEL_MIME_PARSER_STATE_HEADER:
+		case CAMEL_MIME_PARSER_STATE_MULTIPART:
+			totals->parts++;
+			break;
+		case CAMEL_MIME_PARSER_STATE_BODY:
+			totals->content += len;
+			break;
+		default:
+			break;
+		}
+	}
+
+	check_unref(mp, 1);
+}
+
+int main(int argc, char **argv)
+{
+	struct _totals totals[MAX_MODES];
+	double times[MAX_MODES];
+	off_t size;
+	int m;
+
+	camel_test_init(argc, argv);
+
+	/* clear out any camel-test data */
+	system("/bin/rm -rf /tmp/camel-test");
+	system("/bin/mkdir /tmp/camel-test");
+
+	camel_test_start("writing a large mbox");
+	size = mbox_write();
+	camel_test_end();
+
+	for (m=0;m<MAX_MODES;m++) {
+		char *what = g_strdup_printf("parsing a large mbox, %s read window", modes[m] ? modes[m] : "default");
+
+		camel_test_start(what);
+		test_free(what);
+
+		if (modes[m])
+			setenv("CAMEL_MIME_PARSER_BUFFER", modes[m], 1);
+		else
+			unsetenv("CAMEL_MIME_PARSER_BUFFER");
+
+		times[m] = now();
+		mbox_parse(&totals[m]);
+		times[m] = now() - times[m];
+
+		check_msg(totals[m].messages == MAX_MESSAGES, "%d messages", totals[m].messages);
+		/* the message and its two parts */
+		check_msg(totals[m].parts == MAX_MESSAGES * 3, "%d parts", totals[m].parts);
+		if (m > 0)
+			check_msg(totals[m].from_sum == totals[0].from_sum && totals[m].content == totals[0].content,
+				  "content %d bytes, %d before", (int) totals[m].content, (int) totals[0].content);
+
+		camel_test_end();
+	}
+
+	unsetenv("CAMEL_MIME_PARSER_BUFFER");
+
+	for (m=0;m<MAX_MODES;m++)
+		printf("%d messages, %.2f MB, %-7s read window %.3fs, %7.1f MB/s\n", MAX_MESSAGES, size / (1024.0 * 1024.0),
+		       modes[m] ? modes[m] : "default", times[m], size / times[m] / (1024 * 1024));
+
+	return 0;
+}
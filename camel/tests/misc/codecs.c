@@ -0,0 +1,532 @@
+/* base64 and quoted-printable step functions against the byte at a
+   time versions, on random data in random steps, and their speed */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/time.h>
+
+#include "camel-test.h"
+
+#include <camel/camel-mime-utils.h>
+
+#define FUZZ_ROUNDS (2000)
+#define FUZZ_MAX (8192)
+#define FUZZ_STEP (300)
+
+#define BENCH_SIZE (12 * 1024 * 1024)	/* in whole base64 groups */
+#define BENCH_STEP (4096)	/* about what the mime parser hands a filter */
+#define BENCH_ROUNDS (4)
+
+static guint32 seed = 1;
+
+static guint32
+rnd(guint32 n)
+{
+	seed = seed * 1103515245 + 12345;
+
+	return (seed >> 8) % n;
+}
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* ********************************************************************** */
+
+/* camel_quoted_encode_step() and camel_quoted_decode_step() as they
+   were before they copied runs of plain text in one go */
+
+static const unsigned char tohex[16] = {
+	'0', '1', '2', '3', '4', '5', '6', '7',
+	'8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+static size_t
+quoted_encode_step_ref(unsigned char *in, size_t len, unsigned char *out, int *statep, int *save)
+{
+	register guchar *inptr, *outptr, *inend;
+	unsigned char c;
+	register int sofar = *save;
+	register int last = *statep;
+
+	inptr = in;
+	inend = in + len;
+	outptr = out;
+	while (inptr < inend) {
+		c = *inptr++;
+		if (c == '\r') {
+			if (last != -1) {
+				*outptr++ = '=';
+				*outptr++ = tohex[(last >> 4) & 0xf];
+				*outptr++ = tohex[last & 0xf];
+				sofar += 3;
+			}
+			last = c;
+		} else if (c == '\n') {
+			if (last != -1 && last != '\r') {
+				*outptr++ = '=';
+				*outptr++ = tohex[(last >> 4) & 0xf];
+				*outptr++ = tohex[last & 0xf];
+			}
+			*outptr++ = '\n';
+			sofar = 0;
+			last = -1;
+		} else {
+			if (last != -1) {
+				if (camel_mime_is_qpsafe(last)) {
+					*outptr++ = last;
+					sofar++;
+				} else {
+					*outptr++ = '=';
+					*outptr++ = tohex[(last >> 4) & 0xf];
+					*outptr++ = tohex[last & 0xf];
+					sofar += 3;
+				}
+			}
+
+			if (camel_mime_is_qpsafe(c)) {
+				if (sofar > 74) {
+					*outptr++ = '=';
+					*outptr++ = '\n';
+					sofar = 0;
+				}
+
+				if (c==' ' || c=='\t') {
+					last = c;
+				} else {
+					*outptr++ = c;
+					sofar++;
+					last = -1;
+				}
+			} else {
+				if (sofar > 72) {
+					*outptr++ = '=';
+					*outptr++ = '\n';
+					sofar = 3;
+				} else
+					sofar += 3;
+
+				*outptr++ = '=';
+				*outptr++ = tohex[(c >> 4) & 0xf];
+				*outptr++ = tohex[c & 0xf];
+				last = -1;
+			}
+		}
+	}
+	*save = sofar;
+	*statep = last;
+
+	return (outptr - out);
+}
+
+static size_t
+quoted_decode_step_ref(unsigned char *in, size_t len, unsigned char *out, int *savestate, int *saveme)
+{
+	register unsigned char *inptr, *outptr;
+	unsigned char *inend, c;
+	int state, save;
+
+	inend = in+len;
+	outptr = out;
+
+	state = *savestate;
+	save = *saveme;
+	inptr = in;
+	while (inptr<inend) {
+		switch (state) {
+		case 0:
+			while (inptr<inend) {
+				c = *inptr++;
+				if (c=='=') {
+					state = 1;
+					break;
+				} else {
+					*outptr++ = c;
+				}
+			}
+			break;
+		case 1:
+			c = *inptr++;
+			if (c=='\n') {
+				state = 0;
+			} else {
+				save = c;
+				state = 2;
+			}
+			break;
+		case 2:
+			c = *inptr++;
+			if (isxdigit(c) && isxdigit(save)) {
+				c = toupper(c);
+				save = toupper(save);
+				*outptr++ = (((save>='A'?save-'A'+10:save-'0')&0x0f) << 4)
+					| ((c>='A'?c-'A'+10:c-'0')&0x0f);
+			} else if (c=='\n' && save == '\r') {
+			} else {
+				*outptr++ = '=';
+				*outptr++ = save;
+				*outptr++ = c;
+			}
+			state = 0;
+			break;
+		}
+	}
+
+	*savestate = state;
+	*saveme = save;
+
+	return outptr-out;
+}
+
+/* ********************************************************************** */
+
+static void
+random_binary(unsigned char *data, size_t len)
+{
+	size_t i;
+
+	for (i=0;i<len;i++)
+		data[i] = rnd(256);
+}
+
+/* mostly plain text, with the things quoted-printable cares about */
+static void
+random_text(unsigned char *data, size_t len)
+{
+	static const char special[] = " \t\r\n=\x80\xe9\xff";
+	size_t i;
+	int r;
+
+	for (i=0;i<len;i++) {
+		r = rnd(100);
+		if (r < 80)
+			data[i] = 'a' + rnd(26);
+		else if (r < 98)
+			data[i] = special[rnd(sizeof(special) - 1)];
+		else
+			data[i] = rnd(256);
+	}
+}
+
+/* words and lines, mostly ascii, like the bodies quoted-printable
+   gets used for */
+static void
+random_prose(unsigned char *data, size_t len)
+{
+	static const char special[] = "=\t\xe9\xfc";
+	size_t i, line = 0, word = 0;
+	int r;
+
+	for (i=0;i<len;i++) {
+		r = rnd(1000);
+		if (line >= 60 + rnd(16)) {
+			data[i] = '\n';
+			line = word = 0;
+			continue;
+		} else if (word >= 2 + rnd(10)) {
+			data[i] = r < 100 ? ',' : ' ';
+			word = 0;
+		} else if (r < 10) {
+			data[i] = special[rnd(sizeof(special) - 1)];
+		} else {
+			data[i] = 'a' + rnd(26);
+			word++;
+		}
+		line++;
+	}
+}
+
+/* base64 text, with the kind of damage real mail has */
+static size_t
+random_base64(unsigned char *data, size_t len)
+{
+	static const char damage[] = "\r\n= -!\x80";
+	unsigned char *raw, *enc;
+	int state = 0, save = 0;
+	size_t n, i, o;
+
+	raw = g_malloc(len);
+	enc = g_malloc(len * 2 + 8);
+	random_binary(raw, len / 2);
+	n = g_base64_encode_step(raw, len / 2, TRUE, (char *) enc, &state, &save);
+	n += g_base64_encode_close(TRUE, (char *) enc + n, &state, &save);
+
+	for (i=0,o=0;i<n && o<len;i++) {
+		switch (rnd(rnd(2) ? 2000 : 50)) {
+		case 0:		/* drop one */
+			break;
+		case 1:
+			data[o++] = damage[rnd(sizeof(damage) - 1)];
+			if (o < len)
+				data[o++] = enc[i];
+			break;
+		default:
+			data[o++] = enc[i];
+		}
+	}
+
+	g_free(raw);
+	g_free(enc);
+
+	return o;
+}
+
+/* quoted-printable text, with broken escapes and soft breaks */
+static size_t
+random_quoted(unsigned char *data, size_t len)
+{
+	static const char damage[] = "=\r\nAFaz0 ";
+	unsigned char *text, *enc;
+	int state = -1, save = 0;
+	size_t n, i, o;
+
+	text = g_malloc(len);
+	enc = g_malloc(len * 4 + 4);
+	random_text(text, len / 2);
+	n = quoted_encode_step_ref(text, len / 2, enc, &state, &save);
+
+	for (i=0,o=0;i<n && o<len;i++) {
+		if (rnd(rnd(2) ? 2000 : 20) == 0)
+			data[o++] = damage[rnd(sizeof(damage) - 1)];
+		else
+			data[o++] = enc[i];
+	}
+
+	g_free(text);
+	g_free(enc);
+
+	return o;
+}
+
+/* ********************************************************************** */
+
+static void
+fuzz_base64_encode(unsigned char *in, size_t len, gboolean break_lines, unsigned char *out1, unsigned char *out2)
+{
+	int state1 = 0, save1 = 0, state2 = 0, save2 = 0;
+	size_t i, n, len1, len2;
+
+	for (i=0;i<len;i+=n) {
+		n = MIN(len - i, rnd(FUZZ_STEP));
+		len1 = g_base64_encode_step(in + i, n, break_lines, (char *) out1, &state1, &save1);
+		len2 = camel_base64_encode_step(in + i, n, break_lines, out2, &state2, &save2);
+		check_msg(len1 == len2 && memcmp(out1, out2, len1) == 0,
+			  "encoding %d bytes at %d: %d bytes '%.*s' != %d bytes '%.*s'",
+			  (int) n, (int) i, (int) len1, (int) len1, out1, (int) len2, (int) len2, out2);
+		check_msg(state1 == state2 && save1 == save2, "state %d/%08x != %d/%08x", state1, save1, state2, save2);
+	}
+
+	n = MIN(len, rnd(FUZZ_STEP));
+	len1 = g_base64_encode_step(in, n, break_lines, (char *) out1, &state1, &save1);
+	len1 += g_base64_encode_close(break_lines, (char *) out1 + len1, &state1, &save1);
+	len2 = camel_base64_encode_close(in, n, break_lines, out2, &state2, &save2);
+	check_msg(len1 == len2 && memcmp(out1, out2, len1) == 0, "closing '%.*s' != '%.*s'",
+		  (int) len1, out1, (int) len2, out2);
+	check(state1 == state2 && save1 == save2);
+}
+
+static void
+fuzz_base64_decode(unsigned char *in, size_t len, unsigned char *out1, unsigned char *out2)
+{
+	unsigned int save1 = 0, save2 = 0;
+	int state1 = 0, state2 = 0;
+	size_t i, n, len1, len2;
+
+	for (i=0;i<len;i+=n) {
+		n = MIN(len - i, rnd(FUZZ_STEP));
+		len1 = g_base64_decode_step((char *) in + i, n, out1, &state1, &save1);
+		len2 = camel_base64_decode_step(in + i, n, out2, &state2, &save2);
+		check_msg(len1 == len2 && memcmp(out1, out2, len1) == 0,
+			  "decoding '%.*s': %d bytes != %d bytes", (int) n, in + i, (int) len1, (int) len2);
+		check_msg(state1 == state2 && save1 == save2, "state %d/%08x != %d/%08x", state1, save1, state2, save2);
+	}
+}
+
+static void
+fuzz_quoted_encode(unsigned char *in, size_t len, unsigned char *out1, unsigned char *out2)
+{
+	int state1 = -1, save1 = 0, state2 = -1, save2 = 0;
+	size_t i, n, len1, len2;
+
+	for (i=0;i<len;i+=n) {
+		n = MIN(len - i, rnd(FUZZ_STEP));
+		len1 = quoted_encode_step_ref(in + i, n, out1, &state1, &save1);
+		len2 = camel_quoted_encode_step(in + i, n, out2, &state2, &save2);
+		check_msg(len1 == len2 && memcmp(out1, out2, len1) == 0,
+			  "encoding %d bytes at %d: %d bytes '%.*s' != %d bytes '%.*s'",
+			  (int) n, (int) i, (int) len1, (int) len1, out1, (int) len2, (int) len2, out2);
+		check_msg(state1 == state2 && save1 == save2, "state %d/%d != %d/%d", state1, save1, state2, save2);
+	}
+}
+
+static void
+fuzz_quoted_decode(unsigned char *in, size_t len, unsigned char *out1, unsigned char *out2)
+{
+	int state1 = 0, save1 = 0, state2 = 0, save2 = 0;
+	size_t i, n, len1, len2;
+
+	for (i=0;i<len;i+=n) {
+		n = MIN(len - i, rnd(FUZZ_STEP));
+		len1 = quoted_decode_step_ref(in + i, n, out1, &state1, &save1);
+		len2 = camel_quoted_decode_step(in + i, n, out2, &state2, &save2);
+		check_msg(len1 == len2 && memcmp(out1, out2, len1) == 0,
+			  "decoding '%.*s': %d bytes '%.*s' != %d bytes '%.*s'", (int) n, in + i,
+			  (int) len1, (int) len1, out1, (int) len2, (int) len2, out2);
+		check_msg(state1 == state2 && save1 == save2, "state %d/%d != %d/%d", state1, save1, state2, save2);
+	}
+}
+
+/* ********************************************************************** */
+
+enum {
+	BASE64_ENCODE,
+	BASE64_DECODE,
+	QUOTED_ENCODE,
+	QUOTED_DECODE,
+	MAX_CODECS
+};
+
+static const char *codecs[] = { "base64 encode", "base64 decode", "qp encode", "qp decode" };
+
+/* run a codec over the whole buffer a step at a time, the old way
+   or the new, and return the bytes out */
+static size_t
+bench_run(int codec, int fast, unsigned char *in, size_t len, unsigned char *out)
+{
+	unsigned int usave = 0;
+	int state, save = 0;
+	size_t i, n, o = 0;
+
+	state = codec == QUOTED_ENCODE ? -1 : 0;
+
+	for (i=0;i<len;i+=n) {
+		n = MIN(len - i, BENCH_STEP);
+		switch (codec) {
+		case BASE64_ENCODE:
+			o += fast ? camel_base64_encode_step(in + i, n, TRUE, out + o, &state, &save)
+				: g_base64_encode_step(in + i, n, TRUE, (char *) out + o, &state, &save);
+			break;
+		case BASE64_DECODE:
+			o += fast ? camel_base64_decode_step(in + i, n, out + o, &state, &usave)
+				: g_base64_decode_step((char *) in + i, n, out + o, &state, &usave);
+			break;
+		case QUOTED_ENCODE:
+			o += fast ? camel_quoted_encode_step(in + i, n, out + o, &state, &save)
+				: quoted_encode_step_ref(in + i, n, out + o, &state, &save);
+			break;
+		case QUOTED_DECODE:
+			o += fast ? camel_quoted_decode_step(in + i, n, out + o, &state, &save)
+				: quoted_decode_step_ref(in + i, n, out + o, &state, &save);
+			break;
+		}
+	}
+
+	return o;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char *in, *out1, *out2, *enc;
+	double times[MAX_CODECS][2];
+	size_t len, enclen, out1len = 0, out2len;
+	int i, c, f;
+
+	camel_test_init(argc, argv);
+
+	in = g_malloc(FUZZ_MAX);
+	out1 = g_malloc(FUZZ_MAX * 4 + 16);
+	out2 = g_malloc(FUZZ_MAX * 4 + 16);
+
+	camel_test_start("base64 step functions against glib");
+	for (i=0;i<FUZZ_ROUNDS;i++) {
+		push("round %d", i);
+		len = rnd(FUZZ_MAX);
+		random_binary(in, len);
+		fuzz_base64_encode(in, len, TRUE, out1, out2);
+		fuzz_base64_encode(in, len, FALSE, out1, out2);
+		len = random_base64(in, FUZZ_MAX);
+		fuzz_base64_decode(in, len, out1, out2);
+		pull();
+	}
+	camel_test_end();
+
+	camel_test_start("quoted-printable step functions against byte at a time");
+	for (i=0;i<FUZZ_ROUNDS;i++) {
+		push("round %d", i);
+		len = rnd(FUZZ_MAX);
+		random_text(in, len);
+		fuzz_quoted_encode(in, len, out1, out2);
+		random_prose(in, len);
+		fuzz_quoted_encode(in, len, out1, out2);
+		random_binary(in, len);
+		fuzz_quoted_encode(in, len, out1, out2);
+		len = random_quoted(in, FUZZ_MAX);
+		fuzz_quoted_decode(in, len, out1, out2);
+		pull();
+	}
+	camel_test_end();
+
+	g_free(in);
+	g_free(out1);
+	g_free(out2);
+
+	in = g_malloc(BENCH_SIZE);
+	enc = g_malloc(BENCH_SIZE * 4 + 16);
+	out1 = g_malloc(BENCH_SIZE * 4 + 16);
+	out2 = g_malloc(BENCH_SIZE * 4 + 16);
+
+	for (c=0;c<MAX_CODECS;c++) {
+		char *what = g_strdup_printf("%s, %d bytes %d at a time", codecs[c], BENCH_SIZE, BENCH_STEP);
+
+		camel_test_start(what);
+		test_free(what);
+
+		/* binary for base64, mail text for quoted-printable, and
+		   encoded with the old code for the decoders */
+		if (c == BASE64_ENCODE || c == BASE64_DECODE)
+			random_binary(in, BENCH_SIZE);
+		else
+			random_prose(in, BENCH_SIZE);
+		if (c == BASE64_DECODE || c == QUOTED_DECODE) {
+			enclen = bench_run(c - 1, FALSE, in, BENCH_SIZE, enc);
+		} else {
+			memcpy(enc, in, BENCH_SIZE);
+			enclen = BENCH_SIZE;
+		}
+
+		for (f=0;f<2;f++) {
+			times[c][f] = now();
+			for (i=0;i<BENCH_ROUNDS;i++)
+				out2len = bench_run(c, f, enc, enclen, f ? out2 : out1);
+			times[c][f] = (now() - times[c][f]) / BENCH_ROUNDS;
+			if (f == 0)
+				out1len = out2len;
+		}
+
+		check_msg(out1len == out2len && memcmp(out1, out2, out1len) == 0, "%d bytes != %d bytes", (int) out1len, (int) out2len);
+		if (c == BASE64_DECODE)
+			check(out2len == BENCH_SIZE && memcmp(out2, in, BENCH_SIZE) == 0);
+
+		camel_test_end();
+	}
+
+	g_free(in);
+	g_free(enc);
+	g_free(out1);
+	g_free(out2);
+
+	for (c=0;c<MAX_CODECS;c++)
+		printf("%-14s byte at a time %7.1f MB/s, camel %7.1f MB/s (%.1fx)\n", codecs[c],
+		       BENCH_SIZE / times[c][0] / (1024 * 1024), BENCH_SIZE / times[c][1] / (1024 * 1024),
+		       times[c][0] / times[c][1]);
+
+	return 0;
+}
@@ -0,0 +1,138 @@
+/* data cache size limit, least recently used items expired first, and reopening from the manifest or by scanning */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "camel-test.h"
+
+#include <camel/camel-data-cache.h>
+
+#define CACHE_PATH "/tmp/camel-test/datacache"
+#define MAX_ITEMS (2000)
+#define ITEM_SIZE (4096)
+#define MAX_SIZE (ITEM_SIZE * 200)
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int
+cached_items(CamelDataCache *cdc)
+{
+	CamelStream *stream;
+	char key[16];
+	int i, count = 0;
+
+	for (i=0;i<MAX_ITEMS;i++) {
+		sprintf(key, "item%d", i);
+		stream = camel_data_cache_get(cdc, "items", key, NULL);
+		if (stream) {
+			count++;
+			camel_object_unref(stream);
+		}
+	}
+
+	return count;
+}
+
+static double
+reopen(CamelDataCache **cdc)
+{
+	CamelException *ex = camel_exception_new();
+	double start;
+
+	*cdc = camel_data_cache_new(CACHE_PATH, 0, ex);
+	check_msg(*cdc != NULL, "%s", camel_exception_get_description(ex));
+	start = now();
+	camel_data_cache_set_expire_size(*cdc, MAX_SIZE);
+	start = now() - start;
+	camel_exception_free(ex);
+
+	return start;
+}
+
+int main(int argc, char **argv)
+{
+	CamelDataCache *cdc;
+	CamelStream *stream;
+	char key[16], data[ITEM_SIZE];
+	guint32 hits, misses, expired;
+	double add_time, load_time, scan_time;
+	int i, count;
+
+	camel_test_init(argc, argv);
+
+	system("/bin/rm -rf /tmp/camel-test");
+	system("/bin/mkdir /tmp/camel-test");
+
+	memset(data, 'x', sizeof(data));
+
+	camel_test_start("data cache size limit");
+
+	push("adding %d items of %d bytes, limit %d bytes", MAX_ITEMS, ITEM_SIZE, MAX_SIZE);
+	reopen(&cdc);
+	add_time = now();
+	for (i=0;i<MAX_ITEMS;i++) {
+		sprintf(key, "item%d", i);
+		stream = camel_data_cache_add(cdc, "items", key, NULL);
+		check(stream != NULL);
+		check(camel_stream_write(stream, data, sizeof(data)) == sizeof(data));
+		camel_object_unref(stream);
+
+		/* keep the first one in use */
+		stream = camel_data_cache_get(cdc, "items", "item0", NULL);
+		check_msg(stream != NULL, "item0 expired adding item%d", i);
+		camel_object_unref(stream);
+	}
+	add_time = now() - add_time;
+	pull();
+
+	push("checking the least recently used were expired");
+	count = cached_items(cdc);
+	check_msg(count * ITEM_SIZE <= MAX_SIZE, "%d items still cached", count);
+	check_msg(count * ITEM_SIZE > MAX_SIZE / 2, "only %d items still cached", count);
+	sprintf(key, "item%d", MAX_ITEMS - 1);
+	stream = camel_data_cache_get(cdc, "items", key, NULL);
+	check_msg(stream != NULL, "most recent item expired");
+	camel_object_unref(stream);
+	camel_data_cache_get_stats(cdc, &hits, &misses, &expired);
+	check(hits == MAX_ITEMS + count + 1);
+	check(misses == MAX_ITEMS - count);
+	check_msg(expired == MAX_ITEMS - count, "%d expired, %d cached", expired, count);
+	check_unref(cdc, 1);
+	pull();
+
+	push("reopening from the manifest");
+	check(g_file_test(CACHE_PATH "/.cache-manifest", G_FILE_TEST_EXISTS));
+	load_time = reopen(&cdc);
+	check(cached_items(cdc) == count);
+	check_unref(cdc, 1);
+	pull();
+
+	push("reopening by scanning the cache");
+	check(g_unlink(CACHE_PATH "/.cache-manifest") == 0);
+	scan_time = reopen(&cdc);
+	check(cached_items(cdc) == count);
+	check_unref(cdc, 1);
+	pull();
+
+	printf("%d items added with a limit of %d: %.3fs, %d kept; opening %d items from the manifest %.4fs, by scanning %.4fs\n",
+	       MAX_ITEMS, MAX_SIZE / ITEM_SIZE, add_time, count, count, load_time, scan_time);
+
+	camel_test_end();
+
+	return 0;
+}
@@ -0,0 +1,316 @@
+/* deflate stream read a few bytes at a time, and against a loopback
+   server, header fetches sent plain and compressed, bytes on the wire
+   and throughput */
+
+#include <config.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "camel-test.h"
+
+#include <camel/camel-stream-buffer.h>
+#include <camel/camel-stream-deflate.h>
+#include <camel/camel-stream-fs.h>
+#include <camel/camel-stream-mem.h>
+
+#define MAX_FETCHES (20)
+#define RUN_SIZE (65536)
+#define FETCH_MESSAGES (500)
+#define HEADER_LINES (7)
+
+static const char *modes[] = { "plain", "compressed" };
+#define MAX_MODES (sizeof(modes)/sizeof(modes[0]))
+
+/* the header lines of message i, much as an IMAP server would send
+   them for a summary update */
+static void
+header_line(int i, int line, char *buf)
+{
+	static const char *days[] = { "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun" };
+
+	switch (line) {
+	case 0:
+		sprintf(buf, "* %d FETCH (UID %d RFC822.SIZE %d BODY[HEADER.FIELDS (DATE FROM TO SUBJECT MESSAGE-ID)] {%d}",
+			i + 1, i + 1001, 2000 + (i * 37) % 5000, 200 + i % 50);
+		break;
+	case 1:
+		sprintf(buf, "Date: %s, %d Oct 2008 %02d:%02d:%02d +0000", days[i % 7], 1 + i % 28, i % 24, i % 60, (i * 7) % 60);
+		break;
+	case 2:
+		sprintf(buf, "From: Person %d <person%d@example.com>", i % 97, i % 97);
+		break;
+	case 3:
+		sprintf(buf, "To: list-%d@lists.example.com", i % 5);
+		break;
+	case 4:
+		sprintf(buf, "Subject: Re: [list-%d] weekly status report %d", i % 5, i / 10);
+		break;
+	case 5:
+		sprintf(buf, "Message-ID: <%d.%d.camel@host%d.example.com>", i * 7919, i % 13, i % 11);
+		break;
+	default:
+		strcpy(buf, ")");
+		break;
+	}
+}
+
+/* ********************************************************************** */
+
+/* The stand-in server.  It answers "COMPRESS" by switching both ways
+   to deflate, "FETCH first count" with the header lines of count
+   messages and an "OK", and "QUIT" with the number of bytes it has
+   written to the socket. */
+
+static void
+server_session(int fd)
+{
+	CamelStream *in, *out, *mem, *raw;
+	unsigned long wire = 0;
+	char *line, buf[256];
+	int first, count, i, j;
+
+	raw = camel_stream_fs_new_with_fd(dup(fd));
+	in = camel_stream_buffer_new(raw, CAMEL_STREAM_BUFFER_READ);
+	mem = camel_stream_mem_new();
+	out = mem;
+	camel_object_ref(out);
+
+	while ((line = camel_stream_buffer_read_line((CamelStreamBuffer *)in))) {
+		if (!strcmp(line, "COMPRESS")) {
+			write(fd, "OK\r\n", 4);
+			wire += 4;
+			camel_object_unref(in);
+			in = camel_stream_deflate_new(raw);
+			camel_object_unref(raw);
+			raw = in;
+			in = camel_stream_buffer_new(raw, CAMEL_STREAM_BUFFER_READ);
+			camel_object_unref(out);
+			out = camel_stream_deflate_new(mem);
+		} else if (sscanf(line, "FETCH %d %d", &first, &count) == 2) {
+			for (i=first;i<first+count;i++) {
+				for (j=0;j<HEADER_LINES;j++) {
+					header_line(i, j, buf);
+					strcat(buf, "\r\n");
+					camel_stream_write(out, buf, strlen(buf));
+				}
+			}
+			camel_stream_write(out, "OK\r\n", 4);
+		} else if (!strcmp(line, "QUIT")) {
+			sprintf(buf, "BYE %lu\r\n", wire);
+			camel_stream_write(out, buf, strlen(buf));
+		}
+		g_free(line);
+
+		/* what went out for this command */
+		if (((CamelStreamMem *)mem)->buffer->len) {
+			write(fd, ((CamelStreamMem *)mem)->buffer->data, ((CamelStreamMem *)mem)->buffer->len);
+			wire += ((CamelStreamMem *)mem)->buffer->len;
+			g_byte_array_set_size(((CamelStreamMem *)mem)->buffer, 0);
+			camel_stream_reset(mem);
+		}
+	}
+
+	camel_object_unref(in);
+	camel_object_unref(raw);
+	camel_object_unref(out);
+	camel_object_unref(mem);
+	close(fd);
+}
+
+static pid_t
+server_start(int *port)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	pid_t pid;
+	int fd, conn;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 || listen(fd, 1) == -1
+	    || getsockname(fd, (struct sockaddr *)&sin, &len) == -1) {
+		camel_test_fail("Cannot listen for the test server: %s", g_strerror(errno));
+		return -1;
+	}
+	*port = ntohs(sin.sin_port);
+
+	pid = fork();
+	if (pid != 0) {
+		close(fd);
+		return pid;
+	}
+
+	while ((conn = accept(fd, NULL, NULL)) != -1)
+		server_session(conn);
+
+	_exit(0);
+}
+
+/* ********************************************************************** */
+
+/* a long run compresses to a few bytes which inflate to far more than
+   one small read, so zlib is left holding output with no input left */
+static void
+small_reads(void)
+{
+	CamelStream *mem, *ds;
+	char buf[16], *run;
+	ssize_t len;
+	size_t total = 0;
+
+	run = g_malloc(RUN_SIZE);
+	memset(run, 'x', RUN_SIZE);
+
+	mem = camel_stream_mem_new();
+	ds = camel_stream_deflate_new(mem);
+	check(camel_stream_write(ds, run, RUN_SIZE) == RUN_SIZE);
+	check_unref(ds, 1);
+	camel_stream_reset(mem);
+
+	ds = camel_stream_deflate_new(mem);
+	while ((len = camel_stream_read(ds, buf, sizeof(buf))) > 0) {
+		check(memcmp(buf, run, len) == 0);
+		total += len;
+	}
+	check(len == 0);
+	check_msg(total == RUN_SIZE, "read %lu bytes of %d", (unsigned long)total, RUN_SIZE);
+
+	check_unref(ds, 1);
+	check_unref(mem, 1);
+	g_free(run);
+}
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int
+client_connect(int port)
+{
+	struct sockaddr_in sin;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+	if (fd == -1 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+		camel_test_fail("Cannot connect to the test server: %s", g_strerror(errno));
+		return -1;
+	}
+
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long wire[MAX_MODES], text = 0;
+	double times[MAX_MODES];
+	CamelStream *stream, *in, *deflate;
+	char *line, buf[256], cmd[64];
+	int i, j, k, m, fd, port;
+	pid_t pid;
+
+	camel_test_init(argc, argv);
+
+	camel_test_start("deflate stream, small reads");
+	small_reads();
+	camel_test_end();
+
+	pid = server_start(&port);
+
+	for (m=0;m<MAX_MODES;m++) {
+		char *what = g_strdup_printf("deflate stream, %s header fetches", modes[m]);
+
+		camel_test_start(what);
+		test_free(what);
+
+		fd = client_connect(port);
+		stream = camel_stream_fs_new_with_fd(fd);
+
+		if (m == 1) {
+			push("starting compression");
+			check(camel_stream_write(stream, "COMPRESS\r\n", 10) == 10);
+			in = camel_stream_buffer_new(stream, CAMEL_STREAM_BUFFER_READ);
+			line = camel_stream_buffer_read_line((CamelStreamBuffer *)in);
+			check(line != NULL && !strcmp(line, "OK"));
+			g_free(line);
+			camel_object_unref(in);
+			deflate = camel_stream_deflate_new(stream);
+			check(deflate != NULL);
+			camel_object_unref(stream);
+			stream = deflate;
+			pull();
+		}
+
+		in = camel_stream_buffer_new(stream, CAMEL_STREAM_BUFFER_READ);
+
+		push("fetching %d headers %d at a time", MAX_FETCHES * FETCH_MESSAGES, FETCH_MESSAGES);
+		times[m] = now();
+		for (i=0;i<MAX_FETCHES;i++) {
+			sprintf(cmd, "FETCH %d %d\r\n", i * FETCH_MESSAGES, FETCH_MESSAGES);
+			check(camel_stream_write(stream, cmd, strlen(cmd)) == strlen(cmd));
+			for (j=i*FETCH_MESSAGES;j<(i+1)*FETCH_MESSAGES;j++) {
+				for (k=0;k<HEADER_LINES;k++) {
+					line = camel_stream_buffer_read_line((CamelStreamBuffer *)in);
+					check_msg(line != NULL, "message %d line %d missing", j, k);
+					header_line(j, k, buf);
+					check_msg(!strcmp(line, buf), "message %d line %d: '%s' != '%s'", j, k, line, buf);
+					if (m == 0)
+						text += strlen(line) + 2;
+					g_free(line);
+				}
+			}
+			line = camel_stream_buffer_read_line((CamelStreamBuffer *)in);
+			check(line != NULL && !strcmp(line, "OK"));
+			g_free(line);
+		}
+		times[m] = now() - times[m];
+		pull();
+
+		push("counting the bytes sent");
+		check(camel_stream_write(stream, "QUIT\r\n", 6) == 6);
+		line = camel_stream_buffer_read_line((CamelStreamBuffer *)in);
+		check(line != NULL && sscanf(line, "BYE %lu", &wire[m]) == 1);
+		g_free(line);
+		pull();
+
+		check_unref(in, 1);
+		check_unref(stream, 1);
+
+		camel_test_end();
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	camel_test_start("deflate stream compression ratio");
+	check_msg(wire[1] * 3 < wire[0], "%lu bytes compressed, %lu plain", wire[1], wire[0]);
+	camel_test_end();
+
+	for (m=0;m<MAX_MODES;m++)
+		printf("%-10s %lu bytes of headers as %lu bytes on the wire (%.1fx), %.3fs, %.1f MB/s\n",
+		       modes[m], text, wire[m], (double) text / wire[m], times[m], text / times[m] / (1024 * 1024));
+
+	return 0;
+}
@@ -0,0 +1,161 @@
+/* key file posting lists, size and read time of raw and packed records */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <glib.h>
+
+#include "camel-test.h"
+
+#include <camel/camel-block-file.h>
+
+#define RAW_PATH "/tmp/camel-test/keys-raw"
+#define PACKED_PATH "/tmp/camel-test/keys-packed"
+#define MAX_LISTS (2000)
+#define MAX_RECORD (32)
+
+static camel_block_t heads[MAX_LISTS];
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static off_t
+file_size(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) == -1)
+		return 0;
+
+	return st.st_size;
+}
+
+/* names like the text index allocates them, 1024 to a block, and
+   lists from a few names for rare words to most names for common ones */
+static int
+list_keys(int list, camel_key_t *keys)
+{
+	int i, len = 0, step = list % 97 + 1;
+
+	for (i=0;i<20000;i+=step)
+		keys[len++] = ((i / 1000 + 1) << 10) | (i % 1000);
+
+	/* names aren't always added in order */
+	if (list & 1 && len > 2) {
+		camel_key_t tmp = keys[0];
+
+		keys[0] = keys[len/2];
+		keys[len/2] = tmp;
+	}
+
+	return len;
+}
+
+static void
+keys_write(const char *path, gboolean packed)
+{
+	CamelKeyFile *kf;
+	camel_key_t keys[20000];
+	int i, j, len;
+
+	kf = camel_key_file_new(path, O_CREAT|O_RDWR|O_TRUNC, "KEYS.TST");
+	check(kf != NULL);
+	camel_key_file_set_packed(kf, packed);
+
+	for (i=0;i<MAX_LISTS;i++) {
+		heads[i] = 0;
+		len = list_keys(i, keys);
+		for (j=0;j<len;j+=MAX_RECORD)
+			check(camel_key_file_write(kf, &heads[i], MIN(MAX_RECORD, len-j), keys+j) != -1);
+	}
+
+	check_unref(kf, 1);
+}
+
+static void
+keys_read(const char *path)
+{
+	CamelKeyFile *kf;
+	camel_key_t keys[20000], *records;
+	camel_block_t next;
+	size_t count;
+	int i, j, len;
+
+	kf = camel_key_file_new(path, O_RDONLY, "KEYS.TST");
+	check(kf != NULL);
+
+	for (i=0;i<MAX_LISTS;i++) {
+		len = list_keys(i, keys);
+		next = heads[i];
+		/* records come back last written first */
+		j = ((len - 1) / MAX_RECORD) * MAX_RECORD;
+		while (next != 0) {
+			check(camel_key_file_read(kf, &next, &count, &records) == 0);
+			check(count == MIN(MAX_RECORD, len-j));
+			check(memcmp(records, keys+j, count * sizeof(records[0])) == 0);
+			g_free(records);
+			j -= MAX_RECORD;
+		}
+		check(j == -MAX_RECORD);
+	}
+
+	check_unref(kf, 1);
+}
+
+int main(int argc, char **argv)
+{
+	double start, raw_time, packed_time;
+	off_t raw_size, packed_size;
+
+	camel_test_init(argc, argv);
+
+	system("/bin/rm -rf /tmp/camel-test");
+	system("/bin/mkdir /tmp/camel-test");
+
+	camel_test_start("Key file posting lists");
+
+	push("writing and reading raw records");
+	keys_write(RAW_PATH, FALSE);
+	raw_size = file_size(RAW_PATH);
+	start = now();
+	keys_read(RAW_PATH);
+	raw_time = now() - start;
+	pull();
+
+	push("writing and reading packed records");
+	keys_write(PACKED_PATH, TRUE);
+	packed_size = file_size(PACKED_PATH);
+	start = now();
+	keys_read(PACKED_PATH);
+	packed_time = now() - start;
+	check_msg(packed_size < raw_size / 2, "packed %ld bytes, raw %ld bytes", (long)packed_size, (long)raw_size);
+	pull();
+
+	push("opening with another header");
+	check(camel_key_file_new(PACKED_PATH, O_RDONLY, "KEYS.OLD") == NULL);
+	check(errno == EINVAL);
+	check(camel_key_file_new(PACKED_PATH, O_RDWR, "KEYS.OLD") == NULL);
+	check(file_size(PACKED_PATH) == packed_size);
+	pull();
+
+	printf("%d posting lists: raw %ld bytes read in %.3fs, packed %ld bytes read in %.3fs\n",
+	       MAX_LISTS, (long)raw_size, raw_time, (long)packed_size, packed_time);
+
+	camel_test_end();
+
+	return 0;
+}
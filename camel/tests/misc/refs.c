@@ -0,0 +1,189 @@
+/* object and message info ref and unref from many threads at once,
+   the last unref racing lookups in a bag, and ref/unref speed */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <glib.h>
+
+#include "camel-test.h"
+
+#include <camel/camel-folder-summary.h>
+#include <camel/camel-object.h>
+
+#define MAX_THREADS (8)
+#define MAX_REFS (500000)	/* per thread */
+#define MAX_HOLD (4)		/* refs each thread holds at once */
+#define MAX_BAG_ROUNDS (200)
+
+enum {
+	REF_OBJECT,
+	REF_INFO,
+	REF_SUMMARY_INFO,
+	MAX_KINDS
+};
+
+static const char *kinds[] = { "object", "message info", "summary message info" };
+
+static void *shared[MAX_KINDS];
+static CamelObjectBag *bag;
+static volatile int bag_done;
+static int finalised;
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void *
+ref_thread(void *data)
+{
+	int kind = GPOINTER_TO_INT(data);
+	void *o = shared[kind];
+	int i, j;
+
+	for (i=0;i<MAX_REFS;i+=MAX_HOLD) {
+		for (j=0;j<MAX_HOLD;j++) {
+			if (kind == REF_OBJECT)
+				camel_object_ref(o);
+			else
+				camel_message_info_ref(o);
+		}
+		for (j=0;j<MAX_HOLD;j++) {
+			if (kind == REF_OBJECT)
+				camel_object_unref(o);
+			else
+				camel_message_info_free(o);
+		}
+	}
+
+	return NULL;
+}
+
+/* ref and unref the shared item from @count threads at once */
+static double
+ref_run(int kind, int count)
+{
+	pthread_t id[MAX_THREADS];
+	double start;
+	int i;
+
+	start = now();
+	for (i=0;i<count;i++)
+		check(pthread_create(&id[i], NULL, ref_thread, GINT_TO_POINTER(kind)) == 0);
+	for (i=0;i<count;i++)
+		pthread_join(id[i], NULL);
+
+	return now() - start;
+}
+
+static void
+object_finalised(CamelObject *o, void *event_data, void *data)
+{
+	finalised++;
+}
+
+/* keep looking the object up and dropping it until it's gone */
+static void *
+bag_thread(void *data)
+{
+	CamelObject *o;
+
+	while (!bag_done) {
+		if ((o = camel_object_bag_peek(bag, "object")) != NULL) {
+			check(CAMEL_IS_OBJECT(o));
+			camel_object_unref(o);
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	double times[MAX_KINDS][2];
+	CamelFolderSummary *summary;
+	CamelObject *o;
+	pthread_t id[MAX_THREADS];
+	int i, k, round;
+
+	camel_test_init(argc, argv);
+
+	shared[REF_OBJECT] = camel_object_new(camel_object_get_type());
+	shared[REF_INFO] = camel_message_info_new(NULL);
+	summary = camel_folder_summary_new(NULL);
+	shared[REF_SUMMARY_INFO] = camel_message_info_new(summary);
+
+	for (k=0;k<MAX_KINDS;k++) {
+		char *what = g_strdup_printf("%s ref and unref from %d threads", kinds[k], MAX_THREADS);
+
+		camel_test_start(what);
+		test_free(what);
+
+		times[k][0] = ref_run(k, 1);
+		times[k][1] = ref_run(k, MAX_THREADS);
+
+		if (k == REF_OBJECT)
+			check_msg(((CamelObject *)shared[k])->ref_count == 1, "ref count %d", ((CamelObject *)shared[k])->ref_count);
+		else
+			check_msg(((CamelMessageInfo *)shared[k])->refcount == 1, "ref count %d", ((CamelMessageInfo *)shared[k])->refcount);
+
+		camel_test_end();
+	}
+
+	camel_object_unref(shared[REF_OBJECT]);
+	camel_message_info_free(shared[REF_INFO]);
+	camel_message_info_free(shared[REF_SUMMARY_INFO]);
+	check_unref(summary, 1);
+
+	camel_test_start("last unref racing lookups in a bag");
+	bag = camel_object_bag_new(g_str_hash, g_str_equal, (CamelCopyFunc)g_strdup, g_free);
+	for (round=0;round<MAX_BAG_ROUNDS;round++) {
+		push("round %d", round);
+
+		finalised = 0;
+		o = camel_object_new(camel_object_get_type());
+		camel_object_hook_event(o, "finalize", object_finalised, NULL);
+		check(camel_object_bag_reserve(bag, "object") == NULL);
+		camel_object_bag_add(bag, "object", o);
+
+		bag_done = FALSE;
+		for (i=0;i<MAX_THREADS;i++)
+			check(pthread_create(&id[i], NULL, bag_thread, NULL) == 0);
+
+		/* let them get going, then drop the only ref we own, one
+		   of them may end up with the last one */
+		g_usleep(100);
+		camel_object_unref(o);
+		g_usleep(100);
+
+		bag_done = TRUE;
+		for (i=0;i<MAX_THREADS;i++)
+			pthread_join(id[i], NULL);
+
+		check(camel_object_bag_peek(bag, "object") == NULL);
+
+		check_msg(finalised == 1, "finalised %d times", finalised);
+
+		pull();
+	}
+	camel_object_bag_destroy(bag);
+	camel_test_end();
+
+	for (k=0;k<MAX_KINDS;k++)
+		printf("%-20s %d refs, 1 thread %6.1f M/s, %d threads %6.1f M/s\n", kinds[k], MAX_REFS * 2,
+		       MAX_REFS * 2 / times[k][0] / 1000000.0, MAX_THREADS,
+		       MAX_REFS * 2 * MAX_THREADS / times[k][1] / 1000000.0);
+
+	return 0;
+}
@@ -0,0 +1,441 @@
+/* SMTP sending against a stand-in server, round trips for a big
+   distribution list sent lock-step, with PIPELINING and with CHUNKING,
+   and the message as the server received it */
+
+#include <config.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "camel-test.h"
+#include "camel-test-provider.h"
+#include "session.h"
+
+#include <camel/camel-exception.h>
+#include <camel/camel-internet-address.h>
+#include <camel/camel-mime-filter-crlf.h>
+#include <camel/camel-mime-message.h>
+#include <camel/camel-stream-filter.h>
+#include <camel/camel-stream-mem.h>
+#include <camel/camel-transport.h>
+
+#define RESULT_PATH "/tmp/camel-test/smtp-result"
+#define BODY_PATH "/tmp/camel-test/smtp-body"
+#define MAX_RECIPIENTS (300)
+#define BODY_LINES (20000)
+
+static const char *smtp_drivers[] = { "smtp" };
+
+static const char *modes[] = { "plain", "pipelining", "chunking" };
+#define MAX_MODES (sizeof(modes)/sizeof(modes[0]))
+
+/* ********************************************************************** */
+
+/* The stand-in server.  It is forked listening on a port on the
+   loopback, and answers one connection at a time.  Replies are only
+   written when it runs out of input, as a pipelining server does, so
+   each write is a round trip for the client.  When a message has been
+   received the round trips since its MAIL FROM, the number of
+   recipients and the body size are written to RESULT_PATH, and the
+   body to BODY_PATH.  Recipients containing "reject" are refused. */
+
+static int server_pipelining, server_chunking;
+
+static struct {
+	int fd;
+	char in[65536];
+	int inpos, inlen;
+	GString *out;
+	int txn, rounds, rcpts;
+	GString *body;
+} server;
+
+static int
+server_fill(void)
+{
+	ssize_t len;
+
+	if (server.out->len) {
+		if (write(server.fd, server.out->str, server.out->len) != server.out->len)
+			return -1;
+		g_string_truncate(server.out, 0);
+		if (server.txn)
+			server.rounds++;
+	}
+
+	memmove(server.in, server.in + server.inpos, server.inlen - server.inpos);
+	server.inlen -= server.inpos;
+	server.inpos = 0;
+
+	do {
+		len = read(server.fd, server.in + server.inlen, sizeof(server.in) - server.inlen);
+	} while (len == -1 && errno == EINTR);
+	if (len <= 0)
+		return -1;
+	server.inlen += len;
+
+	return 0;
+}
+
+static char *
+server_getline(void)
+{
+	char *line, *nl;
+
+	while ((nl = memchr(server.in + server.inpos, '\n', server.inlen - server.inpos)) == NULL)
+		if (server_fill() == -1)
+			return NULL;
+
+	line = server.in + server.inpos;
+	server.inpos = nl - server.in + 1;
+	*nl = 0;
+	if (nl > line && nl[-1] == '\r')
+		nl[-1] = 0;
+
+	return line;
+}
+
+static int
+server_getdata(size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		if (server.inpos == server.inlen && server_fill() == -1)
+			return -1;
+		n = MIN(len, server.inlen - server.inpos);
+		g_string_append_len(server.body, server.in + server.inpos, n);
+		server.inpos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void
+server_done(void)
+{
+	FILE *fp;
+
+	/* the reply to the body is one more round trip */
+	fp = fopen(RESULT_PATH, "w");
+	fprintf(fp, "%d %d %lu\n", server.rounds + 1, server.rcpts, (unsigned long) server.body->len);
+	fclose(fp);
+	fp = fopen(BODY_PATH, "w");
+	fwrite(server.body->str, 1, server.body->len, fp);
+	fclose(fp);
+
+	g_string_append(server.out, "250 2.0.0 Message accepted\r\n");
+	server.txn = 0;
+}
+
+static void
+server_session(int fd)
+{
+	char *line;
+
+	server.fd = fd;
+	server.inpos = server.inlen = 0;
+	server.txn = 0;
+
+	g_string_append(server.out, "220 localhost ESMTP test server\r\n");
+	while ((line = server_getline())) {
+		if (!g_ascii_strncasecmp(line, "EHLO", 4)) {
+			g_string_append(server.out, "250-localhost\r\n250-8BITMIME\r\n");
+			if (server_pipelining)
+				g_string_append(server.out, "250-PIPELINING\r\n");
+			if (server_chunking)
+				g_string_append(server.out, "250-CHUNKING\r\n");
+			g_string_append(server.out, "250 HELP\r\n");
+		} else if (!g_ascii_strncasecmp(line, "MAIL FROM:", 10)) {
+			server.txn = 1;
+			server.rounds = 0;
+			server.rcpts = 0;
+			g_string_truncate(server.body, 0);
+			g_string_append(server.out, "250 2.1.0 Sender OK\r\n");
+		} else if (!g_ascii_strncasecmp(line, "RCPT TO:", 8)) {
+			if (strstr(line, "reject")) {
+				g_string_append(server.out, "550 5.1.1 No such user\r\n");
+			} else {
+				server.rcpts++;
+				g_string_append(server.out, "250 2.1.5 Recipient OK\r\n");
+			}
+		} else if (!g_ascii_strcasecmp(line, "DATA")) {
+			g_string_append(server.out, "354 End data with <CR><LF>.<CR><LF>\r\n");
+			while ((line = server_getline()) && strcmp(line, ".") != 0) {
+				if (line[0] == '.')
+					line++;
+				g_string_append(server.body, line);
+				g_string_append(server.body, "\r\n");
+			}
+			if (line == NULL)
+				break;
+			server_done();
+		} else if (!g_ascii_strncasecmp(line, "BDAT ", 5)) {
+			char *end;
+			size_t len = strtoul(line + 5, &end, 10);
+			int last = strstr(end, "LAST") != NULL;
+
+			if (server_getdata(len) == -1)
+				break;
+			if (last)
+				server_done();
+			else
+				g_string_append_printf(server.out, "250 2.0.0 %lu octets received\r\n", (unsigned long) len);
+		} else if (!g_ascii_strcasecmp(line, "RSET")) {
+			server.txn = 0;
+			g_string_append(server.out, "250 2.0.0 OK\r\n");
+		} else if (!g_ascii_strcasecmp(line, "QUIT")) {
+			g_string_append(server.out, "221 2.0.0 Bye\r\n");
+			write(server.fd, server.out->str, server.out->len);
+			break;
+		} else {
+			g_string_append(server.out, "500 5.5.1 Unknown command\r\n");
+		}
+	}
+
+	g_string_truncate(server.out, 0);
+	close(fd);
+}
+
+static pid_t
+server_start(const char *mode, int *port)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	pid_t pid;
+	int fd, conn;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 || listen(fd, 1) == -1
+	    || getsockname(fd, (struct sockaddr *)&sin, &len) == -1) {
+		camel_test_fail("Cannot listen for the test server: %s", g_strerror(errno));
+		return -1;
+	}
+	*port = ntohs(sin.sin_port);
+
+	pid = fork();
+	if (pid != 0) {
+		close(fd);
+		return pid;
+	}
+
+	server_pipelining = strcmp(mode, "plain") != 0;
+	server_chunking = strcmp(mode, "chunking") == 0;
+	server.out = g_string_new("");
+	server.body = g_string_new("");
+	while ((conn = accept(fd, NULL, NULL)) != -1)
+		server_session(conn);
+
+	_exit(0);
+}
+
+/* ********************************************************************** */
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static CamelMimeMessage *
+build_message(GByteArray **expected)
+{
+	CamelMimeMessage *msg;
+	CamelInternetAddress *addr;
+	CamelStreamFilter *filter;
+	CamelMimeFilter *crlf;
+	CamelStreamMem *mem;
+	GString *text;
+	int i;
+
+	msg = camel_mime_message_new();
+	camel_mime_message_set_subject(msg, "Pipelined message");
+	addr = camel_internet_address_new();
+	camel_internet_address_add(addr, "Sender", "sender@example.com");
+	camel_mime_message_set_from(msg, addr);
+	camel_object_unref(addr);
+	camel_mime_message_set_date(msg, 1000000000, 0);
+
+	/* every so often a line the DATA command has to dot-stuff */
+	text = g_string_new("");
+	for (i=0;i<BODY_LINES;i++) {
+		if ((i % 100) == 0)
+			g_string_append_printf(text, ".line %d starts with a dot\n", i);
+		else
+			g_string_append_printf(text, "line %d of the message body, sent to a long list\n", i);
+	}
+	camel_mime_part_set_content((CamelMimePart *)msg, text->str, text->len, "text/plain");
+	g_string_free(text, TRUE);
+	camel_mime_message_set_best_encoding(msg, CAMEL_BESTENC_GET_ENCODING, CAMEL_BESTENC_8BIT);
+
+	/* what the server should see */
+	mem = (CamelStreamMem *)camel_stream_mem_new();
+	filter = camel_stream_filter_new_with_stream((CamelStream *)mem);
+	crlf = camel_mime_filter_crlf_new(CAMEL_MIME_FILTER_CRLF_ENCODE, CAMEL_MIME_FILTER_CRLF_MODE_CRLF_ONLY);
+	camel_stream_filter_add(filter, crlf);
+	camel_object_unref(crlf);
+	camel_data_wrapper_write_to_stream((CamelDataWrapper *)msg, (CamelStream *)filter);
+	camel_stream_flush((CamelStream *)filter);
+	camel_object_unref(filter);
+	*expected = g_byte_array_new();
+	g_byte_array_append(*expected, mem->buffer->data, mem->buffer->len);
+	camel_object_unref(mem);
+
+	return msg;
+}
+
+static size_t
+trim_crlf(const char *data, size_t len)
+{
+	while (len > 0 && (data[len-1] == '\r' || data[len-1] == '\n'))
+		len--;
+
+	return len;
+}
+
+static int
+send_message(CamelTransport *transport, CamelMimeMessage *msg, int count, const char *reject, CamelException *ex)
+{
+	CamelInternetAddress *from, *to;
+	char name[32];
+	int i, ret;
+
+	from = camel_internet_address_new();
+	camel_internet_address_add(from, NULL, "sender@example.com");
+	to = camel_internet_address_new();
+	for (i=0;i<count;i++) {
+		sprintf(name, "user%d@example.com", i);
+		camel_internet_address_add(to, NULL, (reject && i == count / 2) ? reject : name);
+	}
+
+	ret = camel_transport_send_to(transport, msg, (CamelAddress *)from, (CamelAddress *)to, ex);
+
+	camel_object_unref(from);
+	camel_object_unref(to);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds[MAX_MODES], expect[MAX_MODES];
+	double times[MAX_MODES];
+	CamelSession *session;
+	CamelTransport *transport;
+	CamelMimeMessage *msg;
+	CamelException *ex;
+	GByteArray *expected;
+	char *uri, *body;
+	gsize body_len;
+	FILE *fp;
+	int i, port, rcpts;
+	unsigned long len;
+	pid_t pid;
+
+	camel_test_init(argc, argv);
+	camel_test_provider_init(1, smtp_drivers);
+
+	ex = camel_exception_new();
+
+	msg = build_message(&expected);
+
+	for (i=0;i<MAX_MODES;i++) {
+		char *what = g_strdup_printf("SMTP sending to a %s server", modes[i]);
+
+		camel_test_start(what);
+		test_free(what);
+
+		/* clear out any camel-test data */
+		system("/bin/rm -rf /tmp/camel-test");
+		system("/bin/mkdir /tmp/camel-test");
+
+		pid = server_start(modes[i], &port);
+		session = camel_test_session_new("/tmp/camel-test");
+		uri = g_strdup_printf("smtp://127.0.0.1:%d/", port);
+
+		push("connecting");
+		transport = camel_session_get_transport(session, uri, ex);
+		check_msg(!camel_exception_is_set(ex), "getting transport: %s", camel_exception_get_description(ex));
+		check(transport != NULL);
+		camel_service_connect((CamelService *)transport, ex);
+		check_msg(!camel_exception_is_set(ex), "connecting: %s", camel_exception_get_description(ex));
+		pull();
+
+		push("sending to %d recipients", MAX_RECIPIENTS);
+		times[i] = now();
+		check_msg(send_message(transport, msg, MAX_RECIPIENTS, NULL, ex),
+			  "sending: %s", camel_exception_get_description(ex));
+		times[i] = now() - times[i];
+		fp = fopen(RESULT_PATH, "r");
+		check(fp != NULL);
+		check(fscanf(fp, "%d %d %lu", &rounds[i], &rcpts, &len) == 3);
+		fclose(fp);
+		check(rcpts == MAX_RECIPIENTS);
+		/* MAIL FROM and each RCPT TO, then DATA and the body;
+		   or the envelope 100 commands at a time and the body */
+		if (i == 0)
+			expect[i] = MAX_RECIPIENTS + 3;
+		else
+			expect[i] = (MAX_RECIPIENTS + 100) / 100 + (i == 1 ? 2 : 1);
+		check_msg(rounds[i] <= expect[i], "%d round trips, expected %d", rounds[i], expect[i]);
+		pull();
+
+		push("checking the message received");
+		check(g_file_get_contents(BODY_PATH, &body, &body_len, NULL));
+		check_msg(trim_crlf(body, body_len) == trim_crlf((char *)expected->data, expected->len),
+			  "received %lu bytes, sent %u", (unsigned long) body_len, expected->len);
+		check(memcmp(body, expected->data, trim_crlf(body, body_len)) == 0);
+		g_free(body);
+		pull();
+
+		push("sending with a recipient refused");
+		check(!send_message(transport, msg, 10, "reject@example.com", ex));
+		check_msg(camel_exception_is_set(ex) && strstr(camel_exception_get_description(ex), "reject@example.com"),
+			  "%s", camel_exception_get_description(ex));
+		camel_exception_clear(ex);
+		check_msg(send_message(transport, msg, 10, NULL, ex),
+			  "sending after a refusal: %s", camel_exception_get_description(ex));
+		pull();
+
+		push("disconnecting");
+		camel_service_disconnect((CamelService *)transport, TRUE, ex);
+		check_msg(!camel_exception_is_set(ex), "%s", camel_exception_get_description(ex));
+		check_unref(transport, 1);
+		camel_object_unref(session);
+		pull();
+
+		g_free(uri);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+
+		camel_test_end();
+	}
+
+	for (i=0;i<MAX_MODES;i++)
+		printf("%-10s server: %d recipients and %u bytes in %d round trips, %.3fs\n",
+		       modes[i], MAX_RECIPIENTS, expected->len, rounds[i], times[i]);
+
+	g_byte_array_free(expected, TRUE);
+	camel_object_unref(msg);
+	camel_exception_free(ex);
+
+	return 0;
+}
@@ -0,0 +1,202 @@
+/* text index build, word by word and bulk loaded, compaction while adding, and lookup, through the block cache and mapped */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <glib.h>
+
+#include "camel-test.h"
+
+#include <camel/camel-text-index.h>
+
+#define INDEX_PATH "/tmp/camel-test/textindex"
+#define MAX_NAMES (2000)
+#define MAX_WORDS (5000)
+#define NAME_WORDS (200)
+#define MAX_ADDED (500)
+
+static int counts[MAX_WORDS];
+static int max_names = MAX_NAMES;
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+index_add(CamelIndex *idx, int first, int last)
+{
+	CamelIndexName *idn;
+	char name[16], word[16];
+	int i, j, w;
+
+	for (i=first;i<last;i++) {
+		sprintf(name, "%d", i);
+		idn = camel_index_add_name(idx, name);
+		check(idn != NULL);
+		for (j=0;j<NAME_WORDS;j++) {
+			w = (i * 7 + j * 13) % MAX_WORDS;
+			sprintf(word, "word%05d", w);
+			camel_index_name_add_word(idn, word);
+			counts[w]++;
+		}
+		check(camel_index_write_name(idx, idn) == 0);
+		camel_object_unref((CamelObject *)idn);
+	}
+}
+
+/* delete every @step'th name, from the first */
+static void
+index_delete(CamelIndex *idx, int step)
+{
+	char name[16];
+	int i, j;
+
+	for (i=1;i<max_names;i+=step) {
+		sprintf(name, "%d", i);
+		camel_index_delete_name(idx, name);
+		for (j=0;j<NAME_WORDS;j++)
+			counts[(i * 7 + j * 13) % MAX_WORDS]--;
+	}
+}
+
+static void *
+index_add_thread(void *data)
+{
+	CamelIndex *idx = data;
+	int i;
+
+	/* a few at a time, so some get in while it's being compacted */
+	for (i=MAX_NAMES;i<MAX_NAMES+MAX_ADDED;i+=10) {
+		index_add(idx, i, i+10);
+		camel_index_sync(idx);
+	}
+
+	return NULL;
+}
+
+/* build the index, the names from @bulk on bulk loaded with @memory */
+static void
+index_build(int bulk, size_t memory)
+{
+	CamelIndex *idx;
+
+	memset(counts, 0, sizeof(counts));
+
+	idx = (CamelIndex *)camel_text_index_new(INDEX_PATH, O_CREAT|O_RDWR|O_TRUNC);
+	check(idx != NULL);
+
+	index_add(idx, 0, bulk);
+	if (bulk > 0)
+		check(camel_index_sync(idx) == 0);
+	camel_text_index_bulk_start((CamelTextIndex *)idx, memory);
+	index_add(idx, bulk, MAX_NAMES);
+
+	check(camel_index_sync(idx) == 0);
+	check_unref(idx, 1);
+}
+
+static void
+index_lookup(int flags)
+{
+	CamelIndex *idx;
+	CamelIndexCursor *idc;
+	char word[16];
+	int i, count;
+
+	idx = (CamelIndex *)camel_text_index_new(INDEX_PATH, flags);
+	check(idx != NULL);
+
+	for (i=0;i<MAX_WORDS;i++) {
+		sprintf(word, "word%05d", i);
+		idc = camel_index_find(idx, word);
+		check(idc != NULL);
+		count = 0;
+		while (camel_index_cursor_next(idc) != NULL)
+			count++;
+		check_msg(count == counts[i], "word '%s' found in %d names, expected %d", word, count, counts[i]);
+		camel_object_unref((CamelObject *)idc);
+	}
+
+	check(camel_index_has_name(idx, "0"));
+	check(!camel_index_has_name(idx, "nothere"));
+	check(camel_index_has_name(idx, "1") == (max_names == MAX_NAMES));
+	check_unref(idx, 1);
+}
+
+int main(int argc, char **argv)
+{
+	double start, build_time, bulk_time, cached_time, mapped_time, compact_time;
+	CamelIndex *idx;
+	pthread_t id;
+
+	camel_test_init(argc, argv);
+
+	system("/bin/rm -rf /tmp/camel-test");
+	system("/bin/mkdir /tmp/camel-test");
+
+	camel_test_start("Text index build and lookup");
+
+	push("building an index of %d names", MAX_NAMES);
+	start = now();
+	index_build(MAX_NAMES, 0);
+	build_time = now() - start;
+	index_lookup(O_RDWR);
+	pull();
+
+	push("bulk loading half of an index in small runs");
+	index_build(MAX_NAMES / 2, 64*1024);
+	index_lookup(O_RDWR);
+	pull();
+
+	push("bulk loading an index of %d names", MAX_NAMES);
+	start = now();
+	index_build(0, 0);
+	bulk_time = now() - start;
+	pull();
+
+	push("looking up %d words, read-write", MAX_WORDS);
+	start = now();
+	index_lookup(O_RDWR);
+	cached_time = now() - start;
+	pull();
+
+	push("looking up %d words, read-only", MAX_WORDS);
+	start = now();
+	index_lookup(O_RDONLY);
+	mapped_time = now() - start;
+	pull();
+
+	push("compacting while adding %d names", MAX_ADDED);
+	idx = (CamelIndex *)camel_text_index_new(INDEX_PATH, O_RDWR);
+	check(idx != NULL);
+	index_delete(idx, 4);
+	max_names = MAX_NAMES + MAX_ADDED;
+	check(pthread_create(&id, NULL, index_add_thread, idx) == 0);
+	start = now();
+	check(camel_index_compress(idx) == 0);
+	compact_time = now() - start;
+	pthread_join(id, NULL);
+	check(camel_index_sync(idx) == 0);
+	check_unref(idx, 1);
+	index_lookup(O_RDONLY);
+	pull();
+
+	printf("%d names of %d words: build %.3fs, bulk %.3fs, lookup %.3fs cached, %.3fs read-only, compact %.3fs\n",
+	       MAX_NAMES, NAME_WORDS, build_time, bulk_time, cached_time, mapped_time, compact_time);
+
+	camel_test_end();
+
+	return 0;
+}